@@ -21,13 +21,11 @@
 #include "image_helpers.h"
 #include "types.h"
 
-#include "math/constrained_least_squares.h"
-#include "math/rng.h"
-#include "math/sphere.h"
 #include "math/SH.h"
 #include "math/ZSH.h"
 
 #include "dwi/gradient.h"
+#include "dwi/response.h"
 #include "dwi/shells.h"
 
 
@@ -37,11 +35,6 @@ using namespace App;
 
 
 
-//#define AMP2RESPONSE_DEBUG
-//#define AMP2RESPONSE_PERVOXEL_IMAGES
-
-
-
 void usage ()
 {
 
@@ -87,26 +80,6 @@ void usage ()
 
 
 
-Eigen::Matrix<default_type, 3, 3> gen_rotation_matrix (const Eigen::Vector3& dir)
-{
-  static Math::RNG::Normal<default_type> rng;
-  // Generates a matrix that will rotate a unit vector into a new frame of reference,
-  //   where the peak direction of the FOD is aligned in Z (3rd dimension)
-  // Previously this was done using the tensor eigenvectors
-  // Here the other two axes are determined at random (but both are orthogonal to the FOD peak direction)
-  Eigen::Matrix<default_type, 3, 3> R;
-  R (2, 0) = dir[0]; R (2, 1) = dir[1]; R (2, 2) = dir[2];
-  Eigen::Vector3 vec2 (rng(), rng(), rng());
-  vec2 = dir.cross (vec2);
-  vec2.normalize();
-  R (0, 0) = vec2[0]; R (0, 1) = vec2[1]; R (0, 2) = vec2[2];
-  Eigen::Vector3 vec3 = dir.cross (vec2);
-  vec3.normalize();
-  R (1, 0) = vec3[0]; R (1, 1) = vec3[1]; R (1, 2) = vec3[2];
-  return R;
-}
-
-
 vector<size_t> all_volumes (const size_t num)
 {
   vector<size_t> result;
@@ -209,30 +182,19 @@ void run ()
   if (!num_voxels)
     throw Exception ("input mask does not contain any voxels");
 
+  const bool constrained = !get_options("noconstraint").size();
   Eigen::MatrixXd responses (dirs_azel.size(), Math::ZSH::NforL (max_lmax));
 
   for (size_t shell_index = 0; shell_index != dirs_azel.size(); ++shell_index) {
 
-    std::string shell_desc = (dirs_azel.size() > 1) ? ("_shell" + str(shell_index)) : "";
-
-    Eigen::MatrixXd dirs_cartesian = Math::Sphere::spherical2cartesian (dirs_azel[shell_index]);
-
-    // All directions from all SF voxels get concatenated into a single large matrix
-    Eigen::MatrixXd cat_transforms (num_voxels * dirs_azel[shell_index].rows(), Math::ZSH::NforL (lmax[shell_index]));
-    Eigen::VectorXd cat_data (num_voxels * dirs_azel[shell_index].rows());
-
-#ifdef AMP2RESPONSE_DEBUG
-    // To make sure we've got our data rotated correctly, let's generate a scatterplot of
-    //   elevation vs. amplitude
-    Eigen::MatrixXd scatter;
-#endif
+    DWI::ResponseEstimator estimator (dirs_azel[shell_index], lmax[shell_index], constrained);
+    estimator.reserve (num_voxels);
 
-    size_t voxel_counter = 0;
+    Eigen::VectorXd data (dirs_azel[shell_index].rows());
     for (auto l = Loop (mask, 0, 3) (image, mask, dir_image); l; ++l) {
       if (mask.value()) {
 
         // Grab the image data
-        Eigen::VectorXd data (dirs_azel[shell_index].rows());
         for (size_t i = 0; i != volumes[shell_index].size(); ++i) {
           image.index(3) = volumes[shell_index][i];
           data[i] = image.value();
@@ -242,131 +204,22 @@ void run ()
         Eigen::Vector3 fibre_dir;
         for (dir_image.index(3) = 0; dir_image.index(3) != 3; ++dir_image.index(3))
           fibre_dir[dir_image.index(3)] = dir_image.value();
-        fibre_dir.normalize();
-
-        // Rotate the directions into a new reference frame,
-        //   where the Z axis is defined by the specified direction
-        Eigen::Matrix<default_type, 3, 3> R = gen_rotation_matrix (fibre_dir);
-        Eigen::Matrix<default_type, Eigen::Dynamic, 3> rotated_dirs_cartesian (dirs_cartesian.rows(), 3);
-        Eigen::Vector3 vec (3), rot (3);
-        for (ssize_t row = 0; row != dirs_azel[shell_index].rows(); ++row) {
-          vec = dirs_cartesian.row (row);
-          rot = R * vec;
-          rotated_dirs_cartesian.row (row) = rot;
-        }
-
-        // Convert directions from Euclidean space to azimuth/elevation pairs
-        Eigen::MatrixXd rotated_dirs_azel = Math::Sphere::cartesian2spherical (rotated_dirs_cartesian);
-
-        // Constrain elevations to between 0 and pi/2
-        for (ssize_t i = 0; i != rotated_dirs_azel.rows(); ++i) {
-          if (rotated_dirs_azel (i, 1) > Math::pi_2) {
-            if (rotated_dirs_azel (i, 0) > Math::pi)
-              rotated_dirs_azel (i, 0) -= Math::pi;
-            else
-              rotated_dirs_azel (i, 0) += Math::pi;
-            rotated_dirs_azel (i, 1) = Math::pi - rotated_dirs_azel (i, 1);
-          }
-        }
-
-#ifdef AMP2RESPONSE_PERVOXEL_IMAGES
-        // For the sake of generating a figure, output the original and rotated signals to a dixel ODF image
-        Header rotated_header (header);
-        rotated_header.size(0) = rotated_header.size(1) = rotated_header.size(2) = 1;
-        rotated_header.size(3) = volumes[shell_index].size();
-        Header nonrotated_header (rotated_header);
-        nonrotated_header.size(3) = header.size(3);
-        Eigen::MatrixXd rotated_grad (volumes[shell_index].size(), 4);
-        for (size_t i = 0; i != volumes.size(); ++i) {
-          rotated_grad.block<1,3>(i, 0) = rotated_dirs_cartesian.row(i);
-          rotated_grad(i, 3) = 1000.0;
-        }
-        DWI::set_DW_scheme (rotated_header, rotated_grad);
-        Image<float> out_rotated = Image<float>::create ("rotated_amps_" + str(sf_counter) + shell_desc + ".mif", rotated_header);
-        Image<float> out_nonrotated = Image<float>::create ("nonrotated_amps_" + str(sf_counter) + shell_desc + ".mif", nonrotated_header);
-        out_rotated.index(0) = out_rotated.index(1) = out_rotated.index(2) = 0;
-        out_nonrotated.index(0) = out_nonrotated.index(1) = out_nonrotated.index(2) = 0;
-        for (size_t i = 0; i != volumes[shell_index].size(); ++i) {
-          image.index(3) = volumes[shell_index][i];
-          out_rotated.index(3) = i;
-          out_rotated.value() = image.value();
-        }
-        for (ssize_t i = 0; i != header.size(3); ++i) {
-          image.index(3) = out_nonrotated.index(3) = i;
-          out_nonrotated.value() = image.value();
-        }
-#endif
 
-        // Generate the ZSH -> amplitude transform
-        Eigen::MatrixXd transform = Math::ZSH::init_amp_transform<default_type> (rotated_dirs_azel.col(1), lmax[shell_index]);
-
-        // Concatenate these data to the ICLS matrices
-        cat_transforms.block (voxel_counter * data.size(), 0, transform.rows(), transform.cols()) = transform;
-        cat_data.segment (voxel_counter * data.size(), data.size()) = data;
-
-#ifdef AMP2RESPONSE_DEBUG
-        scatter.conservativeResize (cat_data.size(), 2);
-        scatter.block (old_rows, 0, data.size(), 1) = rotated_dirs_azel.col(1);
-        scatter.block (old_rows, 1, data.size(), 1) = data;
-#endif
-
-        ++voxel_counter;
+        estimator.add (data, fibre_dir);
 
       }
     }
 
-#ifdef AMP2RESPONSE_DEBUG
-    save_matrix (scatter, "scatter" + shell_desc + ".csv");
-#endif
-
     Eigen::VectorXd rf;
-    shell_desc = (shells && shells->count() > 1) ? ("Shell b=" + str(int(std::round((*shells)[shell_index].get_mean()))) + ": ") : "";
-    // Is this anything other than an isotropic response?
-    if (lmax[shell_index]) {
-
-      if (get_options("noconstraint").size()) {
-
-        // Get an ordinary least squares solution
-        Eigen::HouseholderQR<Eigen::MatrixXd> solver (cat_transforms);
-        rf = solver.solve (cat_data);
-
-        CONSOLE (shell_desc + "Response function [" + str(rf.transpose().cast<float>()) + "] solved via ordinary least-squares from " + str(voxel_counter) + " voxels");
-
-      } else {
-
-        // Generate the constraint matrix
-        // We are going to both constrain the amplitudes to be non-negative, and constrain the derivatives to be non-negative
-        const size_t num_angles_constraint = 90;
-        Eigen::VectorXd els;
-        els.resize (num_angles_constraint+1);
-        for (size_t i = 0; i <= num_angles_constraint; ++i)
-          els[i] = default_type(i) * Math::pi / 180.0;
-        Eigen::MatrixXd amp_transform   = Math::ZSH::init_amp_transform  <default_type> (els, lmax[shell_index]);
-        Eigen::MatrixXd deriv_transform = Math::ZSH::init_deriv_transform<default_type> (els, lmax[shell_index]);
-
-        Eigen::MatrixXd constraints (amp_transform.rows() + deriv_transform.rows(), amp_transform.cols());
-        constraints.block (0, 0, amp_transform.rows(), amp_transform.cols()) = amp_transform;
-        constraints.block (amp_transform.rows(), 0, deriv_transform.rows(), deriv_transform.cols()) = deriv_transform;
-
-        // Initialise the problem solver
-        auto problem = Math::ICLS::Problem<default_type> (cat_transforms, constraints, 1e-10, 1e-10);
-        auto solver  = Math::ICLS::Solver <default_type> (problem);
-
-        // Estimate the solution
-        const size_t niter = solver (rf, cat_data);
-
-        CONSOLE (shell_desc + "Response function [" + str(rf.transpose().cast<float>()) + " ] solved after " + str(niter) + " constraint iterations from " + str(voxel_counter) + " voxels");
-
-      }
+    const size_t niter = estimator (rf);
 
+    const std::string shell_desc = (shells && shells->count() > 1) ? ("Shell b=" + str(int(std::round((*shells)[shell_index].get_mean()))) + ": ") : "";
+    if (!lmax[shell_index]) {
+      CONSOLE (shell_desc + "Response function [ " + str(float(rf[0])) + " ] from average of " + str(num_voxels) + " voxels");
+    } else if (!constrained) {
+      CONSOLE (shell_desc + "Response function [" + str(rf.transpose().cast<float>()) + "] solved via ordinary least-squares from " + str(num_voxels) + " voxels");
     } else {
-
-      // lmax is zero - perform a straight average of the image data
-      rf.resize(1);
-      rf[0] = cat_data.mean() * std::sqrt(4*Math::pi);
-
-      CONSOLE (shell_desc + "Response function [ " + str(float(rf[0])) + " ] from average of " + str(voxel_counter) + " voxels");
-
+      CONSOLE (shell_desc + "Response function [" + str(rf.transpose().cast<float>()) + " ] solved after " + str(niter) + " constraint iterations from " + str(num_voxels) + " voxels");
     }
 
     rf.conservativeResizeLike (Eigen::VectorXd::Zero (Math::ZSH::NforL (max_lmax)));
@@ -181,6 +181,15 @@ void run()
       throw Exception ("number of rows in the permutations file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
   }
 
+  // Load exchangeability blocks if supplied
+  opt = get_options ("exchange_within");
+  vector<size_t> blocks;
+  if (opt.size()) {
+    blocks = Math::Stats::Permutation::load_blocks_file (opt[0][0]);
+    if (blocks.size() != (size_t)design.rows())
+      throw Exception ("number of entries in the exchangeability blocks file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
+  }
+
   // Load non-stationary correction permutations file if supplied
   opt = get_options("permutations_nonstationary");
   vector<vector<size_t> > permutations_nonstationary;
@@ -272,7 +281,7 @@ void run()
       Stats::PermTest::PermutationStack perm_stack (permutations_nonstationary, "precomputing empirical statistic for non-stationarity adjustment...");
       Stats::PermTest::precompute_empirical_stat (glm_ttest, enhancer, perm_stack, empirical_statistic);
     } else {
-      Stats::PermTest::PermutationStack perm_stack (nperms_nonstationary, design.rows(), "precomputing empirical statistic for non-stationarity adjustment...", true);
+      Stats::PermTest::PermutationStack perm_stack (nperms_nonstationary, design.rows(), blocks, "precomputing empirical statistic for non-stationarity adjustment...", true);
       Stats::PermTest::precompute_empirical_stat (glm_ttest, enhancer, perm_stack, empirical_statistic);
     }
     save_matrix (mat2vec.V2M (empirical_statistic), output_prefix + "_empirical.csv");
@@ -295,18 +304,23 @@ void run()
     vector_type null_distribution (num_perms);
     vector_type uncorrected_pvalues (num_edges);
 
+    bool complete;
     if (permutations.size()) {
-      Stats::PermTest::run_permutations (permutations, glm_ttest, enhancer, empirical_statistic,
-                                         enhanced_output, std::shared_ptr<vector_type>(),
-                                         null_distribution, std::shared_ptr<vector_type>(),
-                                         uncorrected_pvalues, std::shared_ptr<vector_type>());
+      complete = Stats::PermTest::run_permutations (permutations, glm_ttest, enhancer, empirical_statistic,
+                                                    enhanced_output, std::shared_ptr<vector_type>(),
+                                                    null_distribution, std::shared_ptr<vector_type>(),
+                                                    uncorrected_pvalues, std::shared_ptr<vector_type>());
     } else {
-      Stats::PermTest::run_permutations (num_perms, glm_ttest, enhancer, empirical_statistic,
-                                         enhanced_output, std::shared_ptr<vector_type>(),
-                                         null_distribution, std::shared_ptr<vector_type>(),
-                                         uncorrected_pvalues, std::shared_ptr<vector_type>());
+      complete = Stats::PermTest::run_permutations (num_perms, blocks, glm_ttest, enhancer, empirical_statistic,
+                                                    enhanced_output, std::shared_ptr<vector_type>(),
+                                                    null_distribution, std::shared_ptr<vector_type>(),
+                                                    uncorrected_pvalues, std::shared_ptr<vector_type>());
     }
 
+    // Only a subset of permutations has been processed (-shard option)
+    if (!complete)
+      return;
+
     save_vector (null_distribution, output_prefix + "_null_dist.txt");
     vector_type pvalue_output (num_edges);
     Math::Stats::Permutation::statistic2pvalue (null_distribution, enhanced_output, pvalue_output);
@@ -18,8 +18,8 @@
 #include "phase_encoding.h"
 #include "progressbar.h"
 #include "algo/threaded_copy.h"
-#include "math/least_squares.h"
 #include "dwi/gradient.h"
+#include "dwi/log_linear_fit.h"
 
 
 using namespace MR;
@@ -46,32 +46,42 @@ using value_type = float;
 
 
 
+// Voxels are processed one image row at a time, such that the fit for all
+// voxels within the row reduces to a single matrix product
 class DWI2ADC { MEMALIGN(DWI2ADC)
   public:
-    DWI2ADC (const Eigen::MatrixXd& binv, size_t dwi_axis) :
-      dwi (binv.cols()),
-      adc (2), 
-      binv (binv), 
+    DWI2ADC (const Eigen::MatrixXd& b, size_t dwi_axis, Image<value_type>& dwi_image, Image<value_type>& adc_image) :
+      dwi_image (dwi_image),
+      adc_image (adc_image),
+      fit (b),
       dwi_axis (dwi_axis) { }
 
-    template <class DWIType, class ADCType>
-      void operator() (DWIType& dwi_image, ADCType& adc_image) {
+    void operator() (const Iterator& pos) {
+      assign_pos_of (pos, 1, 3).to (dwi_image, adc_image);
+      const ssize_t nvox = dwi_image.size(0);
+
+      dwi.resize (fit.num_volumes(), nvox);
+      for (dwi_image.index(0) = 0; dwi_image.index(0) < nvox; ++dwi_image.index(0)) {
         for (auto l = Loop (dwi_axis) (dwi_image); l; ++l) {
           value_type val = dwi_image.value();
-          dwi[dwi_image.index (dwi_axis)] = val ? std::log (val) : 1.0e-12;
+          dwi (dwi_image.index (dwi_axis), dwi_image.index(0)) = val ? std::log (val) : 1.0e-12;
         }
+      }
 
-        adc = binv * dwi;
+      fit (dwi, adc);
 
+      for (adc_image.index(0) = 0; adc_image.index(0) < nvox; ++adc_image.index(0)) {
         adc_image.index(3) = 0;
-        adc_image.value() = std::exp (adc[0]);
+        adc_image.value() = std::exp (adc (0, adc_image.index(0)));
         adc_image.index(3) = 1;
-        adc_image.value() = adc[1];
+        adc_image.value() = adc (1, adc_image.index(0));
       }
+    }
 
   protected:
-    Eigen::VectorXd dwi, adc;
-    const Eigen::MatrixXd& binv;
+    Image<value_type> dwi_image, adc_image;
+    DWI::LogLinearFit<2> fit;
+    Eigen::MatrixXd dwi, adc;
     const size_t dwi_axis;
 };
 
@@ -93,8 +103,6 @@ void run () {
     b(i,1) = -grad (i,3);
   }
 
-  auto binv = Math::pinv (b);
-
   Header header (dwi);
   header.datatype() = DataType::Float32;
   header.ndim() = 4;
@@ -104,8 +112,8 @@ void run () {
 
   auto adc = Image<value_type>::create (argument[1], header);
 
-  ThreadedLoop ("computing ADC values", dwi, 0, 3)
-    .run (DWI2ADC (binv, dwi_axis), dwi, adc);
+  ThreadedLoop ("computing ADC values", dwi, vector<size_t> ({ 1, 2 }), vector<size_t> ({ 0 }))
+    .run_outer (DWI2ADC (b, dwi_axis, dwi, adc));
 }
 
 
@@ -17,6 +17,7 @@
 #include "header.h"
 #include "image.h"
 #include "phase_encoding.h"
+#include "timer.h"
 #include "algo/threaded_loop.h"
 #include "dwi/gradient.h"
 #include "dwi/shells.h"
@@ -57,6 +58,20 @@ OptionGroup CommonOptions = OptionGroup ("Options common to more than one algori
 
 
 
+OptionGroup MSMT_CSDOptions = OptionGroup ("Options for the multi-shell, multi-tissue CSD algorithm")
+
+    + Option ("niter_image",
+              "output an image containing the number of iterations of the constrained "
+              "least-squares solver required in each voxel.")
+      + Argument ("image").type_image_out()
+
+    + Option ("time_image",
+              "output an image containing the time taken (in microseconds) to "
+              "estimate the ODFs in each voxel.")
+      + Argument ("image").type_image_out();
+
+
+
 
 void usage ()
 {
@@ -95,6 +110,7 @@ void usage ()
     + DWI::ShellsOption
     + CommonOptions
     + DWI::SDeconv::CSD_options
+    + MSMT_CSDOptions
     + Stride::Options;
 }
 
@@ -166,46 +182,72 @@ class CSD_Processor { MEMALIGN(CSD_Processor)
 
 
 
+// Voxels are processed one image row at a time, such that the solver for
+// each voxel can be warm-started from the solution of its neighbour
 class MSMT_Processor { MEMALIGN (MSMT_Processor)
   public:
-    MSMT_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared, Image<bool>& mask_image, vector< Image<float> > odf_images) :
+    MSMT_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared, Image<float>& dwi_image, Image<bool>& mask_image,
+                    vector< Image<float> > odf_images, Image<uint32_t>& niter_image, Image<float>& time_image) :
         sdeconv (shared),
+        dwi_image (dwi_image),
         mask_image (mask_image),
         odf_images (odf_images),
+        niter_image (niter_image),
+        time_image (time_image),
         dwi_data (shared.grad.rows()),
         output_data (shared.problem.H.cols()) { }
 
 
-    void operator() (Image<float>& dwi_image)
+    void operator() (const Iterator& pos)
     {
-      if (mask_image.valid()) {
-        assign_pos_of (dwi_image, 0, 3).to (mask_image);
-        if (!mask_image.value())
-          return;
-      }
-
-      for (auto l = Loop (3) (dwi_image); l; ++l)
-        dwi_data[dwi_image.index(3)] = dwi_image.value();
-
-      sdeconv (dwi_data, output_data);
-      if (sdeconv.niter >= sdeconv.shared.problem.max_niter) {
-        INFO ("voxel [ " + str (dwi_image.index(0)) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
-            " ] did not reach full convergence");
-      }
-
-      size_t j = 0;
-      for (size_t i = 0; i < odf_images.size(); ++i) {
-        assign_pos_of (dwi_image, 0, 3).to (odf_images[i]);
-        for (auto l = Loop(3)(odf_images[i]); l; ++l)
-          odf_images[i].value() = output_data[j++];
+      assign_pos_of (pos, 1, 3).to (dwi_image);
+      bool warm_start = false;
+      for (dwi_image.index(0) = 0; dwi_image.index(0) < dwi_image.size(0); ++dwi_image.index(0)) {
+        if (mask_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (mask_image);
+          if (!mask_image.value())
+            continue;
+        }
+
+        if (time_image.valid())
+          timer.start();
+        for (auto l = Loop (3) (dwi_image); l; ++l)
+          dwi_data[dwi_image.index(3)] = dwi_image.value();
+
+        sdeconv (dwi_data, output_data, warm_start);
+        warm_start = true;
+        if (sdeconv.niter >= sdeconv.shared.problem.max_niter) {
+          INFO ("voxel [ " + str (dwi_image.index(0)) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
+              " ] did not reach full convergence");
+        }
+
+        size_t j = 0;
+        for (size_t i = 0; i < odf_images.size(); ++i) {
+          assign_pos_of (dwi_image, 0, 3).to (odf_images[i]);
+          for (auto l = Loop(3)(odf_images[i]); l; ++l)
+            odf_images[i].value() = output_data[j++];
+        }
+
+        if (niter_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (niter_image);
+          niter_image.value() = sdeconv.niter;
+        }
+        if (time_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (time_image);
+          time_image.value() = 1.0e6 * timer.elapsed();
+        }
       }
     }
 
 
   private:
     DWI::SDeconv::MSMT_CSD sdeconv;
+    Image<float> dwi_image;
     Image<bool> mask_image;
     vector< Image<float> > odf_images;
+    Image<uint32_t> niter_image;
+    Image<float> time_image;
+    Timer timer;
     Eigen::VectorXd dwi_data;
     Eigen::VectorXd output_data;
 };
@@ -238,6 +280,8 @@ void run ()
 
     if (argument.size() != 4)
       throw Exception ("CSD algorithm expects a single input response function and single output FOD image");
+    if (get_options ("niter_image").size() || get_options ("time_image").size())
+      throw Exception ("-niter_image and -time_image options are only applicable to the MSMT_CSD algorithm");
 
     DWI::SDeconv::CSD::Shared shared (header_in);
     shared.parse_cmdline_options();
@@ -291,10 +335,26 @@ void run ()
       odfs.push_back (Image<float> (Image<float>::create (odf_paths[i], header_out)));
     }
 
-    MSMT_Processor processor (shared, mask, odfs);
+    Header diagnostic_header (header_out);
+    diagnostic_header.ndim() = 3;
+    DWI::clear_DW_scheme (diagnostic_header);
+    Image<uint32_t> niter_image;
+    opt = get_options ("niter_image");
+    if (opt.size()) {
+      diagnostic_header.datatype() = DataType::UInt32;
+      niter_image = Image<uint32_t>::create (opt[0][0], diagnostic_header);
+    }
+    Image<float> time_image;
+    opt = get_options ("time_image");
+    if (opt.size()) {
+      diagnostic_header.datatype() = DataType::Float32;
+      time_image = Image<float>::create (opt[0][0], diagnostic_header);
+    }
+
     auto dwi = header_in.get_image<float>().with_direct_io (3);
-    ThreadedLoop ("performing multi-shell, multi-tissue CSD", dwi, 0, 3)
-        .run (processor, dwi);
+    MSMT_Processor processor (shared, dwi, mask, odfs, niter_image, time_image);
+    ThreadedLoop ("performing multi-shell, multi-tissue CSD", dwi, vector<size_t> ({ 1, 2 }), vector<size_t> ({ 0 }))
+        .run_outer (processor);
 
   } else {
     assert (0);
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "header.h"
+#include "image.h"
+#include "progressbar.h"
+#include "thread_queue.h"
+#include "types.h"
+
+#include "algo/loop.h"
+#include "filter/dilate.h"
+
+#include "dwi/fmls.h"
+#include "dwi/gradient.h"
+#include "dwi/response.h"
+#include "dwi/shells.h"
+#include "dwi/directions/set.h"
+#include "dwi/sdeconv/csd.h"
+
+
+
+using namespace MR;
+using namespace App;
+
+
+
+#define DEFAULT_SF_VOXELS 300
+#define DEFAULT_ITER_VOXELS 3000
+#define DEFAULT_DILATE_PASSES 1
+#define DEFAULT_MAX_ITERS 10
+#define DEFAULT_RESPONSE_LMAX 10
+#define INITIAL_LMAX 4
+
+
+
+void usage ()
+{
+
+  AUTHOR = "Robert E. Smith (robert.smith@florey.edu.au)";
+
+  SYNOPSIS = "Estimate the single-fibre response function using the iterative voxel selection of Tournier et al. (2013)";
+
+  DESCRIPTION
+   + "This command implements the 'tournier' algorithm of the dwi2response script, "
+     "but performs all iterations in memory. At each iteration, constrained spherical "
+     "deconvolution is performed within the current set of candidate voxels only, and "
+     "the resulting FODs are segmented to obtain the amplitudes of their two largest "
+     "peaks. The voxels with the highest values of the cost function "
+     "sqrt(|peak1|) * (1 - |peak2| / |peak1|)^2 are selected as single-fibre voxels, "
+     "from which the response function is re-estimated as in amp2response. The "
+     "candidate voxels for the next iteration are obtained by dilating a larger set of "
+     "top-ranked voxels, within the bounds of the initial mask. Iteration stops once the "
+     "selection of single-fibre voxels no longer changes."
+
+   + "Only a single non-zero b-value shell is used: if the data contain more than one, "
+     "the largest b-value is used, unless specified otherwise using the -shells option."
+
+   + "The other algorithms of the dwi2response script (such as 'dhollander', 'msmt_5tt' "
+     "and 'fa') remain implemented in Python only.";
+
+  ARGUMENTS
+    + Argument ("dwi", "the input diffusion-weighted images").type_image_in()
+    + Argument ("response", "the output zonal spherical harmonic coefficients").type_file_out();
+
+  OPTIONS
+    + Option ("mask", "only consider voxels within the specified mask (default: all voxels)")
+      + Argument ("image").type_image_in()
+
+    + Option ("lmax", "the maximum harmonic degree of the response function to estimate "
+                      "(default: " + str(DEFAULT_RESPONSE_LMAX) + "); this is also used for the "
+                      "CSD in all but the first iteration (otherwise, the dwi2fod default applies)")
+      + Argument ("value").type_integer (2, 30)
+
+    + Option ("sf_voxels", "number of single-fibre voxels to use when calculating the response function "
+                           "(default: " + str(DEFAULT_SF_VOXELS) + ")")
+      + Argument ("number").type_integer (1)
+
+    + Option ("iter_voxels", "number of single-fibre voxels to select when preparing for the next iteration "
+                             "(default: " + str(DEFAULT_ITER_VOXELS) + ")")
+      + Argument ("number").type_integer (1)
+
+    + Option ("dilate", "number of mask dilation steps to apply when deriving the voxel mask to test "
+                        "in the next iteration (default: " + str(DEFAULT_DILATE_PASSES) + ")")
+      + Argument ("passes").type_integer (0)
+
+    + Option ("max_iters", "maximum number of iterations (default: " + str(DEFAULT_MAX_ITERS) + ")")
+      + Argument ("number").type_integer (2)
+
+    + Option ("voxels", "output an image showing the final selection of single-fibre voxels")
+      + Argument ("image").type_image_out()
+
+    + DWI::GradImportOptions()
+    + DWI::ShellsOption;
+
+  REFERENCES
+    + "Tournier, J.-D.; Calamante, F. & Connelly, A. "
+      "Determination of the appropriate b-value and number of gradient directions for high-angular-resolution diffusion-weighted imaging. "
+      "NMR Biomedicine, 2013, 26, 1775-1786";
+}
+
+
+
+using voxel_type = Eigen::Array3i;
+
+
+
+// The outcome of CSD & FOD segmentation in a candidate voxel
+class SFCandidate { MEMALIGN(SFCandidate)
+  public:
+    SFCandidate () : cost (NaN) { }
+    default_type cost;
+    Eigen::Vector3 dir;
+};
+
+
+
+// Performs CSD & FOD segmentation in each candidate voxel, and computes the
+//   single-fibre cost function from the amplitudes of the two largest peaks
+class SFAnalyser { MEMALIGN(SFAnalyser)
+  public:
+    SFAnalyser (const DWI::SDeconv::CSD::Shared& shared, const DWI::FMLS::Segmenter& fmls, Image<float>& dwi,
+                const vector<voxel_type>& voxels, vector<SFCandidate>& results, ProgressBar& progress) :
+        sdeconv (shared),
+        fmls (fmls),
+        dwi (dwi),
+        voxels (voxels),
+        results (results),
+        progress (progress),
+        data (shared.dwis.size()) { }
+
+    bool operator() (const size_t& index)
+    {
+      process (voxels[index], results[index]);
+      std::lock_guard<std::mutex> lock (mutex);
+      ++progress;
+      return true;
+    }
+
+  private:
+    DWI::SDeconv::CSD sdeconv;
+    const DWI::FMLS::Segmenter& fmls;
+    Image<float> dwi;
+    const vector<voxel_type>& voxels;
+    vector<SFCandidate>& results;
+    ProgressBar& progress;
+    Eigen::VectorXd data;
+    DWI::FMLS::SH_coefs sh;
+    DWI::FMLS::FOD_lobes lobes;
+    static std::mutex mutex;
+
+    void process (const voxel_type& vox, SFCandidate& result)
+    {
+      for (size_t axis = 0; axis != 3; ++axis)
+        dwi.index (axis) = vox[axis];
+      for (size_t n = 0; n != sdeconv.shared.dwis.size(); ++n) {
+        dwi.index(3) = sdeconv.shared.dwis[n];
+        data[n] = dwi.value();
+        if (!std::isfinite (data[n]))
+          return;
+        if (data[n] < 0.0)
+          data[n] = 0.0;
+      }
+
+      sdeconv.set (data);
+      for (size_t n = 0; n < sdeconv.shared.niter; n++)
+        if (sdeconv.iterate())
+          break;
+
+      sh = sdeconv.FOD();
+      sh.vox = vox;
+      fmls (sh, lobes);
+      if (lobes.empty())
+        return;
+
+      // Lobes are ordered by decreasing peak amplitude
+      const default_type peak1 = lobes[0].get_max_peak_value();
+      const default_type peak2 = lobes.size() > 1 ? lobes[1].get_max_peak_value() : 0.0;
+      result.cost = std::sqrt (peak1) * Math::pow2 (1.0 - peak2 / peak1);
+      result.dir = lobes[0].get_mean_dir();
+    }
+};
+std::mutex SFAnalyser::mutex;
+
+
+
+void run ()
+{
+  auto header = Header::open (argument[0]);
+  auto dwi = header.get_image<float>().with_direct_io (3);
+
+  Header header_3D (header);
+  header_3D.ndim() = 3;
+  header_3D.datatype() = DataType::Bit;
+  DWI::clear_DW_scheme (header_3D);
+
+  // Voxels outside of the initial mask are never considered
+  auto initial_mask = Image<bool>::scratch (header_3D, "initial mask");
+  auto opt = get_options ("mask");
+  if (opt.size()) {
+    auto mask = Image<bool>::open (opt[0][0]);
+    check_dimensions (dwi, mask, 0, 3);
+    for (auto l = Loop (0, 3) (mask, initial_mask); l; ++l)
+      initial_mask.value() = mask.value();
+  } else {
+    for (auto l = Loop (initial_mask) (initial_mask); l; ++l)
+      initial_mask.value() = true;
+  }
+
+  vector<voxel_type> candidates;
+  for (auto l = Loop (initial_mask) (initial_mask); l; ++l) {
+    if (initial_mask.value())
+      candidates.push_back (voxel_type (initial_mask.index(0), initial_mask.index(1), initial_mask.index(2)));
+  }
+  if (candidates.empty())
+    throw Exception ("mask does not contain any voxels");
+
+  const int lmax = get_option_value ("lmax", 0);
+  if (lmax % 2)
+    throw Exception ("lmax must be an even number");
+  const size_t sf_voxels = get_option_value ("sf_voxels", DEFAULT_SF_VOXELS);
+  const size_t iter_voxels = get_option_value ("iter_voxels", DEFAULT_ITER_VOXELS);
+  const size_t dilate_passes = get_option_value ("dilate", DEFAULT_DILATE_PASSES);
+  const size_t max_iters = get_option_value ("max_iters", DEFAULT_MAX_ITERS);
+
+  const DWI::Directions::FastLookupSet dirs (1281);
+  std::unique_ptr<DWI::FMLS::Segmenter> fmls;
+  int fmls_lmax = 0;
+
+  Eigen::VectorXd response (3);
+  response << 1.0, -1.0, 1.0;
+  vector<voxel_type> sf, prev_sf;
+  bool converged = false;
+
+  for (size_t iter = 0; iter != max_iters && !converged; ++iter) {
+
+    // CSD & response function estimation are restricted to lmax=4 in the first iteration
+    const int response_lmax = iter ? (lmax ? lmax : DEFAULT_RESPONSE_LMAX) : INITIAL_LMAX;
+
+    DWI::SDeconv::CSD::Shared shared (header);
+    shared.lmax_cmdline = iter ? lmax : INITIAL_LMAX;
+    shared.set_response (response);
+    shared.init();
+
+    if (!fmls || fmls_lmax != shared.lmax) {
+      fmls.reset (new DWI::FMLS::Segmenter (dirs, shared.lmax));
+      fmls->set_integral_threshold (0.0);
+      fmls->set_peak_value_threshold (0.0);
+      fmls_lmax = shared.lmax;
+    }
+
+    vector<SFCandidate> results (candidates.size());
+    {
+      ProgressBar progress ("iteration " + str(iter) + ": processing " + str(candidates.size()) + " candidate voxels", candidates.size());
+      size_t counter = 0;
+      auto source = [&] (size_t& index) { index = counter++; return index < candidates.size(); };
+      Thread::run_queue (source, Thread::batch (size_t()), Thread::multi (SFAnalyser (shared, *fmls, dwi, candidates, results, progress)));
+    }
+
+    // Rank the candidate voxels by decreasing value of the cost function
+    vector<size_t> ranking;
+    ranking.reserve (candidates.size());
+    for (size_t i = 0; i != candidates.size(); ++i) {
+      if (std::isfinite (results[i].cost))
+        ranking.push_back (i);
+    }
+    if (ranking.empty())
+      throw Exception ("no candidate single-fibre voxels found at iteration " + str(iter));
+    std::stable_sort (ranking.begin(), ranking.end(), [&] (size_t a, size_t b) { return results[a].cost > results[b].cost; });
+
+    // Generate a new response function based on the top-ranked voxels
+    DWI::ResponseEstimator estimator (shared.DW_dirs, response_lmax);
+    const size_t num_sf = std::min (sf_voxels, ranking.size());
+    estimator.reserve (num_sf);
+    sf.clear();
+    Eigen::VectorXd data (shared.dwis.size());
+    for (size_t i = 0; i != num_sf; ++i) {
+      const voxel_type& vox (candidates[ranking[i]]);
+      sf.push_back (vox);
+      for (size_t axis = 0; axis != 3; ++axis)
+        dwi.index (axis) = vox[axis];
+      for (size_t n = 0; n != shared.dwis.size(); ++n) {
+        dwi.index(3) = shared.dwis[n];
+        data[n] = dwi.value();
+      }
+      estimator.add (data, results[ranking[i]].dir);
+    }
+    estimator (response);
+    INFO ("iteration " + str(iter) + ": response function [ " + str(response.transpose().cast<float>()) + " ] from " + str(num_sf) + " voxels");
+
+    // Should we terminate?
+    std::sort (sf.begin(), sf.end(), [] (const voxel_type& a, const voxel_type& b) {
+      return std::lexicographical_compare (a.data(), a.data()+3, b.data(), b.data()+3);
+    });
+    if (iter && sf.size() == prev_sf.size() && std::equal (sf.begin(), sf.end(), prev_sf.begin(),
+          [] (const voxel_type& a, const voxel_type& b) { return (a == b).all(); })) {
+      CONSOLE ("Convergence of SF voxel selection detected at iteration " + str(iter));
+      converged = true;
+      break;
+    }
+    std::swap (sf, prev_sf);
+
+    // Select a greater number of top single-fibre voxels, and dilate (within bounds of initial mask);
+    //   these are the voxels that will be re-tested in the next iteration
+    auto next = Image<bool>::scratch (header_3D, "candidate voxels");
+    for (size_t i = 0; i != std::min (iter_voxels, ranking.size()); ++i) {
+      const voxel_type& vox (candidates[ranking[i]]);
+      for (size_t axis = 0; axis != 3; ++axis)
+        next.index (axis) = vox[axis];
+      next.value() = true;
+    }
+    if (dilate_passes) {
+      Filter::Dilate dilate_filter (next);
+      dilate_filter.set_npass (dilate_passes);
+      auto dilated = Image<bool>::scratch (dilate_filter, "dilated candidate voxels");
+      dilate_filter (next, dilated);
+      next = dilated;
+    }
+    candidates.clear();
+    for (auto l = Loop (next) (next, initial_mask); l; ++l) {
+      if (next.value() && initial_mask.value())
+        candidates.push_back (voxel_type (next.index(0), next.index(1), next.index(2)));
+    }
+  }
+
+  if (!converged) {
+    CONSOLE ("Exiting after maximum " + str(max_iters) + " iterations");
+    std::swap (sf, prev_sf);
+  }
+
+  CONSOLE ("Response function [ " + str(response.transpose().cast<float>()) + " ] from " + str(sf.size()) + " voxels");
+  save_vector (response, argument[1]);
+
+  opt = get_options ("voxels");
+  if (opt.size()) {
+    auto voxels = Image<bool>::create (opt[0][0], header_3D);
+    for (const auto& vox : sf) {
+      for (size_t axis = 0; axis != 3; ++axis)
+        voxels.index (axis) = vox[axis];
+      voxels.value() = true;
+    }
+  }
+}
@@ -19,6 +19,7 @@
 #include "image.h"
 #include "algo/threaded_copy.h"
 #include "dwi/gradient.h"
+#include "dwi/log_linear_fit.h"
 #include "dwi/tensor.h"
 
 using namespace MR;
@@ -72,60 +73,67 @@ void usage ()
 
 }
 
-template <class MASKType, class B0Type, class DKTType, class PredictType>
+// Voxels are processed one image row at a time, such that the initial
+// ordinary least-squares estimates for all voxels within the row can be
+// computed as a single matrix product
+template <int NumParams, class MASKType, class B0Type, class DKTType, class PredictType>
 class Processor { MEMALIGN(Processor)
   public:
-    Processor (const Eigen::MatrixXd& b, const int iter, MASKType* mask_image, B0Type* b0_image, DKTType* dkt_image, PredictType* predict_image) :
+    Processor (const Eigen::MatrixXd& b, const int iter, Image<value_type>& dwi_image, Image<value_type>& dt_image,
+               MASKType* mask_image, B0Type* b0_image, DKTType* dkt_image, PredictType* predict_image) :
+      dwi_image (dwi_image),
+      dt_image (dt_image),
       mask_image (mask_image),
       b0_image (b0_image),
       dkt_image (dkt_image),
       predict_image (predict_image),
-      dwi(b.rows()),
-      p(b.cols()),
-      w(b.rows()),
-      work(b.cols(),b.cols()),
-      llt(work.rows()),
-      b(b),
-      maxit(iter) { }
-
-    template <class DWIType, class DTType>
-      void operator() (DWIType& dwi_image, DTType& dt_image)
-      {
+      fit (b, iter) { }
+
+    void operator() (const Iterator& pos)
+    {
+      assign_pos_of (pos, 1, 3).to (dwi_image);
+      voxels.clear();
+      for (dwi_image.index(0) = 0; dwi_image.index(0) < dwi_image.size(0); ++dwi_image.index(0)) {
         if (mask_image) {
           assign_pos_of (dwi_image, 0, 3).to (*mask_image);
           if (!mask_image->value())
-            return;
+            continue;
         }
-        
+        voxels.push_back (dwi_image.index(0));
+      }
+      if (voxels.empty())
+        return;
+
+      dwi.resize (fit.num_volumes(), voxels.size());
+      for (size_t n = 0; n != voxels.size(); ++n) {
+        dwi_image.index(0) = voxels[n];
         for (auto l = Loop (3) (dwi_image); l; ++l)
-          dwi[dwi_image.index(3)] = dwi_image.value();
-        
-        double small_intensity = 1.0e-6 * dwi.maxCoeff(); 
-        for (int i = 0; i < dwi.rows(); i++) {
-          if (dwi[i] < small_intensity)
-            dwi[i] = small_intensity;
-          dwi[i] = std::log (dwi[i]);
+          dwi (dwi_image.index(3), n) = dwi_image.value();
+        auto S = dwi.col (n);
+        double small_intensity = 1.0e-6 * S.maxCoeff();
+        for (int i = 0; i < S.rows(); i++) {
+          if (S[i] < small_intensity)
+            S[i] = small_intensity;
+          S[i] = std::log (S[i]);
         }
-        
-        work.setZero();
-        work.selfadjointView<Eigen::Lower>().rankUpdate (b.transpose());
-        p = llt.compute (work.selfadjointView<Eigen::Lower>()).solve(b.transpose()*dwi);
-        for (int it = 0; it < maxit; it++) {
-          w = (b*p).array().exp();
-          work.setZero();
-          work.selfadjointView<Eigen::Lower>().rankUpdate (b.transpose()*w.asDiagonal());
-          p = llt.compute (work.selfadjointView<Eigen::Lower>()).solve(b.transpose()*w.asDiagonal()*w.asDiagonal()*dwi);
-        }
-        
+      }
+
+      fit (dwi, params);
+
+      for (size_t n = 0; n != voxels.size(); ++n) {
+        const auto p = params.col (n);
+        dwi_image.index(0) = voxels[n];
+
         if (b0_image) {
           assign_pos_of (dwi_image, 0, 3).to (*b0_image);
           b0_image->value() = exp(p[6]);
         }
-        
+
+        assign_pos_of (dwi_image, 0, 3).to (dt_image);
         for (auto l = Loop(3)(dt_image); l; ++l) {
           dt_image.value() = p[dt_image.index(3)];
         }
-        
+
         if (dkt_image) {
           assign_pos_of (dwi_image, 0, 3).to (*dkt_image);
           double adc_sq = (p[0]+p[1]+p[2])*(p[0]+p[1]+p[2])/9.0;
@@ -133,34 +141,33 @@ class Processor { MEMALIGN(Processor)
             dkt_image->value() = p[dkt_image->index(3)+7]/adc_sq;
           }
         }
-        
+
         if (predict_image) {
           assign_pos_of (dwi_image, 0, 3).to (*predict_image);
-          dwi = (b*p).array().exp();
+          predicted = (fit.design()*p).array().exp();
           for (auto l = Loop(3)(*predict_image); l; ++l) {
-            predict_image->value() = dwi[predict_image->index(3)];
+            predict_image->value() = predicted[predict_image->index(3)];
           }
         }
-        
       }
+    }
 
   private:
+    Image<value_type> dwi_image, dt_image;
     copy_ptr<MASKType> mask_image;
     copy_ptr<B0Type> b0_image;
     copy_ptr<DKTType> dkt_image;
     copy_ptr<PredictType> predict_image;
-    Eigen::VectorXd dwi;
-    Eigen::VectorXd p;
-    Eigen::VectorXd w;
-    Eigen::MatrixXd work;
-    Eigen::LLT<Eigen::MatrixXd> llt;
-    const Eigen::MatrixXd& b;
-    const int maxit;
+    DWI::LogLinearFit<NumParams> fit;
+    vector<ssize_t> voxels;
+    Eigen::MatrixXd dwi, params;
+    Eigen::VectorXd predicted;
 };
 
-template <class MASKType, class B0Type, class DKTType, class PredictType> 
-inline Processor<MASKType, B0Type, DKTType, PredictType> processor (const Eigen::MatrixXd& b, const int& iter, MASKType* mask_image, B0Type* b0_image, DKTType* dkt_image, PredictType* predict_image) {
-  return { b, iter, mask_image, b0_image, dkt_image, predict_image };
+template <int NumParams, class MASKType, class B0Type, class DKTType, class PredictType>
+inline Processor<NumParams, MASKType, B0Type, DKTType, PredictType> processor (const Eigen::MatrixXd& b, const int& iter, Image<value_type>& dwi_image, Image<value_type>& dt_image,
+                                                                               MASKType* mask_image, B0Type* b0_image, DKTType* dkt_image, PredictType* predict_image) {
+  return { b, iter, dwi_image, dt_image, mask_image, b0_image, dkt_image, predict_image };
 }
 
 void run ()
@@ -209,6 +216,10 @@ void run ()
   
   Eigen::MatrixXd b = -DWI::grad2bmatrix<double> (grad, opt.size()>0);
 
-  ThreadedLoop("computing tensors", dwi, 0, 3).run (processor (b, iter, mask, b0, dkt, predict), dwi, dt);
+  auto loop = ThreadedLoop ("computing tensors", dwi, vector<size_t> ({ 1, 2 }), vector<size_t> ({ 0 }));
+  if (dkt)
+    loop.run_outer (processor<22> (b, iter, dwi, dt, mask, b0, dkt, predict));
+  else
+    loop.run_outer (processor<7> (b, iter, dwi, dt, mask, b0, dkt, predict));
 }
 
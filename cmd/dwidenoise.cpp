@@ -15,14 +15,20 @@
 
 #include "command.h"
 #include "image.h"
+#include <random>
 #include <Eigen/Dense>
 #include <Eigen/Eigenvalues>
 
 #define DEFAULT_SIZE 5
 
+// Number of inverse iterations used to compute each retained eigenvector
+#define DENOISE_INVERSE_ITERATIONS 3
+
 using namespace MR;
 using namespace App;
 
+const char* const dtypes[] = { "float32", "float64", nullptr };
+
 
 void usage ()
 {
@@ -63,7 +69,10 @@ void usage ()
     +   Argument ("window").type_sequence_int ()
 
     + Option ("noise", "the output noise map.")
-    +   Argument ("level").type_image_out();
+    +   Argument ("level").type_image_out()
+
+    + Option ("datatype", "datatype for the eigenvalue decomposition (single or double precision). (default = float32)")
+    +   Argument ("float32/float64").type_choice (dtypes);
 
   COPYRIGHT = "Copyright (c) 2016 New York University, University of Antwerp, and the MRtrix3 contributors \n \n"
       "Permission is hereby granted, free of charge, to any non-commercial entity ('Recipient') obtaining a copy of this software and "
@@ -88,20 +97,45 @@ void usage ()
 using value_type = float;
 
 
-template <class ImageType>
+
+// Denoising is performed for all voxels along each image row in turn. The image data
+//   of all rows intersecting the sliding window along that row are first loaded into a
+//   contiguous buffer (zero-padded along x), from which the Casorati matrix for each
+//   voxel is then assembled.
+//
+// The Gram matrix is scaled and reduced to tridiagonal form exactly as within
+//   Eigen::SelfAdjointEigenSolver, but only its eigenvalues are computed by the QR
+//   algorithm; the eigenvectors of the tridiagonal matrix are then computed only for
+//   the (typically few) eigenvalues above the Marchenko-Pastur threshold, and
+//   transformed back only for the single column of data being recombined.
+template <typename F, class ImageType>
 class DenoisingFunctor { MEMALIGN(DenoisingFunctor)
   public:
+  using MatrixType = Eigen::Matrix<F, Eigen::Dynamic, Eigen::Dynamic>;
+  using VectorType = Eigen::Matrix<F, Eigen::Dynamic, 1>;
+
   DenoisingFunctor (ImageType& dwi, vector<int> extent, Image<bool>& mask, ImageType& noise)
     : extent {{extent[0]/2, extent[1]/2, extent[2]/2}},
       m (dwi.size(3)),
       n (extent[0]*extent[1]*extent[2]),
       r ((m<n) ? m : n),
-      X (m,n), 
-      pos {{0, 0, 0}}, 
+      width (extent[0]),
+      planes (extent[1]*extent[2]),
+      padded (dwi.size(0) + width - 1),
+      slab (m, padded * planes),
+      X (m, n),
+      row {{-1, -1}},
+      start (r),
       mask (mask),
       noise (noise)
-  { }
-  
+  {
+    // fixed (pseudo-random) starting vector for inverse iteration:
+    std::minstd_rand generator;
+    std::uniform_real_distribution<double> uniform (-1.0, 1.0);
+    for (ssize_t i = 0; i != r; ++i)
+      start[i] = uniform (generator);
+  }
+
   void operator () (ImageType& dwi, ImageType& out)
   {
     if (mask.valid()) {
@@ -111,18 +145,35 @@ class DenoisingFunctor { MEMALIGN(DenoisingFunctor)
     }
 
     // Load data in local window
-    load_data (dwi);
+    if (dwi.index(1) != row[0] || dwi.index(2) != row[1])
+      load_slab (dwi);
+    load_data (dwi.index(0));
 
     // Compute Eigendecomposition:
-    Eigen::MatrixXf XtX (r,r);
+    MatrixType XtX (r,r);
     if (m <= n)
       XtX.template triangularView<Eigen::Lower>() = X * X.transpose();
-    else 
+    else
       XtX.template triangularView<Eigen::Lower>() = X.transpose() * X;
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig (XtX);
+    // (scaling and tridiagonalisation as performed within Eigen::SelfAdjointEigenSolver,
+    //   such that the eigenvalues are identical to those it would compute)
+    MatrixType T = XtX.template triangularView<Eigen::Lower>();
+    F scale = T.cwiseAbs().maxCoeff();
+    if (scale == F(0))
+      scale = F(1);
+    T.template triangularView<Eigen::Lower>() /= scale;
     // eigenvalues provide squared singular values:
-    Eigen::VectorXf s = eig.eigenvalues();
-   
+    VectorType s (r);
+    if (r > 1) {
+      tridiag.compute (T);
+      diag = tridiag.diagonal();
+      subdiag = tridiag.subDiagonal();
+      eig.computeFromTridiagonal (diag, subdiag, Eigen::EigenvaluesOnly);
+      s = eig.eigenvalues() * scale;
+    } else {
+      s[0] = XtX(0,0);
+    }
+
     // Marchenko-Pastur optimal threshold
     const double lam_r = s[0] / n;
     double clam = 0.0;
@@ -139,23 +190,31 @@ class DenoisingFunctor { MEMALIGN(DenoisingFunctor)
       if (sigsq2 < sigsq1) {
         sigma2 = sigsq1;
         cutoff_p = p+1;
-      } 
+      }
     }
 
-    if (cutoff_p > 0) {
-      // recombine data using only eigenvectors above threshold:
-      s.head (cutoff_p).setZero();
-      s.tail (r-cutoff_p).setOnes();
-      if (m <= n) 
-        X.col (n/2) = eig.eigenvectors() * ( s.asDiagonal() * ( eig.eigenvectors().adjoint() * X.col(n/2) ));
-      else 
-        X.col (n/2) = X * ( eig.eigenvectors() * ( s.asDiagonal() * eig.eigenvectors().adjoint().col(n/2) ));
+    // Data for the centre of the window
+    VectorType result = X.col (n/2);
+    if (cutoff_p == r) {
+      result.setZero();
+    } else if (cutoff_p > 0) {
+      // recombine data using only eigenvectors above threshold
+      //   (only reached if r > 1, such that the tridiagonal form is available):
+      compute_eigenvectors (r-cutoff_p);
+      const MatrixType V = eigenvectors.template cast<F>();
+      if (m <= n) {
+        const VectorType z = tridiag.matrixQ().adjoint() * result;
+        result = tridiag.matrixQ() * (V * (V.transpose() * z));
+      } else {
+        const VectorType z = tridiag.matrixQ().adjoint() * VectorType::Unit (n, n/2);
+        result = X * (tridiag.matrixQ() * (V * (V.transpose() * z)));
+      }
     }
 
     // Store output
     assign_pos_of(dwi).to(out);
     for (auto l = Loop (3) (out); l; ++l)
-      out.value() = X(out.index(3), n/2);
+      out.value() = value_type (result[out.index(3)]);
 
     // store noise map if requested:
     if (noise.valid()) {
@@ -163,37 +222,143 @@ class DenoisingFunctor { MEMALIGN(DenoisingFunctor)
       noise.value() = value_type (std::sqrt(sigma2));
     }
   }
-  
-  
-  void load_data (ImageType& dwi)
+
+
+  // Load the data of all image rows intersecting the window along the current row
+  void load_slab (ImageType& dwi)
   {
-    pos[0] = dwi.index(0); pos[1] = dwi.index(1); pos[2] = dwi.index(2);
-    X.setZero();
-    ssize_t k = 0;
-    for (dwi.index(2) = pos[2]-extent[2]; dwi.index(2) <= pos[2]+extent[2]; ++dwi.index(2))
-      for (dwi.index(1) = pos[1]-extent[1]; dwi.index(1) <= pos[1]+extent[1]; ++dwi.index(1))
-        for (dwi.index(0) = pos[0]-extent[0]; dwi.index(0) <= pos[0]+extent[0]; ++dwi.index(0), ++k)
-          if (! is_out_of_bounds(dwi,0,3))
-            X.col(k) = dwi.row(3);
+    const std::array<ssize_t, 3> pos {{ dwi.index(0), dwi.index(1), dwi.index(2) }};
+    row = {{ pos[1], pos[2] }};
+    slab.setZero();
+    ssize_t p = 0;
+    for (dwi.index(2) = pos[2]-extent[2]; dwi.index(2) <= pos[2]+extent[2]; ++dwi.index(2)) {
+      for (dwi.index(1) = pos[1]-extent[1]; dwi.index(1) <= pos[1]+extent[1]; ++dwi.index(1), ++p) {
+        if (is_out_of_bounds (dwi, 1, 3))
+          continue;
+        for (dwi.index(0) = 0; dwi.index(0) < dwi.size(0); ++dwi.index(0))
+          slab.col (p*padded + dwi.index(0) + extent[0]) = dwi.row(3);
+      }
+    }
     // reset image position
     dwi.index(0) = pos[0];
     dwi.index(1) = pos[1];
     dwi.index(2) = pos[2];
   }
-  
+
+
+  // Assemble the Casorati matrix of the window centred on voxel x
+  //   (with columns ordered by z, y & x, from slowest to fastest varying)
+  void load_data (const ssize_t x)
+  {
+    for (ssize_t p = 0; p != planes; ++p)
+      X.middleCols (p*width, width) = slab.middleCols (p*padded + x, width).template cast<F>();
+  }
+
+
+  // Compute the eigenvectors of the (scaled) tridiagonal matrix for its k largest
+  //   eigenvalues by inverse iteration (as in LAPACK's xSTEIN), using the LU
+  //   factorisation of (T - lambda I) with partial pivoting (as in LAPACK's xGTTRF);
+  //   each vector is orthogonalised against those previously computed, such that
+  //   clusters of close eigenvalues yield an orthonormal basis
+  void compute_eigenvectors (const ssize_t k)
+  {
+    const Eigen::VectorXd d = diag.template cast<double>(), e = subdiag.template cast<double>();
+    double norm = 0.0;
+    for (ssize_t i = 0; i != r; ++i)
+      norm = std::max (norm, std::abs (d[i]) + (i ? std::abs (e[i-1]) : 0.0) + (i+1 < r ? std::abs (e[i]) : 0.0));
+    const double tiny = std::numeric_limits<double>::epsilon() * std::max (norm, 1.0);
+
+    eigenvectors.resize (r, k);
+    Eigen::VectorXd lower (r), upper (r), upper2 (r);
+    vector<bool> swapped (r);
+    for (ssize_t j = 0; j != k; ++j) {
+      // factorise (T - lambda I) = P L U:
+      lower.head (r-1) = e;
+      upper.head (r-1) = e;
+      u = (d.array() - double (eig.eigenvalues()[r-k+j])).matrix();
+      for (ssize_t i = 0; i+1 < r; ++i) {
+        swapped[i] = std::abs (u[i]) < std::abs (lower[i]);
+        upper2[i] = 0.0;
+        if (!swapped[i]) {
+          if (u[i] == 0.0)
+            u[i] = tiny;
+          lower[i] /= u[i];
+          u[i+1] -= lower[i] * upper[i];
+        } else {
+          const double factor = u[i] / lower[i];
+          u[i] = lower[i];
+          lower[i] = factor;
+          const double temp = upper[i];
+          upper[i] = u[i+1];
+          u[i+1] = temp - factor * u[i+1];
+          if (i+2 < r) {
+            upper2[i] = upper[i+1];
+            upper[i+1] *= -factor;
+          }
+        }
+      }
+      if (u[r-1] == 0.0)
+        u[r-1] = tiny;
+
+      auto v = eigenvectors.col (j);
+      v = start;
+      for (size_t iter = 0; iter != DENOISE_INVERSE_ITERATIONS; ++iter) {
+        // solve L y = P^T v:
+        for (ssize_t i = 0; i+1 < r; ++i) {
+          if (!swapped[i]) {
+            v[i+1] -= lower[i] * v[i];
+          } else {
+            const double temp = v[i];
+            v[i] = v[i+1];
+            v[i+1] = temp - lower[i] * v[i+1];
+          }
+        }
+        // solve U x = y:
+        v[r-1] /= u[r-1];
+        v[r-2] = (v[r-2] - upper[r-2] * v[r-1]) / u[r-2];
+        for (ssize_t i = r-3; i >= 0; --i)
+          v[i] = (v[i] - upper[i] * v[i+1] - upper2[i] * v[i+2]) / u[i];
+        v.normalize();
+        for (ssize_t i = 0; i != j; ++i)
+          v -= eigenvectors.col(i).dot (v) * eigenvectors.col(i);
+        v.normalize();
+      }
+    }
+  }
+
+
 private:
   const std::array<ssize_t, 3> extent;
   const ssize_t m, n, r;
-  Eigen::MatrixXf X;
-  std::array<ssize_t, 3> pos;
+  // Window width along x, number of image rows intersecting the window, and padded row length
+  const ssize_t width, planes, padded;
+  Eigen::MatrixXf slab;
+  MatrixType X;
+  std::array<ssize_t, 2> row;
+  Eigen::Tridiagonalization<MatrixType> tridiag;
+  VectorType diag, subdiag;
+  Eigen::SelfAdjointEigenSolver<MatrixType> eig;
+  Eigen::VectorXd start, u;
+  Eigen::MatrixXd eigenvectors;
   double sigma2;
   Image<bool> mask;
   ImageType noise;
-  
+
 };
 
 
 
+template <typename F>
+void denoise (Image<value_type>& dwi_in, Image<value_type>& dwi_out, const vector<int>& extent, Image<bool>& mask, Image<value_type>& noise)
+{
+  DenoisingFunctor<F, Image<value_type>> func (dwi_in, extent, mask, noise);
+  // Each thread processes complete rows along x, such that the data loaded for the window can be reused
+  ThreadedLoop ("running MP-PCA denoising", dwi_in, vector<size_t> ({ 1, 2 }), vector<size_t> ({ 0 }))
+    .run (func, dwi_in, dwi_out);
+}
+
+
+
 void run ()
 {
   auto dwi_in = Image<value_type>::open (argument[0]).with_direct_io(3);
@@ -232,9 +397,11 @@ void run ()
     noise = Image<value_type>::create (opt[0][0], header);
   }
 
-  DenoisingFunctor< Image<value_type> > func (dwi_in, extent, mask, noise);
-  ThreadedLoop ("running MP-PCA denoising", dwi_in, 0, 3)
-    .run (func, dwi_in, dwi_out);
+  opt = get_options ("datatype");
+  if (!opt.size() || int(opt[0][0]) == 0)
+    denoise<float> (dwi_in, dwi_out, extent, mask, noise);
+  else
+    denoise<double> (dwi_in, dwi_out, extent, mask, noise);
 }
 
 
@@ -61,7 +61,13 @@ void usage ()
     "present in the input fixel template, in order to retain fixel correspondence. However a consequence of this is that "
     "all fixels in the template will be initialy visible when the output fixel directory is loaded in mrview. Those fixels "
     "outside the processing mask will immediately disappear from view as soon as any data-file-based fixel colouring or "
-    "thresholding is applied.";
+    "thresholding is applied."
+
+  + "Fixel-fixel connectivity can either be computed from the input tractogram, or loaded from a file "
+    "generated previously using the fixelconnectivity command; the latter avoids re-computing connectivity "
+    "from the tractogram for every analysis performed using the same fixel template. In this case, the "
+    "-angle option is not applicable, and the -connectivity option can only be used to increase the "
+    "threshold relative to that used when the file was generated. The same fixel mask must also be used.";
 
   REFERENCES
   + "Raffelt, D.; Smith, RE.; Ridgway, GR.; Tournier, JD.; Vaughan, DN.; Rose, S.; Henderson, R.; Connelly, A." // Internal
@@ -83,7 +89,8 @@ void usage ()
 
   + Argument ("contrast", "the contrast vector, specified as a single row of weights").type_file_in ()
 
-  + Argument ("tracks", "the tracks used to determine fixel-fixel connectivity").type_tracks_in ()
+  + Argument ("tracks", "the tracks used to determine fixel-fixel connectivity; "
+                        "alternatively, a fixel connectivity file generated using the fixelconnectivity command").type_file_in ()
 
   + Argument ("out_fixel_directory", "the output directory where results will be saved. Will be created if it does not exist").type_text();
 
@@ -121,12 +128,53 @@ void usage ()
   + Argument ("value").type_float (0.0, 90.0)
 
   + Option ("mask", "provide a fixel data file containing a mask of those fixels to be used during processing")
-  + Argument ("file").type_image_in();
+  + Argument ("file").type_image_in()
+
+  + Option ("float32", "store the subject data in single precision, halving the memory required; "
+                       "all statistical computations are nevertheless performed in double precision")
+
+  + Option ("data_cache", "if the specified file exists, load the (smoothed) subject data from it rather than from the input "
+                          "fixel data files; otherwise, write the subject data to this file once loaded and smoothed. This allows "
+                          "multiple analyses that differ only in their design matrix, contrast or statistical inference "
+                          "parameters to share the same data. The file is rejected if the list of subject data files, fixel mask, "
+                          "connectivity or smoothing parameters differ, or if it was written using the -float32 option and the "
+                          "current analysis is performed without it; changes to the contents of the subject data files themselves "
+                          "are however not detected.")
+  + Argument ("path").type_text();
 
 }
 
 
 
+// Hash of the input data files and the smoothing filter (which incorporates the fixel
+//   mask, fixel-fixel connectivity and smoothing kernel), used to verify that the
+//   contents of a data cache file correspond to the current analysis
+uint64_t hash_inputs (const vector<std::string>& identifiers, const Stats::CFE::norm_connectivity_matrix_type& smoothing_weights)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  auto add = [&] (const void* data, const size_t size) {
+    for (size_t i = 0; i != size; ++i) {
+      hash ^= reinterpret_cast<const uint8_t*> (data)[i];
+      hash *= 1099511628211ULL;
+    }
+  };
+  for (const auto& i : identifiers)
+    add (i.c_str(), i.size() + 1);
+  for (const auto& row : smoothing_weights) {
+    const uint64_t size = row.size();
+    add (&size, sizeof (size));
+    for (const auto& i : row) {
+      const index_type index = i.index();
+      const connectivity_value_type value = i.value();
+      add (&index, sizeof (index));
+      add (&value, sizeof (value));
+    }
+  }
+  return hash;
+}
+
+
+
 template <class VectorType>
 void write_fixel_output (const std::string& filename,
                          const VectorType& data,
@@ -153,10 +201,10 @@ void run() {
   const value_type cfe_c = get_option_value ("cfe_c", DEFAULT_CFE_C);
   int num_perms = get_option_value ("nperms", DEFAULT_NUMBER_PERMUTATIONS);
   const value_type smooth_std_dev = get_option_value ("smooth", DEFAULT_SMOOTHING_STD) / 2.3548;
-  const value_type connectivity_threshold = get_option_value ("connectivity", DEFAULT_CONNECTIVITY_THRESHOLD);
+  value_type connectivity_threshold = get_option_value ("connectivity", DEFAULT_CONNECTIVITY_THRESHOLD);
   const bool do_nonstationary_adjustment = get_options ("nonstationary").size();
   int nperms_nonstationary = get_option_value ("nperms_nonstationary", DEFAULT_NUMBER_PERMUTATIONS_NONSTATIONARITY);
-  const value_type angular_threshold = get_option_value ("angle", DEFAULT_ANGLE_THRESHOLD);
+  value_type angular_threshold = get_option_value ("angle", DEFAULT_ANGLE_THRESHOLD);
 
 
   const std::string input_fixel_directory = argument[0];
@@ -259,6 +307,15 @@ void run() {
       throw Exception ("number of rows in the permutations file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
   }
 
+  // Load exchangeability blocks if supplied
+  opt = get_options ("exchange_within");
+  vector<size_t> blocks;
+  if (opt.size()) {
+    blocks = Math::Stats::Permutation::load_blocks_file (opt[0][0]);
+    if (blocks.size() != (size_t)design.rows())
+      throw Exception ("number of entries in the exchangeability blocks file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
+  }
+
   // Load non-stationary correction permutations file if supplied
   opt = get_options("permutations_nonstationary");
   vector<vector<size_t> > permutations_nonstationary;
@@ -277,32 +334,26 @@ void run() {
   if (contrast.rows() > 1)
     throw Exception ("only a single contrast vector (defined as a row) is currently supported");
 
-  // Compute fixel-fixel connectivity
-  Stats::CFE::init_connectivity_matrix_type connectivity_matrix (num_fixels);
-  vector<uint16_t> fixel_TDI (num_fixels, 0);
-  const std::string track_filename = argument[4];
-  DWI::Tractography::Properties properties;
-  DWI::Tractography::Reader<float> track_file (track_filename, properties);
-  // Read in tracts, and compute whole-brain fixel-fixel connectivity
-  const size_t num_tracks = properties["count"].empty() ? 0 : to<size_t> (properties["count"]);
-  if (!num_tracks)
-    throw Exception ("no tracks found in input file");
-  if (num_tracks < 1000000)
-    WARN ("more than 1 million tracks should be used to ensure robust fixel-fixel connectivity");
-  {
-    DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity");
-    DWI::Tractography::Mapping::TrackMapperBase mapper (index_image);
-    mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (index_header, properties, 0.333f));
-    mapper.set_use_precise_mapping (true);
-    Stats::CFE::TrackProcessor tract_processor (index_image, directions, mask, fixel_TDI, connectivity_matrix, angular_threshold);
-    Thread::run_queue (
-        loader,
-        Thread::batch (DWI::Tractography::Streamline<float>()),
-        mapper,
-        Thread::batch (DWI::Tractography::Mapping::SetVoxelDir()),
-        tract_processor);
+  // Compute or load fixel-fixel connectivity
+  const std::string connectivity_path = argument[4];
+  std::unique_ptr<Stats::CFE::ConnectivityMatrix> connectivity_matrix;
+  if (!Stats::CFE::ConnectivityMatrix::is_file (connectivity_path)) {
+    connectivity_matrix.reset (new Stats::CFE::ConnectivityMatrix (connectivity_path, index_image, directions, mask, angular_threshold, connectivity_threshold));
+  } else {
+    connectivity_matrix.reset (new Stats::CFE::ConnectivityMatrix (connectivity_path));
+    if (connectivity_matrix->num_fixels() != num_fixels)
+      throw Exception ("fixel connectivity file \"" + connectivity_path + "\" does not match fixel template");
+    if (connectivity_matrix->num_mask_fixels() != mask_fixels)
+      throw Exception ("fixel connectivity file \"" + connectivity_path + "\" was generated using a different fixel mask");
+    if (get_options ("angle").size() && angular_threshold != connectivity_matrix->get_angular_threshold())
+      WARN ("-angle option ignored; using angular threshold of " + str(connectivity_matrix->get_angular_threshold()) + " degrees stored in fixel connectivity file");
+    angular_threshold = connectivity_matrix->get_angular_threshold();
+    if (connectivity_threshold < connectivity_matrix->get_connectivity_threshold()) {
+      if (get_options ("connectivity").size())
+        WARN ("connectivity threshold cannot be lower than that used to generate fixel connectivity file; using " + str(connectivity_matrix->get_connectivity_threshold()));
+      connectivity_threshold = connectivity_matrix->get_connectivity_threshold();
+    }
   }
-  track_file.close();
 
   // Normalise connectivity matrix, threshold, and put in a more efficient format
   Stats::CFE::norm_connectivity_matrix_type norm_connectivity_matrix (mask_fixels);
@@ -330,27 +381,26 @@ void run() {
         //   correspond to rows in the statistical analysis
         connectivity_value_type sum_weights = 0.0;
 
-        for (auto& it : connectivity_matrix[fixel]) {
-#ifndef NDEBUG
+        for (uint64_t entry = connectivity_matrix->row_begin (fixel); entry != connectivity_matrix->row_end (fixel); ++entry) {
+          const index_type connected_fixel = connectivity_matrix->index (entry);
           // Even if this fixel is within the mask, it should still not
           //   connect to any fixel that is outside the mask
-          mask.index(0) = it.first;
-          assert (mask.value());
-#endif
-          const connectivity_value_type connectivity = it.second.value / connectivity_value_type (fixel_TDI[fixel]);
+          if (fixel2row[connected_fixel] < 0)
+            throw Exception ("fixel connectivity file \"" + connectivity_path + "\" was generated using a different fixel mask");
+          const connectivity_value_type connectivity = connectivity_matrix->value (entry);
           if (connectivity >= connectivity_threshold) {
             if (do_smoothing) {
-              const value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[it.first][0]) +
-                                                     Math::pow2 (positions[fixel][1] - positions[it.first][1]) +
-                                                     Math::pow2 (positions[fixel][2] - positions[it.first][2]));
+              const value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[connected_fixel][0]) +
+                                                     Math::pow2 (positions[fixel][1] - positions[connected_fixel][1]) +
+                                                     Math::pow2 (positions[fixel][2] - positions[connected_fixel][2]));
               const connectivity_value_type smoothing_weight = connectivity * gaussian_const1 * std::exp (-Math::pow2 (distance) / gaussian_const2);
               if (smoothing_weight >= connectivity_threshold) {
-                smoothing_weights[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[it.first], smoothing_weight));
+                smoothing_weights[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[connected_fixel], smoothing_weight));
                 sum_weights += smoothing_weight;
               }
             }
             // Here we pre-exponentiate each connectivity value by C
-            norm_connectivity_matrix[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[it.first], std::pow (connectivity, cfe_c)));
+            norm_connectivity_matrix[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[connected_fixel], std::pow (connectivity, cfe_c)));
           }
         }
 
@@ -364,14 +414,12 @@ void run() {
         for (auto i : smoothing_weights[row])
           i.normalise (norm_factor);
 
-        // Force deallocation of memory used for this fixel in the original matrix
-        std::map<uint32_t, Stats::CFE::connectivity>().swap (connectivity_matrix[fixel]);
-
       } else {
 
         // If fixel is not in the mask, tract_processor should never assign
         //   any connections to it
-        assert (connectivity_matrix[fixel].empty());
+        if (connectivity_matrix->row_begin (fixel) != connectivity_matrix->row_end (fixel))
+          throw Exception ("fixel connectivity file \"" + connectivity_path + "\" was generated using a different fixel mask");
 
       }
 
@@ -379,15 +427,16 @@ void run() {
     }
   }
 
-  // The connectivity matrix is now in vector rather than matrix form;
+  // The connectivity matrix has now been re-indexed by row of the analysis;
   //   throw out the structure holding the original data
-  // (Note however that all entries in the original structure should
-  //   have been deleted during the prior loop)
-  Stats::CFE::init_connectivity_matrix_type().swap (connectivity_matrix);
+  connectivity_matrix.reset();
 
 
   Header output_header (header);
-  output_header.keyval()["num permutations"] = str(num_perms);
+  // Under -adaptive, the number of permutations processed is only known once permutation
+  //   testing is complete, and is therefore only reported in the p-value outputs
+  if (!get_options ("adaptive").size())
+    output_header.keyval()["num permutations"] = str(num_perms);
   output_header.keyval()["dh"] = str(cfe_dh);
   output_header.keyval()["cfe_e"] = str(cfe_e);
   output_header.keyval()["cfe_h"] = str(cfe_h);
@@ -398,20 +447,63 @@ void run() {
 
 
   // Load input data
-  matrix_type data (mask_fixels, identifiers.size());
-  data.setZero();
-  {
-    ProgressBar progress (std::string ("loading input images") + (do_smoothing ? " and smoothing" : ""), identifiers.size());
-    for (size_t subject = 0; subject < identifiers.size(); subject++) {
-      LogLevelLatch log_level (0);
+  //   Depending on the -float32 option, only one of these is used
+  const bool single_precision = get_options ("float32").size();
+  matrix_type data;
+  float_matrix_type data_float;
+  if (single_precision)
+    data_float.resize (mask_fixels, identifiers.size());
+  else
+    data.resize (mask_fixels, identifiers.size());
+
+  opt = get_options ("data_cache");
+  const std::string cache_path = opt.size() ? std::string (opt[0][0]) : std::string();
+  const std::string cache_hash = cache_path.size() ? str(hash_inputs (identifiers, smoothing_weights)) : std::string();
+
+  if (cache_path.size() && Path::exists (cache_path)) {
+
+    auto cache_header = Header::open (cache_path);
+    const DataType cache_datatype = cache_header.datatype();
+    auto cache = cache_header.get_image<value_type>();
+    const auto hash = cache.keyval().find ("fixelcfestats hash");
+    if (cache.ndim() < 2 || cache.size(0) != ssize_t(mask_fixels) || cache.size(1) != ssize_t(identifiers.size())
+        || hash == cache.keyval().end() || hash->second != cache_hash)
+      throw Exception ("data cache file \"" + cache_path + "\" does not correspond to the input data, fixel mask, "
+                       "connectivity and smoothing parameters of the current analysis");
+    // single-precision data would be silently used in place of the full-precision data
+    //   otherwise; the converse is harmless, since the data are then rounded regardless
+    if (!single_precision && cache_datatype.bytes() < sizeof (default_type))
+      throw Exception ("data cache file \"" + cache_path + "\" was written using the -float32 option, "
+                       "and cannot be used for an analysis performed in double precision");
+    ProgressBar progress ("loading input data from cache file", identifiers.size());
+    for (cache.index(1) = 0; cache.index(1) != cache.size(1); ++cache.index(1)) {
+      for (cache.index(0) = 0; cache.index(0) != cache.size(0); ++cache.index(0)) {
+        if (single_precision)
+          data_float (cache.index(0), cache.index(1)) = cache.value();
+        else
+          data (cache.index(0), cache.index(1)) = cache.value();
+      }
+      ++progress;
+    }
+
+  } else {
 
+    // Subjects are loaded (and smoothed) in parallel, each into its own column
+    ProgressBar progress (std::string ("loading input images") + (do_smoothing ? " and smoothing" : ""), identifiers.size());
+    LogLevelLatch log_level (0);
+    std::mutex mutex;
+    size_t counter = 0;
+    auto source = [&] (size_t& subject) { subject = counter++; return subject < identifiers.size(); };
+    auto loader = [&] (const size_t& subject)
+    {
+      Image<index_type> index (index_image);
       auto subject_data = Image<value_type>::open (identifiers[subject]).with_direct_io();
       vector<value_type> subject_data_vector (mask_fixels, 0.0);
-      for (auto i = Loop (index_image, 0, 3)(index_image); i; ++i) {
-        index_image.index(3) = 1;
-        uint32_t offset = index_image.value();
+      for (auto i = Loop (index, 0, 3)(index); i; ++i) {
+        index.index(3) = 1;
+        uint32_t offset = index.value();
         uint32_t fixel_index = 0;
-        for (auto f = Fixel::Loop (index_image) (subject_data); f; ++f, ++fixel_index) {
+        for (auto f = Fixel::Loop (index) (subject_data); f; ++f, ++fixel_index) {
           if (!std::isfinite(static_cast<value_type>(subject_data.value())))
             throw Exception ("subject data file " + identifiers[subject] + " contains non-finite value: " + str(subject_data.value()));
           // Note that immediately on import, data are re-arranged according to fixel mask
@@ -422,44 +514,83 @@ void run() {
       }
 
       // Smooth the data
+      vector_type column (mask_fixels);
       if (do_smoothing) {
         for (size_t fixel = 0; fixel < mask_fixels; ++fixel) {
           value_type value = 0.0;
           for (auto i : smoothing_weights[fixel])
             value += subject_data_vector[i.index()] * i.value();
-          data (fixel, subject) = value;
+          column[fixel] = value;
         }
       } else {
-        data.col (subject) = Eigen::Map<Eigen::Matrix<value_type, Eigen::Dynamic, 1> > (subject_data_vector.data(), mask_fixels);
+        column = Eigen::Map<vector_type> (subject_data_vector.data(), mask_fixels);
       }
-      progress++;
-    }
+      if (single_precision)
+        data_float.col (subject) = column.matrix().cast<float>();
+      else
+        data.col (subject) = column.matrix();
+
+      std::lock_guard<std::mutex> lock (mutex);
+      ++progress;
+      return true;
+    };
+    Thread::run_queue (source, size_t(), Thread::multi (loader));
+
   }
 
   // Free the memory occupied by the data smoothing filter; no longer required
   Stats::CFE::norm_connectivity_matrix_type().swap (smoothing_weights);
 
-  if (!data.allFinite())
+  if (!(single_precision ? data_float.allFinite() : data.allFinite()))
     throw Exception ("input data contains non-finite value(s)");
+
+  if (cache_path.size() && !Path::exists (cache_path)) {
+    Header cache_header;
+    cache_header.ndim() = 3;
+    cache_header.size(0) = mask_fixels;
+    cache_header.size(1) = identifiers.size();
+    cache_header.size(2) = 1;
+    cache_header.spacing(0) = cache_header.spacing(1) = cache_header.spacing(2) = 1.0;
+    cache_header.stride(0) = 1; cache_header.stride(1) = 2; cache_header.stride(2) = 3;
+    cache_header.transform().setIdentity();
+    cache_header.datatype() = single_precision ? DataType::Float32 : DataType::Float64;
+    cache_header.datatype().set_byte_order_native();
+    cache_header.keyval()["fixelcfestats hash"] = cache_hash;
+    auto cache = Image<value_type>::create (cache_path, cache_header);
+    ProgressBar progress ("writing data cache file", identifiers.size());
+    for (cache.index(1) = 0; cache.index(1) != cache.size(1); ++cache.index(1)) {
+      for (cache.index(0) = 0; cache.index(0) != cache.size(0); ++cache.index(0))
+        cache.value() = single_precision ? value_type (data_float (cache.index(0), cache.index(1))) : data (cache.index(0), cache.index(1));
+      ++progress;
+    }
+  }
+
   {
-    ProgressBar progress ("outputting beta coefficients, effect size and standard deviation");
-    auto temp = Math::Stats::GLM::solve_betas (data, design);
+    ProgressBar progress ("outputting beta coefficients, effect size and standard deviation", contrast.cols() + 4);
+    matrix_type betas;
+    vector_type abs_effect, std_effect, std_dev;
+    if (single_precision)
+      Math::Stats::GLM::all_stats (data_float, design, contrast, betas, abs_effect, std_effect, std_dev);
+    else
+      Math::Stats::GLM::all_stats (data, design, contrast, betas, abs_effect, std_effect, std_dev);
+    ++progress;
 
     for (ssize_t i = 0; i < contrast.cols(); ++i) {
-      write_fixel_output (Path::join (output_fixel_directory, "beta" + str(i) + ".mif"), temp.row(i), fixel2row, output_header);
+      write_fixel_output (Path::join (output_fixel_directory, "beta" + str(i) + ".mif"), betas.row(i), fixel2row, output_header);
       ++progress;
     }
-    temp = Math::Stats::GLM::abs_effect_size (data, design, contrast); ++progress;
-    write_fixel_output (Path::join (output_fixel_directory, "abs_effect.mif"), temp.row(0), fixel2row, output_header); ++progress;
-    temp = Math::Stats::GLM::std_effect_size (data, design, contrast); ++progress;
-    write_fixel_output (Path::join (output_fixel_directory, "std_effect.mif"), temp.row(0), fixel2row, output_header); ++progress;
-    temp = Math::Stats::GLM::stdev (data, design); ++progress;
-    write_fixel_output (Path::join (output_fixel_directory, "std_dev.mif"), temp.row(0), fixel2row, output_header);
+    write_fixel_output (Path::join (output_fixel_directory, "abs_effect.mif"), abs_effect, fixel2row, output_header); ++progress;
+    write_fixel_output (Path::join (output_fixel_directory, "std_effect.mif"), std_effect, fixel2row, output_header); ++progress;
+    write_fixel_output (Path::join (output_fixel_directory, "std_dev.mif"), std_dev, fixel2row, output_header);
   }
 
-  Math::Stats::GLMTTest glm_ttest (data, design, contrast);
-  std::shared_ptr<Stats::EnhancerBase> cfe_integrator;
+  Math::Stats::GLMTTest glm_ttest = single_precision ?
+                                    Math::Stats::GLMTTest (data_float, design, contrast) :
+                                    Math::Stats::GLMTTest (data, design, contrast);
+  std::shared_ptr<Stats::EnhancerBase> cfe_integrator, cfe_integrator_default;
   cfe_integrator.reset (new Stats::CFE::Enhancer (norm_connectivity_matrix, cfe_dh, cfe_e, cfe_h));
+  // The default permutation is enhanced from a single thread, so can process fixels in parallel
+  cfe_integrator_default.reset (new Stats::CFE::Enhancer (norm_connectivity_matrix, cfe_dh, cfe_e, cfe_h, true));
   vector_type empirical_cfe_statistic;
 
   // If performing non-stationarity adjustment we need to pre-compute the empirical CFE statistic
@@ -469,7 +600,7 @@ void run() {
       Stats::PermTest::PermutationStack permutations (permutations_nonstationary, "precomputing empirical statistic for non-stationarity adjustment");
       Stats::PermTest::precompute_empirical_stat (glm_ttest, cfe_integrator, permutations, empirical_cfe_statistic);
     } else {
-      Stats::PermTest::PermutationStack permutations (nperms_nonstationary, design.rows(), "precomputing empirical statistic for non-stationarity adjustment", false);
+      Stats::PermTest::PermutationStack permutations (nperms_nonstationary, design.rows(), blocks, "precomputing empirical statistic for non-stationarity adjustment", false);
       Stats::PermTest::precompute_empirical_stat (glm_ttest, cfe_integrator, permutations, empirical_cfe_statistic);
     }
     output_header.keyval()["nonstationary adjustment"] = str(true);
@@ -485,7 +616,7 @@ void run() {
   if (compute_negative_contrast)
     cfe_output_neg.reset (new vector_type (mask_fixels));
 
-  Stats::PermTest::precompute_default_permutation (glm_ttest, cfe_integrator, empirical_cfe_statistic, cfe_output, cfe_output_neg, tvalue_output);
+  Stats::PermTest::precompute_default_permutation (glm_ttest, cfe_integrator_default, empirical_cfe_statistic, cfe_output, cfe_output_neg, tvalue_output);
 
   write_fixel_output (Path::join (output_fixel_directory, "cfe.mif"), cfe_output, fixel2row, output_header);
   write_fixel_output (Path::join (output_fixel_directory, "tvalue.mif"), tvalue_output, fixel2row, output_header);
@@ -507,18 +638,26 @@ void run() {
     // FIXME fixelcfestats is hanging here for some reason...
     //   Even when no mask is supplied
 
+    bool complete;
     if (permutations.size()) {
-      Stats::PermTest::run_permutations (permutations, glm_ttest, cfe_integrator, empirical_cfe_statistic,
-                                         cfe_output, cfe_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalues, uncorrected_pvalues_neg);
+      complete = Stats::PermTest::run_permutations (permutations, glm_ttest, cfe_integrator, empirical_cfe_statistic,
+                                                    cfe_output, cfe_output_neg,
+                                                    perm_distribution, perm_distribution_neg,
+                                                    uncorrected_pvalues, uncorrected_pvalues_neg);
     } else {
-      Stats::PermTest::run_permutations (num_perms, glm_ttest, cfe_integrator, empirical_cfe_statistic,
-                                         cfe_output, cfe_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalues, uncorrected_pvalues_neg);
+      complete = Stats::PermTest::run_permutations (num_perms, blocks, glm_ttest, cfe_integrator, empirical_cfe_statistic,
+                                                    cfe_output, cfe_output_neg,
+                                                    perm_distribution, perm_distribution_neg,
+                                                    uncorrected_pvalues, uncorrected_pvalues_neg);
     }
 
+    // Only a subset of permutations has been processed (-shard option)
+    if (!complete)
+      return;
+
+    // Permutation testing may have terminated early (-adaptive option)
+    output_header.keyval()["num permutations"] = str(perm_distribution.size());
+
     ProgressBar progress ("outputting final results");
     save_matrix (perm_distribution, Path::join (output_fixel_directory, "perm_dist.txt")); ++progress;
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "image.h"
+#include "transform.h"
+#include "algo/loop.h"
+#include "fixel/helpers.h"
+#include "fixel/loop.h"
+#include "stats/cfe.h"
+
+
+using namespace MR;
+using namespace App;
+using Stats::CFE::direction_type;
+using Stats::CFE::index_type;
+using Stats::CFE::value_type;
+
+#define DEFAULT_ANGLE_THRESHOLD 45.0
+#define DEFAULT_CONNECTIVITY_THRESHOLD 0.01
+
+
+void usage ()
+{
+  AUTHOR = "Robert E. Smith (robert.smith@florey.edu.au)";
+
+  SYNOPSIS = "Generate a fixel-fixel connectivity matrix, for use in connectivity-based fixel enhancement";
+
+  DESCRIPTION
+  + "The output file contains, for each fixel in the template, the fraction of streamlines traversing that fixel "
+    "that also traverse each other fixel, retaining only those connections exceeding the connectivity threshold. "
+    "This file can be provided to fixelcfestats in place of the tractogram, such that fixel-fixel connectivity "
+    "does not need to be re-computed for every analysis performed using the same fixel template; the connectivity "
+    "exponent and smoothing kernel can still be set independently for each analysis."
+
+  + "If the -mask option is used here, the same fixel mask must be provided to fixelcfestats.";
+
+  ARGUMENTS
+  + Argument ("fixel_directory", "the fixel directory containing the fixel template").type_directory_in()
+
+  + Argument ("tracks", "the tracks used to determine fixel-fixel connectivity").type_tracks_in()
+
+  + Argument ("output", "the output fixel connectivity file").type_file_out();
+
+  OPTIONS
+  + Option ("connectivity", "a threshold to define the required fraction of shared connections to be included in the neighbourhood (default: " + str(DEFAULT_CONNECTIVITY_THRESHOLD, 2) + ")")
+  + Argument ("threshold").type_float (0.0, 1.0)
+
+  + Option ("angle", "the max angle threshold for assigning streamline tangents to fixels (Default: " + str(DEFAULT_ANGLE_THRESHOLD, 2) + " degrees)")
+  + Argument ("value").type_float (0.0, 90.0)
+
+  + Option ("mask", "provide a fixel data file containing a mask of those fixels to be used during processing")
+  + Argument ("file").type_image_in()
+
+  + Option ("quantise", "store connectivity values as 16-bit integers rather than floating-point, halving the size of the "
+                        "value data at the expense of a small loss of precision");
+
+}
+
+
+
+void run ()
+{
+  const value_type connectivity_threshold = get_option_value ("connectivity", DEFAULT_CONNECTIVITY_THRESHOLD);
+  const value_type angular_threshold = get_option_value ("angle", DEFAULT_ANGLE_THRESHOLD);
+
+  const std::string input_fixel_directory = argument[0];
+  Header index_header = Fixel::find_index_header (input_fixel_directory);
+  auto index_image = index_header.get_image<index_type>();
+
+  const index_type num_fixels = Fixel::get_number_of_fixels (index_header);
+  CONSOLE ("number of fixels: " + str(num_fixels));
+
+  Image<bool> mask;
+  auto opt = get_options ("mask");
+  if (opt.size()) {
+    mask = Image<bool>::open (opt[0][0]);
+    Fixel::check_data_file (mask);
+    if (!Fixel::fixels_match (index_header, mask))
+      throw Exception ("Mask image provided using -mask option does not match fixel template");
+  } else {
+    Header data_header;
+    data_header.ndim() = 3;
+    data_header.size(0) = num_fixels;
+    data_header.size(1) = 1;
+    data_header.size(2) = 1;
+    data_header.spacing(0) = data_header.spacing(1) = data_header.spacing(2) = 1.0;
+    data_header.stride(0) = 1; data_header.stride(1) = 2; data_header.stride(2) = 3;
+    data_header.transform().setIdentity();
+    mask = Image<bool>::scratch (data_header, "scratch fixel mask");
+    for (index_type f = 0; f != num_fixels; ++f) {
+      mask.index(0) = f;
+      mask.value() = true;
+    }
+  }
+
+  vector<direction_type> directions (num_fixels);
+  {
+    auto directions_data = Fixel::find_directions_header (input_fixel_directory).get_image<default_type>().with_direct_io ({+2,+1});
+    for (auto i = Loop ("loading template fixel directions", index_image, 0, 3)(index_image); i; ++i) {
+      index_image.index(3) = 1;
+      const index_type offset = index_image.value();
+      size_t fixel_index = 0;
+      for (auto f = Fixel::Loop (index_image) (directions_data); f; ++f, ++fixel_index)
+        directions[offset + fixel_index] = directions_data.row(1);
+    }
+  }
+
+  Stats::CFE::ConnectivityMatrix matrix (argument[1], index_image, directions, mask, angular_threshold, connectivity_threshold);
+  CONSOLE ("fixel mask contains " + str(matrix.num_mask_fixels()) + " fixels; " + str(matrix.num_entries()) + " fixel-fixel connections retained");
+  matrix.save (argument[2], get_options ("quantise").size());
+}
+
@@ -46,9 +46,7 @@ const OptionGroup ConnectOption = OptionGroup ("Options for connected-component
                   "the first 3 axes are included. The axes should be provided as a comma-separated list of values.")
   + Argument ("axes").type_sequence_int()
 
-+ Option ("largest", "only retain the largest connected component")
-
-+ Option ("connectivity", "use 26-voxel-neighbourhood connectivity (Default: 6)");
++ Option ("largest", "only retain the largest connected component");
 
 
 
@@ -91,6 +89,7 @@ void usage ()
   OPTIONS
   + CleanOption
   + ConnectOption
+  + Filter::ConnectivityOptions
   + DilateErodeOption
   + MedianOption
 
@@ -138,9 +137,7 @@ void run () {
       largest_only = true;
       filter.set_largest_only (true);
     }
-    opt = get_options ("connectivity");
-    if (opt.size())
-      filter.set_26_connectivity (true);
+    filter.set_connectivity (Filter::get_connectivity());
 
     Stride::set_from_command_line (filter);
 
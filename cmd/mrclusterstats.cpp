@@ -19,6 +19,7 @@
 #include "image.h"
 #include "math/SH.h"
 #include "dwi/directions/predefined.h"
+#include "thread_queue.h"
 #include "timer.h"
 #include "math/stats/glm.h"
 #include "math/stats/permutation.h"
@@ -82,7 +83,10 @@ void usage ()
                            "This disables TFCE, which is the default otherwise.")
     + Argument ("value").type_float (1.0e-6)
 
-    + Option ("connectivity", "use 26-voxel-neighbourhood connectivity (Default: 6)");
+    + Option ("float32", "store the subject data in single precision, halving the memory required; "
+                         "all statistical computations are nevertheless performed in double precision")
+
+  + Filter::ConnectivityOptions;
 
 }
 
@@ -90,11 +94,10 @@ void usage ()
 
 template <class VectorType, class ImageType>
 void write_output (const VectorType& data,
-                   const vector<vector<int> >& mask_indices,
+                   const Filter::Connector& connector,
                    ImageType& image) {
-  for (size_t i = 0; i < mask_indices.size(); i++) {
-    for (size_t dim = 0; dim < image.ndim(); dim++)
-      image.index(dim) = mask_indices[i][dim];
+  for (size_t i = 0; i < connector.size(); i++) {
+    connector.assign_pos (i, image);
     image.value() = data[i];
   }
 }
@@ -115,7 +118,7 @@ void run() {
   int num_perms = get_option_value ("nperms", DEFAULT_NUMBER_PERMUTATIONS);
   int nperms_nonstationary = get_option_value ("nperms_nonstationary", DEFAULT_NUMBER_PERMUTATIONS_NONSTATIONARITY);
 
-  const bool do_26_connectivity = get_options("connectivity").size();
+  const size_t connectivity = Filter::get_connectivity();
   const bool do_nonstationary_adjustment = get_options ("nonstationary").size();
 
   // Read filenames
@@ -143,6 +146,15 @@ void run() {
        throw Exception ("number of rows in the permutations file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
   }
 
+  // Load exchangeability blocks if supplied
+  opt = get_options ("exchange_within");
+  vector<size_t> blocks;
+  if (opt.size()) {
+    blocks = Math::Stats::Permutation::load_blocks_file (opt[0][0]);
+    if (blocks.size() != (size_t)design.rows())
+      throw Exception ("number of entries in the exchangeability blocks file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
+  }
+
   // Load non-stationary correction permutations file if supplied
   opt = get_options("permutations_nonstationary");
   vector<vector<size_t> > permutations_nonstationary;
@@ -159,39 +171,55 @@ void run() {
     throw Exception ("the number of contrasts does not equal the number of columns in the design matrix");
 
   auto mask_header = Header::open (argument[3]);
-  // Load Mask and compute adjacency
+  // Load mask
   auto mask_image = mask_header.get_image<value_type>();
-  Filter::Connector connector (do_26_connectivity);
-  vector<vector<int> > mask_indices = connector.precompute_adjacency (mask_image);
-  const size_t num_vox = mask_indices.size();
-
-  matrix_type data (num_vox, subjects.size());
+  Filter::Connector connector (connectivity);
+  const size_t num_vox = connector.set_mask (mask_image);
+
+  // Depending on the -float32 option, only one of these is used
+  const bool single_precision = get_options ("float32").size();
+  matrix_type data;
+  float_matrix_type data_float;
+  if (single_precision)
+    data_float.resize (num_vox, subjects.size());
+  else
+    data.resize (num_vox, subjects.size());
 
   {
-    // Load images
+    // Load images; subjects are loaded in parallel, each into its own column
     ProgressBar progress("loading images", subjects.size());
-    for (size_t subject = 0; subject < subjects.size(); subject++) {
-      LogLevelLatch log_level (0);
+    LogLevelLatch log_level (0);
+    std::mutex mutex;
+    size_t counter = 0;
+    auto source = [&] (size_t& subject) { subject = counter++; return subject < subjects.size(); };
+    auto loader = [&] (const size_t& subject)
+    {
       auto input_image = Image<float>::open (subjects[subject]); //.with_direct_io (3); <- Should be inputting 3D images?
       check_dimensions (input_image, mask_image, 0, 3);
-      int index = 0;
-      vector<vector<int> >::iterator it;
-      for (it = mask_indices.begin(); it != mask_indices.end(); ++it) {
-        input_image.index(0) = (*it)[0];
-        input_image.index(1) = (*it)[1];
-        input_image.index(2) = (*it)[2];
-        data (index++, subject) = input_image.value();
+      for (size_t index = 0; index != num_vox; ++index) {
+        connector.assign_pos (index, input_image);
+        if (single_precision)
+          data_float (index, subject) = input_image.value();
+        else
+          data (index, subject) = input_image.value();
       }
-      progress++;
-    }
+      std::lock_guard<std::mutex> lock (mutex);
+      ++progress;
+      return true;
+    };
+    Thread::run_queue (source, size_t(), Thread::multi (loader));
   }
-  if (!data.allFinite())
+  if (!(single_precision ? data_float.allFinite() : data.allFinite()))
     WARN ("input data contains non-finite value(s)");
 
   Header output_header (mask_header);
   output_header.datatype() = DataType::Float32;
-  output_header.keyval()["num permutations"] = str(num_perms);
-  output_header.keyval()["26 connectivity"] = str(do_26_connectivity);
+  // Under -adaptive, the number of permutations processed is only known once permutation
+  //   testing is complete, and is therefore only reported in the p-value outputs
+  if (!get_options ("adaptive").size())
+    output_header.keyval()["num permutations"] = str(num_perms);
+  output_header.keyval()["26 connectivity"] = str(connectivity == 26);
+  output_header.keyval()["neighbourhood"] = str(connectivity);
   output_header.keyval()["nonstationary adjustment"] = str(do_nonstationary_adjustment);
   if (use_tfce) {
     output_header.keyval()["tfce_dh"] = str(tfce_dh);
@@ -211,7 +239,9 @@ void run() {
   if (compute_negative_contrast)
     default_cluster_output_neg.reset (new vector_type (num_vox));
 
-  Math::Stats::GLMTTest glm (data, design, contrast);
+  Math::Stats::GLMTTest glm = single_precision ?
+                              Math::Stats::GLMTTest (data_float, design, contrast) :
+                              Math::Stats::GLMTTest (data, design, contrast);
 
   std::shared_ptr<Stats::EnhancerBase> enhancer;
   if (use_tfce) {
@@ -229,7 +259,7 @@ void run() {
       Stats::PermTest::PermutationStack permutations (permutations_nonstationary, "precomputing empirical statistic for non-stationarity adjustment...");
       Stats::PermTest::precompute_empirical_stat (glm, enhancer, permutations, empirical_enhanced_statistic);
     } else {
-      Stats::PermTest::PermutationStack permutations (nperms_nonstationary, design.rows(), "precomputing empirical statistic for non-stationarity adjustment...", false);
+      Stats::PermTest::PermutationStack permutations (nperms_nonstationary, design.rows(), blocks, "precomputing empirical statistic for non-stationarity adjustment...", false);
       Stats::PermTest::precompute_empirical_stat (glm, enhancer, permutations, empirical_enhanced_statistic);
     }
 
@@ -243,42 +273,44 @@ void run() {
     ProgressBar progress ("generating pre-permutation output", (compute_negative_contrast ? 3 : 2) + contrast.cols() + 3);
     {
       auto tvalue_image = Image<float>::create (prefix + "tvalue.mif", output_header);
-      write_output (tvalue_output, mask_indices, tvalue_image);
+      write_output (tvalue_output, connector, tvalue_image);
     }
     ++progress;
     {
       auto cluster_image = Image<float>::create (prefix + (use_tfce ? "tfce.mif" : "cluster_sizes.mif"), output_header);
-      write_output (default_cluster_output, mask_indices, cluster_image);
+      write_output (default_cluster_output, connector, cluster_image);
     }
     ++progress;
     if (compute_negative_contrast) {
       assert (default_cluster_output_neg);
       auto cluster_image_neg = Image<float>::create (prefix + (use_tfce ? "tfce_neg.mif" : "cluster_sizes_neg.mif"), output_header);
-      write_output (*default_cluster_output_neg, mask_indices, cluster_image_neg);
+      write_output (*default_cluster_output_neg, connector, cluster_image_neg);
       ++progress;
     }
-    auto temp = Math::Stats::GLM::solve_betas (data, design);
+    matrix_type betas;
+    vector_type abs_effect, std_effect, std_dev;
+    if (single_precision)
+      Math::Stats::GLM::all_stats (data_float, design, contrast, betas, abs_effect, std_effect, std_dev);
+    else
+      Math::Stats::GLM::all_stats (data, design, contrast, betas, abs_effect, std_effect, std_dev);
     for (ssize_t i = 0; i < contrast.cols(); ++i) {
       auto beta_image = Image<float>::create (prefix + "beta" + str(i) + ".mif", output_header);
-      write_output (temp.row(i), mask_indices, beta_image);
+      write_output (betas.row(i), connector, beta_image);
       ++progress;
     }
     {
-      const auto temp = Math::Stats::GLM::abs_effect_size (data, design, contrast);
       auto abs_effect_image = Image<float>::create (prefix + "abs_effect.mif", output_header);
-      write_output (temp.row(0), mask_indices, abs_effect_image);
+      write_output (abs_effect, connector, abs_effect_image);
     }
     ++progress;
     {
-      const auto temp = Math::Stats::GLM::std_effect_size (data, design, contrast);
       auto std_effect_image = Image<float>::create (prefix + "std_effect.mif", output_header);
-      write_output (temp.row(0), mask_indices, std_effect_image);
+      write_output (std_effect, connector, std_effect_image);
     }
     ++progress;
     {
-      const auto temp = Math::Stats::GLM::stdev (data, design);
       auto std_dev_image = Image<float>::create (prefix + "std_dev.mif", output_header);
-      write_output (temp.row(0), mask_indices, std_dev_image);
+      write_output (std_dev, connector, std_dev_image);
     }
   }
 
@@ -294,18 +326,26 @@ void run() {
       uncorrected_pvalue_neg.reset (new vector_type (num_vox));
     }
 
+    bool complete;
     if (permutations.size()) {
-      Stats::PermTest::run_permutations (permutations, glm, enhancer, empirical_enhanced_statistic,
-                                         default_cluster_output, default_cluster_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+      complete = Stats::PermTest::run_permutations (permutations, glm, enhancer, empirical_enhanced_statistic,
+                                                    default_cluster_output, default_cluster_output_neg,
+                                                    perm_distribution, perm_distribution_neg,
+                                                    uncorrected_pvalue, uncorrected_pvalue_neg);
     } else {
-      Stats::PermTest::run_permutations (num_perms, glm, enhancer, empirical_enhanced_statistic,
-                                         default_cluster_output, default_cluster_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+      complete = Stats::PermTest::run_permutations (num_perms, blocks, glm, enhancer, empirical_enhanced_statistic,
+                                                    default_cluster_output, default_cluster_output_neg,
+                                                    perm_distribution, perm_distribution_neg,
+                                                    uncorrected_pvalue, uncorrected_pvalue_neg);
     }
 
+    // Only a subset of permutations has been processed (-shard option)
+    if (!complete)
+      return;
+
+    // Permutation testing may have terminated early (-adaptive option)
+    output_header.keyval()["num permutations"] = str(perm_distribution.size());
+
     save_matrix (perm_distribution, prefix + "perm_dist.txt");
     if (compute_negative_contrast) {
       assert (perm_distribution_neg);
@@ -315,26 +355,26 @@ void run() {
     ProgressBar progress ("generating output", compute_negative_contrast ? 4 : 2);
     {
       auto uncorrected_pvalue_image = Image<float>::create (prefix + "uncorrected_pvalue.mif", output_header);
-      write_output (uncorrected_pvalue, mask_indices, uncorrected_pvalue_image);
+      write_output (uncorrected_pvalue, connector, uncorrected_pvalue_image);
     }
     ++progress;
     {
       vector_type fwe_pvalue_output (num_vox);
       Math::Stats::Permutation::statistic2pvalue (perm_distribution, default_cluster_output, fwe_pvalue_output);
       auto fwe_pvalue_image = Image<float>::create (prefix + "fwe_pvalue.mif", output_header);
-      write_output (fwe_pvalue_output, mask_indices, fwe_pvalue_image);
+      write_output (fwe_pvalue_output, connector, fwe_pvalue_image);
     }
     ++progress;
     if (compute_negative_contrast) {
       assert (uncorrected_pvalue_neg);
       assert (perm_distribution_neg);
       auto uncorrected_pvalue_image_neg = Image<float>::create (prefix + "uncorrected_pvalue_neg.mif", output_header);
-      write_output (*uncorrected_pvalue_neg, mask_indices, uncorrected_pvalue_image_neg);
+      write_output (*uncorrected_pvalue_neg, connector, uncorrected_pvalue_image_neg);
       ++progress;
       vector_type fwe_pvalue_output_neg (num_vox);
       Math::Stats::Permutation::statistic2pvalue (*perm_distribution_neg, *default_cluster_output_neg, fwe_pvalue_output_neg);
       auto fwe_pvalue_image_neg = Image<float>::create (prefix + "fwe_pvalue_neg.mif", output_header);
-      write_output (fwe_pvalue_output_neg, mask_indices, fwe_pvalue_image_neg);
+      write_output (fwe_pvalue_output_neg, connector, fwe_pvalue_image_neg);
     }
   }
 
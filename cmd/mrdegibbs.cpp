@@ -13,13 +13,12 @@
  */
 
 
-#include <unsupported/Eigen/FFT>
-
 #include "axes.h"
 #include "command.h"
 #include "image.h"
 #include "progressbar.h"
 #include "algo/threaded_loop.h"
+#include "math/fft.h"
 #include <numeric>
 
 using namespace MR;
@@ -94,24 +93,10 @@ class ComputeSlice
       maxW (maxW),
       in (in),
       out (out),
+      fft_rows (in.size(slice_axes[1])),
+      fft_cols (in.size(slice_axes[0])),
       im1 (in.size(slice_axes[0]), in.size(slice_axes[1])),
-      im2 (im1.rows(), im1.cols()) {
-        prealloc_FFT();
-      }
-
-    ComputeSlice (const ComputeSlice& other) :
-      outer_axes (other.outer_axes),
-      slice_axes (other.slice_axes),
-      nsh (other.nsh),
-      minW (other.minW),
-      maxW (other.maxW),
-      in (other.in),
-      out (other.out),
-      fft (),
-      im1 (in.size(slice_axes[0]), in.size(slice_axes[1])),
-      im2 (im1.rows(), im1.cols()) {
-        prealloc_FFT();
-      }
+      im2 (im1.rows(), im1.cols()) { }
 
 
     void operator() (const Iterator& pos)
@@ -134,38 +119,20 @@ class ComputeSlice
     const vector<size_t>& slice_axes;
     const int nsh, minW, maxW;
     Image<value_type> in, out;
-    Eigen::FFT<double> fft;
-    Eigen::MatrixXcd im1, im2, shifted;
-    Eigen::VectorXcd v;
-
-    void prealloc_FFT () {
-      // needed to avoid within-thread allocations,
-      // which aren't thread-safe in FFTW:
-#ifdef EIGEN_FFTW_DEFAULT
-      Eigen::VectorXcd tmp (im1.rows());
-      FFT (tmp);
-      iFFT (tmp);
-      tmp.resize (im1.cols());
-      FFT (tmp);
-      iFFT (tmp);
-#endif
-    }
-
-    template <typename Derived> FORCE_INLINE void FFT      (Eigen::MatrixBase<Derived>&& vec) { fft.fwd (v, vec); vec = v; }
-    template <typename Derived> FORCE_INLINE void FFT      (Eigen::MatrixBase<Derived>& vec) { FFT (std::move (vec)); }
-    template <typename Derived> FORCE_INLINE void iFFT     (Eigen::MatrixBase<Derived>&& vec) { fft.inv (v, vec); vec = v; }
-    template <typename Derived> FORCE_INLINE void iFFT     (Eigen::MatrixBase<Derived>& vec) { iFFT (std::move (vec)); }
-    template <typename Derived> FORCE_INLINE void row_FFT  (Eigen::MatrixBase<Derived>& mat) { for (auto n = 0; n < mat.rows(); ++n)  FFT (mat.row(n)); }
-    template <typename Derived> FORCE_INLINE void row_iFFT (Eigen::MatrixBase<Derived>& mat) { for (auto n = 0; n < mat.rows(); ++n) iFFT (mat.row(n)); }
-    template <typename Derived> FORCE_INLINE void col_FFT  (Eigen::MatrixBase<Derived>& mat) { for (auto n = 0; n < mat.cols(); ++n)  FFT (mat.col(n)); }
-    template <typename Derived> FORCE_INLINE void col_iFFT (Eigen::MatrixBase<Derived>& mat) { for (auto n = 0; n < mat.cols(); ++n) iFFT (mat.col(n)); }
+    // batched transforms along the rows & columns of the slice; the plans are
+    // shared between the copies of this functor used by each thread
+    Math::FFT<double> fft_rows, fft_cols;
+    Eigen::MatrixXcd im1, im2;
+    // row-major, such that the shifted versions of each line are contiguous
+    // in memory, as required for the batched FFT
+    Eigen::Matrix<cdouble, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> shifted;
 
 
 
     FORCE_INLINE void unring_2d ()
     {
-      row_FFT (im1);
-      col_FFT (im1);
+      fft_rows.forward (im1);
+      fft_cols.forward (im1.transpose());
 
       for (int k = 0; k < im1.cols(); k++) {
         double ck = (1.0+cos(2.0*Math::pi*(double(k)/im1.cols())))*0.5;
@@ -181,11 +148,11 @@ class ComputeSlice
         }
       }
 
-      row_iFFT (im1);
-      col_iFFT (im2);
+      fft_rows.inverse (im1);
+      fft_cols.inverse (im2.transpose());
 
-      unring_1d (im1);
-      unring_1d (im2.transpose());
+      unring_1d (im1, fft_cols);
+      unring_1d (im2.transpose(), fft_rows);
 
       im1 += im2;
     }
@@ -195,7 +162,7 @@ class ComputeSlice
 
 
     template <typename Derived>
-      FORCE_INLINE void unring_1d (Eigen::MatrixBase<Derived>&& eig)
+      FORCE_INLINE void unring_1d (Eigen::MatrixBase<Derived>&& eig, Math::FFT<double>& fft)
       {
         const int n = eig.rows();
         const int numlines = eig.cols();
@@ -233,7 +200,8 @@ class ComputeSlice
           }
 
 
-          col_iFFT (shifted);
+          // all subvoxel-shifted versions of this line are transformed at once
+          fft.inverse (shifted.transpose());
 
           for (int j = 0; j < 2*nsh+1; ++j) {
             TV1arr[j] = 0.0;
@@ -288,7 +256,7 @@ class ComputeSlice
       }
 
     template <typename Derived>
-      FORCE_INLINE void unring_1d (Eigen::MatrixBase<Derived>& eig) { unring_1d (std::move (eig)); }
+      FORCE_INLINE void unring_1d (Eigen::MatrixBase<Derived>& eig, Math::FFT<double>& fft) { unring_1d (std::move (eig), fft); }
 
 };
 
@@ -16,6 +16,7 @@
 #include "command.h"
 #include "image.h"
 #include "algo/loop.h"
+#include "algo/threaded_loop.h"
 #include "transform.h"
 #include "math/least_squares.h"
 #include "algo/threaded_copy.h"
@@ -81,13 +82,14 @@ void usage ()
 template <int poly_order>
 struct PolyBasisFunction { MEMALIGN (PolyBasisFunction)
 
-  const int n_basis_vecs = 20;
+  static constexpr int n_basis_vecs = 20;
+  using vector_type = Eigen::Matrix<double, n_basis_vecs, 1>;
 
-  FORCE_INLINE Eigen::MatrixXd operator () (const Eigen::Vector3& pos) {
+  FORCE_INLINE vector_type operator () (const Eigen::Vector3& pos) const {
     double x = pos[0];
     double y = pos[1];
     double z = pos[2];
-    Eigen::MatrixXd basis(n_basis_vecs, 1);
+    vector_type basis;
     basis(0) = 1.0;
     basis(1) = x;
     basis(2) = y;
@@ -115,11 +117,12 @@ struct PolyBasisFunction { MEMALIGN (PolyBasisFunction)
 
 template <>
 struct PolyBasisFunction<0> { MEMALIGN (PolyBasisFunction<0>)
-  const int n_basis_vecs = 1;
 
-  PolyBasisFunction() {}
-  FORCE_INLINE Eigen::MatrixXd operator () (const Eigen::Vector3&) {
-    Eigen::MatrixXd basis(n_basis_vecs, 1);
+  static constexpr int n_basis_vecs = 1;
+  using vector_type = Eigen::Matrix<double, n_basis_vecs, 1>;
+
+  FORCE_INLINE vector_type operator () (const Eigen::Vector3&) const {
+    vector_type basis;
     basis(0) = 1.0;
     return basis;
   }
@@ -128,13 +131,15 @@ struct PolyBasisFunction<0> { MEMALIGN (PolyBasisFunction<0>)
 
 template <>
 struct PolyBasisFunction<1> { MEMALIGN (PolyBasisFunction<1>)
-  const int n_basis_vecs = 4;
 
-  FORCE_INLINE Eigen::MatrixXd operator () (const Eigen::Vector3& pos) {
+  static constexpr int n_basis_vecs = 4;
+  using vector_type = Eigen::Matrix<double, n_basis_vecs, 1>;
+
+  FORCE_INLINE vector_type operator () (const Eigen::Vector3& pos) const {
     double x = pos[0];
     double y = pos[1];
     double z = pos[2];
-    Eigen::MatrixXd basis(n_basis_vecs, 1);
+    vector_type basis;
     basis(0) = 1.0;
     basis(1) = x;
     basis(2) = y;
@@ -146,13 +151,15 @@ struct PolyBasisFunction<1> { MEMALIGN (PolyBasisFunction<1>)
 
 template <>
 struct PolyBasisFunction<2> { MEMALIGN (PolyBasisFunction<2>)
-  const int n_basis_vecs = 10;
 
-  FORCE_INLINE Eigen::MatrixXd operator () (const Eigen::Vector3& pos) {
+  static constexpr int n_basis_vecs = 10;
+  using vector_type = Eigen::Matrix<double, n_basis_vecs, 1>;
+
+  FORCE_INLINE vector_type operator () (const Eigen::Vector3& pos) const {
     double x = pos[0];
     double y = pos[1];
     double z = pos[2];
-    Eigen::MatrixXd basis(n_basis_vecs, 1);
+    vector_type basis;
     basis(0) = 1.0;
     basis(1) = x;
     basis(2) = y;
@@ -168,17 +175,148 @@ struct PolyBasisFunction<2> { MEMALIGN (PolyBasisFunction<2>)
 };
 
 
+// Maps voxel positions to scanner-space coordinates, centred on the image
+// and scaled to lie within [-1,1]. The polynomial basis spans the same space
+// whatever the origin and scale of the coordinates, so this does not affect
+// the fitted field, but keeps the normal equations well-conditioned.
+class BasisCoordinates { MEMALIGN (BasisCoordinates)
+  public:
+    template <class HeaderType>
+    BasisCoordinates (const HeaderType& header) :
+        voxel2scanner (Transform (header).voxel2scanner)
+    {
+      const Eigen::Vector3 centre_vox (0.5 * (header.size(0)-1), 0.5 * (header.size(1)-1), 0.5 * (header.size(2)-1));
+      centre = voxel2scanner * centre_vox;
+      scale = 0.0;
+      for (size_t i = 0; i < 8; ++i) {
+        const Eigen::Vector3 corner_vox ((i&1) ? header.size(0)-1 : 0, (i&2) ? header.size(1)-1 : 0, (i&4) ? header.size(2)-1 : 0);
+        scale = std::max (scale, (voxel2scanner * corner_vox - centre).cwiseAbs().maxCoeff());
+      }
+      if (!scale)
+        scale = 1.0;
+    }
+
+    template <class ImageType>
+    FORCE_INLINE Eigen::Vector3 operator() (const ImageType& image) const {
+      const Eigen::Vector3 vox (image.index(0), image.index(1), image.index(2));
+      return (voxel2scanner * vox - centre) / scale;
+    }
+
+  private:
+    transform_type voxel2scanner;
+    Eigen::Vector3 centre;
+    double scale;
+};
+
+
+// Accumulates the normal equations of a linear least-squares problem over
+// all voxels processed. The contributions of each image slice are accumulated
+// separately, and only summed (in slice order) when solving, such that the
+// result does not depend on the number of threads. The functor must therefore
+// be run with the slice axis as the only outer axis, such that each slice is
+// processed in its entirety (and in a fixed voxel order) by a single thread.
+template <int Size>
+class NormalEquations { MEMALIGN (NormalEquations<Size>)
+  public:
+    using matrix_type = Eigen::Matrix<double, Size, Size>;
+    using vector_type = Eigen::Matrix<double, Size, 1>;
+
+    NormalEquations (const ssize_t size, const ssize_t num_slices) :
+        slices (new vector<std::pair<Eigen::MatrixXd, Eigen::VectorXd>> (num_slices,
+              std::make_pair (Eigen::MatrixXd::Zero (size, size), Eigen::VectorXd::Zero (size)))) { }
+
+    vector_type solve () const {
+      const ssize_t size = slices->front().second.size();
+      matrix_type AtA (matrix_type::Zero (size, size));
+      vector_type Atb (vector_type::Zero (size));
+      for (const auto& slice : *slices) {
+        AtA.template triangularView<Eigen::Lower>() += slice.first;
+        Atb += slice.second;
+      }
+      AtA.template triangularView<Eigen::StrictlyUpper>() = AtA.transpose();
+      return AtA.colPivHouseholderQr().solve (Atb);
+    }
+
+  protected:
+    template <class RowType>
+    FORCE_INLINE void add (const ssize_t slice, const RowType& row, const double b) {
+      auto& sums = (*slices)[slice];
+      sums.first.template selfadjointView<Eigen::Lower>().rankUpdate (row);
+      sums.second += b * row;
+    }
+
+  private:
+    std::shared_ptr<vector<std::pair<Eigen::MatrixXd, Eigen::VectorXd>>> slices;
+};
+
+
+// Normal equations for the tissue balance factors: the balanced sum of the
+// (field-corrected) tissue components should be unity in each voxel
+class BalanceEquations : public NormalEquations<Eigen::Dynamic> { MEMALIGN (BalanceEquations)
+  public:
+    BalanceEquations (const ssize_t num_tissues, const ssize_t num_slices) :
+        NormalEquations<Eigen::Dynamic> (num_tissues, num_slices),
+        x (num_tissues) { }
+
+    void operator() (Image<bool>& mask, Image<float>& combined_tissue, Image<float>& norm_field_image) {
+      if (!mask.value())
+        return;
+      for (ssize_t j = 0; j < x.size(); ++j) {
+        combined_tissue.index (3) = j;
+        x[j] = combined_tissue.value() / norm_field_image.value();
+      }
+      add (mask.index (2), x, 1.0);
+    }
+
+  private:
+    vector_type x;
+};
+
+
+// Normal equations for the polynomial weights of the log-domain normalisation field
+template <int poly_order>
+class FieldEquations : public NormalEquations<PolyBasisFunction<poly_order>::n_basis_vecs> { MEMALIGN (FieldEquations<poly_order>)
+  public:
+    using base_type = NormalEquations<PolyBasisFunction<poly_order>::n_basis_vecs>;
+
+    FieldEquations (const ssize_t num_slices, const BasisCoordinates& coordinates,
+                    const Eigen::VectorXd& balance_factors, const double log_norm_value) :
+        base_type (PolyBasisFunction<poly_order>::n_basis_vecs, num_slices),
+        coordinates (coordinates),
+        balance_factors (balance_factors),
+        log_norm_value (log_norm_value) { }
+
+    void operator() (Image<bool>& mask, Image<float>& combined_tissue) {
+      if (!mask.value())
+        return;
+      double sum = 0.0;
+      for (ssize_t j = 0; j < balance_factors.size(); ++j) {
+        combined_tissue.index (3) = j;
+        sum += balance_factors(j) * combined_tissue.value();
+      }
+      this->add (mask.index (2), basis_function (coordinates (mask)), std::log (sum) - log_norm_value);
+    }
+
+  private:
+    PolyBasisFunction<poly_order> basis_function;
+    const BasisCoordinates& coordinates;
+    const Eigen::VectorXd& balance_factors;
+    const double log_norm_value;
+};
+
+
+
 // Removes non-physical voxels from the mask
 FORCE_INLINE void refine_mask (Image<float>& summed,
   Image<bool>& initial_mask,
   Image<bool>& refined_mask) {
 
-  for (auto i = Loop (summed, 0, 3) (summed, initial_mask, refined_mask); i; ++i) {
+  ThreadedLoop (summed, 0, 3).run ([] (Image<float>& summed, Image<bool>& initial_mask, Image<bool>& refined_mask) {
     if (std::isfinite((float) summed.value ()) && summed.value () > 0.f && initial_mask.value ())
       refined_mask.value () = true;
     else
       refined_mask.value () = false;
-  }
+  }, summed, initial_mask, refined_mask);
 }
 
 
@@ -216,6 +354,7 @@ template <int poly_order>
 void run_primitive () {
 
   PolyBasisFunction<poly_order> basis_function;
+  constexpr int n_basis_vecs = PolyBasisFunction<poly_order>::n_basis_vecs;
 
   using ImageType = Image<float>;
   using MaskType = Image<bool>;
@@ -263,15 +402,15 @@ void run_primitive () {
   auto orig_mask = MaskType::open (opt[0][0]);
   auto initial_mask = MaskType::scratch (orig_mask, "Initial processing mask");
   auto mask = MaskType::scratch (orig_mask, "Processing mask");
-  auto prev_mask = MaskType::scratch (orig_mask, "Previous processing mask");
 
   {
     auto summed = ImageType::scratch (header_3D, "Summed tissue volumes");
     for (size_t j = 0; j < input_images.size(); ++j) {
       input_progress++;
 
-      for (auto i = Loop (0, 3) (summed, input_images[j]); i; ++i)
-        summed.value() += input_images[j].value();
+      ThreadedLoop (summed, 0, 3).run ([] (ImageType& summed, Adapter::Replicate<ImageType>& input) {
+        summed.value() += input.value();
+      }, summed, input_images[j]);
     }
     refine_mask (summed, orig_mask, initial_mask);
   }
@@ -289,9 +428,9 @@ void run_primitive () {
     input_progress++;
 
     combined_tissue.index (3) = i;
-    for (auto l = Loop (0, 3) (combined_tissue, input_images[i]); l; ++l) {
-      combined_tissue.value () = std::max<float>(input_images[i].value (), 0.f);
-    }
+    ThreadedLoop (combined_tissue, 0, 3).run ([] (ImageType& combined_tissue, Adapter::Replicate<ImageType>& input) {
+      combined_tissue.value () = std::max<float>(input.value (), 0.f);
+    }, combined_tissue, input_images[i]);
   }
 
   size_t num_voxels = 0;
@@ -310,15 +449,16 @@ void run_primitive () {
   const size_t max_balance_iter = DEFAULT_BALANCE_MAXITER_VALUE;
 
   // Initialise normalisation fields in both image and log domain
-  Eigen::MatrixXd norm_field_weights;
+  const BasisCoordinates coordinates (header_3D);
+  Eigen::Matrix<double, n_basis_vecs, 1> norm_field_weights;
 
   auto norm_field_image = ImageType::scratch (header_3D, "Normalisation field (intensity)");
   auto norm_field_log = ImageType::scratch (header_3D, "Normalisation field (log-domain)");
 
-  for (auto i = Loop(norm_field_log) (norm_field_image, norm_field_log); i; ++i) {
+  ThreadedLoop (norm_field_log).run ([] (ImageType& norm_field_image, ImageType& norm_field_log) {
     norm_field_image.value() = 1.f;
     norm_field_log.value() = 0.f;
-  }
+  }, norm_field_image, norm_field_log);
 
   Eigen::VectorXd balance_factors (Eigen::VectorXd::Ones (n_tissue_types));
 
@@ -327,24 +467,25 @@ void run_primitive () {
   // Store lambda-function for performing outlier-rejection.
   // We perform a coarse outlier-rejection initially as well as
   // a finer outlier-rejection within each iteration of the
-  // tissue (re)balancing loop
+  // tissue (re)balancing loop. Returns whether the mask has changed.
+  auto summed_log = ImageType::scratch (header_3D, "Log of summed tissue volumes");
   auto outlier_rejection = [&](float outlier_range) {
 
-    auto summed_log = ImageType::scratch (header_3D, "Log of summed tissue volumes");
-    for (auto i = Loop (0, 3) (summed_log, combined_tissue, norm_field_image); i; ++i) {
+    ThreadedLoop (summed_log, 0, 3).run ([&] (MaskType& initial_mask, ImageType& summed_log, ImageType& combined_tissue, ImageType& norm_field_image) {
+      if (!initial_mask.value())
+        return;
+      float sum = 0.f;
       for (size_t j = 0; j < n_tissue_types; ++j) {
         combined_tissue.index(3) = j;
-        summed_log.value() += balance_factors(j) * combined_tissue.value() / norm_field_image.value();
+        sum += balance_factors(j) * combined_tissue.value() / norm_field_image.value();
       }
-      summed_log.value() = std::log(summed_log.value());
-    }
-
-    threaded_copy (initial_mask, mask);
+      summed_log.value() = std::log (sum);
+    }, initial_mask, summed_log, combined_tissue, norm_field_image);
 
     vector<float> summed_log_values;
     summed_log_values.reserve (num_voxels);
-    for (auto i = Loop (0, 3) (mask, summed_log); i; ++i) {
-      if (mask.value())
+    for (auto i = Loop (0, 3) (initial_mask, summed_log); i; ++i) {
+      if (initial_mask.value())
         summed_log_values.push_back (summed_log.value());
     }
 
@@ -359,17 +500,24 @@ void run_primitive () {
     const float lower_outlier_threshold = lower_quartile - outlier_range * (upper_quartile - lower_quartile);
     const float upper_outlier_threshold = upper_quartile + outlier_range * (upper_quartile - lower_quartile);
 
-    for (auto i = Loop (0, 3) (mask, summed_log); i; ++i) {
-      if (mask.value()) {
-        if (summed_log.value() < lower_outlier_threshold || summed_log.value() > upper_outlier_threshold) {
-          mask.value() = 0;
-          num_voxels--;
-        }
+    num_voxels = std::count_if (summed_log_values.begin(), summed_log_values.end(), [&] (float value) {
+      return !(value < lower_outlier_threshold || value > upper_outlier_threshold);
+    });
+
+    std::atomic<bool> mask_changed (false);
+    ThreadedLoop (mask, 0, 3).run ([&] (MaskType& mask, MaskType& initial_mask, ImageType& summed_log) {
+      const bool value = initial_mask.value() &&
+          !(summed_log.value() < lower_outlier_threshold || summed_log.value() > upper_outlier_threshold);
+      if (value != mask.value()) {
+        mask.value() = value;
+        mask_changed = true;
       }
-    }
+    }, mask, initial_mask, summed_log);
 
     if (log_level >= 3)
       display (mask);
+
+    return bool (mask_changed);
   };
 
   input_progress.done ();
@@ -378,8 +526,6 @@ void run_primitive () {
   // Perform an initial outlier rejection prior to the first iteration
   outlier_rejection (3.f);
 
-  threaded_copy (mask, prev_mask);
-
   while (iter <= max_iter) {
 
     INFO ("Iteration: " + str(iter));
@@ -395,21 +541,9 @@ void run_primitive () {
       if (n_tissue_types > 1) {
 
         // Solve for tissue balance factors
-        Eigen::MatrixXd X (num_voxels, n_tissue_types);
-        Eigen::VectorXd y (Eigen::VectorXd::Ones (num_voxels));
-        uint32_t index = 0;
-
-        for (auto i = Loop (0, 3) (mask, combined_tissue, norm_field_image); i; ++i) {
-          if (mask.value()) {
-            for (size_t j = 0; j < n_tissue_types; ++j) {
-              combined_tissue.index (3) = j;
-              X (index, j) = combined_tissue.value() / norm_field_image.value();
-            }
-            ++index;
-          }
-        }
-
-        balance_factors = X.colPivHouseholderQr().solve(y);
+        BalanceEquations equations (n_tissue_types, mask.size (2));
+        ThreadedLoop (mask, vector<size_t> ({ 2 }), vector<size_t> ({ 0, 1 })).run (equations, mask, combined_tissue, norm_field_image);
+        balance_factors = equations.solve();
 
         // Ensure our balance factors satisfy the condition that sum(log(balance_factors)) = 0
         double log_sum = 0.0;
@@ -425,56 +559,26 @@ void run_primitive () {
 
       INFO ("Balance factors (" + str(balance_iter) + "): " + str(balance_factors.transpose()));
 
-      // Perform outlier rejection on log-domain of summed images
-      outlier_rejection(1.5f);
-
-      // Check for convergence
-      balance_converged = true;
-      for (auto i = Loop (0, 3) (mask, prev_mask); i; ++i) {
-        if (mask.value() != prev_mask.value()) {
-          balance_converged = false;
-          break;
-        }
-      }
-
-      threaded_copy (mask, prev_mask);
+      // Perform outlier rejection on log-domain of summed images,
+      // and check for convergence
+      balance_converged = !outlier_rejection(1.5f);
 
       balance_iter++;
     }
 
 
     // Solve for normalisation field weights in the log domain
-    Transform transform (mask);
-    Eigen::MatrixXd norm_field_basis (num_voxels, basis_function.n_basis_vecs);
-    Eigen::VectorXd y (num_voxels);
-    uint32_t index = 0;
-    for (auto i = Loop (0, 3) (mask, combined_tissue); i; ++i) {
-      if (mask.value()) {
-        Eigen::Vector3 vox (mask.index(0), mask.index(1), mask.index(2));
-        Eigen::Vector3 pos = transform.voxel2scanner * vox;
-        norm_field_basis.row (index) = basis_function (pos).col(0);
-
-        double sum = 0.0;
-        for (size_t j = 0; j < n_tissue_types; ++j) {
-          combined_tissue.index(3) = j;
-          sum += balance_factors(j) * combined_tissue.value() ;
-        }
-        y (index++) = std::log(sum) - log_norm_value;
-      }
-    }
-
-    norm_field_weights = norm_field_basis.colPivHouseholderQr().solve(y);
-
-    // Generate normalisation field in the log domain
-    for (auto i = Loop (0, 3) (norm_field_log); i; ++i) {
-      Eigen::Vector3 vox (norm_field_log.index(0), norm_field_log.index(1), norm_field_log.index(2));
-      Eigen::Vector3 pos = transform.voxel2scanner * vox;
-      norm_field_log.value() = basis_function (pos).col(0).dot (norm_field_weights.col(0));
+    {
+      FieldEquations<poly_order> equations (mask.size (2), coordinates, balance_factors, log_norm_value);
+      ThreadedLoop (mask, vector<size_t> ({ 2 }), vector<size_t> ({ 0, 1 })).run (equations, mask, combined_tissue);
+      norm_field_weights = equations.solve();
     }
 
-    // Generate normalisation field in the image domain
-    for (auto i = Loop (0, 3) (norm_field_log, norm_field_image); i; ++i)
+    // Generate normalisation field in the log and image domains
+    ThreadedLoop (norm_field_log, 0, 3).run ([&] (ImageType& norm_field_log, ImageType& norm_field_image) {
+      norm_field_log.value() = basis_function (coordinates (norm_field_log)).dot (norm_field_weights);
       norm_field_image.value () = std::exp(norm_field_log.value());
+    }, norm_field_log, norm_field_image);
 
     progress++;
     iter++;
@@ -516,13 +620,13 @@ void run_primitive () {
     const size_t n_vols = input_images[j].size(3);
     const Eigen::VectorXf zero_vec = Eigen::VectorXf::Zero (n_vols);
 
-    for (auto i = Loop (0,3) (output_image, input_images[j], norm_field_image); i; ++i) {
-      input_images[j].index(3) = 0;
+    ThreadedLoop (output_image, 0, 3).run ([&] (ImageType& output_image, Adapter::Replicate<ImageType>& input, ImageType& norm_field_image) {
+      input.index(3) = 0;
 
-      if (input_images[j].value() < 0.f)
+      if (input.value() < 0.f)
         output_image.row(3) = zero_vec;
       else
-        output_image.row(3) = Eigen::VectorXf{input_images[j].row(3)} / norm_field_image.value();
-    }
+        output_image.row(3) = Eigen::VectorXf{input.row(3)} / norm_field_image.value();
+    }, output_image, input_images[j], norm_field_image);
   }
 }
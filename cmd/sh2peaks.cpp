@@ -16,10 +16,10 @@
 #include "command.h"
 #include "math/SH.h"
 #include "memory.h"
-#include "progressbar.h"
-#include "thread_queue.h"
 #include "image.h"
 #include "algo/loop.h"
+#include "algo/threaded_loop.h"
+#include "dwi/peaks.h"
 
 
 #define DOT_THRESHOLD 0.99
@@ -73,7 +73,8 @@ void usage ()
   + Argument ("image").type_image_in()
 
   + Option ("fast",
-            "use lookup table to compute associated Legendre polynomials (faster, but approximate).");
+            "use lookup table to compute associated Legendre polynomials (approximate; "
+            "this is only faster than the default for lmax > 12).");
 }
 
 
@@ -96,112 +97,106 @@ class Direction { MEMALIGN(Direction)
 
 
 
-class Item { MEMALIGN(Item)
-  public:
-    Eigen::VectorXf data;
-    ssize_t pos[3];
-};
-
-
+using PeakFinder = DWI::PeakFinder<value_type>;
 
 
 
-class DataLoader { MEMALIGN(DataLoader)
+// Voxels are processed one image row at a time, such that the amplitudes of
+// the SH series for all voxels within the row along all seed directions can
+// be computed as a single matrix product
+class Processor { MEMALIGN(Processor)
   public:
-    DataLoader (Image<value_type>& sh_data,
-                Image<bool>* mask_data) :
+    Processor (Image<value_type>& sh_data,
+               Image<value_type>& dirs_data,
+               Image<bool>* mask_data,
+               const PeakFinder& finder,
+               int npeaks,
+               vector<Direction> true_peaks,
+               value_type threshold,
+               Image<value_type>* ipeaks_data) :
       sh (sh_data),
-      loop (Loop("estimating peak directions", 0, 3) (sh)) { }
+      dirs_vox (dirs_data),
+      mask (mask_data ? new Image<bool> (*mask_data) : nullptr),
+      finder (finder),
+      npeaks (npeaks),
+      true_peaks (true_peaks),
+      threshold (threshold),
+      peaks_out (npeaks),
+      ipeaks_vox (ipeaks_data ? new Image<value_type> (*ipeaks_data) : nullptr) { }
 
-    bool operator() (Item& item) {
-      if (loop) {
-        item.data.resize (sh.size(3));
-        item.pos[0] = sh.index(0);
-        item.pos[1] = sh.index(1);
-        item.pos[2] = sh.index(2);
+    void operator() (const Iterator& pos) {
+      assign_pos_of (pos, 1, 3).to (sh, dirs_vox);
 
+      voxels.clear();
+      for (sh.index(0) = 0; sh.index(0) < sh.size(0); ++sh.index(0)) {
         if (mask) {
-          assign_pos_of(sh).to(*mask);
+          assign_pos_of (sh, 0, 3).to (*mask);
           if (!mask->value()) {
-            for (auto l = Loop(3) (sh); l; ++l)
-              item.data[sh.index(3)] = NaN;
+            write_nan (sh.index(0));
+            continue;
           }
-        } else {
-          // iterates over SH coefficients
-          for (auto l = Loop(3) (sh); l; ++l)
-            item.data[sh.index(3)] = sh.value();
         }
-
-        loop++;
-
-        return true;
+        voxels.push_back (sh.index(0));
       }
-      return false;
+      if (voxels.empty())
+        return;
+
+      data.resize (sh.size(3), voxels.size());
+      for (size_t n = 0; n != voxels.size(); ++n) {
+        sh.index(0) = voxels[n];
+        for (auto l = Loop(3) (sh); l; ++l)
+          data (sh.index(3), n) = sh.value();
+      }
+      finder.amplitudes (data, amplitudes);
+
+      for (size_t n = 0; n != voxels.size(); ++n)
+        process (voxels[n], data.col (n), amplitudes.col (n));
     }
 
   private:
-    Image<value_type>  sh;
-    std::unique_ptr<Image<bool> > mask;
-    LoopAlongAxisRangeProgress::Run<Image<value_type> > loop;
-};
-
-
-
-
-class Processor { MEMALIGN(Processor)
-  public:
-    Processor (Image<value_type>& dirs_data,
-               Eigen::Matrix<value_type, Eigen::Dynamic, 2>& directions,
-               int lmax,
-               int npeaks,
-               vector<Direction> true_peaks,
-               value_type threshold,
-               Image<value_type>* ipeaks_data,
-               bool use_precomputer) :
-      dirs_vox (dirs_data),
-      dirs (directions),
-      lmax (lmax),
-      npeaks (npeaks),
-      true_peaks (true_peaks),
-      threshold (threshold),
-      peaks_out (npeaks),
-      ipeaks_vox (ipeaks_data),
-      precomputer (use_precomputer ? new Math::SH::PrecomputedAL<value_type> (lmax) :  nullptr) { }
+    Image<value_type> sh, dirs_vox;
+    copy_ptr<Image<bool> > mask;
+    const PeakFinder& finder;
+    int npeaks;
+    vector<Direction> true_peaks;
+    value_type threshold;
+    vector<Direction> peaks_out;
+    copy_ptr<Image<value_type> > ipeaks_vox;
+    vector<ssize_t> voxels;
+    PeakFinder::matrix_type data, amplitudes;
+    PeakFinder::vector_type fod;
+    vector<PeakFinder::Peak> found;
+
+    void write_nan (const ssize_t x) {
+      dirs_vox.index(0) = x;
+      for (auto l = Loop(3) (dirs_vox); l; ++l)
+        dirs_vox.value() = NaN;
+    }
 
-    bool operator() (const Item& item) {
+    template <class AmplitudeVectorType>
+    void process (const ssize_t x, const PeakFinder::vector_type& voxel_data, const AmplitudeVectorType& seed_amplitudes) {
 
-      dirs_vox.index(0) = item.pos[0];
-      dirs_vox.index(1) = item.pos[1];
-      dirs_vox.index(2) = item.pos[2];
+      dirs_vox.index(0) = x;
+      fod = voxel_data;
 
-      if (check_input (item)) {
-        for (auto l = Loop(3) (dirs_vox); l; ++l)
-          dirs_vox.value() = NaN;
-        return true;
+      if (check_input()) {
+        write_nan (x);
+        return;
       }
 
-      vector<Direction> all_peaks;
+      finder (fod, seed_amplitudes, found);
 
-      for (size_t i = 0; i < size_t(dirs.rows()); i++) {
-        Direction p (dirs (i,0), dirs (i,1));
-        p.a = Math::SH::get_peak (item.data, lmax, p.v, precomputer);
-        if (std::isfinite (p.a)) {
-          for (size_t j = 0; j < all_peaks.size(); j++) {
-            if (abs (p.v.dot (all_peaks[j].v)) > DOT_THRESHOLD) {
-              p.a = NAN;
-              break;
-            }
-          }
-        }
-        if (std::isfinite (p.a) && p.a >= threshold)
+      vector<Direction> all_peaks;
+      for (const auto& f : found) {
+        if (f.amplitude >= threshold) {
+          Direction p;
+          p.a = f.amplitude;
+          p.v = f.dir;
           all_peaks.push_back (p);
+        }
       }
 
       if (ipeaks_vox) {
-        ipeaks_vox->index(0) = item.pos[0];
-        ipeaks_vox->index(1) = item.pos[1];
-        ipeaks_vox->index(2) = item.pos[2];
-
         for (int i = 0; i < npeaks; i++) {
           Eigen::Vector3f p;
           ipeaks_vox->index(3) = 3*i;
@@ -246,36 +241,22 @@ class Processor { MEMALIGN(Processor)
         dirs_vox.index(3)++;
       }
       for (; dirs_vox.index(3) < 3*npeaks; dirs_vox.index(3)++) dirs_vox.value() = NaN;
-
-      return true;
     }
 
-  private:
-    Image<value_type> dirs_vox;
-    Eigen::Matrix<value_type, Eigen::Dynamic, 2> dirs;
-    int lmax, npeaks;
-    vector<Direction> true_peaks;
-    value_type threshold;
-    vector<Direction> peaks_out;
-    copy_ptr<Image<value_type> > ipeaks_vox;
-    Math::SH::PrecomputedAL<value_type>* precomputer;
-
-    bool check_input (const Item& item) {
+    bool check_input () {
       if (ipeaks_vox) {
-        ipeaks_vox->index(0) = item.pos[0];
-        ipeaks_vox->index(1) = item.pos[1];
-        ipeaks_vox->index(2) = item.pos[2];
+        assign_pos_of (dirs_vox, 0, 3).to (*ipeaks_vox);
         ipeaks_vox->index(3) = 0;
         if (std::isnan (value_type (ipeaks_vox->value())))
           return true;
       }
 
       bool no_peaks = true;
-      for (size_t i = 0; i < size_t(item.data.size()); i++) {
-        if (std::isnan (item.data[i]))
+      for (size_t i = 0; i < size_t(fod.size()); i++) {
+        if (std::isnan (fod[i]))
           return true;
         if (no_peaks)
-          if (i && item.data[i] != 0.0)
+          if (i && fod[i] != 0.0)
             no_peaks = false;
       }
 
@@ -339,11 +320,9 @@ void run ()
   header.size(3) = 3 * npeaks;
   auto peaks = Image<value_type>::create (argument[1], header);
 
-  DataLoader loader (SH_data, mask_data.get());
-  Processor processor (peaks, dirs, Math::SH::LforN (SH_data.size (3)),
-      npeaks, true_peaks, threshold, ipeaks_data.get(), get_options("fast").size());
-
-  Thread::run_queue (loader, Thread::batch (Item()), Thread::multi (processor));
+  const PeakFinder finder (dirs, Math::SH::LforN (SH_data.size (3)), DOT_THRESHOLD, get_options("fast").size());
+  ThreadedLoop ("estimating peak directions", SH_data, vector<size_t> ({ 1, 2 }), vector<size_t> ({ 0 }))
+    .run_outer (Processor (SH_data, peaks, mask_data.get(), finder, npeaks, true_peaks, threshold, ipeaks_data.get()));
 }
 
 
@@ -24,6 +24,7 @@
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/weights.h"
 #include "dwi/tractography/mapping/loader.h"
+#include "dwi/tractography/connectome/cache.h"
 #include "dwi/tractography/connectome/connectome.h"
 #include "dwi/tractography/connectome/metric.h"
 #include "dwi/tractography/connectome/mapper.h"
@@ -39,6 +40,10 @@ using namespace MR::DWI::Tractography::Connectome;
 
 
 
+const char* extra_metrics[] = { "count", "length", "invlength", "invnodevol", "length_invnodevol", "invlength_invnodevol", NULL };
+
+
+
 void usage ()
 {
 
@@ -71,7 +76,34 @@ void usage ()
     + Argument ("path").type_file_out()
 
   + Option ("vector", "output a vector representing connectivities from a given seed point to target nodes, "
-                      "rather than a matrix of node-node connectivities");
+                      "rather than a matrix of node-node connectivities")
+
+  + OptionGroup ("Options for generating multiple connectomes from a single pass through the tractogram")
+
+  + Option ("extra_nodes", "additionally generate a connectome from a different parcellation image, "
+                           "using the same streamline assignment mechanism and edge metric as the primary output "
+                           "(this option can be used multiple times)").allow_multiple()
+    + Argument ("nodes_in").type_image_in()
+    + Argument ("connectome_out").type_file_out()
+
+  + Option ("extra_metric", "additionally generate a connectome from the primary parcellation image, "
+                            "using a different edge metric (options are: " + join(extra_metrics, ", ") + "); "
+                            "if the -scale_file option is provided, it is applied to these outputs also "
+                            "(this option can be used multiple times)").allow_multiple()
+    + Argument ("metric").type_choice (extra_metrics)
+    + Argument ("connectome_out").type_file_out()
+
+  + Option ("out_cache", "write the node assignments and lengths of all streamlines, for all parcellation images, "
+                         "to a compact binary file; this can subsequently be provided to tck2connectome via the "
+                         "-in_cache option, in order to generate connectomes with different metrics or "
+                         "edge statistics without re-reading the streamlines or repeating the assignment search")
+    + Argument ("path").type_file_out()
+
+  + Option ("in_cache", "read the node assignments and lengths of all streamlines from a file generated previously "
+                        "using the -out_cache option, rather than reading the streamline data and assigning streamlines to nodes; "
+                        "the same parcellation images must be provided, in the same order, as when the file was generated "
+                        "(note that the track file header is still read in order to verify the number of streamlines)")
+    + Argument ("path").type_file_in();
 
   REFERENCES
   + "If using the default streamline-parcel assignment mechanism (or -assignment_radial_search option): " // Internal
@@ -88,96 +120,266 @@ void usage ()
 
 
 
+void setup_extra_metric (Metric& metric, const size_t type, Image<node_t>& node_image)
+{
+  switch (type) {
+    case 0: break;
+    case 1: metric.set_scale_length(); break;
+    case 2: metric.set_scale_invlength(); break;
+    case 3: metric.set_scale_invnodevol (node_image); break;
+    case 4: metric.set_scale_length(); metric.set_scale_invnodevol (node_image); break;
+    case 5: metric.set_scale_invlength(); metric.set_scale_invnodevol (node_image); break;
+  }
+  auto opt = get_options ("scale_file");
+  if (opt.size())
+    metric.set_scale_file (opt[0][0]);
+}
+
+
+
+class Parcellation
+{ MEMALIGN(Parcellation)
+  public:
+    Parcellation (const std::string& path) :
+        image (Image<node_t>::open (path)),
+        max_node_index (0)
+    {
+      // First, find out how many segmented nodes there are, so the matrix can be pre-allocated
+      // Also check for node volume for all nodes
+      vector<uint32_t> node_volumes (1, 0);
+      for (auto i = Loop (image) (image); i; ++i) {
+        if (image.value() > max_node_index) {
+          max_node_index = image.value();
+          node_volumes.resize (max_node_index + 1, 0);
+        }
+        ++node_volumes[image.value()];
+      }
+
+      for (size_t i = 1; i != node_volumes.size(); ++i) {
+        if (!node_volumes[i])
+          missing_nodes.insert (i);
+      }
+      if (missing_nodes.size()) {
+        WARN ("The following nodes are missing from the parcellation image \"" + image.name() + "\":");
+        std::set<node_t>::iterator i = missing_nodes.begin();
+        std::string list = str(*i);
+        for (++i; i != missing_nodes.end(); ++i)
+          list += ", " + str(*i);
+        WARN (list);
+        WARN ("(This may indicate poor parcellation image preparation, use of incorrect or incomplete LUT file(s) in labelconvert, or very poor registration)");
+      }
+    }
+
+    Image<node_t> image;
+    node_t max_node_index;
+    std::set<node_t> missing_nodes;
+};
+
+
+
+// Takes the node assignments of each streamline to all parcellations, and
+//   feeds the relevant contribution to every requested connectome output;
+//   optionally also stores all node assignments for writing to a cache file
+template <typename T>
+class Outputs
+{ MEMALIGN(Outputs<T>)
+
+  public:
+    Outputs (const bool pair, CacheWriter* cache) :
+        pair (pair),
+        cache (cache) { }
+
+    void add (const size_t parcellation, const node_t max_node_index, const Metric& metric, const std::string& path)
+    {
+      const bool vector_output = get_options ("vector").size();
+      // Only store the streamline assignments for the primary output
+      const bool track_assignments = outputs.empty() && get_options ("out_assignments").size();
+      auto opt = get_options ("stat_edge");
+      const stat_edge statistic = opt.size() ? stat_edge(int(opt[0][0])) : stat_edge::SUM;
+      outputs.push_back (Output (parcellation, metric, path,
+                                 std::make_shared<Matrix<T>> (max_node_index, statistic, vector_output, track_assignments)));
+    }
+
+    bool operator() (const Mapped_track_multi& in)
+    {
+      for (auto& o : outputs) {
+        const vector<node_t>& nodes (in.get_nodes (o.parcellation));
+        if (pair) {
+          Mapped_track_nodepair track;
+          track.set_track_index (in.get_track_index());
+          track.set_nodes (in.get_nodepair (o.parcellation));
+          track.set_factor (o.metric (in.get_track_index(), in.get_length(), track.get_nodes()));
+          track.set_weight (in.get_weight());
+          (*o.matrix) (track);
+        } else {
+          Mapped_track_nodelist track;
+          track.set_track_index (in.get_track_index());
+          track.set_nodes (nodes);
+          track.set_factor (o.metric (in.get_track_index(), in.get_length(), nodes));
+          track.set_weight (in.get_weight());
+          (*o.matrix) (track);
+        }
+      }
+      if (cache)
+        (*cache) (in);
+      return true;
+    }
+
+    void finalize (const vector<Parcellation>& parcellations)
+    {
+      for (auto& o : outputs) {
+        o.matrix->finalize();
+        o.matrix->error_check (parcellations[o.parcellation].missing_nodes);
+        o.matrix->save (o.path, get_options ("keep_unassigned").size(), get_options ("symmetric").size(), get_options ("zero_diagonal").size());
+      }
+      auto opt = get_options ("out_assignments");
+      if (opt.size())
+        outputs.front().matrix->write_assignments (opt[0][0]);
+      if (cache)
+        cache->finalize();
+    }
+
+  private:
+    class Output
+    { MEMALIGN(Output)
+      public:
+        Output (const size_t parcellation, const Metric& metric, const std::string& path, std::shared_ptr<Matrix<T>> matrix) :
+            parcellation (parcellation),
+            metric (metric),
+            path (path),
+            matrix (matrix) { }
+        size_t parcellation;
+        Metric metric;
+        std::string path;
+        std::shared_ptr<Matrix<T>> matrix;
+    };
+
+    const bool pair;
+    CacheWriter* cache;
+    vector<Output> outputs;
+};
+
+
+
 template <typename T>
-void execute (Image<node_t>& node_image, const node_t max_node_index, const std::set<node_t>& missing_nodes)
+void execute (vector<Parcellation>& parcellations, const vector<std::string>& output_paths)
 {
-  // Are we generating a matrix or a vector?
-  const bool vector_output = get_options ("vector").size();
+  auto opt = get_options ("in_cache");
+  std::unique_ptr<CacheReader> cache_in (opt.size() ? new CacheReader (opt[0][0]) : nullptr);
+
+  // Get the assignment mechanism for each parcellation
+  vector<std::unique_ptr<Tck2nodes_base>> tck2nodes;
+  vector<const Tck2nodes_base*> tck2nodes_ptrs;
+  bool pair;
+  if (cache_in) {
+    if (cache_in->num_parcellations() != parcellations.size())
+      throw Exception ("Number of parcellation images provided (" + str(parcellations.size()) + ") does not match "
+                       "number of parcellations in streamline node assignments file (" + str(cache_in->num_parcellations()) + ")");
+    for (size_t i = 0; i != parcellations.size(); ++i) {
+      if (cache_in->max_node_index (i) > parcellations[i].max_node_index)
+        throw Exception ("Streamline node assignments file contains node indices exceeding those in parcellation image \""
+                         + parcellations[i].image.name() + "\"; ensure that parcellation images are provided in the same order as when the file was generated");
+    }
+    pair = cache_in->provides_pair();
+    for (size_t index = 0; modes[index]; ++index) {
+      if (get_options (modes[index]).size())
+        WARN ("Streamline assignment option -" + str(modes[index]) + " ignored: node assignments are read from file");
+    }
+  } else {
+    for (auto& p : parcellations) {
+      tck2nodes.emplace_back (load_assignment_mode (p.image));
+      tck2nodes_ptrs.push_back (tck2nodes.back().get());
+    }
+    pair = tck2nodes.front()->provides_pair();
+  }
 
-  // Do we need to keep track of the nodes to which each streamline is
-  //   assigned, or would it be a waste of memory?
-  const bool track_assignments = get_options ("out_assignments").size();
+  opt = get_options ("out_cache");
+  std::unique_ptr<CacheWriter> cache_out (opt.size() ? new CacheWriter (opt[0][0], parcellations.size(), pair) : nullptr);
 
-  // Get the metric, assignment mechanism & per-edge statistic for connectome construction
-  Metric metric;
-  Tractography::Connectome::setup_metric (metric, node_image);
-  std::unique_ptr<Tck2nodes_base> tck2nodes (load_assignment_mode (node_image));
-  auto opt = get_options ("stat_edge");
-  const stat_edge statistic = opt.size() ? stat_edge(int(opt[0][0])) : stat_edge::SUM;
+  // Set up the metric for each connectome output
+  Outputs<T> outputs (pair, cache_out.get());
+  for (size_t i = 0; i != parcellations.size(); ++i) {
+    Metric metric;
+    Tractography::Connectome::setup_metric (metric, parcellations[i].image);
+    outputs.add (i, parcellations[i].max_node_index, metric, output_paths[i]);
+  }
+  opt = get_options ("extra_metric");
+  for (size_t i = 0; i != opt.size(); ++i) {
+    Metric metric;
+    setup_extra_metric (metric, int(opt[i][0]), parcellations[0].image);
+    outputs.add (0, parcellations[0].max_node_index, metric, opt[i][1]);
+  }
 
   // Prepare for reading the track data
   Tractography::Properties properties;
   Tractography::Reader<float> reader (argument[0], properties);
+  const size_t count = properties["count"].empty() ? 0 : to<size_t>(properties["count"]);
 
-  // Initialise classes in preparation for multi-threading
-  Mapping::TrackLoader loader (reader, properties["count"].empty() ? 0 : to<size_t>(properties["count"]), "Constructing connectome");
-  Tractography::Connectome::Mapper mapper (*tck2nodes, metric);
-  Tractography::Connectome::Matrix<T> connectome (max_node_index, statistic, vector_output, track_assignments);
+  if (cache_in) {
+
+    if (count && count != cache_in->num_streamlines())
+      throw Exception ("Number of streamlines in track file (" + str(count) + ") does not match number in streamline node assignments file (" + str(cache_in->num_streamlines()) + ")");
+    reader.close();
+
+    // Streamline weights would otherwise be provided by the track file reader
+    Eigen::VectorXd weights;
+    opt = get_options ("tck_weights_in");
+    if (opt.size()) {
+      weights = load_vector (opt[0][0]);
+      if (size_t(weights.size()) != cache_in->num_streamlines())
+        throw Exception ("Number of entries in streamline weights file (" + str(weights.size()) + ") does not match number of streamlines (" + str(cache_in->num_streamlines()) + ")");
+    }
+
+    // Connectome construction from the node assignments file is limited by disk I/O;
+    //   no benefit to multi-threading
+    Mapped_track_multi track;
+    while ((*cache_in) (track)) {
+      if (weights.size())
+        track.set_weight (weights[track.get_track_index()]);
+      outputs (track);
+    }
 
-  // Multi-threaded connectome construction
-  if (tck2nodes->provides_pair()) {
-    Thread::run_queue (
-        loader,
-        Thread::batch (Tractography::Streamline<float>()),
-        Thread::multi (mapper),
-        Thread::batch (Mapped_track_nodepair()),
-        connectome);
   } else {
+
+    // Initialise classes in preparation for multi-threading
+    Mapping::TrackLoader loader (reader, count, "Constructing connectome" + std::string(parcellations.size() > 1 ? "s" : ""));
+    Tractography::Connectome::MultiMapper mapper (tck2nodes_ptrs);
+
+    // Multi-threaded connectome construction
     Thread::run_queue (
         loader,
         Thread::batch (Tractography::Streamline<float>()),
         Thread::multi (mapper),
-        Thread::batch (Mapped_track_nodelist()),
-        connectome);
-  }
-
-  connectome.finalize();
-  connectome.error_check (missing_nodes);
+        Thread::batch (Mapped_track_multi()),
+        outputs);
 
-  connectome.save (argument[2], get_options ("keep_unassigned").size(), get_options ("symmetric").size(), get_options ("zero_diagonal").size());
+  }
 
-  opt = get_options ("out_assignments");
-  if (opt.size())
-    connectome.write_assignments (opt[0][0]);
+  outputs.finalize (parcellations);
 }
 
 
 
 void run ()
 {
-  auto node_image = Image<node_t>::open (argument[1]);
-
-  // First, find out how many segmented nodes there are, so the matrix can be pre-allocated
-  // Also check for node volume for all nodes
-  vector<uint32_t> node_volumes (1, 0);
-  node_t max_node_index = 0;
-  for (auto i = Loop (node_image) (node_image); i; ++i) {
-    if (node_image.value() > max_node_index) {
-      max_node_index = node_image.value();
-      node_volumes.resize (max_node_index + 1, 0);
-    }
-    ++node_volumes[node_image.value()];
+  vector<Parcellation> parcellations;
+  vector<std::string> output_paths;
+  parcellations.emplace_back (argument[1]);
+  output_paths.push_back (argument[2]);
+  auto opt = get_options ("extra_nodes");
+  for (size_t i = 0; i != opt.size(); ++i) {
+    parcellations.emplace_back (opt[i][0]);
+    output_paths.push_back (opt[i][1]);
   }
 
-  std::set<node_t> missing_nodes;
-  for (size_t i = 1; i != node_volumes.size(); ++i) {
-    if (!node_volumes[i])
-      missing_nodes.insert (i);
-  }
-  if (missing_nodes.size()) {
-    WARN ("The following nodes are missing from the parcellation image:");
-    std::set<node_t>::iterator i = missing_nodes.begin();
-    std::string list = str(*i);
-    for (++i; i != missing_nodes.end(); ++i)
-      list += ", " + str(*i);
-    WARN (list);
-    WARN ("(This may indicate poor parcellation image preparation, use of incorrect or incomplete LUT file(s) in labelconvert, or very poor registration)");
-  }
+  node_t max_node_index = 0;
+  for (const auto& p : parcellations)
+    max_node_index = std::max (max_node_index, p.max_node_index);
 
   if (max_node_index >= node_count_ram_limit) {
     INFO ("Very large number of nodes detected; using single-precision floating-point storage");
-    execute<float> (node_image, max_node_index, missing_nodes);
+    execute<float> (parcellations, output_paths);
   } else {
-    execute<double> (node_image, max_node_index, missing_nodes);
+    execute<double> (parcellations, output_paths);
   }
 }
@@ -24,6 +24,7 @@
 #include "dwi/tractography/file.h"
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/roi.h"
+#include "dwi/tractography/spatial_index.h"
 #include "dwi/tractography/weights.h"
 
 #include "dwi/tractography/editing/editing.h"
@@ -74,6 +75,8 @@ void usage ()
 
   + Option ("ends_only", "only test the ends of each streamline against the provided include/exclude ROIs")
 
+  + Tractography::SpatialIndexOption
+
   // TODO Input weights with multiple input files currently not supported
   + OptionGroup ("Options for handling streamline weights")
   + Tractography::TrackWeightsInOption
@@ -172,6 +175,30 @@ void run ()
 
   Loader loader (input_file_list);
   Worker worker (properties, inverse, ends_only);
+
+  auto opt = get_options ("tck_index");
+  if (opt.size()) {
+    if (num_inputs > 1)
+      throw Exception ("Cannot use a track file spatial index with multiple input files");
+    if (properties.include.size() || properties.exclude.size()) {
+      SpatialIndex index (opt[0][0]);
+      Properties p;
+      Reader<float> reader (argument[0], p);
+      index.verify (p);
+      std::shared_ptr<BitSet> include_candidates, exclude_candidates;
+      if (properties.include.size()) {
+        include_candidates.reset (new BitSet (index.candidates (properties.include, true)));
+        INFO (str(include_candidates->count()) + " of " + str(index.num_streamlines()) + " streamlines may intersect all include regions");
+      }
+      if (properties.exclude.size()) {
+        exclude_candidates.reset (new BitSet (index.candidates (properties.exclude, false)));
+        INFO (str(exclude_candidates->count()) + " of " + str(index.num_streamlines()) + " streamlines may intersect an exclude region");
+      }
+      worker.set_candidates (include_candidates, exclude_candidates);
+    } else {
+      WARN ("Track file spatial index is only used for include / exclude regions of interest; -tck_index option ignored");
+    }
+  }
   // This needs to be run AFTER creation of the Worker class
   // (worker needs to be able to set max & min number of points based on step size in input file,
   //  receiver needs "output_step_size" field to have been updated before file creation)
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "types.h"
+
+#include "dwi/tractography/spatial_index.h"
+
+
+using namespace MR;
+using namespace App;
+using namespace MR::DWI;
+using namespace MR::DWI::Tractography;
+
+
+
+void usage ()
+{
+
+  AUTHOR = "Robert E. Smith (robert.smith@florey.edu.au)";
+
+  SYNOPSIS = "Generate a spatial index of a track file, for accelerating region-of-interest queries";
+
+  DESCRIPTION
+  + "Scanner space is divided into a regular grid of cubic cells, and for each cell, "
+    "the list of streamlines possessing at least one vertex within that cell is stored. "
+    "When this index is subsequently provided to other commands (e.g. tckedit -tck_index), "
+    "those streamlines that cannot possibly intersect a particular region of interest can be "
+    "identified without explicitly testing every streamline vertex against that region."
+
+  + "Smaller cell sizes permit more precise identification of candidate streamlines, "
+    "at the expense of a larger index file.";
+
+  ARGUMENTS
+  + Argument ("tracks_in", "the input track file").type_tracks_in()
+  + Argument ("index_out", "the output track index file").type_file_out();
+
+  OPTIONS
+  + Option ("cell_size", "the side length of each cubic cell in mm (default: " + str(TRACTOGRAPHY_SPATIAL_INDEX_DEFAULT_CELL_SIZE, 2) + ")")
+    + Argument ("value").type_float (0.0);
+
+}
+
+
+
+void run ()
+{
+  const float cell_size = get_option_value ("cell_size", TRACTOGRAPHY_SPATIAL_INDEX_DEFAULT_CELL_SIZE);
+  SpatialIndex index (argument[0], cell_size);
+  index.save (argument[1]);
+}
+
@@ -101,6 +101,15 @@ void run()
       throw Exception ("number of rows in the permutations file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
   }
 
+  // Load exchangeability blocks if supplied
+  opt = get_options ("exchange_within");
+  vector<size_t> blocks;
+  if (opt.size()) {
+    blocks = Math::Stats::Permutation::load_blocks_file (opt[0][0]);
+    if (blocks.size() != (size_t)design.rows())
+      throw Exception ("number of entries in the exchangeability blocks file (" + str(opt[0][0]) + ") does not match number of rows in design matrix");
+  }
+
   // Load contrast matrix
   matrix_type contrast = load_matrix (argument[3]);
   if (contrast.cols() > design.cols())
@@ -177,18 +186,23 @@ void run()
     vector_type null_distribution (num_perms), uncorrected_pvalues (num_perms);
     vector_type empirical_distribution;
 
+    bool complete;
     if (permutations.size()) {
-      Stats::PermTest::run_permutations (permutations, glm_ttest, enhancer, empirical_distribution,
-                                         default_tvalues, std::shared_ptr<vector_type>(),
-                                         null_distribution, std::shared_ptr<vector_type>(),
-                                         uncorrected_pvalues, std::shared_ptr<vector_type>());
+      complete = Stats::PermTest::run_permutations (permutations, glm_ttest, enhancer, empirical_distribution,
+                                                    default_tvalues, std::shared_ptr<vector_type>(),
+                                                    null_distribution, std::shared_ptr<vector_type>(),
+                                                    uncorrected_pvalues, std::shared_ptr<vector_type>());
     } else {
-      Stats::PermTest::run_permutations (num_perms, glm_ttest, enhancer, empirical_distribution,
-                                         default_tvalues, std::shared_ptr<vector_type>(),
-                                         null_distribution, std::shared_ptr<vector_type>(),
-                                         uncorrected_pvalues, std::shared_ptr<vector_type>());
+      complete = Stats::PermTest::run_permutations (num_perms, blocks, glm_ttest, enhancer, empirical_distribution,
+                                                    default_tvalues, std::shared_ptr<vector_type>(),
+                                                    null_distribution, std::shared_ptr<vector_type>(),
+                                                    uncorrected_pvalues, std::shared_ptr<vector_type>());
     }
 
+    // Only a subset of permutations has been processed (-shard option)
+    if (!complete)
+      return;
+
     vector_type default_pvalues (num_elements);
     Math::Stats::Permutation::statistic2pvalue (null_distribution, default_tvalues, default_pvalues);
     save_vector (default_pvalues,     output_prefix + "_fwe_pvalue.csv");
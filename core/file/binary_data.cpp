@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "file/binary_data.h"
+
+#include <sstream>
+
+
+namespace MR
+{
+  namespace File
+  {
+
+
+
+    void write_data_offset (OFStream& out, const size_t alignment)
+    {
+      // Allow sufficient space for the remainder of the header
+      int64_t data_offset = int64_t(out.tellp()) + 32;
+      data_offset += (alignment - (data_offset % alignment)) % alignment;
+      out << "file: . " << data_offset << "\nEND\n";
+      out.seekp (data_offset);
+    }
+
+
+
+    void open_data (std::ifstream& in, const std::string& path, const std::string& file_entry, const std::string& description)
+    {
+      std::istringstream files_stream (file_entry);
+      std::string fname;
+      int64_t offset = 0;
+      files_stream >> fname >> offset;
+      if (fname != "." || !offset)
+        throw Exception ("invalid data specification in " + description + " file \"" + path + "\"");
+
+      in.open (path.c_str(), std::ios::in | std::ios::binary);
+      if (!in)
+        throw Exception ("error opening " + description + " file \"" + path + "\": " + strerror (errno));
+      in.seekg (offset);
+    }
+
+
+
+  }
+}
+
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __file_binary_data_h__
+#define __file_binary_data_h__
+
+#include <fstream>
+
+#include "raw.h"
+#include "types.h"
+#include "file/ofstream.h"
+
+
+namespace MR
+{
+  namespace File
+  {
+
+
+    /*! \defgroup BinaryData Binary data following a key-value header
+     * \brief Functions to handle files consisting of a key-value header
+     * (as read by File::KeyValue) followed by little-endian binary data.
+     *
+     * The header is terminated by an entry of the form "file: . <offset>",
+     * giving the byte offset of the binary data from the start of the
+     * same file, and by the "END" line.
+     * @{ */
+
+
+    //! terminate the header, and seek to the start of the binary data
+    /*! Writes the "file: . <offset>" and "END" lines, with the offset
+     * rounded up to a multiple of \a alignment bytes. */
+    void write_data_offset (OFStream& out, const size_t alignment);
+
+    //! open \a path and seek to the start of its binary data
+    /*! \a file_entry is the value of the "file" key in the header of
+     * \a path; \a description is used in any error messages (e.g. "track
+     * index" for errors relating to a "track index file"). */
+    void open_data (std::ifstream& in, const std::string& path, const std::string& file_entry, const std::string& description);
+
+
+
+    template <typename T>
+      inline void write_LE (std::ostream& out, const T value)
+      {
+        const T data = ByteOrder::LE (value);
+        out.write (reinterpret_cast<const char*> (&data), sizeof (T));
+      }
+
+    template <typename T>
+      inline void write_LE (std::ostream& out, const T* data, const size_t size)
+      {
+        for (size_t i = 0; i != size; ++i)
+          write_LE<T> (out, data[i]);
+      }
+
+    template <typename T>
+      inline void write_LE (std::ostream& out, const vector<T>& data)
+      {
+        write_LE (out, data.data(), data.size());
+      }
+
+
+
+    template <typename T>
+      inline T read_LE (std::istream& in)
+      {
+        T value;
+        in.read (reinterpret_cast<char*> (&value), sizeof (T));
+        return ByteOrder::LE (value);
+      }
+
+    template <typename T>
+      inline void read_LE (std::istream& in, T* data, const size_t size)
+      {
+        in.read (reinterpret_cast<char*> (data), size * sizeof (T));
+        for (size_t i = 0; i != size; ++i)
+          data[i] = ByteOrder::LE (data[i]);
+      }
+
+    template <typename T>
+      inline void read_LE (std::istream& in, vector<T>& data)
+      {
+        read_LE (in, data.data(), data.size());
+      }
+
+
+    /** @} */
+
+
+  }
+}
+
+#endif
+
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "filter/connected_components.h"
+
+namespace MR
+{
+  namespace Filter
+  {
+
+
+    using namespace App;
+
+    const char* neighbourhoods[] = { "6", "18", "26", nullptr };
+
+    const OptionGroup ConnectivityOptions = OptionGroup ("Options for defining the connectivity of voxels")
+
+    + Option ("connectivity", "use 26-voxel-neighbourhood connectivity (Default: 6); equivalent to \"-neighbourhood 26\"")
+
+    + Option ("neighbourhood", "the number of neighbours of each voxel used to define connectivity: "
+                               "6 (faces), 18 (faces and edges) or 26 (faces, edges and corners) (Default: 6)")
+    + Argument ("value").type_choice (neighbourhoods);
+
+
+
+    size_t get_connectivity ()
+    {
+      size_t connectivity = 6;
+      auto opt = get_options ("neighbourhood");
+      if (opt.size())
+        connectivity = to<size_t> (neighbourhoods[int(opt[0][0])]);
+      if (get_options ("connectivity").size()) {
+        if (opt.size() && connectivity != 26)
+          throw Exception ("-connectivity option is incompatible with -neighbourhood " + str(connectivity));
+        connectivity = 26;
+      }
+      return connectivity;
+    }
+
+
+  }
+}
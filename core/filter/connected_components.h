@@ -16,14 +16,15 @@
 #ifndef __filter_connected_h__
 #define __filter_connected_h__
 
+#include "app.h"
 #include "memory.h"
 #include "image.h"
+#include "thread_queue.h"
 #include "algo/loop.h"
 
 #include "filter/base.h"
 
-#include <stack>
-#include <iostream>
+#include <numeric>
 
 namespace MR
 {
@@ -46,205 +47,270 @@ namespace MR
     }
 
 
-    class Connector { NOMEMALIGN
 
-      public:
-        Connector (bool do_26_connectivity) :
-          do_26_connectivity (do_26_connectivity),
-          dim_to_ignore (4, false) {
-            dim_to_ignore[3] = true;
-        }
+    //! command-line options selecting the neighbourhood that defines voxel connectivity
+    extern const App::OptionGroup ConnectivityOptions;
 
+    //! the connectivity (6, 18 or 26) requested via ConnectivityOptions (default: 6)
+    size_t get_connectivity ();
 
-        // Perform connected components on the mask.
-        const vector<vector<int> >& run (vector<cluster>& clusters,
-                                                   vector<uint32_t>& labels) const {
-          labels.resize (adjacent_indices.size(), 0);
-          uint32_t current_label = 1;
-          for (uint32_t i = 0; i < labels.size(); i++) {
-            // this node has not been already clustered
-            if (labels[i] == 0) {
-              cluster cluster;
-              cluster.label = current_label;
-              cluster.size = 0;
-              depth_first_search (i, cluster, labels);
-              clusters.push_back (cluster);
-              current_label++;
-            }
-          }
-          if (clusters.size() > std::numeric_limits<uint32_t>::max())
-            throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
-          return mask_indices;
-        }
 
 
-        // Perform connected components on data with the defined threshold. Assumes adjacency is the same as the mask.
-        template <class VectorType>
-        void run (vector<cluster>& clusters,
-                  vector<uint32_t>& labels,
-                  const VectorType& data,
-                  const float threshold) const {
-          labels.resize (adjacent_indices.size(), 0);
-          uint32_t current_label = 1;
-          for (uint32_t i = 0; i < labels.size(); i++) {
-            // this node has not been already clustered and is above threshold
-            if (labels[i] == 0 && data[i] > threshold) {
-              cluster cluster;
-              cluster.label = current_label;
-              cluster.size = 0;
-              depth_first_search (i, cluster, labels, data, threshold);
-              clusters.push_back (cluster);
-              current_label++;
-            }
-          }
-          if (clusters.size() > std::numeric_limits<uint32_t>::max())
-            throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
+    /*! Connected-component labelling of the voxels within a mask image
+     *
+     * Neighbouring voxels are found directly on the image grid, using a lookup
+     * of the index of each voxel within the mask, rather than storing an explicit
+     * list of neighbours for every mask voxel. The neighbourhood can use 6
+     * (faces), 18 (faces and edges) or 26 (faces, edges and corners)
+     * connectivity; where the 4th axis is not ignored, these correspond to
+     * neighbours differing in position along at most one, at most two, or any
+     * number of axes respectively.
+     *
+     * Labelling of the whole mask is performed using a union-find structure:
+     * contiguous blocks of mask voxels are processed in parallel, after which
+     * those connections crossing between blocks are merged. Clusters are
+     * labelled in order of the first mask voxel they contain. */
+    class Connector { NOMEMALIGN
+
+      public:
+        Connector (const size_t connectivity = 6) :
+            connectivity (connectivity),
+            dim_to_ignore (4, false)
+        {
+          if (connectivity != 6 && connectivity != 18 && connectivity != 26)
+            throw Exception ("connectivity must be one of 6, 18 or 26 (requested " + str(connectivity) + ")");
+          dim_to_ignore[3] = true;
+          for (size_t axis = 0; axis != 4; ++axis)
+            dim[axis] = 1;
         }
 
 
-        void set_dim_to_ignore (vector<bool>& ignore_dim) {
+        void set_dim_to_ignore (const vector<bool>& ignore_dim) {
           for (size_t d = 0; d < ignore_dim.size(); ++d) {
             dim_to_ignore[d] = ignore_dim[d];
           }
         }
 
 
+        // Define the mask voxels to be labelled; must be called after set_dim_to_ignore()
+        // Returns the number of voxels within the mask
         template <class MaskImageType>
-        const vector<vector<int> >& precompute_adjacency (MaskImageType& mask) {
-
-          auto index_image = Image<uint32_t>::scratch (mask);
-
-          // 1st pass, store mask image indices and their index in the array
-          for (auto l = Loop (mask) (mask, index_image); l; ++l) {
+        size_t set_mask (MaskImageType& mask) {
+          if (mask.ndim() > 4)
+            throw Exception ("Cannot run connected components analysis with more than 4 dimensions");
+          size_t num_grid_voxels = 1;
+          for (size_t axis = 0; axis != 4; ++axis) {
+            dim[axis] = axis < mask.ndim() ? mask.size(axis) : 1;
+            num_grid_voxels *= dim[axis];
+          }
+          lookup.assign (num_grid_voxels, 0);
+          voxels.clear();
+          for (auto l = Loop (mask) (mask); l; ++l) {
             if (mask.value() >= 0.5) {
-              // For each voxel, store the index within mask_indices for 2nd pass
-              index_image.value() = mask_indices.size();
-              vector<int> index (mask.ndim());
-              for (size_t dim = 0; dim < mask.ndim(); dim++)
-                index[dim] = mask.index(dim);
-              mask_indices.push_back (index);
-            } else {
-              index_image.value() = 0;
+              if (voxels.size() == std::numeric_limits<uint32_t>::max())
+                throw Exception ("The number of mask voxels is larger than can be indexed with an unsigned 32bit integer.");
+              size_t voxel = 0;
+              for (ssize_t axis = ssize_t(mask.ndim()) - 1; axis >= 0; --axis)
+                voxel = voxel * dim[axis] + mask.index(axis);
+              voxels.push_back (voxel);
+              lookup[voxel] = voxels.size();
             }
           }
+
           // Here we pre-compute the offsets for our neighbours in 4D space
-          vector< vector<int> > neighbour_offsets;
-          vector<int> offset (4);
-          for (offset[0] = -1; offset[0] <= 1; offset[0]++) {
-            for (offset[1] = -1; offset[1] <= 1; offset[1]++) {
-              for (offset[2] = -1; offset[2] <= 1; offset[2]++) {
-                for (offset[3] = -1; offset[3] <= 1; offset[3]++) {
-                  if (!do_26_connectivity && ((abs(offset[0]) + abs(offset[1]) + abs(offset[2]) + abs(offset[3])) > 1))
-                    continue;
-                  if ((abs(offset[0]) && dim_to_ignore[0]) || (abs(offset[1]) && dim_to_ignore[1]) ||
-                      (abs(offset[2]) && dim_to_ignore[2]) || (abs(offset[3]) && dim_to_ignore[3]))
-                    continue;
-                  neighbour_offsets.push_back (offset);
+          const size_t max_axes = connectivity == 6 ? 1 : (connectivity == 18 ? 2 : 4);
+          offsets.clear();
+          Offset offset;
+          for (offset.shift[0] = -1; offset.shift[0] <= 1; offset.shift[0]++) {
+            for (offset.shift[1] = -1; offset.shift[1] <= 1; offset.shift[1]++) {
+              for (offset.shift[2] = -1; offset.shift[2] <= 1; offset.shift[2]++) {
+                for (offset.shift[3] = -1; offset.shift[3] <= 1; offset.shift[3]++) {
+                  size_t num_axes = 0;
+                  bool ignored = false;
+                  ssize_t stride = 1;
+                  offset.delta = 0;
+                  for (size_t axis = 0; axis != 4; ++axis) {
+                    if (offset.shift[axis]) {
+                      ++num_axes;
+                      if (dim_to_ignore[axis] || dim[axis] == 1)
+                        ignored = true;
+                    }
+                    offset.delta += offset.shift[axis] * stride;
+                    stride *= dim[axis];
+                  }
+                  if (num_axes && num_axes <= max_axes && !ignored)
+                    offsets.push_back (offset);
                 }
               }
             }
           }
-          // 2nd pass, define adjacency
-          MaskImageType mask_neigh (mask);
-          for (vector<vector<int> >::const_iterator it = mask_indices.begin(); it != mask_indices.end(); ++it) {
-            vector<uint32_t> neighbour_indices;
-            for (vector< vector<int> >::const_iterator offset = neighbour_offsets.begin(); offset != neighbour_offsets.end(); ++offset) {
-              for (size_t dim = 0; dim < mask.ndim(); dim++)
-                mask_neigh.index(dim) = (*it)[dim] + (*offset)[dim];
-              if (!is_out_of_bounds (mask_neigh)) {
-                if (mask_neigh.value() >= 0.5) {
-                  assign_pos_of (mask_neigh).to (index_image);
-                  neighbour_indices.push_back (index_image.value());
-                }
-              }
-            }
-            adjacent_indices.push_back (neighbour_indices);
+
+          return voxels.size();
+        }
+
+
+        size_t size() const { return voxels.size(); }
+
+
+        // Set the position of an image to that of a particular mask voxel
+        template <class ImageType>
+        void assign_pos (const uint32_t index, ImageType& image) const {
+          size_t voxel = voxels[index];
+          for (size_t axis = 0; axis != 4; ++axis) {
+            if (axis < image.ndim())
+              image.index(axis) = voxel % dim[axis];
+            voxel /= dim[axis];
           }
+        }
+
 
-          return mask_indices;
+        // Invoke functor for the index of each mask voxel adjacent to a particular mask voxel
+        template <class Functor>
+        void for_each_neighbour (const uint32_t index, Functor&& functor) const {
+          const size_t voxel = voxels[index];
+          ssize_t pos[4];
+          size_t remainder = voxel;
+          for (size_t axis = 0; axis != 4; ++axis) {
+            pos[axis] = remainder % dim[axis];
+            remainder /= dim[axis];
+          }
+          for (const auto& offset : offsets) {
+            if (inside (pos, offset)) {
+              const uint32_t neighbour = lookup[ssize_t(voxel) + offset.delta];
+              if (neighbour)
+                functor (neighbour - 1);
+            }
+          }
         }
 
 
-        bool next_neighbour (uint32_t& node, vector<uint32_t>& labels) const {
-          for (size_t n = 0; n < adjacent_indices[node].size(); n++) {
-            if (labels[adjacent_indices[node][n]] == 0) {
-              node = adjacent_indices[node][n];
-              return true;
+        // Perform connected components on the mask.
+        void run (vector<cluster>& clusters,
+                  vector<uint32_t>& labels) const {
+          const size_t num_blocks = std::max (std::min (Thread::number_of_threads(), voxels.size()), size_t(1));
+          const size_t block_size = (voxels.size() + num_blocks - 1) / num_blocks;
+          vector<uint32_t> parent (voxels.size());
+          std::iota (parent.begin(), parent.end(), 0);
+          // Connections between blocks are deferred until all blocks have been processed
+          vector<vector<std::pair<uint32_t, uint32_t>>> crossing (num_blocks);
+
+          size_t counter = 0;
+          auto source = [&] (size_t& block) { block = counter++; return block < num_blocks; };
+          auto worker = [&] (const size_t& block)
+          {
+            const uint32_t begin = block * block_size;
+            const uint32_t end = std::min ((block+1) * block_size, voxels.size());
+            for (uint32_t i = begin; i < end; ++i) {
+              for_each_neighbour (i, [&] (const uint32_t n) {
+                if (n < begin)
+                  crossing[block].push_back (std::make_pair (n, i));
+                else if (n < i)
+                  unite (parent, n, i);
+              });
             }
+            return true;
+          };
+          Thread::run_queue (source, size_t(), Thread::multi (worker));
+
+          for (const auto& block : crossing) {
+            for (const auto& edge : block)
+              unite (parent, edge.first, edge.second);
           }
-          return false;
+          label (parent, clusters, labels);
         }
 
 
+        // Perform connected components on data with the defined threshold. Assumes adjacency is the same as the mask.
         template <class VectorType>
-        bool next_neighbour (uint32_t& node,
-                             vector<uint32_t>& labels,
-                             const VectorType& data,
-                             const float threshold) const {
-          for (size_t n = 0; n < adjacent_indices[node].size(); n++) {
-            if (labels[adjacent_indices[node][n]] == 0 && data[adjacent_indices[node][n]] > threshold) {
-              node = adjacent_indices[node][n];
-              return true;
+        void run (vector<cluster>& clusters,
+                  vector<uint32_t>& labels,
+                  const VectorType& data,
+                  const float threshold) const {
+          constexpr uint32_t inactive = std::numeric_limits<uint32_t>::max();
+          vector<uint32_t> parent (voxels.size(), inactive);
+          for (uint32_t i = 0; i != voxels.size(); ++i) {
+            if (data[i] > threshold) {
+              parent[i] = i;
+              for_each_neighbour (i, [&] (const uint32_t n) {
+                if (n < i && parent[n] != inactive)
+                  unite (parent, n, i);
+              });
             }
           }
-          return false;
+          label (parent, clusters, labels);
         }
 
 
-        // use a non-recursive depth first search to agglomerate adjacent voxels
-        void depth_first_search (uint32_t root,
-                                 cluster& cluster,
-                                 vector<uint32_t>& labels) const {
-          uint32_t node = root;
-          std::stack<uint32_t> stack;
-          while (true) {
-            labels[node] = cluster.label;
-            stack.push (node);
-            cluster.size++;
-            if (next_neighbour (node, labels)) {
-              continue;
-            } else {
-              do {
-                if (stack.top() == root)
-                  return;
-                stack.pop();
-                node = stack.top();
-              } while (!next_neighbour (node, labels));
-            }
+      private:
+        class Offset { NOMEMALIGN
+          public:
+            ssize_t shift[4];
+            ssize_t delta;
+        };
+
+        size_t connectivity;
+        vector<bool> dim_to_ignore;
+        size_t dim[4];
+        // For each image voxel, one plus its index within the mask (zero if outside the mask)
+        vector<uint32_t> lookup;
+        // For each mask voxel, its linear index within the image
+        vector<size_t> voxels;
+        vector<Offset> offsets;
+
+
+        bool inside (const ssize_t* pos, const Offset& offset) const {
+          for (size_t axis = 0; axis != 4; ++axis) {
+            const ssize_t p = pos[axis] + offset.shift[axis];
+            if (p < 0 || p >= ssize_t(dim[axis]))
+              return false;
           }
+          return true;
         }
 
-        // use a non-recursive depth first search to agglomerate adjacent voxels
-        template <class VectorType>
-        void depth_first_search (uint32_t root,
-                                 cluster& cluster,
-                                 vector<uint32_t>& labels,
-                                 const VectorType& data,
-                                 const float threshold) const {
-          uint32_t node = root;
-          std::stack<uint32_t> stack;
-          while (true) {
-            labels[node] = cluster.label;
-            stack.push (node);
-            cluster.size++;
-            if (next_neighbour (node, labels, data, threshold)) {
+
+        // The root of each tree is always the lowest index within that tree
+        static uint32_t find (vector<uint32_t>& parent, uint32_t x) {
+          while (parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+          }
+          return x;
+        }
+
+        static void unite (vector<uint32_t>& parent, const uint32_t a, const uint32_t b) {
+          const uint32_t root_a = find (parent, a), root_b = find (parent, b);
+          if (root_a < root_b)
+            parent[root_b] = root_a;
+          else if (root_b < root_a)
+            parent[root_a] = root_b;
+        }
+
+
+        // Assign labels to clusters in order of their lowest index
+        static void label (vector<uint32_t>& parent,
+                           vector<cluster>& clusters,
+                           vector<uint32_t>& labels) {
+          constexpr uint32_t inactive = std::numeric_limits<uint32_t>::max();
+          labels.assign (parent.size(), 0);
+          for (uint32_t i = 0; i != parent.size(); ++i) {
+            if (parent[i] == inactive)
               continue;
+            const uint32_t root = find (parent, i);
+            if (root == i) {
+              if (clusters.size() == std::numeric_limits<uint32_t>::max())
+                throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
+              cluster cluster;
+              cluster.label = clusters.size() + 1;
+              cluster.size = 0;
+              clusters.push_back (cluster);
+              labels[i] = cluster.label;
             } else {
-              do {
-                if (stack.top() == root)
-                  return;
-                stack.pop();
-                node = stack.top();
-              } while (!next_neighbour (node, labels, data, threshold));
+              labels[i] = labels[root];
             }
+            ++clusters[labels[i]-1].size;
           }
         }
 
-
-        bool do_26_connectivity;
-        vector<bool> dim_to_ignore;
-        vector<vector<int> > mask_indices;
-        vector<vector<uint32_t> > adjacent_indices;
     };
 
 
@@ -272,7 +338,7 @@ namespace MR
       ConnectedComponents (const HeaderType& in) :
         Base (in),
         largest_only (false),
-        do_26_connectivity (false)
+        connectivity (6)
       {
         if (this->ndim() > 4)
           throw Exception ("Cannot run connected components analysis with more than 4 dimensions");
@@ -293,12 +359,12 @@ namespace MR
       template <class InputVoxelType, class OutputVoxelType>
       void operator() (InputVoxelType& in, OutputVoxelType& out)
       {
-        Connector connector (do_26_connectivity);
+        Connector connector (connectivity);
 
         if (dim_to_ignore.size())
           connector.set_dim_to_ignore (dim_to_ignore);
 
-        connector.precompute_adjacency (in);
+        connector.set_mask (in);
 
         std::unique_ptr<ProgressBar> progress;
         if (message.size()) {
@@ -308,7 +374,7 @@ namespace MR
 
         vector<cluster> clusters;
         vector<uint32_t> labels;
-        vector<vector<int> > mask_indices = connector.run (clusters, labels);
+        connector.run (clusters, labels);
 
         if (progress)
           ++(*progress);
@@ -323,9 +389,9 @@ namespace MR
         for (auto l = Loop (out) (out); l; ++l)
           out.value() = 0;
 
-        for (uint32_t i = 0; i < mask_indices.size(); i++)
+        for (uint32_t i = 0; i < connector.size(); i++)
         {
-          assign_pos_of (mask_indices[i]).to (out);
+          connector.assign_pos (i, out);
           if (largest_only) {
             if (label_lookup[labels[i] - 1] == 1)
               out.value() = 1;
@@ -351,14 +417,22 @@ namespace MR
 
       void set_26_connectivity (bool value)
       {
-        do_26_connectivity = value;
+        connectivity = value ? 26 : 6;
+      }
+
+
+      void set_connectivity (size_t value)
+      {
+        if (value != 6 && value != 18 && value != 26)
+          throw Exception ("connectivity must be one of 6, 18 or 26 (requested " + str(value) + ")");
+        connectivity = value;
       }
 
 
       protected:
         vector<bool> dim_to_ignore;
         bool largest_only;
-        bool do_26_connectivity;
+        size_t connectivity;
     };
     //! @}
   }
@@ -18,20 +18,25 @@
 
 #include <complex>
 
-#include <unsupported/Eigen/FFT>
-
 #include "datatype.h"
 #include "memory.h"
 #include "image.h"
 #include "algo/copy.h"
 #include "algo/threaded_copy.h"
+#include "algo/threaded_loop.h"
 #include "filter/base.h"
+#include "math/fft.h"
 
 namespace MR
 {
   namespace Filter
   {
 
+    template <class ImageType>
+      void fft (ImageType&& vox, const size_t axis, const bool inverse = false);
+
+
+
     /** \addtogroup Filters
       @{ */
 
@@ -100,8 +105,13 @@ namespace MR
                   break;
                 }
               }
-              FFTKernel<decltype(temp)> kernel (temp, *axis, inverse);
-              ThreadedLoop (temp, axes, 1).run (kernel);
+              if (axes.empty()) {
+                fft (temp, *axis, inverse);
+              } else {
+                // all lines along the fastest remaining axis are transformed at once
+                FFTKernel<decltype(temp)> kernel (temp, *axis, axes[0], inverse);
+                ThreadedLoop (temp, axes, 1).run_outer (kernel);
+              }
               if (progress) ++(*progress);
             }
 
@@ -129,30 +139,33 @@ namespace MR
         template <class ComplexImageType>
         class FFTKernel { MEMALIGN(FFTKernel)
           public:
-            FFTKernel (const ComplexImageType& voxel, const size_t FFT_axis, const bool inverse_FFT) :
+            FFTKernel (const ComplexImageType& voxel, const size_t FFT_axis, const size_t batch_axis, const bool inverse_FFT) :
                 vox (voxel),
-                data_in (vox.size (FFT_axis)),
-                data_out (data_in.size()),
+                fft (vox.size (FFT_axis)),
+                data (vox.size (batch_axis), vox.size (FFT_axis)),
                 axis (FFT_axis),
+                batch_axis (batch_axis),
                 inverse (inverse_FFT) { }
 
             void operator () (const Iterator& pos) {
               assign_pos_of (pos).to (vox);
-              for (vox.index(axis) = 0; vox.index(axis) < vox.size(axis); ++vox.index(axis))
-                data_in[vox.index(axis)] = cdouble (vox.value());
+              for (vox.index(batch_axis) = 0; vox.index(batch_axis) < vox.size(batch_axis); ++vox.index(batch_axis))
+                for (vox.index(axis) = 0; vox.index(axis) < vox.size(axis); ++vox.index(axis))
+                  data (vox.index(batch_axis), vox.index(axis)) = cdouble (vox.value());
               if (inverse)
-                fft.inv (data_out, data_in);
+                fft.inverse (data);
               else
-                fft.fwd (data_out, data_in);
-              for (vox.index(axis) = 0; vox.index(axis) < vox.size(axis); ++vox.index(axis))
-                vox.value() = typename ComplexImageType::value_type (data_out[vox.index(axis)]);
+                fft.forward (data);
+              for (vox.index(batch_axis) = 0; vox.index(batch_axis) < vox.size(batch_axis); ++vox.index(batch_axis))
+                for (vox.index(axis) = 0; vox.index(axis) < vox.size(axis); ++vox.index(axis))
+                  vox.value() = typename ComplexImageType::value_type (data (vox.index(batch_axis), vox.index(axis)));
             }
 
           protected:
             ComplexImageType vox;
-            Eigen::Matrix<cdouble, Eigen::Dynamic, 1> data_in, data_out;
-            Eigen::FFT<double> fft;
-            size_t axis;
+            Math::FFT<double> fft;
+            Eigen::Matrix<cdouble, Eigen::Dynamic, Eigen::Dynamic> data;
+            size_t axis, batch_axis;
             bool inverse;
         };
 
@@ -161,39 +174,61 @@ namespace MR
 
 
     template <class ImageType>
-      void fft (ImageType&& vox, const size_t axis, const bool inverse = false) {
+      void fft (ImageType&& vox, const size_t axis, const bool inverse) {
         auto axes = Stride::order (vox);
         for (size_t n = 0; n < axes.size(); ++n)
           if (axis == axes[n])
             axes.erase (axes.begin() + n);
 
-        struct Kernel { MEMALIGN(Kernel)
-          Kernel (const ImageType& v, size_t axis, bool inverse) :
-            data_in (v.size (axis)), data_out (data_in.size()), axis (axis), inverse (inverse) { }
+        if (axes.empty()) {
+          // one-dimensional image: there is only a single line to transform
+          Math::FFT<double> fft (vox.size (axis));
+          Eigen::Matrix<cdouble, Eigen::Dynamic, Eigen::Dynamic> data (1, vox.size (axis));
+          for (vox.index(axis) = 0; vox.index(axis) < vox.size(axis); ++vox.index(axis))
+            data (0, vox.index(axis)) = cdouble (vox.value());
+          if (inverse)
+            fft.inverse (data);
+          else
+            fft.forward (data);
+          for (vox.index(axis) = 0; vox.index(axis) < vox.size(axis); ++vox.index(axis))
+            vox.value() = typename std::remove_reference<ImageType>::type::value_type (data (0, vox.index(axis)));
+          return;
+        }
 
-          void operator ()(ImageType& v) {
-            for (auto l = Loop (axis, axis+1) (v); l; ++l)
-              data_in[v[axis]] = cdouble (v.value());
+        // all lines along the fastest remaining axis are transformed at once
+        const size_t batch_axis = axes[0];
+        struct Kernel { MEMALIGN(Kernel)
+          Kernel (const ImageType& v, size_t axis, size_t batch_axis, bool inverse) :
+            v (v), fft (v.size (axis)), data (v.size (batch_axis), v.size (axis)), axis (axis), batch_axis (batch_axis), inverse (inverse) { }
+
+          void operator() (const Iterator& pos) {
+            assign_pos_of (pos).to (v);
+            for (v.index(batch_axis) = 0; v.index(batch_axis) < v.size(batch_axis); ++v.index(batch_axis))
+              for (v.index(axis) = 0; v.index(axis) < v.size(axis); ++v.index(axis))
+                data (v.index(batch_axis), v.index(axis)) = cdouble (v.value());
             if (inverse)
-              fft.inv (data_out, data_in);
+              fft.inverse (data);
             else
-              fft.fwd (data_out, data_in);
-            for (auto l = Loop (axis, axis+1) (v); l; ++l)
-              v.value() = typename std::remove_reference<ImageType>::type::value_type (data_out[v[axis]]);
+              fft.forward (data);
+            for (v.index(batch_axis) = 0; v.index(batch_axis) < v.size(batch_axis); ++v.index(batch_axis))
+              for (v.index(axis) = 0; v.index(axis) < v.size(axis); ++v.index(axis))
+                v.value() = typename std::remove_reference<ImageType>::type::value_type (data (v.index(batch_axis), v.index(axis)));
           }
-          Eigen::FFT<double> fft;
-          Eigen::Matrix<cdouble, Eigen::Dynamic, 1> data_in, data_out;
-          const size_t axis;
+          typename std::remove_reference<ImageType>::type v;
+          Math::FFT<double> fft;
+          Eigen::Matrix<cdouble, Eigen::Dynamic, Eigen::Dynamic> data;
+          const size_t axis, batch_axis;
           const bool inverse;
-        } kernel (vox, axis, inverse);
+        } kernel (vox, axis, batch_axis, inverse);
 
         ThreadedLoop ("performing in-place FFT", vox, axes)
-          .run (kernel, vox);
+          .run_outer (kernel);
       }
 
 
 
 
+
   }
 }
 
@@ -21,6 +21,11 @@
 
 #define MAX_DIR_CHANGE 0.2
 #define ANGLE_TOLERANCE 1e-4
+// Step size below which get_peak() consults its stopping predicate: while the
+//   steps are larger, a search may pass close to one peak on its way to another.
+//   Below it, Newton's method converges quadratically, such that the remaining
+//   distance to the peak is of the order of ANGLE_TOLERANCE
+#define STOP_ANGLE_TOLERANCE 1e-2
 
 namespace MR
 {
@@ -42,25 +47,25 @@ namespace MR
       extern const char* encoding_description;
 
       //! the number of (even-degree) coefficients for the given value of \a lmax
-      inline size_t NforL (int lmax)
+      constexpr inline size_t NforL (int lmax)
       {
         return (lmax+1) * (lmax+2) /2;
       }
 
       //! compute the index for coefficient (l,m)
-      inline size_t index (int l, int m)
+      constexpr inline size_t index (int l, int m)
       {
         return l * (l+1) /2 + m;
       }
 
       //! same as NforL(), but consider only non-negative orders \e m
-      inline size_t NforL_mpos (int lmax)
+      constexpr inline size_t NforL_mpos (int lmax)
       {
         return (lmax/2+1) * (lmax/2+1);
       }
 
       //! same as index(), but consider only non-negative orders \e m
-      inline size_t index_mpos (int l, int m)
+      constexpr inline size_t index_mpos (int l, int m)
       {
         return l*l/4 + m;
       }
@@ -451,18 +456,342 @@ namespace MR
 
 
 
-      //! estimate direction & amplitude of SH peak
-      /*! find a peak of an SH series using Gauss-Newton optimisation, modified
-       * to operate directly in spherical coordinates. The initial search
-       * direction is \a unit_init_dir. If \a precomputer is not nullptr, it
-       * will be used to speed up the calculations, at the cost of a minor
-       * reduction in accuracy. */
-      template <class VectorType, class UnitVectorType, class ValueType = float>
+      //! SH kernels specialised at compile time for a given lmax
+      /*! These provide the same functionality as the corresponding free
+       * functions value(), delta() and derivatives(), but with the harmonic
+       * order known at compile time, such that all loops have fixed trip
+       * counts. The recursion coefficients for the associated Legendre
+       * functions are computed once, so that no square roots or
+       * trigonometric functions need to be evaluated per call. For
+       * evaluation along a unit direction [ x y z ], the identity
+       * sin^m(el) exp(i m az) = (x + i y)^m is used, reducing the SH series to
+       * a polynomial in x, y & z.
+       *
+       * The function signatures match those of the generic functions (the \a
+       * lmax and \a precomputer arguments are ignored), so that the
+       * appropriate version can be selected once at run time using
+       * value_function() or derivatives_function(). */
+      template <int LMax>
+        class FixedLmax { NOMEMALIGN
+          public:
+            static constexpr int lmax = LMax;
+
+            template <class VectorType, class UnitVectorType>
+              static typename VectorType::Scalar value (const VectorType& coefs, const UnitVectorType& unit_dir, int = LMax)
+              {
+                using value_type = typename VectorType::Scalar;
+                const auto& T = tables<value_type>();
+                value_type c[LMax+1], s[LMax+1];
+                azimuthal_terms (c, s, unit_dir[0], unit_dir[1]);
+                value_type P[3][LMax+1];
+                value_type amplitude = 0.0;
+                for (int l = 0; l <= LMax; l++) {
+                  T.legendre (P, l, unit_dir[2]);
+                  if (!(l&1)) {
+                    const value_type* p = P[l%3];
+                    const size_t i0 = index (l,0);
+                    for (int m = 0; m <= l; m++)
+                      amplitude += p[m] * (c[m] * coefs[i0+m] + s[m] * coefs[i0-m]);
+                  }
+                }
+                return amplitude;
+              }
+
+            template <class VectorType1, class VectorType2>
+              static VectorType1& delta (VectorType1& delta_vec, const VectorType2& unit_dir, int = LMax)
+              {
+                using value_type = typename VectorType1::Scalar;
+                const auto& T = tables<value_type>();
+                delta_vec.resize (NforL (LMax));
+                value_type c[LMax+1], s[LMax+1];
+                azimuthal_terms (c, s, unit_dir[0], unit_dir[1]);
+                value_type P[3][LMax+1];
+                for (int l = 0; l <= LMax; l++) {
+                  T.legendre (P, l, unit_dir[2]);
+                  if (!(l&1)) {
+                    const value_type* p = P[l%3];
+                    const size_t i0 = index (l,0);
+                    for (int m = 1; m <= l; m++) {
+                      delta_vec[i0+m] = p[m] * c[m];
+                      delta_vec[i0-m] = p[m] * s[m];
+                    }
+                    delta_vec[i0] = p[0];
+                  }
+                }
+                return delta_vec;
+              }
+
+            template <class VectorType>
+              static void derivatives (
+                  const VectorType& sh,
+                  const int,
+                  const typename VectorType::Scalar elevation,
+                  const typename VectorType::Scalar azimuth,
+                  typename VectorType::Scalar& amplitude,
+                  typename VectorType::Scalar& dSH_del,
+                  typename VectorType::Scalar& dSH_daz,
+                  typename VectorType::Scalar& d2SH_del2,
+                  typename VectorType::Scalar& d2SH_deldaz,
+                  typename VectorType::Scalar& d2SH_daz2,
+                  PrecomputedAL<typename VectorType::Scalar>*)
+              {
+                using value_type = typename VectorType::Scalar;
+                const auto& T = tables<value_type>();
+                const value_type sel = std::sin (elevation);
+                const value_type cel = std::cos (elevation);
+                const bool atpole = sel < 1e-4;
+
+                dSH_del = dSH_daz = d2SH_del2 = d2SH_deldaz = d2SH_daz2 = 0.0;
+
+                value_type sel_m[LMax+1];
+                sel_m[0] = 1.0;
+                for (int m = 1; m <= LMax; m++)
+                  sel_m[m] = sel_m[m-1] * sel;
+                value_type AL[NforL_mpos (LMax)], P[3][LMax+1];
+                for (int l = 0; l <= LMax; l++) {
+                  T.legendre (P, l, cel);
+                  if (!(l&1)) {
+                    const value_type* p = P[l%3];
+                    for (int m = 0; m <= l; m++)
+                      AL[index_mpos (l,m)] = p[m] * sel_m[m];
+                  }
+                }
+
+                amplitude = sh[0] * AL[0];
+                for (int l = 2; l <= LMax; l+=2) {
+                  const value_type& v (sh[index (l,0)]);
+                  amplitude += v * AL[index_mpos (l,0)];
+                  dSH_del += v * T.D1a[l][0] * AL[index_mpos (l,1)];
+                  d2SH_del2 += v * (T.D2a[l][0] * AL[index_mpos (l,2)] - l* (l+1) * AL[index_mpos (l,0)]) / 2.0;
+                }
+
+                const value_type cos_az = std::cos (azimuth), sin_az = std::sin (azimuth);
+                value_type caz (Math::sqrt2), saz (0.0);
+                for (int m = 1; m <= LMax; m++) {
+                  const value_type caz_next = caz*cos_az - saz*sin_az;
+                  saz = saz*cos_az + caz*sin_az;
+                  caz = caz_next;
+                  for (int l = ( (m&1) ? m+1 : m); l <= LMax; l+=2) {
+                    const value_type& vp (sh[index (l,m)]);
+                    const value_type& vm (sh[index (l,-m)]);
+                    amplitude += (vp*caz + vm*saz) * AL[index_mpos (l,m)];
+
+                    value_type tmp = T.D1b[l][m] * AL[index_mpos (l,m-1)];
+                    if (l > m) tmp -= T.D1a[l][m] * AL[index_mpos (l,m+1)];
+                    tmp /= -2.0;
+                    dSH_del += (vp*caz + vm*saz) * tmp;
+
+                    value_type tmp2 = - ( (l+m) * (l-m+1) + (l-m) * (l+m+1)) * AL[index_mpos (l,m)];
+                    if (m == 1) tmp2 -= T.D2b[l][m] * AL[index_mpos (l,1)];
+                    else tmp2 += T.D2b[l][m] * AL[index_mpos (l,m-2)];
+                    if (l > m+1) tmp2 += T.D2a[l][m] * AL[index_mpos (l,m+2)];
+                    tmp2 /= 4.0;
+                    d2SH_del2 += (vp*caz + vm*saz) * tmp2;
+
+                    if (atpole) dSH_daz += (vm*caz - vp*saz) * tmp;
+                    else {
+                      d2SH_deldaz += m * (vm*caz - vp*saz) * tmp;
+                      dSH_daz += m * (vm*caz - vp*saz) * AL[index_mpos (l,m)];
+                      d2SH_daz2 -= (vp*caz + vm*saz) * m*m * AL[index_mpos (l,m)];
+                    }
+                  }
+                }
+
+                if (!atpole) {
+                  dSH_daz /= sel;
+                  d2SH_deldaz /= sel;
+                  d2SH_daz2 /= sel*sel;
+                }
+              }
+
+
+          private:
+            // sqrt(2) * sin^m(el) * [ cos(m*az), sin(m*az) ] for m > 0, and [ 1, 0 ] for m = 0:
+            template <typename ValueType>
+              static void azimuthal_terms (ValueType* c, ValueType* s, const ValueType x, const ValueType y)
+              {
+                c[0] = 1.0;
+                s[0] = 0.0;
+                c[1] = Math::sqrt2 * x;
+                s[1] = Math::sqrt2 * y;
+                for (int m = 2; m <= LMax; m++) {
+                  c[m] = c[m-1]*x - s[m-1]*y;
+                  s[m] = s[m-1]*x + c[m-1]*y;
+                }
+              }
+
+            template <typename ValueType>
+              class Tables { NOMEMALIGN
+                public:
+                  Tables ()
+                  {
+                    for (int l = 0; l <= LMax; l++) {
+                      for (int m = 0; m <= LMax; m++) {
+                        A[l][m] = B[l][m] = C[l][m] = 0.0;
+                        D1a[l][m] = D1b[l][m] = D2a[l][m] = D2b[l][m] = 0.0;
+                      }
+                    }
+                    for (int m = 0; m <= LMax; m++) {
+                      // (l,m) = (m,m) term, without its sin^m(el) factor:
+                      double v = 1.0;
+                      for (int k = 1; k <= m; k++)
+                        v *= (2.0*k-1.0) / (2.0*k);
+                      C[m][m] = 0.282094791773878 * std::sqrt ((2.0*m+1.0) * v) * ( (m&1) ? -1.0 : 1.0);
+                      double f_prev = std::sqrt (2.0*m+3.0);
+                      if (m < LMax)
+                        A[m+1][m] = f_prev;
+                      for (int l = m+2; l <= LMax; l++) {
+                        const double f = std::sqrt ( (4.0*l*l-1.0) / (double(l*l) - double(m*m)));
+                        A[l][m] = f;
+                        B[l][m] = f / f_prev;
+                        f_prev = f;
+                      }
+                    }
+                    // factors involved in the derivatives:
+                    for (int l = 0; l <= LMax; l++) {
+                      for (int m = 0; m <= l; m++) {
+                        D1a[l][m] = std::sqrt (double ( (l-m) * (l+m+1)));
+                        D1b[l][m] = std::sqrt (double ( (l+m) * (l-m+1)));
+                        D2a[l][m] = std::sqrt (double ( (l-m) * (l+m+1) * std::max (l-m-1, 0) * (l+m+2)));
+                        D2b[l][m] = std::sqrt (double ( (l+m) * (l-m+1) * std::max (l+m-1, 0) * (l-m+2)));
+                      }
+                    }
+                  }
+
+                  // compute the associated Legendre functions of degree l for
+                  // all orders m <= l, without their sin^m(el) factor, from
+                  // those of degrees l-1 & l-2. These are held in a circular
+                  // buffer of 3 rows, with degree l stored in row l%3.
+                  // The recursion is performed for all orders at once, so as
+                  // to avoid the serial dependency along each order.
+                  void legendre (ValueType (*P)[LMax+1], const int l, const ValueType z) const
+                  {
+                    ValueType* p = P[l%3];
+                    if (l == 0) {
+                      p[0] = C[0][0];
+                      return;
+                    }
+                    const ValueType* p1 = P[(l+2)%3];
+                    if (l == 1) {
+                      p[0] = A[1][0] * z * p1[0];
+                      p[1] = C[1][1];
+                      return;
+                    }
+                    const ValueType* p2 = P[(l+1)%3];
+                    for (int m = 0; m < l-1; m++)
+                      p[m] = A[l][m] * z * p1[m] - B[l][m] * p2[m];
+                    p[l-1] = A[l][l-1] * z * p1[l-1];
+                    p[l] = C[l][l];
+                  }
+
+                  ValueType A[LMax+1][LMax+1], B[LMax+1][LMax+1], C[LMax+1][LMax+1];
+                  ValueType D1a[LMax+1][LMax+1], D1b[LMax+1][LMax+1], D2a[LMax+1][LMax+1], D2b[LMax+1][LMax+1];
+              };
+
+            template <typename ValueType>
+              static const Tables<ValueType>& tables ()
+              {
+                static const Tables<ValueType> T;
+                return T;
+              }
+        };
+
+      //! whether FixedLmax<> kernels are available for \a lmax
+      constexpr inline bool has_fixed_lmax (const int lmax)
+      {
+        return lmax >= 2 && lmax <= 12 && !(lmax&1);
+      }
+
+      template <class VectorType, class UnitVectorType>
+        using value_function_type = typename VectorType::Scalar (*) (const VectorType&, const UnitVectorType&, int);
+
+      //! get the most efficient function to evaluate an SH series of order \a lmax
+      /*! This returns a pointer to the FixedLmax<>::value() specialisation for
+       * \a lmax if available, or to the generic value() function otherwise.
+       * Either way, it is invoked as f (coefs, unit_dir, lmax). */
+      template <class VectorType, class UnitVectorType>
+        inline value_function_type<VectorType,UnitVectorType> value_function (const int lmax)
+        {
+          switch (lmax) {
+            case 2:  return FixedLmax<2>::template value<VectorType,UnitVectorType>;
+            case 4:  return FixedLmax<4>::template value<VectorType,UnitVectorType>;
+            case 6:  return FixedLmax<6>::template value<VectorType,UnitVectorType>;
+            case 8:  return FixedLmax<8>::template value<VectorType,UnitVectorType>;
+            case 10: return FixedLmax<10>::template value<VectorType,UnitVectorType>;
+            case 12: return FixedLmax<12>::template value<VectorType,UnitVectorType>;
+            default: return value<VectorType,UnitVectorType>;
+          }
+        }
+
+      template <class VectorType1, class VectorType2>
+        using delta_function_type = VectorType1& (*) (VectorType1&, const VectorType2&, int);
+
+      //! get the most efficient function to compute the SH coefficients of a delta function of order \a lmax
+      template <class VectorType1, class VectorType2>
+        inline delta_function_type<VectorType1,VectorType2> delta_function (const int lmax)
+        {
+          switch (lmax) {
+            case 2:  return FixedLmax<2>::template delta<VectorType1,VectorType2>;
+            case 4:  return FixedLmax<4>::template delta<VectorType1,VectorType2>;
+            case 6:  return FixedLmax<6>::template delta<VectorType1,VectorType2>;
+            case 8:  return FixedLmax<8>::template delta<VectorType1,VectorType2>;
+            case 10: return FixedLmax<10>::template delta<VectorType1,VectorType2>;
+            case 12: return FixedLmax<12>::template delta<VectorType1,VectorType2>;
+            default: return delta<VectorType1,VectorType2>;
+          }
+        }
+
+      template <class VectorType>
+        using derivatives_function_type = void (*) (const VectorType&, const int,
+            const typename VectorType::Scalar, const typename VectorType::Scalar,
+            typename VectorType::Scalar&, typename VectorType::Scalar&, typename VectorType::Scalar&,
+            typename VectorType::Scalar&, typename VectorType::Scalar&, typename VectorType::Scalar&,
+            PrecomputedAL<typename VectorType::Scalar>*);
+
+      template <class VectorType>
+        inline void derivatives (const VectorType& sh, const int lmax,
+            const typename VectorType::Scalar elevation, const typename VectorType::Scalar azimuth,
+            typename VectorType::Scalar& amplitude, typename VectorType::Scalar& dSH_del, typename VectorType::Scalar& dSH_daz,
+            typename VectorType::Scalar& d2SH_del2, typename VectorType::Scalar& d2SH_deldaz, typename VectorType::Scalar& d2SH_daz2,
+            PrecomputedAL<typename VectorType::Scalar>* precomputer);
+
+      //! get the most efficient function to compute the derivatives of an SH series of order \a lmax
+      template <class VectorType>
+        inline derivatives_function_type<VectorType> derivatives_function (const int lmax)
+        {
+          switch (lmax) {
+            case 2:  return FixedLmax<2>::template derivatives<VectorType>;
+            case 4:  return FixedLmax<4>::template derivatives<VectorType>;
+            case 6:  return FixedLmax<6>::template derivatives<VectorType>;
+            case 8:  return FixedLmax<8>::template derivatives<VectorType>;
+            case 10: return FixedLmax<10>::template derivatives<VectorType>;
+            case 12: return FixedLmax<12>::template derivatives<VectorType>;
+            default: return derivatives<VectorType>;
+          }
+        }
+
+
+
+
+
+
+      //! estimate direction & amplitude of SH peak, with early termination
+      /*! As for get_peak() below, but using the supplied \a derivatives_func
+       * (see derivatives_function()), and invoking \a stop on the current
+       * estimate once the search has (nearly) converged, i.e. once the step
+       * size has dropped below STOP_ANGLE_TOLERANCE, including on the final
+       * estimate: if this returns true, the search is abandoned and the
+       * amplitude at the current estimate is returned. This allows searches
+       * that are converging onto a peak that has already been found to be
+       * terminated early. */
+      template <class VectorType, class UnitVectorType, class StopFunctor>
         inline typename VectorType::Scalar get_peak (
             const VectorType& sh,
             int lmax,
             UnitVectorType& unit_init_dir,
-            PrecomputedAL<typename VectorType::Scalar>* precomputer = nullptr)
+            derivatives_function_type<VectorType> derivatives_func,
+            PrecomputedAL<typename VectorType::Scalar>* precomputer,
+            StopFunctor&& stop)
         {
           using value_type = typename VectorType::Scalar;
           assert (std::isfinite (unit_init_dir[0]));
@@ -470,7 +799,7 @@ namespace MR
             value_type az = std::atan2 (unit_init_dir[1], unit_init_dir[0]);
             value_type el = std::acos (unit_init_dir[2]);
             value_type amplitude, dSH_del, dSH_daz, d2SH_del2, d2SH_deldaz, d2SH_daz2;
-            derivatives (sh, lmax, el, az, amplitude, dSH_del, dSH_daz, d2SH_del2, d2SH_deldaz, d2SH_daz2, precomputer);
+            derivatives_func (sh, lmax, el, az, amplitude, dSH_del, dSH_daz, d2SH_del2, d2SH_deldaz, d2SH_daz2, precomputer);
 
             value_type del = sqrt (dSH_del*dSH_del + dSH_daz*dSH_daz);
             value_type daz = 0.0;
@@ -495,6 +824,8 @@ namespace MR
             unit_init_dir[2] -= del*std::sin (el);
             unit_init_dir.normalize();
 
+            if (dt < STOP_ANGLE_TOLERANCE && stop (unit_init_dir))
+              return amplitude;
             if (dt < ANGLE_TOLERANCE)
               return amplitude;
           }
@@ -506,6 +837,26 @@ namespace MR
 
 
 
+      //! estimate direction & amplitude of SH peak
+      /*! find a peak of an SH series using Gauss-Newton optimisation, modified
+       * to operate directly in spherical coordinates. The initial search
+       * direction is \a unit_init_dir. If \a precomputer is not nullptr, it
+       * will be used to speed up the calculations, at the cost of a minor
+       * reduction in accuracy. */
+      template <class VectorType, class UnitVectorType, class ValueType = float>
+        inline typename VectorType::Scalar get_peak (
+            const VectorType& sh,
+            int lmax,
+            UnitVectorType& unit_init_dir,
+            PrecomputedAL<typename VectorType::Scalar>* precomputer = nullptr)
+        {
+          return get_peak (sh, lmax, unit_init_dir,
+              precomputer ? derivatives<VectorType> : derivatives_function<VectorType> (lmax),
+              precomputer, [] (const UnitVectorType&) { return false; });
+        }
+
+
+
 
 
 
@@ -687,6 +1038,135 @@ namespace MR
       };
 
 
+
+
+      //! a class to rotate SH coefficients
+      /*! This computes the real-valued Wigner D-matrices corresponding to a
+       * 3x3 rotation matrix, using the recursion of Ivanic & Ruedenberg (J.
+       * Phys. Chem. 1996; 100:6342 & 1998; 102:9099), and applies them to SH
+       * coefficient vectors. The rotation matrix is block-diagonal, with one
+       * (2l+1)x(2l+1) block per (even) harmonic degree l, so the rotation is
+       * exact and costs O(lmax^3) per SH series once the blocks have been
+       * computed.
+       *
+       * If the input coefficients represent the function f(u), the output
+       * coefficients represent f(R^T u), where R is the rotation matrix. */
+      template <typename ValueType> class Rotation
+      { MEMALIGN(Rotation<ValueType>)
+        public:
+          using matrix_type = Eigen::Matrix<ValueType,Eigen::Dynamic,Eigen::Dynamic>;
+
+          Rotation (const size_t lmax) :
+            lmax (lmax),
+            D (lmax/2 + 1) { }
+
+          template <class MatrixType>
+            Rotation (const size_t lmax, const MatrixType& rotation) :
+              Rotation (lmax) {
+                set (rotation);
+              }
+
+          //! compute the D-matrices for the 3x3 rotation matrix \a rotation
+          template <class MatrixType>
+            void set (const MatrixType& rotation)
+            {
+              // degree 1 harmonics with m = -1, 0, 1 are proportional to y, z & x
+              // respectively (the sign of the m = +/-1 terms is accounted for
+              // below):
+              const int xyz[] = { 1, 2, 0 };
+              for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 3; ++j)
+                  R1(i,j) = rotation (xyz[i], xyz[j]);
+
+              D[0] = matrix_type::Ones (1,1);
+              Eigen::MatrixXd previous (R1), current;
+              for (int l = 2; l <= int(lmax); ++l) {
+                current.resize (2*l+1, 2*l+1);
+                for (int m = -l; m <= l; ++m) {
+                  for (int n = -l; n <= l; ++n) {
+                    const double d = (m == 0) ? 1.0 : 0.0;
+                    const double denom = (std::abs (n) == l) ? (2*l) * (2*l-1) : (l+n) * (l-n);
+                    const double u = std::sqrt ((l+m) * (l-m) / denom);
+                    const double v = 0.5 * std::sqrt ((1.0+d) * (l+std::abs(m)-1) * (l+std::abs(m)) / denom) * (1.0-2.0*d);
+                    const double w = -0.5 * std::sqrt ((l-std::abs(m)-1) * (l-std::abs(m)) / denom) * (1.0-d);
+                    double value = 0.0;
+                    if (u) value += u * U (previous, l, m, n);
+                    if (v) value += v * V (previous, l, m, n);
+                    if (w) value += w * W (previous, l, m, n);
+                    current (m+l, n+l) = value;
+                  }
+                }
+                if (!(l&1)) {
+                  // the SH basis used in MRtrix3 includes the Condon-Shortley phase:
+                  D[l/2].resize (2*l+1, 2*l+1);
+                  for (int m = -l; m <= l; ++m)
+                    for (int n = -l; n <= l; ++n)
+                      D[l/2](m+l,n+l) = ((m+n) & 1) ? -current (m+l,n+l) : current (m+l,n+l);
+                }
+                std::swap (previous, current);
+              }
+            }
+
+          //! rotate the SH series \a in, storing the result in \a out
+          /*! \note \a in and \a out must not refer to the same vector. */
+          template <class VectorType1, class VectorType2>
+            VectorType1& operator() (VectorType1& out, const VectorType2& in) const
+            {
+              assert (size_t (in.size()) >= NforL (lmax));
+              out.resize (NforL (lmax));
+              for (size_t l = 0; l <= lmax; l += 2) {
+                const size_t start = index (l,0) - l;
+                out.segment (start, 2*l+1).noalias() = D[l/2] * in.segment (start, 2*l+1);
+              }
+              return out;
+            }
+
+          //! the (2l+1)x(2l+1) block of the rotation matrix for (even) degree \a l
+          const matrix_type& block (const size_t l) const { return D[l/2]; }
+
+        private:
+          const size_t lmax;
+          vector<matrix_type> D;
+          Eigen::Matrix3d R1;
+
+          // the helper functions of Ivanic & Ruedenberg, with the matrices of
+          // degree 1 & l-1 indexed from -1 & -(l-1) respectively:
+          double P (const Eigen::MatrixXd& Rp, const int i, const int l, const int a, const int b) const
+          {
+            if (b == l)
+              return R1(i+1,2) * Rp(a+l-1, 2*l-2) - R1(i+1,0) * Rp(a+l-1, 0);
+            if (b == -l)
+              return R1(i+1,2) * Rp(a+l-1, 0) + R1(i+1,0) * Rp(a+l-1, 2*l-2);
+            return R1(i+1,1) * Rp(a+l-1, b+l-1);
+          }
+
+          double U (const Eigen::MatrixXd& Rp, const int l, const int m, const int n) const
+          {
+            return P (Rp, 0, l, m, n);
+          }
+
+          double V (const Eigen::MatrixXd& Rp, const int l, const int m, const int n) const
+          {
+            if (m == 0)
+              return P (Rp, 1, l, 1, n) + P (Rp, -1, l, -1, n);
+            if (m > 0)
+              return (m == 1) ?
+                Math::sqrt2 * P (Rp, 1, l, 0, n) :
+                P (Rp, 1, l, m-1, n) - P (Rp, -1, l, -m+1, n);
+            return (m == -1) ?
+              Math::sqrt2 * P (Rp, -1, l, 0, n) :
+              P (Rp, 1, l, m+1, n) + P (Rp, -1, l, -m-1, n);
+          }
+
+          double W (const Eigen::MatrixXd& Rp, const int l, const int m, const int n) const
+          {
+            if (m > 0)
+              return P (Rp, 1, l, m+1, n) + P (Rp, -1, l, -m-1, n);
+            return P (Rp, 1, l, m-1, n) - P (Rp, -1, l, -m+1, n);
+          }
+      };
+
+
       //! convenience function to check if an input image can contain SH coefficients
       template <class ImageType>
         void check (const ImageType& H) {
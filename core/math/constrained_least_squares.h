@@ -136,17 +136,54 @@ namespace MR
 
             Solver (const Problem<value_type>& problem) :
               P (problem),
-              BtB (P.chol_HtH.rows(), P.chol_HtH.cols()),
+              L (P.B.rows(), P.B.rows()),
               B (P.B.rows(), P.B.cols()),
-              y_u (BtB.rows()),
+              y_u (P.chol_HtH.rows()),
               c (P.B.rows()),
               c_u (P.B.rows()),
               lambda (c.size()),
               lambda_prev (c.size()),
               l (lambda.size()),
+              t (lambda.size()),
               active (lambda.size(), false) { }
 
-            size_t operator() (vector_type& x, const vector_type& b) 
+            //! solve the problem for measurement vector \e b, starting from an empty active set
+            size_t operator() (vector_type& x, const vector_type& b)
+            {
+              std::fill (active.begin(), active.end(), false);
+              return solve (x, b);
+            }
+
+            //! solve the problem for measurement vector \e b, starting from the active set provided
+            /*! This can be used to warm-start the solver using the active set
+             * of a closely related problem, typically that of a neighbouring
+             * voxel as returned by active_set(). The solution is identical
+             * (within solver tolerance) to that obtained from an empty active
+             * set, but typically requires far fewer iterations. */
+            size_t operator() (vector_type& x, const vector_type& b, const vector<bool>& initial_active_set)
+            {
+              assert (initial_active_set.size() == active.size());
+              if (&initial_active_set != &active)
+                active = initial_active_set;
+              return solve (x, b);
+            }
+
+            //! the active set of constraints at the solution of the last problem solved
+            const vector<bool>& active_set () const { return active; }
+
+            const Problem<value_type>& problem () const { return P; }
+
+          protected:
+            const Problem<value_type>& P;
+            // Cholesky factor of B*B' for the rows of B corresponding to
+            // the active constraints, in the order listed in active_index:
+            matrix_type L, B;
+            vector_type y_u, c, c_u, lambda, lambda_prev, l, t;
+            vector<bool> active;
+            vector<size_t> active_index;
+
+
+            size_t solve (vector_type& x, const vector_type& b)
             {
 #ifdef MRTRIX_ICLS_DEBUG
               std::ofstream l_stream ("l.txt");
@@ -160,79 +197,36 @@ namespace MR
               // set all Lagrangian multipliers to zero:
               lambda.setZero();
               lambda_prev.setZero();
-              // set active set empty:
-              std::fill (active.begin(), active.end(), false);
 
               // initial estimate of constraint values:
               c = c_u;
               // initial estimate of solution:
               x = y_u;
 
+              // if warm-starting, obtain solution for initial active set:
+              active_index.clear();
+              for (size_t n = 0; n < active.size(); ++n) {
+                if (active[n]) {
+                  active[n] = false;
+                  add_constraint (n);
+                }
+              }
+              if (active_index.size()) {
+                update_lambdas (x);
+                lambda_prev = lambda;
+                c = P.B * x;
+              }
+
               size_t min_c_index;
               size_t niter = 0;
 
               while (c.minCoeff (&min_c_index) < -P.tol) {
                 bool active_set_changed = !active[min_c_index];
-                active[min_c_index] = true;
-
-                while (1) {
-                  // form submatrix of active constraints:
-                  size_t num_active = 0;
-                  for (size_t n = 0; n < active.size(); ++n) {
-                    if (active[n]) {
-                      B.row (num_active) = P.B.row (n);
-                      l[num_active] = -c_u[n];
-                      ++num_active;
-                    }
-                  }
-                  auto B_active = B.topRows (num_active);
-                  auto l_active = l.head (num_active);
-
-                  BtB.resize (num_active, num_active);
-                  // solve for l in B*B'l = -c_u by Cholesky decomposition:
-                  BtB = B_active * B_active.transpose();
-                  BtB.diagonal().array() += P.lambda_min_norm;
-                  BtB.template selfadjointView<Eigen::Lower>().llt().solveInPlace (l_active);
-
-                  // update lambda values in full vector 
-                  // and identify worst offender if any lambda < 0
-                  // by projection from previous onto feasible 
-                  // subset (i.e. l>=0):
-                  value_type s_min = std::numeric_limits<value_type>::infinity();
-                  size_t s_min_index = 0;
-                  size_t a = 0;
-                  for (size_t n = 0; n < active.size(); ++n) {
-                    if (active[n]) {
-                      if (l_active[a] < 0.0) {
-                        value_type s = lambda_prev[n] / (lambda_prev[n] - l_active[a]);
-                        if (s < s_min) {
-                          s_min = s;
-                          s_min_index = n;
-                        }
-                      }
-                      lambda[n] = l_active[a];
-                      ++a;
-                    }
-                    else
-                      lambda[n] = 0.0;
-                  }
-
-                  // if no lambda < 0, proceed:
-                  if (!std::isfinite (s_min)) {
-                    // update solution vector:
-                    x = y_u + B_active.transpose() * l_active;
-                    break;
-                  }
-#ifdef MRTRIX_ICLS_DEBUG
-                l_stream << lambda << "\n";
-#endif
+                if (active_set_changed)
+                  add_constraint (min_c_index);
 
-                  // remove worst offending lambda from active set, 
-                  // and re-estimate remaining lambdas:
-                  if (active[s_min_index])
-                    active_set_changed = true;
-                  active[s_min_index] = false;
-                }
+                if (update_lambdas (x))
+                  active_set_changed = true;
 
                 // store feasible subset of lambdas:
                 lambda_prev = lambda;
@@ -246,7 +240,7 @@ namespace MR
 #endif
 
                 ++niter;
-                if (!active_set_changed || niter > P.max_niter) 
+                if (!active_set_changed || niter > P.max_niter)
                   break;
 
                 // compute constraint values at updated solution:
@@ -258,13 +252,112 @@ namespace MR
               return niter;
             }
 
-            const Problem<value_type>& problem () const { return P; }
 
-          protected:
-            const Problem<value_type>& P;
-            matrix_type BtB, B;
-            vector_type y_u, c, c_u, lambda, lambda_prev, l;
-            vector<bool> active;
+            // estimate the Lagrangian multipliers for the current active
+            // set, removing constraints from the active set until all are
+            // non-negative, and update the solution accordingly. Returns true
+            // if any constraint was removed from the active set.
+            bool update_lambdas (vector_type& x)
+            {
+              bool active_set_changed = false;
+              while (1) {
+                const size_t num_active = active_index.size();
+                auto B_active = B.topRows (num_active);
+                auto l_active = l.head (num_active);
+
+                // solve for l in B*B'l = -c_u using the Cholesky factor:
+                for (size_t a = 0; a < num_active; ++a)
+                  l_active[a] = -c_u[active_index[a]];
+                L.topLeftCorner (num_active, num_active).template triangularView<Eigen::Lower>().solveInPlace (l_active);
+                L.topLeftCorner (num_active, num_active).template triangularView<Eigen::Lower>().transpose().solveInPlace (l_active);
+
+                // update lambda values in full vector
+                // and identify worst offender if any lambda < 0
+                // by projection from previous onto feasible
+                // subset (i.e. l>=0):
+                value_type s_min = std::numeric_limits<value_type>::infinity();
+                size_t s_min_index = 0, s_min_pos = 0;
+                lambda.setZero();
+                for (size_t a = 0; a < num_active; ++a) {
+                  const size_t n = active_index[a];
+                  if (l_active[a] < 0.0) {
+                    value_type s = lambda_prev[n] / (lambda_prev[n] - l_active[a]);
+                    if (s < s_min || (s == s_min && n < s_min_index)) {
+                      s_min = s;
+                      s_min_index = n;
+                      s_min_pos = a;
+                    }
+                  }
+                  lambda[n] = l_active[a];
+                }
+
+                // if no lambda < 0, proceed:
+                if (!std::isfinite (s_min)) {
+                  // update solution vector:
+                  x = y_u + B_active.transpose() * l_active;
+                  return active_set_changed;
+                }
+
+                // remove worst offending lambda from active set,
+                // and re-estimate remaining lambdas:
+                remove_constraint (s_min_pos);
+                active_set_changed = true;
+              }
+            }
+
+
+            // append constraint n to the active set, and update the
+            // Cholesky factor accordingly:
+            void add_constraint (size_t n)
+            {
+              const size_t k = active_index.size();
+              B.row (k) = P.B.row (n);
+              value_type d = B.row (k).squaredNorm() + P.lambda_min_norm;
+              if (k) {
+                auto r = t.head (k);
+                r.noalias() = B.topRows (k) * B.row (k).transpose();
+                L.topLeftCorner (k, k).template triangularView<Eigen::Lower>().solveInPlace (r);
+                L.row (k).head (k) = r.transpose();
+                d -= r.squaredNorm();
+              }
+              // guard against loss of positive-definiteness due to round-off:
+              L(k,k) = std::sqrt (std::max (d, std::numeric_limits<value_type>::epsilon() * (P.lambda_min_norm + 1.0)));
+              active[n] = true;
+              active_index.push_back (n);
+            }
+
+
+            // remove the constraint at position pos in the active set, and
+            // update the Cholesky factor accordingly:
+            void remove_constraint (size_t pos)
+            {
+              const size_t k = active_index.size();
+              const size_t m = k - pos - 1;
+              auto v = t.head (m);
+              v = L.col (pos).segment (pos+1, m);
+              for (size_t i = pos; i < k-1; ++i) {
+                L.row (i).head (pos) = L.row (i+1).head (pos);
+                L.row (i).segment (pos, i-pos+1) = L.row (i+1).segment (pos+1, i-pos+1);
+                B.row (i) = B.row (i+1);
+              }
+              // rank-1 update of trailing block with removed column:
+              for (size_t i = 0; i < m; ++i) {
+                const size_t j = pos + i;
+                const value_type Ljj = L(j,j);
+                const value_type r = std::hypot (Ljj, v[i]);
+                const value_type cs = r / Ljj, sn = v[i] / Ljj;
+                L(j,j) = r;
+                if (i+1 < m) {
+                  auto Lcol = L.col (j).segment (j+1, m-i-1);
+                  auto vtail = v.segment (i+1, m-i-1);
+                  Lcol = (Lcol + sn * vtail) / cs;
+                  vtail = cs * vtail - sn * Lcol;
+                }
+              }
+              active[active_index[pos]] = false;
+              active_index.erase (active_index.begin() + pos);
+            }
+
         };
 
 
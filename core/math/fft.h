@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __math_fft_h__
+#define __math_fft_h__
+
+#include <complex>
+
+#ifdef EIGEN_FFTW_DEFAULT
+#include <unsupported/Eigen/FFT>
+#endif
+
+#include "memory.h"
+#include "types.h"
+#include "math/math.h"
+
+// Largest prime factor of the transform length for which the DFT is evaluated
+//   directly within a mixed-radix stage; transforms with any larger prime factor
+//   are computed using Bluestein's algorithm (see testing_bench_fft)
+#define FFT_MAX_GENERIC_RADIX 48
+
+namespace MR
+{
+  namespace Math
+  {
+
+
+
+    //! Batched 1D fast Fourier transform
+    /*! Computes the discrete Fourier transform of each row of a matrix, with all
+     * rows being transformed simultaneously using a self-sorting (Stockham)
+     * mixed-radix algorithm. Rather than transforming one line at a time, each
+     * butterfly is applied to all lines at once: the data are held internally in
+     * split real / imaginary format with the line index varying fastest, such that
+     * all inner loops operate on contiguous arrays and can be vectorised.
+     *
+     * The plan (factorisation of the transform length and the twiddle factors) is
+     * computed on construction and shared between copies of the object, whereas
+     * each copy has its own workspace; a single instance can therefore be
+     * constructed and then copied into each thread.
+     *
+     * Transform lengths with a prime factor greater than FFT_MAX_GENERIC_RADIX
+     * are handled using Bluestein's algorithm: the DFT is expressed as a
+     * convolution with a chirp, evaluated using a power-of-two transform of at
+     * least twice the length, such that the cost remains O(N log N).
+     *
+     * If MRtrix3 is configured with FFTW (EIGEN_FFTW_DEFAULT), each line is
+     * instead transformed individually using Eigen::FFT, and hence FFTW.
+     *
+     * As with Eigen::FFT, the forward transform is unscaled, and the inverse
+     * transform is scaled by 1/N.
+     *
+     * Typical usage:
+     * \code
+     * Math::FFT<double> fft (data.cols());
+     * fft.forward (data);              // transform each row of data
+     * fft.inverse (data.transpose());  // inverse transform each column of data
+     * \endcode */
+    template <typename ValueType>
+    class FFT
+    { MEMALIGN(FFT<ValueType>)
+      public:
+        using value_type = ValueType;
+        using complex_type = std::complex<value_type>;
+
+        FFT (const size_t size) :
+            plan (new Plan (size)) { initialise(); }
+
+#ifdef EIGEN_FFTW_DEFAULT
+        // The FFTW plans held by Eigen::FFT must not be shared between copies
+        FFT (const FFT& that) :
+            plan (that.plan) { initialise(); }
+#endif
+
+        size_t size () const { return plan->size; }
+
+        //! perform the forward transform of each row of \a data in-place
+        template <class MatrixType>
+          void forward (MatrixType&& data) { transform (data, false); }
+
+        //! perform the inverse transform of each row of \a data in-place
+        template <class MatrixType>
+          void inverse (MatrixType&& data) { transform (data, true); }
+
+
+      private:
+        using array_type = Eigen::Array<value_type, Eigen::Dynamic, Eigen::Dynamic>;
+
+        class Plan
+        { NOMEMALIGN
+          public:
+            Plan (const size_t size);
+            const size_t size;
+            // radix of each stage, and twiddle factors exp(-2*pi*i*q*k / (L*radix))
+            //   for q = 1..radix-1 & k = 0..L-1, where L is the product of the radices
+            //   of all preceding stages
+            vector<size_t> radices;
+            vector<vector<complex_type>> twiddles;
+            // roots of unity for the generic butterfly
+            vector<vector<complex_type>> roots;
+            // Bluestein's algorithm: plan of the power-of-two transform used to
+            //   compute the convolution, chirp exp(-i*pi*n^2/N) for n = 0..N-1,
+            //   and DFT of the convolution kernel (the conjugate chirp, wrapped
+            //   around to negative indices), scaled by the inverse of its length
+            std::shared_ptr<const Plan> inner;
+            vector<complex_type> chirp, kernel;
+        };
+
+        std::shared_ptr<const Plan> plan;
+        array_type real, imag, work_real, work_imag, scratch_real, scratch_imag;
+#ifdef EIGEN_FFTW_DEFAULT
+        Eigen::FFT<value_type> fftw;
+        Eigen::Matrix<complex_type, Eigen::Dynamic, 1> line_in, line_out;
+#endif
+
+        void initialise ();
+
+        template <class MatrixType>
+          void transform (MatrixType& data, const bool inverse);
+
+        template <class MatrixType>
+          void bluestein (MatrixType& data, const bool inverse);
+
+        void execute (const Plan& p, const size_t lines, const bool inverse);
+
+        void stage (const Plan& p, const size_t index, const size_t L, const size_t lines,
+                    const value_type* x_real, const value_type* x_imag,
+                    value_type* y_real, value_type* y_imag);
+
+        static void radix2 (const size_t lines, const complex_type* w,
+                            const value_type* __restrict a0r, const value_type* __restrict a0i,
+                            const value_type* __restrict a1r, const value_type* __restrict a1i,
+                            value_type* __restrict b0r, value_type* __restrict b0i,
+                            value_type* __restrict b1r, value_type* __restrict b1i);
+        static void radix3 (const size_t lines, const complex_type* w,
+                            const value_type* __restrict a0r, const value_type* __restrict a0i,
+                            const value_type* __restrict a1r, const value_type* __restrict a1i,
+                            const value_type* __restrict a2r, const value_type* __restrict a2i,
+                            value_type* __restrict b0r, value_type* __restrict b0i,
+                            value_type* __restrict b1r, value_type* __restrict b1i,
+                            value_type* __restrict b2r, value_type* __restrict b2i);
+        static void radix4 (const size_t lines, const complex_type* w,
+                            const value_type* __restrict a0r, const value_type* __restrict a0i,
+                            const value_type* __restrict a1r, const value_type* __restrict a1i,
+                            const value_type* __restrict a2r, const value_type* __restrict a2i,
+                            const value_type* __restrict a3r, const value_type* __restrict a3i,
+                            value_type* __restrict b0r, value_type* __restrict b0i,
+                            value_type* __restrict b1r, value_type* __restrict b1i,
+                            value_type* __restrict b2r, value_type* __restrict b2i,
+                            value_type* __restrict b3r, value_type* __restrict b3i);
+        static void radix5 (const size_t lines, const complex_type* w,
+                            const value_type* __restrict a0r, const value_type* __restrict a0i,
+                            const value_type* __restrict a1r, const value_type* __restrict a1i,
+                            const value_type* __restrict a2r, const value_type* __restrict a2i,
+                            const value_type* __restrict a3r, const value_type* __restrict a3i,
+                            const value_type* __restrict a4r, const value_type* __restrict a4i,
+                            value_type* __restrict b0r, value_type* __restrict b0i,
+                            value_type* __restrict b1r, value_type* __restrict b1i,
+                            value_type* __restrict b2r, value_type* __restrict b2i,
+                            value_type* __restrict b3r, value_type* __restrict b3i,
+                            value_type* __restrict b4r, value_type* __restrict b4i);
+    };
+
+
+
+
+
+    template <typename ValueType>
+    FFT<ValueType>::Plan::Plan (const size_t size) :
+        size (size)
+    {
+      if (!size)
+        throw Exception ("FFT length must be greater than zero");
+#ifndef EIGEN_FFTW_DEFAULT
+      size_t remainder = size;
+      while (!(remainder % 4)) { radices.push_back (4); remainder /= 4; }
+      while (!(remainder % 2)) { radices.push_back (2); remainder /= 2; }
+      for (size_t factor = 3; remainder > 1; factor += 2) {
+        while (!(remainder % factor)) { radices.push_back (factor); remainder /= factor; }
+      }
+
+      if (radices.size() && radices.back() > FFT_MAX_GENERIC_RADIX) {
+        radices.clear();
+        size_t M = 1;
+        while (M < 2*size - 1)
+          M *= 2;
+        inner.reset (new Plan (M));
+        // n^2 is reduced modulo 2N to preserve the precision of the phase
+        chirp.resize (size);
+        for (size_t n = 0; n != size; ++n)
+          chirp[n] = complex_type (std::polar (1.0, -Math::pi * double((n*n) % (2*size)) / double(size)));
+        Eigen::Matrix<cdouble, 1, Eigen::Dynamic> b = Eigen::Matrix<cdouble, 1, Eigen::Dynamic>::Zero (M);
+        for (size_t n = 0; n != size; ++n) {
+          b[n] = std::polar (1.0, Math::pi * double((n*n) % (2*size)) / double(size));
+          if (n)
+            b[M-n] = b[n];
+        }
+        FFT<double> (M).forward (b);
+        kernel.resize (M);
+        for (size_t m = 0; m != M; ++m)
+          kernel[m] = complex_type (b[m] / double(M));
+        return;
+      }
+
+      size_t L = 1;
+      for (const auto p : radices) {
+        vector<complex_type> stage_twiddles (L * (p-1));
+        for (size_t k = 0; k != L; ++k) {
+          for (size_t q = 1; q != p; ++q)
+            stage_twiddles[k*(p-1) + q-1] = complex_type (std::polar (1.0, -2.0 * Math::pi * double(q*k) / double(L*p)));
+        }
+        twiddles.push_back (std::move (stage_twiddles));
+        vector<complex_type> stage_roots (p);
+        for (size_t q = 0; q != p; ++q)
+          stage_roots[q] = complex_type (std::polar (1.0, -2.0 * Math::pi * double(q) / double(p)));
+        roots.push_back (std::move (stage_roots));
+        L *= p;
+      }
+#endif
+    }
+
+
+
+
+    template <typename ValueType>
+    void FFT<ValueType>::initialise ()
+    {
+#ifdef EIGEN_FFTW_DEFAULT
+      // FFTW planning is not thread-safe: the plans for this length are
+      //   created on construction, rather than within each processing thread
+      line_in.resize (size());
+      line_in.setZero();
+      fftw.fwd (line_out, line_in);
+      fftw.inv (line_in, line_out);
+#endif
+    }
+
+
+
+
+    template <typename ValueType>
+    template <class MatrixType>
+    void FFT<ValueType>::transform (MatrixType& data, const bool inverse)
+    {
+      const size_t N = size(), lines = data.rows();
+      assert (size_t(data.cols()) == N);
+      if (!lines)
+        return;
+
+#ifdef EIGEN_FFTW_DEFAULT
+      for (size_t l = 0; l != lines; ++l) {
+        for (size_t i = 0; i != N; ++i)
+          line_in[i] = complex_type (data (l, i));
+        if (inverse)
+          fftw.inv (line_out, line_in);
+        else
+          fftw.fwd (line_out, line_in);
+        for (size_t i = 0; i != N; ++i)
+          data (l, i) = line_out[i];
+      }
+#else
+      if (plan->inner) {
+        bluestein (data, inverse);
+        return;
+      }
+
+      real.resize (lines, N);
+      imag.resize (lines, N);
+      for (size_t i = 0; i != N; ++i) {
+        for (size_t l = 0; l != lines; ++l) {
+          const complex_type value (data (l, i));
+          real (l, i) = value.real();
+          imag (l, i) = value.imag();
+        }
+      }
+
+      execute (*plan, lines, inverse);
+
+      const value_type scale = inverse ? value_type(1) / value_type(N) : value_type(1);
+      for (size_t i = 0; i != N; ++i) {
+        for (size_t l = 0; l != lines; ++l)
+          data (l, i) = complex_type (scale * real (l, i), scale * imag (l, i));
+      }
+#endif
+    }
+
+
+
+
+    // With nk = (n^2 + k^2 - (k-n)^2) / 2, the DFT becomes the convolution of the
+    //   input multiplied by the chirp with the conjugate chirp, followed by
+    //   multiplication by the chirp; the convolution is evaluated using a
+    //   power-of-two transform, with zero-padding to avoid wrap-around. The
+    //   inverse transform uses the conjugates of both chirp and kernel.
+    template <typename ValueType>
+    template <class MatrixType>
+    void FFT<ValueType>::bluestein (MatrixType& data, const bool inverse)
+    {
+      const size_t N = size(), M = plan->inner->size, lines = data.rows();
+      auto chirp = [&] (const size_t n) { return inverse ? std::conj (plan->chirp[n]) : plan->chirp[n]; };
+
+      real.setZero (lines, M);
+      imag.setZero (lines, M);
+      for (size_t n = 0; n != N; ++n) {
+        const complex_type w = chirp (n);
+        for (size_t l = 0; l != lines; ++l) {
+          const complex_type value = complex_type (data (l, n)) * w;
+          real (l, n) = value.real();
+          imag (l, n) = value.imag();
+        }
+      }
+
+      execute (*plan->inner, lines, false);
+      for (size_t m = 0; m != M; ++m) {
+        const complex_type k = inverse ? std::conj (plan->kernel[m]) : plan->kernel[m];
+        const value_type kr = k.real(), ki = k.imag();
+        value_type* __restrict r = &real (0, m);
+        value_type* __restrict i = &imag (0, m);
+        for (size_t l = 0; l != lines; ++l) {
+          const value_type vr = r[l], vi = i[l];
+          r[l] = kr*vr - ki*vi;
+          i[l] = kr*vi + ki*vr;
+        }
+      }
+      execute (*plan->inner, lines, true);
+
+      const value_type scale = inverse ? value_type(1) / value_type(N) : value_type(1);
+      for (size_t k = 0; k != N; ++k) {
+        const complex_type w = scale * chirp (k);
+        for (size_t l = 0; l != lines; ++l)
+          data (l, k) = complex_type (real (l, k), imag (l, k)) * w;
+      }
+    }
+
+
+
+
+    // Unscaled transform of each row of real + i*imag, in-place
+    template <typename ValueType>
+    void FFT<ValueType>::execute (const Plan& p, const size_t lines, const bool inverse)
+    {
+      work_real.resize (lines, p.size);
+      work_imag.resize (lines, p.size);
+
+      // The inverse transform is computed as the forward transform of the data
+      //   with real & imaginary components exchanged
+      value_type* x_real = inverse ? imag.data() : real.data();
+      value_type* x_imag = inverse ? real.data() : imag.data();
+      value_type* y_real = inverse ? work_imag.data() : work_real.data();
+      value_type* y_imag = inverse ? work_real.data() : work_imag.data();
+      size_t L = 1;
+      for (size_t s = 0; s != p.radices.size(); ++s) {
+        stage (p, s, L, lines, x_real, x_imag, y_real, y_imag);
+        L *= p.radices[s];
+        std::swap (x_real, y_real);
+        std::swap (x_imag, y_imag);
+      }
+
+      if (p.radices.size() % 2) {
+        real.swap (work_real);
+        imag.swap (work_imag);
+      }
+    }
+
+
+
+
+    // Each stage combines p interleaved transforms of length L into transforms of
+    //   length L*p: with R = N/L, and element (s,k) of the transform of the
+    //   subsequence with offset s stored in block s + R*k, the inputs to each
+    //   butterfly are blocks (s + R/p*q) + R*k for q = 0..p-1, and its outputs
+    //   blocks s + R/p*(k + L*u) for u = 0..p-1
+    template <typename ValueType>
+    void FFT<ValueType>::stage (const Plan& plan, const size_t index, const size_t L, const size_t lines,
+                                const value_type* x_real, const value_type* x_imag,
+                                value_type* y_real, value_type* y_imag)
+    {
+      const size_t p = plan.radices[index];
+      const size_t stride = plan.size / (L*p);
+      const complex_type* twiddles = plan.twiddles[index].data();
+
+      if (p > 5) {
+        scratch_real.resize (lines, p);
+        scratch_imag.resize (lines, p);
+      }
+
+      for (size_t k = 0; k != L; ++k) {
+        const complex_type* w = twiddles + k*(p-1);
+        for (size_t s = 0; s != stride; ++s) {
+          const size_t in = s + stride*p*k, out = s + stride*k;
+          // offsets of input block q and output block u
+          auto x = [&] (const size_t q) { return (in + stride*q) * lines; };
+          auto y = [&] (const size_t u) { return (out + stride*L*u) * lines; };
+
+          switch (p) {
+            case 2:
+              radix2 (lines, w,
+                      x_real + x(0), x_imag + x(0), x_real + x(1), x_imag + x(1),
+                      y_real + y(0), y_imag + y(0), y_real + y(1), y_imag + y(1));
+              break;
+            case 3:
+              radix3 (lines, w,
+                      x_real + x(0), x_imag + x(0), x_real + x(1), x_imag + x(1), x_real + x(2), x_imag + x(2),
+                      y_real + y(0), y_imag + y(0), y_real + y(1), y_imag + y(1), y_real + y(2), y_imag + y(2));
+              break;
+            case 4:
+              radix4 (lines, w,
+                      x_real + x(0), x_imag + x(0), x_real + x(1), x_imag + x(1),
+                      x_real + x(2), x_imag + x(2), x_real + x(3), x_imag + x(3),
+                      y_real + y(0), y_imag + y(0), y_real + y(1), y_imag + y(1),
+                      y_real + y(2), y_imag + y(2), y_real + y(3), y_imag + y(3));
+              break;
+            case 5:
+              radix5 (lines, w,
+                      x_real + x(0), x_imag + x(0), x_real + x(1), x_imag + x(1), x_real + x(2), x_imag + x(2),
+                      x_real + x(3), x_imag + x(3), x_real + x(4), x_imag + x(4),
+                      y_real + y(0), y_imag + y(0), y_real + y(1), y_imag + y(1), y_real + y(2), y_imag + y(2),
+                      y_real + y(3), y_imag + y(3), y_real + y(4), y_imag + y(4));
+              break;
+            default:
+            {
+              // generic radix: direct evaluation of the length-p DFT
+              const complex_type* roots = plan.roots[index].data();
+              for (size_t q = 0; q != p; ++q) {
+                const value_type* xr = x_real + x(q);
+                const value_type* xi = x_imag + x(q);
+                value_type* tr = &scratch_real (0, q);
+                value_type* ti = &scratch_imag (0, q);
+                const value_type wr = q ? w[q-1].real() : value_type(1), wi = q ? w[q-1].imag() : value_type(0);
+                for (size_t l = 0; l != lines; ++l) {
+                  tr[l] = wr*xr[l] - wi*xi[l];
+                  ti[l] = wr*xi[l] + wi*xr[l];
+                }
+              }
+              for (size_t u = 0; u != p; ++u) {
+                value_type* yr = y_real + y(u);
+                value_type* yi = y_imag + y(u);
+                for (size_t l = 0; l != lines; ++l) {
+                  yr[l] = scratch_real (l, 0);
+                  yi[l] = scratch_imag (l, 0);
+                }
+                for (size_t q = 1; q != p; ++q) {
+                  const complex_type root = roots[(q*u) % p];
+                  const value_type rr = root.real(), ri = root.imag();
+                  const value_type* tr = &scratch_real (0, q);
+                  const value_type* ti = &scratch_imag (0, q);
+                  for (size_t l = 0; l != lines; ++l) {
+                    yr[l] += rr*tr[l] - ri*ti[l];
+                    yi[l] += rr*ti[l] + ri*tr[l];
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+
+
+
+    // Butterflies of radix 2, 3, 4 & 5, applied to all lines at once; input and
+    //   output blocks never overlap, which permits vectorisation of these loops
+    template <typename ValueType>
+    void FFT<ValueType>::radix2 (const size_t lines, const complex_type* w,
+                                 const value_type* __restrict a0r, const value_type* __restrict a0i,
+                                 const value_type* __restrict a1r, const value_type* __restrict a1i,
+                                 value_type* __restrict b0r, value_type* __restrict b0i,
+                                 value_type* __restrict b1r, value_type* __restrict b1i)
+    {
+      const value_type w1r = w[0].real(), w1i = w[0].imag();
+      for (size_t l = 0; l != lines; ++l) {
+        const value_type tr = w1r*a1r[l] - w1i*a1i[l];
+        const value_type ti = w1r*a1i[l] + w1i*a1r[l];
+        b0r[l] = a0r[l] + tr; b0i[l] = a0i[l] + ti;
+        b1r[l] = a0r[l] - tr; b1i[l] = a0i[l] - ti;
+      }
+    }
+
+
+    template <typename ValueType>
+    void FFT<ValueType>::radix3 (const size_t lines, const complex_type* w,
+                                 const value_type* __restrict a0r, const value_type* __restrict a0i,
+                                 const value_type* __restrict a1r, const value_type* __restrict a1i,
+                                 const value_type* __restrict a2r, const value_type* __restrict a2i,
+                                 value_type* __restrict b0r, value_type* __restrict b0i,
+                                 value_type* __restrict b1r, value_type* __restrict b1i,
+                                 value_type* __restrict b2r, value_type* __restrict b2i)
+    {
+      const value_type w1r = w[0].real(), w1i = w[0].imag(), w2r = w[1].real(), w2i = w[1].imag();
+      const value_type c = value_type (0.5 * std::sqrt (3.0));
+      for (size_t l = 0; l != lines; ++l) {
+        const value_type t1r = w1r*a1r[l] - w1i*a1i[l], t1i = w1r*a1i[l] + w1i*a1r[l];
+        const value_type t2r = w2r*a2r[l] - w2i*a2i[l], t2i = w2r*a2i[l] + w2i*a2r[l];
+        const value_type sr = t1r + t2r, si = t1i + t2i;
+        const value_type dr = c * (t1r - t2r), di = c * (t1i - t2i);
+        const value_type mr = a0r[l] - value_type(0.5)*sr, mi = a0i[l] - value_type(0.5)*si;
+        b0r[l] = a0r[l] + sr; b0i[l] = a0i[l] + si;
+        b1r[l] = mr + di;     b1i[l] = mi - dr;
+        b2r[l] = mr - di;     b2i[l] = mi + dr;
+      }
+    }
+
+
+    template <typename ValueType>
+    void FFT<ValueType>::radix4 (const size_t lines, const complex_type* w,
+                                 const value_type* __restrict a0r, const value_type* __restrict a0i,
+                                 const value_type* __restrict a1r, const value_type* __restrict a1i,
+                                 const value_type* __restrict a2r, const value_type* __restrict a2i,
+                                 const value_type* __restrict a3r, const value_type* __restrict a3i,
+                                 value_type* __restrict b0r, value_type* __restrict b0i,
+                                 value_type* __restrict b1r, value_type* __restrict b1i,
+                                 value_type* __restrict b2r, value_type* __restrict b2i,
+                                 value_type* __restrict b3r, value_type* __restrict b3i)
+    {
+      const value_type w1r = w[0].real(), w1i = w[0].imag(), w2r = w[1].real(), w2i = w[1].imag(), w3r = w[2].real(), w3i = w[2].imag();
+      for (size_t l = 0; l != lines; ++l) {
+        const value_type t1r = w1r*a1r[l] - w1i*a1i[l], t1i = w1r*a1i[l] + w1i*a1r[l];
+        const value_type t2r = w2r*a2r[l] - w2i*a2i[l], t2i = w2r*a2i[l] + w2i*a2r[l];
+        const value_type t3r = w3r*a3r[l] - w3i*a3i[l], t3i = w3r*a3i[l] + w3i*a3r[l];
+        const value_type s02r = a0r[l] + t2r, s02i = a0i[l] + t2i;
+        const value_type d02r = a0r[l] - t2r, d02i = a0i[l] - t2i;
+        const value_type s13r = t1r + t3r, s13i = t1i + t3i;
+        const value_type d13r = t1r - t3r, d13i = t1i - t3i;
+        b0r[l] = s02r + s13r; b0i[l] = s02i + s13i;
+        b1r[l] = d02r + d13i; b1i[l] = d02i - d13r;
+        b2r[l] = s02r - s13r; b2i[l] = s02i - s13i;
+        b3r[l] = d02r - d13i; b3i[l] = d02i + d13r;
+      }
+    }
+
+
+
+    template <typename ValueType>
+    void FFT<ValueType>::radix5 (const size_t lines, const complex_type* w,
+                                 const value_type* __restrict a0r, const value_type* __restrict a0i,
+                                 const value_type* __restrict a1r, const value_type* __restrict a1i,
+                                 const value_type* __restrict a2r, const value_type* __restrict a2i,
+                                 const value_type* __restrict a3r, const value_type* __restrict a3i,
+                                 const value_type* __restrict a4r, const value_type* __restrict a4i,
+                                 value_type* __restrict b0r, value_type* __restrict b0i,
+                                 value_type* __restrict b1r, value_type* __restrict b1i,
+                                 value_type* __restrict b2r, value_type* __restrict b2i,
+                                 value_type* __restrict b3r, value_type* __restrict b3i,
+                                 value_type* __restrict b4r, value_type* __restrict b4i)
+    {
+      const value_type w1r = w[0].real(), w1i = w[0].imag(), w2r = w[1].real(), w2i = w[1].imag();
+      const value_type w3r = w[2].real(), w3i = w[2].imag(), w4r = w[3].real(), w4i = w[3].imag();
+      const value_type c1 = value_type (std::cos (0.4 * Math::pi)), c2 = value_type (std::cos (0.8 * Math::pi));
+      const value_type s1 = value_type (std::sin (0.4 * Math::pi)), s2 = value_type (std::sin (0.8 * Math::pi));
+      for (size_t l = 0; l != lines; ++l) {
+        const value_type t1r = w1r*a1r[l] - w1i*a1i[l], t1i = w1r*a1i[l] + w1i*a1r[l];
+        const value_type t2r = w2r*a2r[l] - w2i*a2i[l], t2i = w2r*a2i[l] + w2i*a2r[l];
+        const value_type t3r = w3r*a3r[l] - w3i*a3i[l], t3i = w3r*a3i[l] + w3i*a3r[l];
+        const value_type t4r = w4r*a4r[l] - w4i*a4i[l], t4i = w4r*a4i[l] + w4i*a4r[l];
+        const value_type s14r = t1r + t4r, s14i = t1i + t4i, d14r = t1r - t4r, d14i = t1i - t4i;
+        const value_type s23r = t2r + t3r, s23i = t2i + t3i, d23r = t2r - t3r, d23i = t2i - t3i;
+        const value_type m1r = a0r[l] + c1*s14r + c2*s23r, m1i = a0i[l] + c1*s14i + c2*s23i;
+        const value_type m2r = a0r[l] + c2*s14r + c1*s23r, m2i = a0i[l] + c2*s14i + c1*s23i;
+        const value_type n1r = s1*d14r + s2*d23r, n1i = s1*d14i + s2*d23i;
+        const value_type n2r = s2*d14r - s1*d23r, n2i = s2*d14i - s1*d23i;
+        b0r[l] = a0r[l] + s14r + s23r; b0i[l] = a0i[l] + s14i + s23i;
+        b1r[l] = m1r + n1i; b1i[l] = m1i - n1r;
+        b2r[l] = m2r + n2i; b2i[l] = m2i - n2r;
+        b3r[l] = m2r - n2i; b3i[l] = m2i + n2r;
+        b4r[l] = m1r - n1i; b4i[l] = m1i + n1r;
+      }
+    }
+
+
+
+
+  }
+}
+
+#endif
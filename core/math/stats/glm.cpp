@@ -15,8 +15,6 @@
 
 #include "math/stats/glm.h"
 
-#define GLM_BATCH_SIZE 1024
-
 namespace MR
 {
   namespace Math
@@ -99,37 +97,126 @@ namespace MR
 
 
       GLMTTest::GLMTTest (const matrix_type& measurements, const matrix_type& design, const matrix_type& contrast) :
-          y (measurements),
+          y (&measurements),
+          y_float (nullptr),
+          X (design),
+          scaled_contrasts (GLM::scale_contrasts (contrast, X, X.rows()-rank(X)).transpose())
+      {
+        initialise();
+      }
+
+
+
+      GLMTTest::GLMTTest (const float_matrix_type& measurements, const matrix_type& design, const matrix_type& contrast) :
+          y (nullptr),
+          y_float (&measurements),
           X (design),
           scaled_contrasts (GLM::scale_contrasts (contrast, X, X.rows()-rank(X)).transpose())
+      {
+        initialise();
+      }
+
+
+
+      void GLMTTest::initialise ()
       {
         pinvX = Math::pinv (X);
+        contrast_weights = (pinvX.transpose() * scaled_contrasts.col(0)).array();
+        contrast_weights_sum = contrast_weights.sum();
+        Eigen::JacobiSVD<matrix_type> svd (X, Eigen::ComputeThinU);
+        basis = svd.matrixU().leftCols (rank (X));
+        const matrix_type ones (matrix_type::Ones (X.rows(), 1));
+        demean = ((ones - basis * (basis.transpose() * ones)).norm() < 1e-6 * std::sqrt (value_type(X.rows())));
       }
 
 
 
       void GLMTTest::operator() (const vector<size_t>& perm_labelling, vector_type& stats) const
       {
-        stats = vector_type::Zero (y.rows());
-        matrix_type tvalues, betas, residuals, SX, pinvSX;
-
-        SX.resize (X.rows(), X.cols());
-        pinvSX.resize (pinvX.rows(), pinvX.cols());
-        for (ssize_t i = 0; i < X.rows(); ++i) {
-          SX.row(i) = X.row (perm_labelling[i]);
-          pinvSX.col(i) = pinvX.col (perm_labelling[i]);
+        matrix_type result;
+        compute (vector<vector<size_t>> (1, perm_labelling), result);
+        stats = result.col(0).array();
+      }
+
+
+
+      void GLMTTest::operator() (const vector<vector<size_t>>& perm_labellings, matrix_type& stats) const
+      {
+        // The default labelling is always computed in isolation, such that its
+        //   statistics are identical to those obtained via the single-permutation
+        //   interface (which is typically used for the unpermuted statistics)
+        vector<vector<size_t>> permuted;
+        vector<size_t> permuted_index, default_index;
+        for (size_t p = 0; p != perm_labellings.size(); ++p) {
+          bool is_default = true;
+          for (size_t i = 0; i != perm_labellings[p].size() && is_default; ++i)
+            is_default = (perm_labellings[p][i] == i);
+          if (is_default) {
+            default_index.push_back (p);
+          } else {
+            permuted.push_back (perm_labellings[p]);
+            permuted_index.push_back (p);
+          }
         }
 
-        pinvSX.transposeInPlace();
-        SX.transposeInPlace();
-        for (ssize_t i = 0; i < y.rows(); i += GLM_BATCH_SIZE) {
-          const matrix_type tmp = y.block (i, 0, std::min (GLM_BATCH_SIZE, (int)(y.rows()-i)), y.cols());
-          GLM::ttest (tvalues, SX, pinvSX, tmp, scaled_contrasts, betas, residuals);
-          for (ssize_t n = 0; n < tvalues.rows(); ++n) {
-            value_type val = tvalues(n,0);
-            if (!std::isfinite (val))
-              val = value_type(0);
-            stats[i+n] = val;
+        stats.resize (num_elements(), perm_labellings.size());
+        matrix_type result;
+        if (permuted.size()) {
+          compute (permuted, result);
+          for (size_t p = 0; p != permuted_index.size(); ++p)
+            stats.col (permuted_index[p]) = result.col (p);
+        }
+        if (default_index.size()) {
+          compute (vector<vector<size_t>> (1, perm_labellings[default_index[0]]), result);
+          for (auto p : default_index)
+            stats.col (p) = result.col (0);
+        }
+      }
+
+
+
+      void GLMTTest::compute (const vector<vector<size_t>>& perm_labellings, matrix_type& stats) const
+      {
+        // Permuting the rows of the design matrix permutes the rows of both the contrast
+        //   weights and the basis of its column space; the t-statistic for each element
+        //   is then obtained from the product of its measurements with these
+        const ssize_t num_perms = perm_labellings.size();
+        const ssize_t basis_size = basis.cols();
+        const ssize_t stride = basis_size + 1;
+        matrix_type model (X.rows(), num_perms * stride);
+        for (ssize_t p = 0; p != num_perms; ++p) {
+          assert (perm_labellings[p].size() == size_t(X.rows()));
+          for (ssize_t i = 0; i != X.rows(); ++i) {
+            model (i, p*stride) = contrast_weights[perm_labellings[p][i]];
+            model.block (i, p*stride+1, 1, basis_size) = basis.row (perm_labellings[p][i]);
+          }
+        }
+
+        const ssize_t num_elements = this->num_elements();
+        stats.resize (num_elements, num_perms);
+        matrix_type block, product;
+        vector_type means, sqnorms;
+        for (ssize_t i = 0; i < num_elements; i += GLM_BATCH_SIZE) {
+          const ssize_t rows = std::min (ssize_t(GLM_BATCH_SIZE), num_elements-i);
+          if (y)
+            block = y->middleRows (i, rows);
+          else
+            block = y_float->middleRows (i, rows).cast<value_type>();
+          if (demean) {
+            means = block.rowwise().mean().array();
+            block.colwise() -= means.matrix();
+          }
+          sqnorms = block.rowwise().squaredNorm().array();
+          product.noalias() = block * model;
+          for (ssize_t p = 0; p != num_perms; ++p) {
+            for (ssize_t n = 0; n != rows; ++n) {
+              const value_type effect = product (n, p*stride) + (demean ? means[n] * contrast_weights_sum : value_type(0));
+              const value_type rss = sqnorms[n] - product.block (n, p*stride+1, 1, basis_size).squaredNorm();
+              value_type val = effect / std::sqrt (std::max (rss, value_type(0)));
+              if (!std::isfinite (val))
+                val = value_type(0);
+              stats (i+n, p) = val;
+            }
           }
         }
       }
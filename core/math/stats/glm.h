@@ -19,6 +19,9 @@
 #include "math/least_squares.h"
 #include "math/stats/typedefs.h"
 
+// Number of elements processed at once when computing statistics in blocks
+#define GLM_BATCH_SIZE 1024
+
 namespace MR
 {
   namespace Math
@@ -92,6 +95,41 @@ namespace MR
           * @return the matrix containing the output standardised effect size
           */
           matrix_type std_effect_size (const matrix_type& measurements, const matrix_type& design, const matrix_type& contrast);
+
+
+
+          /*! Compute the beta coefficients, effect size, standardised effect size and standard deviation
+          * @param measurements a matrix storing the measured data for each subject in a column (of type matrix_type or float_matrix_type)
+          * @param design the design matrix
+          * @param contrast a matrix defining the group difference (only the first row is used)
+          * @param betas the output beta coefficients (one column per element)
+          * @param abs_effect the output effect size
+          * @param std_effect the output standardised effect size
+          * @param std_dev the output standard deviation
+          *
+          * The results are as for solve_betas(), abs_effect_size(), std_effect_size() and stdev(),
+          * but the measurements are processed in blocks of elements; hence they are never
+          * duplicated in their entirety, and may be stored in single precision.
+          */
+          template <class MeasurementsType>
+          void all_stats (const MeasurementsType& measurements, const matrix_type& design, const matrix_type& contrast,
+                          matrix_type& betas, vector_type& abs_effect, vector_type& std_effect, vector_type& std_dev)
+          {
+            const ssize_t num_elements = measurements.rows();
+            betas.resize (design.cols(), num_elements);
+            abs_effect.resize (num_elements);
+            std_effect.resize (num_elements);
+            std_dev.resize (num_elements);
+            matrix_type block;
+            for (ssize_t i = 0; i < num_elements; i += GLM_BATCH_SIZE) {
+              const ssize_t rows = std::min (ssize_t(GLM_BATCH_SIZE), num_elements - i);
+              block = measurements.middleRows (i, rows).template cast<value_type>();
+              betas.middleCols (i, rows) = solve_betas (block, design);
+              abs_effect.segment (i, rows) = (contrast.row(0) * betas.middleCols (i, rows)).transpose().array();
+              std_dev.segment (i, rows) = stdev (block, design).row(0).transpose().array();
+            }
+            std_effect = abs_effect / std_dev;
+          }
           //! @}
 
       } // End GLM namespace
@@ -110,6 +148,10 @@ namespace MR
           */
           GLMTTest (const matrix_type& measurements, const matrix_type& design, const matrix_type& contrast);
 
+          //! as above, but with measurements stored in single precision
+          /*! All computations are nevertheless performed in double precision. */
+          GLMTTest (const float_matrix_type& measurements, const matrix_type& design, const matrix_type& contrast);
+
           /*! Compute the t-statistics
           * @param perm_labelling a vector to shuffle the rows in the design matrix (for permutation testing)
           * @param stats the vector containing the output t-statistics
@@ -118,12 +160,38 @@ namespace MR
           */
           void operator() (const vector<size_t>& perm_labelling, vector_type& stats) const;
 
-          size_t num_subjects () const { return y.cols(); }
-          size_t num_elements () const { return y.rows(); }
+          /*! Compute the t-statistics for a batch of permutations
+          * @param perm_labellings the labellings for all permutations in the batch
+          * @param stats the output t-statistics, one column per permutation
+          *
+          * For each block of elements, the measurements are multiplied by the
+          * (permuted) model for all permutations in the batch within a single
+          * matrix-matrix product, such that the measurement data are traversed
+          * only once per batch rather than once per permutation.
+          */
+          void operator() (const vector<vector<size_t>>& perm_labellings, matrix_type& stats) const;
+
+          size_t num_subjects () const { return y ? y->cols() : y_float->cols(); }
+          size_t num_elements () const { return y ? y->rows() : y_float->rows(); }
 
         protected:
-          const matrix_type& y;
+          // Only one of these is set, depending on the precision of the stored measurements
+          const matrix_type* y;
+          const float_matrix_type* y_float;
           matrix_type X, pinvX, scaled_contrasts;
+
+          // For the unpermuted design: the weights that yield the contrast of beta
+          //   coefficients directly from the measurements, and an orthonormal basis
+          //   for the column space (from which the residual sum of squares is obtained)
+          vector_type contrast_weights;
+          matrix_type basis;
+          // If the design spans the constant vector, the measurements for each element
+          //   are de-meaned prior to computing the residual sum of squares, for precision
+          bool demean;
+          value_type contrast_weights_sum;
+
+          void initialise ();
+          void compute (const vector<vector<size_t>>& perm_labellings, matrix_type& stats) const;
       };
       //! @}
 
@@ -14,7 +14,12 @@
 
 
 #include "math/stats/permutation.h"
+
+#include <map>
+#include <random>
+
 #include "math/math.h"
+#include "math/rng.h"
 
 namespace MR
 {
@@ -56,20 +61,99 @@ namespace MR
                        const bool include_default)
         {
           permutations.clear();
-          vector<size_t> default_labelling (num_subjects);
-          for (size_t i = 0; i < num_subjects; ++i)
-            default_labelling[i] = i;
-          size_t p = 0;
-          if (include_default) {
-            permutations.push_back (default_labelling);
-            ++p;
+          Generator generator (num_perms, num_subjects, Math::RNG::get_seed(), vector<size_t>(), include_default);
+          vector<size_t> permutation;
+          while (generator (permutation))
+            permutations.push_back (permutation);
+        }
+
+
+
+        namespace {
+          // Finaliser of the SplitMix64 generator, used to combine seeds and to hash permutations
+          inline uint64_t mix (uint64_t x)
+          {
+            x += 0x9E3779B97F4A7C15ULL;
+            x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+            return x ^ (x >> 31);
+          }
+        }
+
+
+
+        Generator::Generator (const size_t num_perms,
+                              const size_t num_subjects,
+                              const size_t seed,
+                              const vector<size_t>& blocks,
+                              const bool include_default) :
+            num_perms (num_perms),
+            num_subjects (num_subjects),
+            seed (seed),
+            include_default (include_default),
+            counter (0)
+        {
+          if (blocks.size()) {
+            if (blocks.size() != num_subjects)
+              throw Exception ("number of entries in exchangeability blocks (" + str(blocks.size()) + ") does not match number of subjects (" + str(num_subjects) + ")");
+            std::map<size_t, vector<size_t>> members;
+            for (size_t i = 0; i != num_subjects; ++i)
+              members[blocks[i]].push_back (i);
+            for (const auto& b : members)
+              block_members.push_back (b.second);
+          } else {
+            block_members.push_back (vector<size_t>());
+            for (size_t i = 0; i != num_subjects; ++i)
+              block_members.back().push_back (i);
           }
-          for (;p < num_perms; ++p) {
-            vector<size_t> permuted_labelling (default_labelling);
-            do {
-              std::random_shuffle (permuted_labelling.begin(), permuted_labelling.end());
-            } while (is_duplicate (permuted_labelling, permutations));
-            permutations.push_back (permuted_labelling);
+
+          // Make sure that the requested number of unique permutations exists
+          default_type log_max_perms = 0.0;
+          for (const auto& b : block_members)
+            log_max_perms += std::lgamma (default_type (b.size() + 1));
+          if (log_max_perms < std::log (default_type (num_perms)) - 1e-6)
+            throw Exception ("number of permutations requested (" + str(num_perms) + ") exceeds the number of unique permutations possible (" + str(std::round (std::exp (log_max_perms))) + ")");
+
+          hashes.reserve (num_perms);
+        }
+
+
+
+        bool Generator::operator() (vector<size_t>& permutation)
+        {
+          if (counter == num_perms)
+            return false;
+          size_t attempt = 0;
+          uint64_t hash;
+          do {
+            if (include_default && !counter) {
+              permutation.resize (num_subjects);
+              for (size_t i = 0; i != num_subjects; ++i)
+                permutation[i] = i;
+            } else {
+              shuffle (counter, attempt++, permutation);
+            }
+            hash = mix (num_subjects);
+            for (auto i : permutation)
+              hash = mix (hash ^ i);
+          } while (!hashes.insert (hash).second);
+          ++counter;
+          return true;
+        }
+
+
+
+        void Generator::shuffle (const size_t index, const size_t attempt, vector<size_t>& permutation) const
+        {
+          std::mt19937_64 rng (mix (mix (mix (seed) ^ index) ^ attempt));
+          permutation.resize (num_subjects);
+          for (const auto& b : block_members) {
+            // Fisher-Yates shuffle of the members of this block
+            vector<size_t> shuffled (b);
+            for (size_t i = shuffled.size(); i > 1; --i)
+              std::swap (shuffled[i-1], shuffled[std::uniform_int_distribution<size_t> (0, i-1) (rng)]);
+            for (size_t i = 0; i != b.size(); ++i)
+              permutation[b[i]] = shuffled[i];
           }
         }
 
@@ -123,6 +207,21 @@ namespace MR
 
 
 
+        vector<size_t> load_blocks_file (const std::string& filename) {
+          const auto data = load_vector<default_type> (filename);
+          if (!data.size())
+            throw Exception ("no data found in exchangeability blocks file: " + str(filename));
+          vector<size_t> blocks;
+          for (ssize_t i = 0; i != data.size(); ++i) {
+            if (data[i] < 0.0 || data[i] != std::round (data[i]))
+              throw Exception ("exchangeability blocks file \"" + filename + "\" must contain non-negative integers only");
+            blocks.push_back (size_t (data[i]));
+          }
+          return blocks;
+        }
+
+
+
       }
     }
   }
@@ -16,6 +16,8 @@
 #ifndef __math_stats_permutation_h__
 #define __math_stats_permutation_h__
 
+#include <unordered_set>
+
 #include "types.h"
 #include "math/stats/typedefs.h"
 
@@ -46,11 +48,53 @@ namespace MR
                        vector<vector<size_t> >& permutations,
                        const bool include_default);
 
+
+
+        /*! Generates unique permutations on demand, rather than storing them all in advance
+         *
+         * Each candidate permutation is a shuffle of the subject labels, using a random number
+         * generator seeded from the seed of the generator, the index of the permutation, and the
+         * number of previously rejected candidates for that index. The sequence of permutations is
+         * therefore fully determined by the seed, and can be regenerated independently elsewhere.
+         * Only a 64-bit hash of each permutation is retained, in order to reject duplicates.
+         *
+         * If exchangeability blocks are provided (one integer per subject), subjects are only
+         * ever exchanged with other subjects in the same block. */
+        class Generator
+        { NOMEMALIGN
+          public:
+            Generator (const size_t num_perms,
+                       const size_t num_subjects,
+                       const size_t seed,
+                       const vector<size_t>& blocks,
+                       const bool include_default);
+
+            //! get the next permutation; returns false once all permutations have been generated
+            bool operator() (vector<size_t>& permutation);
+
+            size_t size() const { return num_perms; }
+            size_t get_seed() const { return seed; }
+
+          private:
+            const size_t num_perms, num_subjects, seed;
+            const bool include_default;
+            vector<vector<size_t>> block_members;
+            std::unordered_set<uint64_t> hashes;
+            size_t counter;
+
+            void shuffle (const size_t index, const size_t attempt, vector<size_t>& permutation) const;
+        };
+
+
+
         void statistic2pvalue (const vector_type& perm_dist, const vector_type& stats, vector_type& pvalues);
 
 
         vector<vector<size_t> > load_permutations_file (const std::string& filename);
 
+        //! load exchangeability blocks: one non-negative integer per subject
+        vector<size_t> load_blocks_file (const std::string& filename);
+
 
 
 
@@ -32,6 +32,8 @@ namespace MR
       using value_type = MR::default_type;
       using matrix_type = Eigen::Matrix<value_type, Eigen::Dynamic, Eigen::Dynamic>;
       using vector_type = Eigen::Array<value_type, Eigen::Dynamic, 1>;
+      //! for storing measurements in single precision; computations are nevertheless performed using value_type
+      using float_matrix_type = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>;
 
 
 
@@ -28,8 +28,8 @@ def needsSingleShell(): #pylint: disable=unused-variable
 
 
 def execute(): #pylint: disable=unused-variable
-  import os, shutil
-  from mrtrix3 import app, file, image, path, run #pylint: disable=redefined-builtin
+  import shutil
+  from mrtrix3 import app, path, run
 
   lmax_option = ''
   if app.args.lmax:
@@ -38,71 +38,13 @@ def execute(): #pylint: disable=unused-variable
   if app.args.max_iters < 2:
     app.error('Number of iterations must be at least 2')
 
-  for iteration in range(0, app.args.max_iters):
-    prefix = 'iter' + str(iteration) + '_'
-
-    if iteration == 0:
-      RF_in_path = 'init_RF.txt'
-      mask_in_path = 'mask.mif'
-      init_RF = '1 -1 1'
-      with open(RF_in_path, 'w') as f:
-        f.write(init_RF)
-      iter_lmax_option = ' -lmax 4'
-    else:
-      RF_in_path = 'iter' + str(iteration-1) + '_RF.txt'
-      mask_in_path = 'iter' + str(iteration-1) + '_SF_dilated.mif'
-      iter_lmax_option = lmax_option
-
-    # Run CSD
-    run.command('dwi2fod csd dwi.mif ' + RF_in_path + ' ' + prefix + 'FOD.mif -mask ' + mask_in_path + iter_lmax_option)
-    # Get amplitudes of two largest peaks, and direction of largest
-    run.command('fod2fixel ' + prefix + 'FOD.mif ' + prefix + 'fixel -peak peaks.mif -mask ' + mask_in_path + ' -fmls_no_thresholds')
-    file.delTemporary(prefix + 'FOD.mif')
-    if iteration:
-      file.delTemporary(mask_in_path)
-    run.command('fixel2voxel ' + prefix + 'fixel/peaks.mif split_data ' + prefix + 'amps.mif -number 2')
-    run.command('mrconvert ' + prefix + 'amps.mif ' + prefix + 'first_peaks.mif -coord 3 0 -axes 0,1,2')
-    run.command('mrconvert ' + prefix + 'amps.mif ' + prefix + 'second_peaks.mif -coord 3 1 -axes 0,1,2')
-    file.delTemporary(prefix + 'amps.mif')
-    run.command('fixel2voxel ' + prefix + 'fixel/directions.mif split_dir ' + prefix + 'all_dirs.mif -number 1')
-    file.delTemporary(prefix + 'fixel')
-    run.command('mrconvert ' + prefix + 'all_dirs.mif ' + prefix + 'first_dir.mif -coord 3 0:2')
-    file.delTemporary(prefix + 'all_dirs.mif')
-    # Calculate the 'cost function' Donald derived for selecting single-fibre voxels
-    # https://github.com/MRtrix3/mrtrix3/pull/426
-    #  sqrt(|peak1|) * (1 - |peak2| / |peak1|)^2
-    run.command('mrcalc ' + prefix + 'first_peaks.mif -sqrt 1 ' + prefix + 'second_peaks.mif ' + prefix + 'first_peaks.mif -div -sub 2 -pow -mult '+ prefix + 'CF.mif')
-    file.delTemporary(prefix + 'first_peaks.mif')
-    file.delTemporary(prefix + 'second_peaks.mif')
-    # Select the top-ranked voxels
-    run.command('mrthreshold ' + prefix + 'CF.mif -top ' + str(app.args.sf_voxels) + ' ' + prefix + 'SF.mif')
-    # Generate a new response function based on this selection
-    run.command('amp2response dwi.mif ' + prefix + 'SF.mif ' + prefix + 'first_dir.mif ' + prefix + 'RF.txt' + iter_lmax_option)
-    file.delTemporary(prefix + 'first_dir.mif')
-    # Should we terminate?
-    if iteration > 0:
-      run.command('mrcalc ' + prefix + 'SF.mif iter' + str(iteration-1) + '_SF.mif -sub ' + prefix + 'SF_diff.mif')
-      file.delTemporary('iter' + str(iteration-1) + '_SF.mif')
-      max_diff = image.statistic(prefix + 'SF_diff.mif', 'max')
-      file.delTemporary(prefix + 'SF_diff.mif')
-      if int(max_diff) == 0:
-        app.console('Convergence of SF voxel selection detected at iteration ' + str(iteration))
-        file.delTemporary(prefix + 'CF.mif')
-        run.function(shutil.copyfile, prefix + 'RF.txt', 'response.txt')
-        run.function(shutil.move, prefix + 'SF.mif', 'voxels.mif')
-        break
-
-    # Select a greater number of top single-fibre voxels, and dilate (within bounds of initial mask);
-    #   these are the voxels that will be re-tested in the next iteration
-    run.command('mrthreshold ' + prefix + 'CF.mif -top ' + str(app.args.iter_voxels) + ' - | maskfilter - dilate - -npass ' + str(app.args.dilate) + ' | mrcalc mask.mif - -mult ' + prefix + 'SF_dilated.mif')
-    file.delTemporary(prefix + 'CF.mif')
-
-  # Commence the next iteration
-
-  # If terminating due to running out of iterations, still need to put the results in the appropriate location
-  if not os.path.exists('response.txt'):
-    app.console('Exiting after maximum ' + str(app.args.max_iters) + ' iterations')
-    run.function(shutil.copyfile, 'iter' + str(app.args.max_iters-1) + '_RF.txt', 'response.txt')
-    run.function(shutil.move, 'iter' + str(app.args.max_iters-1) + '_SF.mif', 'voxels.mif')
+  # The iterative CSD / FMLS / voxel selection loop is performed in memory by dwi2sfresponse,
+  #   which only processes those voxels remaining as candidates in each iteration
+  run.command('dwi2sfresponse dwi.mif response.txt -mask mask.mif'
+              + ' -sf_voxels ' + str(app.args.sf_voxels)
+              + ' -iter_voxels ' + str(app.args.iter_voxels)
+              + ' -dilate ' + str(app.args.dilate)
+              + ' -max_iters ' + str(app.args.max_iters)
+              + ' -voxels voxels.mif' + lmax_option)
 
   run.function(shutil.copyfile, 'response.txt', path.fromUser(app.args.output, False))
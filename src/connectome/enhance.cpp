@@ -54,7 +54,7 @@ namespace MR {
               to_expand.pop_back();
               cluster_size++;
 
-              for (vector<size_t>::const_iterator i = (*adjacency)[index].begin(); i != (*adjacency)[index].end(); ++i) {
+              for (vector<uint32_t>::const_iterator i = (*adjacency)[index].begin(); i != (*adjacency)[index].end(); ++i) {
                 if (!visited[*i] && std::isfinite(in[*i]) && in[*i] >= T) {
                   visited[*i] = true;
                   to_expand.push_back (*i);
@@ -80,12 +80,14 @@ namespace MR {
         const Mat2Vec mat2vec (num_nodes);
         const size_t num_edges = mat2vec.vec_size();
         ProgressBar progress ("Pre-computing statistical correlation matrix...", num_edges);
-        adjacency.reset (new vector< vector<size_t> > (num_edges, vector<size_t>()));
+        if (num_edges > size_t(std::numeric_limits<uint32_t>::max()))
+          throw Exception ("Too many edges in connectome for network-based statistics");
+        adjacency.reset (new Stats::TFCE::adjacency_type (num_edges, vector<uint32_t>()));
         for (node_t row = 0; row != num_nodes; ++row) {
           for (node_t column = row; column != num_nodes; ++column) {
 
             const size_t index = mat2vec (row, column);
-            vector<size_t>& vector = (*adjacency)[index];
+            vector<uint32_t>& vector = (*adjacency)[index];
             vector.reserve (2 * (num_nodes-1));
             // Should be able to expand from this edge to any other edge connected to either row or column
             for (node_t r = 0; r != num_nodes; ++r) {
@@ -71,8 +71,12 @@ namespace MR {
 
           value_type operator() (const vector_type&, const value_type, vector_type&) const override;
 
+          const Stats::TFCE::adjacency_type* get_adjacency() const override { return adjacency.get(); }
+
+          bool is_suprathreshold (const value_type stat, const value_type T) const override { return std::isfinite (stat) && stat >= T; }
+
         protected:
-          std::shared_ptr< vector< vector<size_t> > > adjacency;
+          std::shared_ptr<Stats::TFCE::adjacency_type> adjacency;
           value_type threshold;
 
         private:
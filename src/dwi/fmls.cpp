@@ -136,7 +136,6 @@ namespace MR {
       Segmenter::Segmenter (const DWI::Directions::FastLookupSet& directions, const size_t l) :
           dirs                         (directions),
           lmax                         (l),
-          precomputer                  (new Math::SH::PrecomputedAL<default_type> (lmax, 2 * dirs.size())),
           integral_threshold           (FMLS_INTEGRAL_THRESHOLD_DEFAULT),
           peak_value_threshold         (FMLS_PEAK_VALUE_THRESHOLD_DEFAULT),
           ratio_of_peak_value_to_merge (FMLS_RATIO_TO_PEAK_VALUE_TO_MERGE_DEFAULT),
@@ -150,18 +149,13 @@ namespace MR {
           az_el_pairs (row, 0) = std::atan2 (d[1], d[0]);
           az_el_pairs (row, 1) = std::acos  (d[2]);
         }
-        transform.reset (new Math::SH::Transform<default_type> (az_el_pairs, lmax));
+        peak_finder.reset (new DWI::PeakFinder<default_type> (az_el_pairs, lmax));
         weights.reset (new IntegrationWeights (dirs));
       }
 
 
 
 
-      class Max_abs { NOMEMALIGN
-        public:
-          bool operator() (const default_type& a, const default_type& b) const { return (abs (a) > abs (b)); }
-      };
-
       bool Segmenter::operator() (const SH_coefs& in, FOD_lobes& out) const {
 
         assert (in.size() == ssize_t (Math::SH::NforL (lmax)));
@@ -173,22 +167,28 @@ namespace MR {
           return true;
 
         Eigen::Matrix<default_type, Eigen::Dynamic, 1> values (dirs.size());
-        transform->SH2A (values, in);
-
-        using map_type = std::multimap<default_type, index_type, Max_abs>;
+        peak_finder->amplitudes (in, values);
 
-        map_type data_in_order;
+        // Directions in order of decreasing absolute amplitude; a stable sort
+        //   keeps directions of equal amplitude in index order
+        vector<std::pair<default_type, index_type>> data_in_order;
+        data_in_order.reserve (values.size());
         for (size_t i = 0; i != size_t(values.size()); ++i)
-          data_in_order.insert (std::make_pair (values[i], i));
+          data_in_order.push_back (std::make_pair (values[i], i));
+        std::stable_sort (data_in_order.begin(), data_in_order.end(),
+            [] (const std::pair<default_type, index_type>& a, const std::pair<default_type, index_type>& b) {
+              return abs (a.first) > abs (b.first);
+            });
 
         if (data_in_order.begin()->first <= 0.0)
           return true;
 
         vector< std::pair<index_type, uint32_t> > retrospective_assignments;
 
+        vector<uint32_t> adj_lobes;
         for (const auto& i : data_in_order) {
 
-          vector<uint32_t> adj_lobes;
+          adj_lobes.clear();
           for (uint32_t l = 0; l != out.size(); ++l) {
             if ((((i.first <= 0.0) &&  out[l].is_negative())
                   || ((i.first >  0.0) && !out[l].is_negative()))
@@ -264,7 +264,7 @@ namespace MR {
             // Revise multiple peaks if present
             for (size_t peak_index = 0; peak_index != i->num_peaks(); ++peak_index) {
               Eigen::Vector3 newton_peak = i->get_peak_dir (peak_index);
-              const default_type newton_peak_value = Math::SH::get_peak (in, lmax, newton_peak, &(*precomputer));
+              const default_type newton_peak_value = peak_finder->refine (in, newton_peak);
               if (std::isfinite (newton_peak_value) && newton_peak.allFinite()) {
 
                 // Ensure that the new peak direction found via Newton optimisation
@@ -20,6 +20,7 @@
 
 #include "memory.h"
 #include "math/SH.h"
+#include "dwi/peaks.h"
 #include "dwi/directions/set.h"
 #include "dwi/directions/mask.h"
 #include "image.h"
@@ -262,8 +263,7 @@ namespace MR
 
           const size_t lmax;
 
-          std::shared_ptr<Math::SH::Transform    <default_type>> transform;
-          std::shared_ptr<Math::SH::PrecomputedAL<default_type>> precomputer;
+          std::shared_ptr<DWI::PeakFinder<default_type>> peak_finder;
           std::shared_ptr<IntegrationWeights> weights;
 
           default_type integral_threshold; // Integral of positive lobe must be at least this value
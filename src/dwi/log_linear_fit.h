@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __dwi_log_linear_fit_h__
+#define __dwi_log_linear_fit_h__
+
+#include "types.h"
+#include "math/least_squares.h"
+
+namespace MR
+{
+  namespace DWI
+  {
+
+
+
+    //! Batched fitting of models linear in the logarithm of the DW signal
+    /*! Estimates the parameters \e p of the model log(S) = B p, where B is the
+     * design matrix, using ordinary linear least squares (OLS), optionally
+     * followed by a number of iterations of weighted linear least squares with
+     * weights given by the predicted signal (Veraart et al., 2013). This
+     * encompasses the diffusion tensor (NumParams = 7, see grad2bmatrix()), the
+     * diffusion kurtosis tensor (NumParams = 22), and the mono-exponential ADC
+     * model (NumParams = 2).
+     *
+     * The data for a block of voxels are provided at once, as the columns of a
+     * matrix of log-signals; the OLS estimates for all voxels are then obtained
+     * using a single matrix-matrix product with the pseudo-inverse of the design
+     * matrix, which is computed only once on construction (from a Cholesky
+     * factorisation of the normal equations, or using Math::pinv() where that
+     * fails). The weighted iterations are necessarily performed voxel-wise, but
+     * make use of fixed-size matrices for the normal equations.
+     *
+     * Each thread should use its own copy of this class. */
+    template <int NumParams>
+    class LogLinearFit
+    { MEMALIGN(LogLinearFit<NumParams>)
+      public:
+        using vector_type = Eigen::Matrix<double, NumParams, 1>;
+        using matrix_type = Eigen::Matrix<double, NumParams, NumParams>;
+        using design_type = Eigen::Matrix<double, Eigen::Dynamic, NumParams>;
+
+        LogLinearFit (const Eigen::MatrixXd& design, const int iterations = 0) :
+            b (design),
+            iterations (iterations)
+        {
+          if (design.cols() != NumParams)
+            throw Exception ("design matrix for log-linear fit has " + str(design.cols()) + " columns; expected " + str(NumParams));
+          matrix_type btb (matrix_type::Zero());
+          btb.template selfadjointView<Eigen::Lower>().rankUpdate (b.transpose());
+          Eigen::LLT<matrix_type> btb_llt (btb.template selfadjointView<Eigen::Lower>());
+          // design too poorly conditioned for a Cholesky factorisation of the
+          //   normal equations (e.g. too few distinct b-values / directions):
+          //   fall back to the LDLT-based pseudo-inverse
+          if (btb_llt.info() == Eigen::Success)
+            binv = btb_llt.solve (b.transpose());
+          else
+            binv = Math::pinv (b);
+        }
+
+        size_t num_volumes () const { return b.rows(); }
+        const design_type& design () const { return b; }
+
+        //! estimate the model parameters for each column of \a log_signals
+        /*! On output, column \e i of \a params contains the parameters
+         * estimated from column \e i of \a log_signals. */
+        template <class SignalMatrixType, class ParamMatrixType>
+          void operator() (const SignalMatrixType& log_signals, ParamMatrixType& params)
+          {
+            assert (size_t(log_signals.rows()) == num_volumes());
+            params.resize (NumParams, log_signals.cols());
+            params.noalias() = binv * log_signals;
+            if (!iterations)
+              return;
+            for (ssize_t n = 0; n < log_signals.cols(); ++n) {
+              p = params.col(n);
+              for (int it = 0; it < iterations; ++it) {
+                w = (b*p).array().exp();
+                bw.noalias() = w.asDiagonal() * b;
+                work.setZero();
+                work.template selfadjointView<Eigen::Lower>().rankUpdate (bw.transpose());
+                llt.compute (work.template selfadjointView<Eigen::Lower>());
+                // weights may underflow for implausible estimates; retain the previous one
+                if (llt.info() != Eigen::Success)
+                  break;
+                p = llt.solve (bw.transpose() * w.cwiseProduct (log_signals.col(n)));
+              }
+              params.col(n) = p;
+            }
+          }
+
+      private:
+        const design_type b;
+        Eigen::Matrix<double, NumParams, Eigen::Dynamic> binv;
+        const int iterations;
+        // workspace for the weighted iterations
+        vector_type p;
+        Eigen::VectorXd w;
+        design_type bw;
+        matrix_type work;
+        Eigen::LLT<matrix_type> llt;
+    };
+
+
+
+  }
+}
+
+#endif
+
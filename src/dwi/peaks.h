@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __dwi_peaks_h__
+#define __dwi_peaks_h__
+
+#include <numeric>
+
+#include "types.h"
+#include "math/SH.h"
+
+namespace MR
+{
+  namespace DWI
+  {
+
+
+
+    //! Extraction of the peaks of SH series from a set of seed directions
+    /*! The amplitudes of a block of SH series along all seed directions are
+     * computed as a single matrix-matrix product (see amplitudes()). These are
+     * then used to order the Newton searches for each SH series from the
+     * highest to the lowest seed amplitude, so that the dominant peaks are
+     * found first. Any subsequent search that comes within the angular
+     * threshold of a peak already found is then terminated early, since it
+     * would be discarded as a duplicate anyway.
+     *
+     * The Newton searches make use of the fixed-lmax derivative kernels where
+     * available (see Math::SH::derivatives_function()), or the PrecomputedAL
+     * lookup table if requested.
+     *
+     * This class holds no per-voxel state, and can be shared between threads. */
+    template <typename ValueType>
+    class PeakFinder
+    { MEMALIGN(PeakFinder<ValueType>)
+      public:
+        using value_type = ValueType;
+        using vector_type = Eigen::Matrix<value_type, Eigen::Dynamic, 1>;
+        using matrix_type = Eigen::Matrix<value_type, Eigen::Dynamic, Eigen::Dynamic>;
+        using dir_type = Eigen::Matrix<value_type, 3, 1>;
+
+        class Peak { MEMALIGN(Peak)
+          public:
+            Peak () : amplitude (NaN) { }
+            Peak (const value_type amplitude, const dir_type& dir) : amplitude (amplitude), dir (dir) { }
+            value_type amplitude;
+            dir_type dir;
+            bool operator< (const Peak& that) const { return amplitude > that.amplitude; }
+        };
+
+        //! set up peak finding from the seed directions in \a az_el (azimuth & elevation pairs)
+        template <class MatrixType>
+        PeakFinder (const MatrixType& az_el, const int lmax, const value_type dot_threshold = 1.0, const bool use_precomputer = false) :
+            lmax (lmax),
+            dot_threshold (dot_threshold),
+            SHT (Math::SH::init_transform (az_el.template cast<value_type>(), lmax)),
+            seeds (az_el.rows(), 3),
+            precomputer (use_precomputer ? new Math::SH::PrecomputedAL<value_type> (lmax) : nullptr),
+            derivatives_func (use_precomputer ?
+                Math::SH::derivatives<vector_type> :
+                Math::SH::derivatives_function<vector_type> (lmax))
+        {
+          for (ssize_t n = 0; n < az_el.rows(); ++n)
+            seeds.row (n) << std::cos (az_el(n,0)) * std::sin (az_el(n,1)),
+                             std::sin (az_el(n,0)) * std::sin (az_el(n,1)),
+                             std::cos (az_el(n,1));
+        }
+
+        size_t num_seeds () const { return seeds.rows(); }
+        dir_type seed (const size_t n) const { return seeds.row (n).transpose(); }
+
+        //! compute the amplitudes along each seed direction
+        /*! On output, column \e i of \a amplitudes holds the amplitudes of the
+         * SH series in column \e i of \a sh along each seed direction. */
+        template <class SHMatrixType, class AmplitudeMatrixType>
+        void amplitudes (const SHMatrixType& sh, AmplitudeMatrixType& amplitudes) const
+        {
+          amplitudes.noalias() = SHT * sh;
+        }
+
+        //! refine the peak direction \a dir using Newton optimisation
+        /*! returns the amplitude of the peak, or NaN if the search fails to
+         * converge. */
+        value_type refine (const vector_type& sh, dir_type& dir) const
+        {
+          return Math::SH::get_peak (sh, lmax, dir, derivatives_func, precomputer.get(),
+              [] (const dir_type&) { return false; });
+        }
+
+        //! find the distinct peaks of \a sh from all seed directions
+        /*! \a seed_amplitudes should hold the amplitudes of \a sh along each
+         * seed direction (as computed by amplitudes()). On output, \a peaks
+         * holds all distinct peaks, i.e. separated by more than the angular
+         * threshold set on construction, in the order in which they were
+         * found. */
+        template <class AmplitudeVectorType>
+        void operator() (const vector_type& sh, const AmplitudeVectorType& seed_amplitudes, vector<Peak>& peaks) const
+        {
+          assert (size_t (seed_amplitudes.size()) == num_seeds());
+          peaks.clear();
+          vector<size_t> order (num_seeds());
+          std::iota (order.begin(), order.end(), 0);
+          std::stable_sort (order.begin(), order.end(), [&] (size_t a, size_t b) { return seed_amplitudes[a] > seed_amplitudes[b]; });
+
+          for (const auto n : order) {
+            dir_type dir (seed (n));
+            bool duplicate = false;
+            // tested only once the search has (nearly) converged; see Math::SH::get_peak()
+            const value_type amplitude = Math::SH::get_peak (sh, lmax, dir, derivatives_func, precomputer.get(),
+                [&] (const dir_type& d) {
+                  for (const auto& p : peaks) {
+                    if (abs (d.dot (p.dir)) > dot_threshold)
+                      return (duplicate = true);
+                  }
+                  return false;
+                });
+            if (!duplicate && std::isfinite (amplitude))
+              peaks.push_back (Peak (amplitude, dir));
+          }
+        }
+
+      private:
+        const int lmax;
+        const value_type dot_threshold;
+        const matrix_type SHT;
+        Eigen::Matrix<value_type, Eigen::Dynamic, 3> seeds;
+        std::shared_ptr<Math::SH::PrecomputedAL<value_type>> precomputer;
+        const Math::SH::derivatives_function_type<vector_type> derivatives_func;
+    };
+
+
+
+  }
+}
+
+#endif
+
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "dwi/response.h"
+
+#include "math/constrained_least_squares.h"
+#include "math/sphere.h"
+#include "math/ZSH.h"
+
+
+
+namespace MR
+{
+  namespace DWI
+  {
+
+
+
+    ResponseEstimator::ResponseEstimator (const Eigen::MatrixXd& dirs_azel, const int lmax, const bool constrained) :
+        lmax (lmax),
+        constrained (constrained),
+        dirs (Math::Sphere::spherical2cartesian (dirs_azel))
+    {
+      if (!lmax || !constrained)
+        return;
+
+      // We are going to both constrain the amplitudes to be non-negative, and constrain the derivatives to be non-negative
+      const size_t num_angles_constraint = 90;
+      Eigen::VectorXd els (num_angles_constraint+1);
+      for (size_t i = 0; i <= num_angles_constraint; ++i)
+        els[i] = default_type(i) * Math::pi / 180.0;
+      const Eigen::MatrixXd amp_transform   = Math::ZSH::init_amp_transform  <default_type> (els, lmax);
+      const Eigen::MatrixXd deriv_transform = Math::ZSH::init_deriv_transform<default_type> (els, lmax);
+
+      constraints.resize (amp_transform.rows() + deriv_transform.rows(), amp_transform.cols());
+      constraints.topRows (amp_transform.rows()) = amp_transform;
+      constraints.bottomRows (deriv_transform.rows()) = deriv_transform;
+    }
+
+
+
+    size_t ResponseEstimator::operator() (Eigen::VectorXd& response) const
+    {
+      if (data.empty())
+        throw Exception ("no voxels provided for response function estimation");
+
+      const Eigen::VectorXd cat_data = Eigen::Map<const Eigen::VectorXd> (data.data(), data.size());
+
+      if (!lmax) {
+        response.resize (1);
+        response[0] = cat_data.mean() * std::sqrt (4*Math::pi);
+        return 0;
+      }
+
+      // All directions from all voxels are concatenated into a single large matrix
+      const Eigen::MatrixXd cat_transforms = Math::ZSH::init_amp_transform<default_type> (
+          Eigen::Map<const Eigen::VectorXd> (elevations.data(), elevations.size()), lmax);
+
+      if (!constrained) {
+        response = Eigen::HouseholderQR<Eigen::MatrixXd> (cat_transforms).solve (cat_data);
+        return 0;
+      }
+
+      auto problem = Math::ICLS::Problem<default_type> (cat_transforms, constraints, 1e-10, 1e-10);
+      auto solver  = Math::ICLS::Solver <default_type> (problem);
+      return solver (response, cat_data);
+    }
+
+
+
+  }
+}
+
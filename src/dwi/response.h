@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __dwi_response_h__
+#define __dwi_response_h__
+
+#include "types.h"
+
+namespace MR
+{
+  namespace DWI
+  {
+
+
+
+    //! Estimation of an axially symmetric response function from single-fibre voxels
+    /*! The DW signals of all voxels provided via add() are fitted concurrently,
+     * as a function of the angle between each gradient direction and the fibre
+     * direction in that voxel, using zonal spherical harmonics. Unless disabled,
+     * the response function is constrained to be non-negative, and monotonic
+     * (i.e. its amplitude must increase from the fibre direction out to the
+     * orthogonal plane). For lmax = 0, the response is the average of the
+     * data. */
+    class ResponseEstimator
+    { MEMALIGN(ResponseEstimator)
+      public:
+        //! set up estimation along the directions \a dirs_azel (azimuth & elevation pairs)
+        ResponseEstimator (const Eigen::MatrixXd& dirs_azel, const int lmax, const bool constrained = true);
+
+        size_t num_voxels () const { return data.size() / dirs.rows(); }
+
+        void clear () {
+          elevations.clear();
+          data.clear();
+        }
+
+        void reserve (const size_t num_voxels) {
+          elevations.reserve (num_voxels * dirs.rows());
+          data.reserve (num_voxels * dirs.rows());
+        }
+
+        //! add the DW signal of a single-fibre voxel with fibre direction \a fibre_dir
+        template <class VectorType>
+        void add (const VectorType& signal, const Eigen::Vector3& fibre_dir)
+        {
+          assert (ssize_t (signal.size()) == dirs.rows());
+          const Eigen::Vector3 dir = fibre_dir.normalized();
+          for (ssize_t n = 0; n != dirs.rows(); ++n) {
+            // the response is symmetric about the plane orthogonal to the fibre,
+            // so elevations are folded into [0, pi/2]:
+            elevations.push_back (std::acos (std::min (abs (dirs.row (n).dot (dir)), default_type(1.0))));
+            data.push_back (signal[n]);
+          }
+        }
+
+        //! estimate the response function coefficients from all voxels added
+        /*! returns the number of constraint iterations required (zero if the
+         * problem is unconstrained). */
+        size_t operator() (Eigen::VectorXd& response) const;
+
+      private:
+        const int lmax;
+        const bool constrained;
+        Eigen::Matrix<default_type, Eigen::Dynamic, 3> dirs;
+        Eigen::MatrixXd constraints;
+        vector<default_type> elevations, data;
+    };
+
+
+
+  }
+}
+
+#endif
+
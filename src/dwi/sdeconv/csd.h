@@ -32,6 +32,11 @@
 #define DEFAULT_CSD_THRESHOLD 0.0
 #define DEFAULT_CSD_NITER 50
 
+// Number of successive iterations within a voxel for which the Cholesky
+// factor may be obtained by rank-one updates before it is recomputed in full,
+// to bound the accumulation of round-off error
+#define CSD_MAX_FACTOR_UPDATES 8
+
 namespace MR
 {
   namespace DWI
@@ -55,7 +60,9 @@ namespace MR
               lmax_response (0),
               lmax_cmdline (0),
               lmax (0),
-              niter (DEFAULT_CSD_NITER) {
+              niter (DEFAULT_CSD_NITER),
+              num_solves (0),
+              num_rank_updates (0) {
                 grad = DWI::get_valid_DW_scheme (dwi_header);
                 // Discard b=0 (b=0 normalisation not supported in this version)
                 // Only allow selection of one non-zero shell from command line
@@ -65,6 +72,13 @@ namespace MR
                 lmax_data = Math::SH::LforN (dwis.size());
               }
 
+            ~Shared ()
+            {
+              if (num_solves)
+                INFO ("CSD factorisations: " + str (num_solves) + " solves; "
+                      + str (100.0 * num_rank_updates / default_type(num_solves), 3) + "\% obtained by rank update");
+            }
+
 
             void parse_cmdline_options()
             {
@@ -207,6 +221,8 @@ namespace MR
             vector<size_t> dwis;
             int lmax_response, lmax_data, lmax_cmdline, lmax;
             size_t niter;
+
+            mutable std::atomic<size_t> num_solves, num_rank_updates;
         };
 
 
@@ -225,17 +241,42 @@ namespace MR
           HR_amps (shared.HR_trans.rows()),
           Mt_b (shared.HR_trans.cols()),
           llt (work.rows()),
-          old_neg (shared.HR_trans.rows()) { }
-
-        CSD (const CSD&) = default;
-
-        ~CSD() { }
+          old_neg (shared.HR_trans.rows()),
+          max_rank_updates (shared.nSH() / 3),
+          have_factor (false),
+          num_factor_updates (0),
+          num_solves (0),
+          num_rank_updates (0) { }
+
+        CSD (const CSD& that) :
+          shared (that.shared),
+          work (that.work),
+          HR_T (that.HR_T),
+          F (that.F),
+          init_F (that.init_F),
+          HR_amps (that.HR_amps),
+          Mt_b (that.Mt_b),
+          llt (that.llt),
+          old_neg (that.old_neg),
+          max_rank_updates (that.max_rank_updates),
+          have_factor (false),
+          num_factor_updates (0),
+          num_solves (0),
+          num_rank_updates (0) { }
+
+        ~CSD() {
+          shared.num_solves += num_solves;
+          shared.num_rank_updates += num_rank_updates;
+        }
 
         template <class VectorType>
           void set (const VectorType& DW_signals) {
             F.head (shared.rconv.rows()) = shared.rconv * DW_signals;
             F.tail (F.size()-shared.rconv.rows()).setZero();
             old_neg.assign (1, -1);
+            // each voxel starts from a full factorisation, so that its result
+            // does not depend on the voxels previously processed by this thread
+            have_factor = false;
 
             Mt_b = shared.M.transpose() * DW_signals;
           }
@@ -250,16 +291,8 @@ namespace MR
           if (old_neg == neg)
             return true;
 
-          work.triangularView<Eigen::Lower>() = shared.Mt_M.triangularView<Eigen::Lower>();
-
-          if (neg.size()) {
-            for (size_t i = 0; i < neg.size(); i++)
-              HR_T.row (i) = shared.HR_trans.row (neg[i]);
-            auto HR_T_view = HR_T.topRows (neg.size());
-            work.triangularView<Eigen::Lower>() += HR_T_view.transpose() * HR_T_view;
-          }
-
-          F.noalias() = llt.compute (work.triangularView<Eigen::Lower>()).solve (Mt_b);
+          factorise();
+          F.noalias() = llt.solve (Mt_b);
 
           old_neg = neg;
 
@@ -275,7 +308,79 @@ namespace MR
         Eigen::MatrixXd work, HR_T;
         Eigen::VectorXd F, init_F, HR_amps, Mt_b;
         Eigen::LLT<Eigen::MatrixXd> llt;
-        vector<int> neg, old_neg;
+        vector<int> neg, old_neg, factor_neg, added, removed;
+        // beyond this many changes to the constraint set, a full
+        // factorisation is cheaper than the equivalent rank-one updates:
+        const size_t max_rank_updates;
+        bool have_factor;
+        size_t num_factor_updates;
+        size_t num_solves, num_rank_updates;
+
+
+        // Obtain the Cholesky factor of the normal matrix for the current set
+        // of active constraints. The first iteration within each voxel always
+        // computes the factorisation in full. On subsequent iterations, the
+        // factor from the previous iteration is updated using rank-one
+        // updates / downdates if the two constraint sets differ in only a few
+        // directions, up to CSD_MAX_FACTOR_UPDATES times in succession;
+        // otherwise, the factorisation is computed afresh. Note that the
+        // constraint set always differs from that of the previous iteration,
+        // since iterate() returns as soon as the two are identical.
+        void factorise ()
+        {
+          ++num_solves;
+          if (have_factor && num_factor_updates < CSD_MAX_FACTOR_UPDATES && rank_update()) {
+            ++num_rank_updates;
+            ++num_factor_updates;
+            factor_neg = neg;
+            return;
+          }
+
+          work.triangularView<Eigen::Lower>() = shared.Mt_M.triangularView<Eigen::Lower>();
+
+          if (neg.size()) {
+            for (size_t i = 0; i < neg.size(); i++)
+              HR_T.row (i) = shared.HR_trans.row (neg[i]);
+            auto HR_T_view = HR_T.topRows (neg.size());
+            work.triangularView<Eigen::Lower>() += HR_T_view.transpose() * HR_T_view;
+          }
+
+          llt.compute (work.triangularView<Eigen::Lower>());
+          factor_neg = neg;
+          num_factor_updates = 0;
+          have_factor = (llt.info() == Eigen::Success);
+        }
+
+
+        bool rank_update ()
+        {
+          // both sets are sorted in ascending order:
+          added.clear();
+          removed.clear();
+          auto a = neg.begin(), b = factor_neg.begin();
+          while (a != neg.end() || b != factor_neg.end()) {
+            if (b == factor_neg.end() || (a != neg.end() && *a < *b))
+              added.push_back (*a++);
+            else if (a == neg.end() || *b < *a)
+              removed.push_back (*b++);
+            else {
+              ++a;
+              ++b;
+              continue;
+            }
+            if (added.size() + removed.size() > max_rank_updates)
+              return false;
+          }
+
+          for (auto i : added)
+            llt.rankUpdate (shared.HR_trans.row (i).transpose(), 1.0);
+          for (auto i : removed)
+            llt.rankUpdate (shared.HR_trans.row (i).transpose(), -1.0);
+
+          // a failed downdate leaves the factor invalid:
+          have_factor = (llt.info() == Eigen::Success);
+          return have_factor;
+        }
     };
 
 
@@ -65,7 +65,7 @@ namespace MR
               void set_responses (const vector<std::string>& files)
               {
                 lmax_response.clear();
-                for (const auto s : files) {
+                for (const auto& s : files) {
                   Eigen::MatrixXd r;
                   try {
                     r = load_matrix (s);
@@ -249,8 +249,12 @@ namespace MR
               shared (shared_data),
               solver (shared.problem) { }
 
-          void operator() (const Eigen::VectorXd& data, Eigen::VectorXd& output) {
-            niter = solver (output, data);
+          //! estimate the tissue ODFs for one voxel
+          /*! If \a warm_start is set, the solver is initialised with the
+           * active set of constraints from the previous voxel processed; this
+           * should only be used if that voxel is adjacent to the current one. */
+          void operator() (const Eigen::VectorXd& data, Eigen::VectorXd& output, const bool warm_start = false) {
+            niter = warm_start ? solver (output, data, solver.active_set()) : solver (output, data);
           }
 
           size_t niter;
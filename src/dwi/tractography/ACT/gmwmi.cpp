@@ -213,10 +213,10 @@ namespace MR
           // Before proceeding, make sure that the interface lies somewhere in between these two points
           if (!interp.scanner (p_end))
             return p_end;
-          const Tissues t_end (interp);
+          const Tissues t_end (interp.tissues());
           if (!interp.scanner (p_prev))
             return p_end;
-          const Tissues t_prev (interp);
+          const Tissues t_prev (interp.tissues());
           if (! (((t_end.get_gm() > t_end.get_wm()) && (t_prev.get_gm() < t_prev.get_wm()))
               || ((t_end.get_gm() < t_end.get_wm()) && (t_prev.get_gm() > t_prev.get_wm())))) {
             return p_end;
@@ -246,7 +246,7 @@ namespace MR
             hermite.set (mu);
             const Eigen::Vector3f p (hermite.value (domain));
             interp.scanner (p);
-            const Tissues t (interp);
+            const Tissues t (interp.tissues());
             if (t.get_wm() > t.get_gm()) {
               min_mu = mu;
             } else {
@@ -18,9 +18,9 @@
 
 
 #include "image.h"
-#include "interp/linear.h"
 #include "math/hermite.h"
 #include "dwi/tractography/ACT/act.h"
+#include "dwi/tractography/ACT/tissue_interp.h"
 #include "dwi/tractography/ACT/tissues.h"
 
 
@@ -50,7 +50,7 @@ namespace MR
         { MEMALIGN(GMWMI_finder)
 
           protected:
-            using Interp = Interp::Linear<Image<float>>;
+            using Interp = TissueInterp;
 
           public:
             GMWMI_finder (const Image<float>& buffer) :
@@ -82,7 +82,7 @@ namespace MR
             Tissues get_tissues (const Eigen::Vector3f& p, Interp& interp) const {
               if (!interp.scanner (p))
                 return Tissues ();
-              return Tissues (interp);
+              return interp.tissues();
             }
 
             bool find_interface (Eigen::Vector3f&, Interp&) const;
@@ -17,13 +17,12 @@
 #define __dwi_tractography_act_method_h__
 
 #include "dwi/tractography/ACT/act.h"
+#include "dwi/tractography/ACT/tissue_interp.h"
 #include "dwi/tractography/ACT/tissues.h"
 
 #include "dwi/tractography/tracking/shared.h"
 #include "dwi/tractography/tracking/types.h"
 
-#include "interp/linear.h"
-
 
 #define GMWMI_NORMAL_PERTURBATION 0.001
 
@@ -136,7 +135,7 @@ namespace MR
                 tissue_values.reset();
                 return false;
               }
-              return tissue_values.set (act_image);
+              return tissue_values.set (act_image.value());
             }
 
 
@@ -151,7 +150,7 @@ namespace MR
 
 
           private:
-            Interp::Linear<Image<float>> act_image;
+            TissueInterp act_image;
             Tissues tissue_values;
 
         };
@@ -18,6 +18,7 @@
 
 #include "memory.h"
 #include "dwi/tractography/ACT/gmwmi.h"
+#include "dwi/tractography/ACT/tissue_interp.h"
 
 
 namespace MR
@@ -37,7 +38,6 @@ namespace MR
               voxel (Image<float>::open (path)),
               bt (false)
             {
-              verify_5TT_image (voxel);
               property_set.set (bt, "backtrack");
               if (property_set.find ("crop_at_gmwmi") != property_set.end())
                 gmwmi_finder.reset (new GMWMI_finder (voxel));
@@ -55,7 +55,7 @@ namespace MR
 
 
           private:
-            Image<float> voxel;
+            const TissueInterp voxel;
             bool bt;
 
             std::unique_ptr<GMWMI_finder> gmwmi_finder;
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "dwi/tractography/ACT/tissue_interp.h"
+
+#include "algo/loop.h"
+#include "dwi/tractography/ACT/act.h"
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+      namespace ACT
+      {
+
+
+
+        TissueInterp::TissueInterp (const Image<float>& image) :
+            transform (new Transform (image)),
+            out_of_bounds (true)
+        {
+          verify_5TT_image (image);
+          for (size_t axis = 0; axis != 3; ++axis) {
+            dim[axis] = image.size (axis);
+            voxel_size[axis] = image.spacing (axis);
+          }
+          stride[0] = 5;
+          stride[1] = 5 * dim[0];
+          stride[2] = 5 * dim[0] * dim[1];
+          for (size_t i = 0; i != 8; ++i) {
+            factors[i] = 0.0f;
+            corners[i] = 0;
+          }
+
+          data = std::make_shared<vector<float>> (5 * dim[0] * dim[1] * dim[2]);
+          auto in = image;
+          for (auto l = Loop (in, 0, 3) (in); l; ++l) {
+            float* const out = data->data() + in.index(0)*stride[0] + in.index(1)*stride[1] + in.index(2)*stride[2];
+            for (in.index(3) = 0; in.index(3) != 5; ++in.index(3))
+              out[in.index(3)] = in.value();
+          }
+        }
+
+
+
+      }
+    }
+  }
+}
+
+
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __dwi_tractography_act_tissue_interp_h__
+#define __dwi_tractography_act_tissue_interp_h__
+
+
+#include "image.h"
+#include "memory.h"
+#include "transform.h"
+#include "types.h"
+
+#include "dwi/tractography/ACT/tissues.h"
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+      namespace ACT
+      {
+
+
+
+        /*! Trilinear interpolation of all five tissue partial volumes of a 5TT image at once
+         *
+         * Functionally equivalent to using Interp::Linear<Image<float>> on the 5TT
+         * image and reading each of the five volumes in turn, but the image data are
+         * first re-packed such that the five tissue values of each voxel are
+         * contiguous in memory; each interpolation then requires only a single
+         * computation of the trilinear weights and eight contiguous reads, rather
+         * than five separate passes over the eight neighbouring voxels.
+         *
+         * The packed data are shared between copies of this class, so a single
+         * instance should be constructed from the image and then copied as
+         * necessary (e.g. once per thread). */
+        class TissueInterp
+        { MEMALIGN(TissueInterp)
+
+          public:
+            using value_type = Eigen::Array<float, 5, 1>;
+
+            TissueInterp (const Image<float>& image);
+            TissueInterp (const TissueInterp&) = default;
+
+
+            //! set the position at which to interpolate in voxel space
+            /*! \return false if the position is outside of the image */
+            template <class VectorType>
+            bool voxel (const VectorType& pos)
+            {
+              out_of_bounds = (pos[0] <= -0.5 || pos[0] >= dim[0] - 0.5 ||
+                               pos[1] <= -0.5 || pos[1] >= dim[1] - 0.5 ||
+                               pos[2] <= -0.5 || pos[2] >= dim[2] - 0.5);
+              if (out_of_bounds)
+                return false;
+
+              ssize_t c[3], offsets[3][2];
+              float weights[3][2];
+              for (size_t axis = 0; axis != 3; ++axis) {
+                const default_type lower = std::floor (pos[axis]);
+                c[axis] = lower;
+                const default_type f = (pos[axis] < 0.0 || pos[axis] > dim[axis] - 1.0) ? 0.0 : pos[axis] - lower;
+                weights[axis][0] = 1.0 - f;
+                weights[axis][1] = f;
+                offsets[axis][0] = clamp (c[axis],     dim[axis]) * stride[axis];
+                offsets[axis][1] = clamp (c[axis] + 1, dim[axis]) * stride[axis];
+              }
+
+              size_t i = 0;
+              for (size_t z = 0; z != 2; ++z) {
+                for (size_t y = 0; y != 2; ++y) {
+                  const float partial_weight = weights[1][y] * weights[2][z];
+                  for (size_t x = 0; x != 2; ++x, ++i) {
+                    factors[i] = weights[0][x] * partial_weight;
+                    if (factors[i] < 1.0e-6f)
+                      factors[i] = 0.0f;
+                    corners[i] = offsets[0][x] + offsets[1][y] + offsets[2][z];
+                  }
+                }
+              }
+              return true;
+            }
+
+            //! set the position at which to interpolate in scanner space
+            /*! \return false if the position is outside of the image */
+            template <class VectorType>
+            bool scanner (const VectorType& pos)
+            {
+              return voxel (transform->scanner2voxel * pos.template cast<default_type>());
+            }
+
+            //! test whether current position is within bounds
+            bool operator! () const { return out_of_bounds; }
+
+            //! the interpolated partial volumes of all five tissues at the current position
+            /*! Tissue values are all NaN if the current position is outside of the image. */
+            value_type value () const
+            {
+              if (out_of_bounds)
+                return value_type::Constant (NaN);
+              value_type result (value_type::Zero());
+              for (size_t i = 0; i != 8; ++i)
+                result += factors[i] * Eigen::Map<const value_type> (data->data() + corners[i]);
+              return result;
+            }
+
+            //! the tissues at the current position
+            Tissues tissues () const { return Tissues (value()); }
+
+            default_type spacing (size_t axis) const { return voxel_size[axis]; }
+
+
+          private:
+            std::shared_ptr<vector<float>> data;
+            std::shared_ptr<const Transform> transform;
+            ssize_t dim[3], stride[3];
+            default_type voxel_size[3];
+
+            bool out_of_bounds;
+            float factors[8];
+            size_t corners[8];
+
+            static ssize_t clamp (const ssize_t x, const ssize_t size) { return x < 0 ? 0 : (x >= size ? size-1 : x); }
+
+        };
+
+
+
+      }
+    }
+  }
+}
+
+#endif
+
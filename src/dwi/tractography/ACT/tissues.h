@@ -16,6 +16,8 @@
 #ifndef __dwi_tractography_act_tissues_h__
 #define __dwi_tractography_act_tissues_h__
 
+#include "types.h"
+
 
 // If the sum of tissue probabilities is below this threshold, the image is being exited, so a boolean flag is thrown
 // The values will however still be accessible
@@ -48,6 +50,16 @@ namespace MR
               set (cg, sg, w, c, p);
             }
 
+            Tissues (const Eigen::Array<float, 5, 1>& values) :
+                cgm  (0.0),
+                sgm  (0.0),
+                wm   (0.0),
+                csf  (0.0),
+                path (0.0)
+            {
+              set (values);
+            }
+
             template <class ImageType>
             Tissues (ImageType& data) :
                 cgm  (0.0),
@@ -90,6 +102,10 @@ namespace MR
               return ((is_valid = ((cgm + sgm + wm + csf + path) >= TISSUE_SUM_THRESHOLD)));
             }
 
+            bool set (const Eigen::Array<float, 5, 1>& values) {
+              return set (values[0], values[1], values[2], values[3], values[4]);
+            }
+
             template <class ImageType>
             bool set (ImageType& data)
             {
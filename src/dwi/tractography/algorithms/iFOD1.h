@@ -74,6 +74,9 @@ namespace MR
           properties.set (precomputed, "sh_precomputed");
           if (precomputed)
             precomputer.init (lmax);
+          sh_value = fixed_lmax_sh ?
+              Math::SH::value_function<Eigen::VectorXf,Eigen::Vector3f> (lmax) :
+              Math::SH::value<Eigen::VectorXf,Eigen::Vector3f>;
 
         }
 
@@ -102,6 +105,7 @@ namespace MR
         size_t lmax, max_trials;
         float sin_max_angle;
         Math::SH::PrecomputedAL<float> precomputer;
+        Math::SH::value_function_type<Eigen::VectorXf,Eigen::Vector3f> sh_value;
 
         private:
         mutable double mean_samples, mean_truncations, max_max_truncation;
@@ -233,7 +237,7 @@ namespace MR
       {
         return (S.precomputer ?
             S.precomputer.value (values, d) :
-            Math::SH::value (values, d, S.lmax)
+            S.sh_value (values, d, S.lmax)
         );
       }
 
@@ -87,6 +87,9 @@ namespace MR
                 properties.set (precomputed, "sh_precomputed");
                 if (precomputed)
                   precomputer.init (lmax);
+                sh_value = fixed_lmax_sh ?
+                    Math::SH::value_function<Eigen::VectorXf,Eigen::Vector3f> (lmax) :
+                    Math::SH::value<Eigen::VectorXf,Eigen::Vector3f>;
 
                 // num_samples is number of samples excluding first point
                 --num_samples;
@@ -136,6 +139,7 @@ namespace MR
                 size_t lmax, num_samples, max_trials;
                 float sin_max_angle, fod_power;
                 Math::SH::PrecomputedAL<float> precomputer;
+                Math::SH::value_function_type<Eigen::VectorXf,Eigen::Vector3f> sh_value;
 
               private:
                 mutable double mean_samples, mean_truncations, max_max_truncation;
@@ -358,7 +362,7 @@ end_init:
             {
               return (S.precomputer ?
                   S.precomputer.value (values, direction) :
-                  Math::SH::value (values, direction, S.lmax)
+                  S.sh_value (values, direction, S.lmax)
                   );
             }
 
@@ -473,7 +477,7 @@ end_init:
 
                   float log_prob = init_log_prob;
                   for (size_t i = 0; i < P.S.num_samples; ++i) {
-                    float prob = Math::SH::value (P.values, tangents[i], P.S.lmax) * (1.0 - (positions[i][0] / vox));
+                    float prob = P.S.sh_value (P.values, tangents[i], P.S.lmax) * (1.0 - (positions[i][0] / vox));
                     if (prob <= 0.0)
                       return 0.0;
                     prob = std::log (prob);
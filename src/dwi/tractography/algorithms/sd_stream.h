@@ -35,7 +35,14 @@ class SDStream : public MethodBase { MEMALIGN(SDStream)
       public:
         Shared (const std::string& diff_path, DWI::Tractography::Properties& property_set) :
             SharedBase (diff_path, property_set),
-            lmax (Math::SH::LforN (source.size(3)))
+            lmax (Math::SH::LforN (source.size(3))),
+            precomputer (nullptr),
+            sh_value (fixed_lmax_sh ?
+                Math::SH::value_function<Eigen::VectorXf,Eigen::Vector3f> (lmax) :
+                Math::SH::value<Eigen::VectorXf,Eigen::Vector3f>),
+            sh_derivatives (fixed_lmax_sh ?
+                Math::SH::derivatives_function<Eigen::VectorXf> (lmax) :
+                Math::SH::derivatives<Eigen::VectorXf>)
         {
           try {
             Math::SH::check (source);
@@ -74,6 +81,8 @@ class SDStream : public MethodBase { MEMALIGN(SDStream)
         float dot_threshold;
         size_t lmax;
         Math::SH::PrecomputedAL<float>* precomputer;
+        Math::SH::value_function_type<Eigen::VectorXf,Eigen::Vector3f> sh_value;
+        Math::SH::derivatives_function_type<Eigen::VectorXf> sh_derivatives;
 
     };
 
@@ -148,7 +157,9 @@ class SDStream : public MethodBase { MEMALIGN(SDStream)
 
       float find_peak ()
       {
-        float FOD = Math::SH::get_peak (values, S.lmax, dir, S.precomputer);
+        float FOD = S.precomputer ?
+            Math::SH::get_peak (values, S.lmax, dir, S.precomputer) :
+            Math::SH::get_peak (values, S.lmax, dir, S.sh_derivatives, nullptr, [] (const Eigen::Vector3f&) { return false; });
         if (!std::isfinite (FOD) || FOD < S.threshold)
           FOD = 0.0;
         return FOD;
@@ -158,7 +169,7 @@ class SDStream : public MethodBase { MEMALIGN(SDStream)
       {
         return (S.precomputer ?
             S.precomputer->value (values, d) :
-            Math::SH::value (values, d, S.lmax)
+            S.sh_value (values, d, S.lmax)
         );
       }
 
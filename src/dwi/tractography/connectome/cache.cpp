@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "dwi/tractography/connectome/cache.h"
+
+#include "raw.h"
+#include "file/binary_data.h"
+#include "file/key_value.h"
+#include "file/ofstream.h"
+#include "file/path.h"
+
+
+namespace MR {
+namespace DWI {
+namespace Tractography {
+namespace Connectome {
+
+
+
+namespace {
+  const char* cache_firstline = "mrtrix node assignments";
+}
+
+
+
+
+CacheWriter::CacheWriter (const std::string& path, const size_t num_parcellations, const bool pairs) :
+    path (path),
+    num_parcellations (num_parcellations),
+    pairs (pairs),
+    count_offset (0),
+    count (0),
+    max_node_indices (num_parcellations, 0)
+{
+  App::check_overwrite (path);
+  out.open (path, std::ios::out | std::ios::binary);
+  out << cache_firstline << "\n";
+  out << "mode: " << (pairs ? "pair" : "list") << "\n";
+  // Leave space for the final streamline count & maximal node indices, which
+  //   are only known once all streamlines have been written
+  int64_t data_offset = int64_t(out.tellp()) + 96 + 11 * num_parcellations;
+  data_offset += (4 - (data_offset % 4)) % 4;
+  out << "file: . " << data_offset << "\n";
+  out << "count: ";
+  count_offset = out.tellp();
+  out << "0\nEND\n";
+  out.seekp (data_offset);
+}
+
+
+
+bool CacheWriter::operator() (const Mapped_track_multi& in)
+{
+  assert (in.num_parcellations() == num_parcellations);
+  vector<node_t> record;
+  for (size_t p = 0; p != num_parcellations; ++p) {
+    const vector<node_t>& nodes (in.get_nodes (p));
+    if (pairs)
+      assert (nodes.size() == 2);
+    else
+      record.push_back (nodes.size());
+    for (auto n : nodes) {
+      record.push_back (n);
+      max_node_indices[p] = std::max (max_node_indices[p], n);
+    }
+  }
+
+  const size_t index = in.get_track_index();
+  if (index != count) {
+    pending.emplace (index, std::make_pair (in.get_length(), std::move (record)));
+    return true;
+  }
+  write (in.get_length(), record);
+  while (pending.size() && pending.begin()->first == count) {
+    write (pending.begin()->second.first, pending.begin()->second.second);
+    pending.erase (pending.begin());
+  }
+  return true;
+}
+
+
+
+void CacheWriter::finalize()
+{
+  // Streamlines absent from input (e.g. data pipeline terminated early):
+  //   write as assigned to no nodes
+  const vector<node_t> empty (pairs ? 2*num_parcellations : num_parcellations, 0);
+  for (const auto& i : pending) {
+    while (count < i.first)
+      write (NaN, empty);
+    write (i.second.first, i.second.second);
+  }
+  pending.clear();
+
+  out.seekp (count_offset);
+  out << count << "\nmax_node_index: " << join (max_node_indices, ",") << "\nEND\n";
+  out.close();
+}
+
+
+
+void CacheWriter::write (const float length, const vector<node_t>& record)
+{
+  File::write_LE<float> (out, length);
+  for (auto n : record)
+    File::write_LE<uint32_t> (out, n);
+  if (!out.good())
+    throw Exception ("error writing streamline node assignments file \"" + path + "\": " + strerror (errno));
+  ++count;
+}
+
+
+
+
+
+
+CacheReader::CacheReader (const std::string& path) :
+    path (path),
+    count (0),
+    counter (0),
+    pairs (true)
+{
+  File::KeyValue kv (path, cache_firstline);
+  std::string data_file, mode;
+  bool count_found = false;
+  while (kv.next()) {
+    const std::string key = lowercase (kv.key());
+    if (key == "count") {
+      count = to<size_t> (kv.value());
+      count_found = true;
+    } else if (key == "mode") {
+      mode = lowercase (kv.value());
+    } else if (key == "max_node_index") {
+      for (const auto& i : split (kv.value(), ",", true))
+        max_node_indices.push_back (to<node_t> (i));
+    } else if (key == "file") {
+      data_file = kv.value();
+    }
+  }
+
+  if (!count_found || mode.empty() || max_node_indices.empty() || data_file.empty())
+    throw Exception ("streamline node assignments file \"" + path + "\" is missing essential header information");
+  if (mode == "pair")
+    pairs = true;
+  else if (mode == "list")
+    pairs = false;
+  else
+    throw Exception ("unknown mode \"" + mode + "\" in streamline node assignments file \"" + path + "\"");
+
+  File::open_data (in, path, data_file, "streamline node assignments");
+
+  progress.reset (new ProgressBar ("reading streamline node assignments from file", count));
+}
+
+
+
+bool CacheReader::operator() (Mapped_track_multi& out)
+{
+  if (counter == count) {
+    progress.reset();
+    return false;
+  }
+  const float length = File::read_LE<float> (in);
+  out.set_track_index (counter++);
+  out.set_length (length);
+  out.set_weight (1.0f);
+  out.set_num_parcellations (num_parcellations());
+  for (size_t p = 0; p != num_parcellations(); ++p) {
+    const size_t num_nodes = pairs ? 2 : read_node();
+    if (num_nodes > max_node_indices[p] + 1)
+      throw Exception ("malformed streamline node assignments file \"" + path + "\" (too many nodes for streamline)");
+    vector<node_t> nodes (num_nodes);
+    for (auto& n : nodes) {
+      n = read_node();
+      if (n > max_node_indices[p])
+        throw Exception ("malformed streamline node assignments file \"" + path + "\" (node index exceeds maximum)");
+    }
+    out.set_nodes (p, std::move (nodes));
+  }
+  if (!in.good())
+    throw Exception ("error reading streamline node assignments file \"" + path + "\" (file may be truncated)");
+  ++(*progress);
+  return true;
+}
+
+
+
+node_t CacheReader::read_node()
+{
+  return File::read_LE<uint32_t> (in);
+}
+
+
+
+
+}
+}
+}
+}
+
+
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __dwi_tractography_connectome_cache_h__
+#define __dwi_tractography_connectome_cache_h__
+
+
+#include <fstream>
+#include <map>
+
+#include "progressbar.h"
+#include "types.h"
+#include "file/ofstream.h"
+
+#include "dwi/tractography/connectome/connectome.h"
+#include "dwi/tractography/connectome/mapped_track.h"
+
+
+namespace MR {
+namespace DWI {
+namespace Tractography {
+namespace Connectome {
+
+
+
+// Compact binary storage of the node assignments of every streamline in a
+//   tractogram to one or more parcellation images, along with the length of
+//   each streamline. This contains everything necessary to re-generate
+//   connectomes using any metric, without re-reading the streamline vertices
+//   or repeating the streamline-node assignment search.
+//
+// The file consists of a text header (in the same style as the .tck format),
+//   followed by one record per streamline, in order of streamline index:
+//   - Streamline length (Float32LE)
+//   - For each parcellation:
+//     - If the assignment mechanism provides node pairs: two node indices (UInt32LE)
+//     - Otherwise: the number of nodes, followed by the node indices (all UInt32LE)
+
+
+
+class CacheWriter
+{ MEMALIGN(CacheWriter)
+
+  public:
+    CacheWriter (const std::string& path, const size_t num_parcellations, const bool pairs);
+
+    // Streamlines may arrive out of order if mapping is multi-threaded;
+    //   each record is written as soon as all preceding streamlines have been
+    //   written, so only those streamlines that arrive early are held in memory
+    bool operator() (const Mapped_track_multi&);
+
+    // Writes any streamlines still held (filling the gaps left by any absent
+    //   streamlines), and updates the streamline count & maximal node indices
+    void finalize();
+
+  private:
+    const std::string path;
+    const size_t num_parcellations;
+    const bool pairs;
+
+    File::OFStream out;
+    int64_t count_offset;
+    size_t count;
+    std::map<size_t, std::pair<float, vector<node_t>>> pending;
+    vector<node_t> max_node_indices;
+
+    void write (const float length, const vector<node_t>& record);
+};
+
+
+
+class CacheReader
+{ MEMALIGN(CacheReader)
+
+  public:
+    CacheReader (const std::string& path);
+
+    bool operator() (Mapped_track_multi&);
+
+    size_t num_streamlines()    const { return count; }
+    size_t num_parcellations()  const { return max_node_indices.size(); }
+    bool provides_pair()        const { return pairs; }
+    node_t max_node_index (const size_t parc) const { assert (parc < max_node_indices.size()); return max_node_indices[parc]; }
+
+  private:
+    const std::string path;
+    std::ifstream in;
+    size_t count, counter;
+    bool pairs;
+    vector<node_t> max_node_indices;
+    std::unique_ptr<ProgressBar> progress;
+
+    node_t read_node();
+};
+
+
+
+
+}
+}
+}
+}
+
+
+#endif
+
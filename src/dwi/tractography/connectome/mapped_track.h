@@ -91,6 +91,35 @@ namespace MR {
         };
 
 
+        // Node assignments of a single streamline to each of multiple parcellations,
+        //   along with the streamline length; this is sufficient to compute the
+        //   contribution of the streamline to any connectome metric without
+        //   access to the streamline vertices
+        class Mapped_track_multi : public Mapped_track_base
+        { MEMALIGN(Mapped_track_multi)
+
+          public:
+            Mapped_track_multi() :
+              Mapped_track_base (),
+              length (NaN) { }
+
+            void set_length (const float i)                     { length = i; }
+            void set_num_parcellations (const size_t i)         { nodes.resize (i); }
+            void set_nodes  (const size_t i, const NodePair& n) { nodes[i] = { n.first, n.second }; }
+            void set_nodes  (const size_t i, vector<node_t>&& n) { std::swap (nodes[i], n); }
+
+            float  get_length()            const { return length; }
+            size_t num_parcellations()     const { return nodes.size(); }
+            const vector<node_t>& get_nodes (const size_t i) const { assert (i < nodes.size()); return nodes[i]; }
+            NodePair get_nodepair (const size_t i) const { assert (nodes[i].size() == 2); return std::make_pair (nodes[i][0], nodes[i][1]); }
+
+          private:
+            float length;
+            vector< vector<node_t> > nodes;
+
+        };
+
+
 
 
       }
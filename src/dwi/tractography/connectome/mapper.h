@@ -75,6 +75,51 @@ class Mapper
 
 
 
+// Assign each streamline to the nodes of multiple parcellation images in a single
+//   pass; the streamline length is retained in place of a metric-specific factor,
+//   so that the contribution of the streamline to any number of connectome
+//   metrics can be computed subsequently without the streamline vertices
+class MultiMapper
+{ MEMALIGN(MultiMapper)
+
+  public:
+    MultiMapper (const vector<const Tck2nodes_base*>& a) :
+      tck2nodes (a)
+    {
+      assert (tck2nodes.size());
+    }
+
+    MultiMapper (const MultiMapper& that) :
+      tck2nodes (that.tck2nodes) { }
+
+
+    bool operator() (const Tractography::Streamline<float>& in, Mapped_track_multi& out)
+    {
+      out.set_track_index (in.index);
+      out.set_length (in.calc_length());
+      out.set_weight (in.weight);
+      out.set_num_parcellations (tck2nodes.size());
+      for (size_t i = 0; i != tck2nodes.size(); ++i) {
+        if (tck2nodes[i]->provides_pair()) {
+          out.set_nodes (i, (*tck2nodes[i]) (in));
+        } else {
+          vector<node_t> nodes;
+          (*tck2nodes[i]) (in, nodes);
+          out.set_nodes (i, std::move (nodes));
+        }
+      }
+      return true;
+    }
+
+
+  private:
+    const vector<const Tck2nodes_base*> tck2nodes;
+
+};
+
+
+
+
 }
 }
 }
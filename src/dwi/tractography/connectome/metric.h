@@ -49,18 +49,35 @@ class Metric { MEMALIGN(Metric)
         scale_by_file (false) { }
 
     double operator() (const Streamline<>& tck, const NodePair& nodes) const
+    {
+      return (*this) (tck.index, get_length (tck), nodes);
+    }
+
+    double operator() (const Streamline<>& tck, const vector<node_t>& nodes) const
+    {
+      return (*this) (tck.index, get_length (tck), nodes);
+    }
+
+    double operator() (const Streamline<>& tck) const
+    {
+      return (*this) (tck.index, get_length (tck));
+    }
+
+    // These versions only require the streamline index & length, and can
+    //   therefore be used when the streamline vertices are not available
+    double operator() (const size_t index, const float length, const NodePair& nodes) const
     {
       if (scale_by_invnodevol) {
         assert (nodes.first < node_volumes.size());
         assert (nodes.second < node_volumes.size());
         const double sum_volumes = (node_volumes[nodes.first] + node_volumes[nodes.second]);
         if (!sum_volumes) return 0.0;
-        return (*this)(tck) * 2.0 / sum_volumes;
+        return (*this)(index, length) * 2.0 / sum_volumes;
       }
-      return (*this)(tck);
+      return (*this)(index, length);
     }
 
-    double operator() (const Streamline<>& tck, const vector<node_t>& nodes) const
+    double operator() (const size_t index, const float length, const vector<node_t>& nodes) const
     {
       if (scale_by_invnodevol) {
         double sum_volumes = 0.0;
@@ -69,22 +86,22 @@ class Metric { MEMALIGN(Metric)
           sum_volumes += node_volumes[*n];
         }
         if (!sum_volumes) return 0.0;
-        return (*this)(tck) * nodes.size() / sum_volumes;
+        return (*this)(index, length) * nodes.size() / sum_volumes;
       }
-      return (*this)(tck);
+      return (*this)(index, length);
     }
 
-    double operator() (const Streamline<>& tck) const
+    double operator() (const size_t index, const float length) const
     {
       double result = 1.0;
       if (scale_by_length)
-        result *= tck.calc_length();
+        result *= length;
       else if (scale_by_invlength)
-        result = (tck.size() > 1 ? (result / tck.calc_length()) : 0.0);
+        result = (length > 0.0 ? (result / length) : 0.0);
       if (scale_by_file) {
-        if (tck.index >= size_t(file_values.size()))
+        if (index >= size_t(file_values.size()))
           throw Exception ("File " + file_path + " does not contain enough entries for this tractogram");
-        result *= file_values[tck.index];
+        result *= file_values[index];
       }
       return result;
     }
@@ -129,6 +146,11 @@ class Metric { MEMALIGN(Metric)
     std::string file_path;
     Eigen::VectorXd file_values;
 
+    // Avoid calculating the streamline length if it is not going to be used
+    float get_length (const Streamline<>& tck) const {
+      return (scale_by_length || scale_by_invlength) ? tck.calc_length() : NaN;
+    }
+
 };
 
 
@@ -41,22 +41,30 @@ namespace MR {
           // Assign to ROIs
           if (properties.include.size() || properties.exclude.size()) {
 
+            // Streamline cannot possibly satisfy all inclusion criteria
+            if (include_candidates && !(*include_candidates)[in.index]) {
+              if (inverse)
+                in.swap (out);
+              return true;
+            }
+            const bool test_exclude = properties.exclude.size() && (!exclude_candidates || (*exclude_candidates)[in.index]);
+
             include_visited.assign (properties.include.size(), false);
 
             if (ends_only) {
               for (size_t i = 0; i != 2; ++i) {
                 const Eigen::Vector3f& p (i ? in.back() : in.front());
                 properties.include.contains (p, include_visited);
-                if (properties.exclude.contains (p)) {
+                if (test_exclude && properties.exclude.contains (p)) {
                   if (inverse)
                     in.swap (out);
                   return true;
                 }
               }
-            } else {
+            } else if (properties.include.size() || test_exclude) {
               for (const auto& p : in) {
                 properties.include.contains (p, include_visited);
-                if (properties.exclude.contains (p)) {
+                if (test_exclude && properties.exclude.contains (p)) {
                   if (inverse)
                     in.swap (out);
                   return true;
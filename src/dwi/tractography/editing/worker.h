@@ -19,6 +19,7 @@
 
 #include <string>
 
+#include "bitset.h"
 #include "types.h"
 
 #include "dwi/tractography/properties.h"
@@ -50,9 +51,21 @@ namespace MR {
               inverse (that.inverse),
               ends_only (that.ends_only),
               thresholds (that.thresholds),
+              include_candidates (that.include_candidates),
+              exclude_candidates (that.exclude_candidates),
               include_visited (properties.include.size(), false) { }
 
 
+            // Provide the sets of streamlines that may intersect all include regions, and
+            //   any exclude region, respectively (e.g. from a spatial index of the tractogram);
+            //   streamlines outside of these sets do not need to be tested explicitly
+            void set_candidates (std::shared_ptr<BitSet> include, std::shared_ptr<BitSet> exclude)
+            {
+              include_candidates = include;
+              exclude_candidates = exclude;
+            }
+
+
             bool operator() (Streamline<>&, Streamline<>&) const;
 
 
@@ -72,6 +85,8 @@ namespace MR {
                 float step_size;
             } thresholds;
 
+            std::shared_ptr<BitSet> include_candidates, exclude_candidates;
+
             mutable vector<bool> include_visited;
 
         };
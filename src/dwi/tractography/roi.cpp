@@ -17,6 +17,14 @@
 #include "dwi/tractography/roi.h"
 #include "adapter/subset.h"
 
+#include <map>
+
+
+// Upper limit on the number of grid cells used to rasterise a set of ROIs
+#define ROI_LOOKUP_MAX_CELLS (1 << 24)
+// Lower bound on the grid cell size (in mm), for degenerate regions of interest
+#define ROI_LOOKUP_MIN_CELL_SIZE 1e-3
+
 
 namespace MR {
   namespace DWI {
@@ -71,6 +79,210 @@ namespace MR {
 
 
 
+      namespace {
+
+        // Small margin to guard against precision loss in coordinate transformations:
+        //   cells are classified based on a slightly enlarged version of themselves
+        constexpr float lookup_margin = 1e-3f;
+
+        enum class overlap_t { NONE, PARTIAL, FULL };
+
+        overlap_t sphere_overlap (const ROI& roi, const Eigen::Vector3f& lower, const Eigen::Vector3f& upper)
+        {
+          const Eigen::Vector3f& c (roi.centre());
+          const float radius2 = Math::pow2 (roi.get_radius());
+          const Eigen::Vector3f nearest = c.cwiseMax (lower).cwiseMin (upper);
+          if ((nearest - c).squaredNorm() > radius2)
+            return overlap_t::NONE;
+          const Eigen::Vector3f farthest = (c - lower).cwiseAbs().cwiseMax ((c - upper).cwiseAbs());
+          return farthest.squaredNorm() <= radius2 ? overlap_t::FULL : overlap_t::PARTIAL;
+        }
+
+        overlap_t mask_overlap (Mask& mask, const Eigen::Vector3f& lower, const Eigen::Vector3f& upper)
+        {
+          // Find the range of voxels to which any point within this cell may be rounded
+          Eigen::Vector3f vlower (Eigen::Vector3f::Constant (std::numeric_limits<float>::infinity()));
+          Eigen::Vector3f vupper (Eigen::Vector3f::Constant (-std::numeric_limits<float>::infinity()));
+          for (size_t corner = 0; corner != 8; ++corner) {
+            const Eigen::Vector3f p ((corner & 1) ? upper[0] : lower[0],
+                                     (corner & 2) ? upper[1] : lower[1],
+                                     (corner & 4) ? upper[2] : lower[2]);
+            const Eigen::Vector3f v = *(mask.scanner2voxel) * p;
+            vlower = vlower.cwiseMin (v);
+            vupper = vupper.cwiseMax (v);
+          }
+          std::array<ssize_t, 3> from, to;
+          for (size_t axis = 0; axis != 3; ++axis) {
+            from[axis] = std::round (vlower[axis]);
+            to[axis] = std::round (vupper[axis]);
+            if (to[axis] < 0 || from[axis] >= mask.size (axis))
+              return overlap_t::NONE;
+          }
+          // Any out-of-bounds voxel is treated as false
+          bool any_true = false, any_false = false;
+          for (size_t axis = 0; axis != 3; ++axis) {
+            if (from[axis] < 0 || to[axis] >= mask.size (axis)) {
+              any_false = true;
+              from[axis] = std::max (from[axis], ssize_t(0));
+              to[axis] = std::min (to[axis], ssize_t(mask.size (axis) - 1));
+            }
+          }
+          for (mask.index(2) = from[2]; mask.index(2) <= to[2]; ++mask.index(2)) {
+            for (mask.index(1) = from[1]; mask.index(1) <= to[1]; ++mask.index(1)) {
+              for (mask.index(0) = from[0]; mask.index(0) <= to[0]; ++mask.index(0)) {
+                if (mask.value())
+                  any_true = true;
+                else
+                  any_false = true;
+                if (any_true && any_false)
+                  return overlap_t::PARTIAL;
+              }
+            }
+          }
+          return any_true ? overlap_t::FULL : overlap_t::NONE;
+        }
+
+      }
+
+
+
+      ROILookup::ROILookup (const vector<ROI>& rois, const float upsample_ratio) :
+          num_words ((rois.size() + 63) / 64),
+          inv_cell_size (NaN)
+      {
+        assert (rois.size());
+        assert (upsample_ratio > 0.0f);
+
+        // Determine the bounding box of each ROI in scanner space, and
+        //   the resolution of the grid necessary to represent them
+        vector<Eigen::Vector3f> roi_lower, roi_upper;
+        Eigen::Vector3f lower (Eigen::Vector3f::Constant (std::numeric_limits<float>::infinity()));
+        Eigen::Vector3f upper (Eigen::Vector3f::Constant (-std::numeric_limits<float>::infinity()));
+        float cell_size = std::numeric_limits<float>::infinity();
+        for (const auto& roi : rois) {
+          Eigen::Vector3f this_lower (Eigen::Vector3f::Constant (std::numeric_limits<float>::infinity()));
+          Eigen::Vector3f this_upper (Eigen::Vector3f::Constant (-std::numeric_limits<float>::infinity()));
+          if (roi.is_mask()) {
+            const Mask& mask (roi.get_mask());
+            for (size_t corner = 0; corner != 8; ++corner) {
+              const Eigen::Vector3f v ((corner & 1) ? mask.size(0) - 0.5f : -0.5f,
+                                       (corner & 2) ? mask.size(1) - 0.5f : -0.5f,
+                                       (corner & 4) ? mask.size(2) - 0.5f : -0.5f);
+              const Eigen::Vector3f p = *(mask.voxel2scanner) * v;
+              this_lower = this_lower.cwiseMin (p);
+              this_upper = this_upper.cwiseMax (p);
+            }
+            cell_size = std::min ({ cell_size, float(mask.spacing(0)), float(mask.spacing(1)), float(mask.spacing(2)) });
+          } else {
+            const Eigen::Vector3f extent (Eigen::Vector3f::Constant (roi.get_radius()));
+            this_lower = roi.centre() - extent;
+            this_upper = roi.centre() + extent;
+            // A sphere of zero radius places no constraint on the grid resolution:
+            //   any cell containing its centre is simply flagged as a partial overlap
+            if (roi.get_radius() > 0.0f)
+              cell_size = std::min (cell_size, 0.5f * roi.get_radius());
+          }
+          roi_lower.push_back (this_lower);
+          roi_upper.push_back (this_upper);
+          lower = lower.cwiseMin (this_lower);
+          upper = upper.cwiseMax (this_upper);
+        }
+        // If no ROI provides a usable resolution (e.g. all are spheres of zero radius),
+        //   fall back to the extent of the bounding box, or to the minimum cell size
+        if (!std::isfinite (cell_size))
+          cell_size = (upper - lower).maxCoeff();
+        cell_size = std::max (cell_size / upsample_ratio, float(ROI_LOOKUP_MIN_CELL_SIZE));
+        if (!std::isfinite (cell_size))
+          throw Exception ("unable to determine grid resolution for precomputation of regions of interest");
+
+        auto set_dims = [&] () {
+          size_t num_cells = 1;
+          for (size_t axis = 0; axis != 3; ++axis) {
+            dim[axis] = std::max (size_t(1), size_t (std::ceil ((upper[axis] - lower[axis]) / cell_size)));
+            num_cells *= dim[axis];
+          }
+          return num_cells;
+        };
+        while (set_dims() > ROI_LOOKUP_MAX_CELLS)
+          cell_size *= 1.25f;
+        origin = lower;
+        inv_cell_size = 1.0f / cell_size;
+
+        // Pattern 0 is always the empty pattern, such that
+        //   points outside of the grid can be handled trivially
+        std::map<vector<uint64_t>, uint32_t> pattern_map;
+        vector<uint64_t> pattern (2 * num_words, 0);
+        pattern_map[pattern] = 0;
+        patterns = pattern;
+
+        vector<std::unique_ptr<Mask>> masks;
+        for (const auto& roi : rois)
+          masks.emplace_back (roi.is_mask() ? new Mask (roi.get_mask()) : nullptr);
+
+        cells.assign (dim[0] * dim[1] * dim[2], 0);
+        ProgressBar progress ("precomputing regions of interest", dim[2]);
+        uint32_t previous_index = 0;
+        vector<uint64_t> previous_pattern (pattern);
+        size_t cell_index = 0;
+        for (size_t z = 0; z != dim[2]; ++z) {
+          for (size_t y = 0; y != dim[1]; ++y) {
+            for (size_t x = 0; x != dim[0]; ++x, ++cell_index) {
+              const Eigen::Vector3f cell_lower = origin + cell_size * Eigen::Vector3f (x, y, z) - Eigen::Vector3f::Constant (lookup_margin);
+              const Eigen::Vector3f cell_upper = cell_lower + Eigen::Vector3f::Constant (cell_size + 2.0f * lookup_margin);
+              std::fill (pattern.begin(), pattern.end(), 0);
+              bool empty = true;
+              for (size_t n = 0; n != rois.size(); ++n) {
+                if ((cell_upper.array() < roi_lower[n].array()).any() || (cell_lower.array() > roi_upper[n].array()).any())
+                  continue;
+                const overlap_t overlap = masks[n] ?
+                                          mask_overlap (*masks[n], cell_lower, cell_upper) :
+                                          sphere_overlap (rois[n], cell_lower, cell_upper);
+                if (overlap == overlap_t::NONE)
+                  continue;
+                pattern[(overlap == overlap_t::FULL ? 0 : num_words) + n/64] |= uint64_t(1) << (n%64);
+                empty = false;
+              }
+              if (empty)
+                continue;
+              if (pattern != previous_pattern) {
+                auto it = pattern_map.find (pattern);
+                if (it == pattern_map.end()) {
+                  if (pattern_map.size() == size_t(std::numeric_limits<uint32_t>::max()))
+                    throw Exception ("too many distinct region of interest combinations for precomputation");
+                  it = pattern_map.insert (std::make_pair (pattern, uint32_t(pattern_map.size()))).first;
+                  patterns.insert (patterns.end(), pattern.begin(), pattern.end());
+                }
+                previous_pattern = pattern;
+                previous_index = it->second;
+              }
+              cells[cell_index] = previous_index;
+            }
+          }
+          ++progress;
+        }
+
+        DEBUG ("regions of interest precomputed on grid of " + str(dim[0]) + "x" + str(dim[1]) + "x" + str(dim[2])
+               + " cells of size " + str(cell_size) + "mm, with " + str(pattern_map.size()) + " distinct patterns");
+      }
+
+
+
+
+
+      void ROISet::precompute (const float upsample_ratio)
+      {
+        if (R.size() < 2 || !(upsample_ratio > 0.0f)) {
+          lookup.reset();
+          return;
+        }
+        lookup = std::make_shared<ROILookup> (R, upsample_ratio);
+      }
+
+
+
+
+
+
       Image<bool> Mask::__get_mask (const std::string& name)
       {
         auto data = Image<bool>::open (name);
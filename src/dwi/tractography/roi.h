@@ -80,6 +80,11 @@ namespace MR
 
           std::string shape () const { return (mask ? "image" : "sphere"); }
 
+          bool is_mask () const { return bool(mask); }
+          const Eigen::Vector3f& centre () const { assert (!mask); return pos; }
+          float get_radius () const { assert (!mask); return radius; }
+          const Mask& get_mask () const { assert (mask); return *mask; }
+
           std::string parameters () const {
             return mask ? mask->name() : str(pos[0]) + "," + str(pos[1]) + "," + str(pos[2]) + "," + str(radius);
           }
@@ -121,22 +126,108 @@ namespace MR
 
 
 
+      /*! Rasterisation of a set of ROIs onto a single regular grid in scanner space
+       *
+       * For each grid cell, the ROIs that entirely contain the cell, and those that
+       * only partially overlap the cell, are encoded as two bitmasks (one bit per
+       * ROI). Since the vast majority of cells share one of a small number of
+       * distinct bitmask combinations, each unique combination is stored only once,
+       * with each grid cell storing only an index into this table.
+       *
+       * For any point, a single grid lookup therefore yields those ROIs that
+       * definitely contain the point, and those few ROIs for which the exact
+       * geometric test must still be performed. */
+      class ROILookup { MEMALIGN(ROILookup)
+        public:
+          ROILookup (const vector<ROI>& rois, const float upsample_ratio);
+
+          //! number of 64-bit words per bitmask
+          size_t words () const { return num_words; }
+
+          //! get the bitmasks for the grid cell containing this point
+          /*! The first words() entries of the returned array are the ROIs
+           * that entirely contain the cell; the next words() entries are the
+           * ROIs that partially overlap the cell. */
+          const uint64_t* operator() (const Eigen::Vector3f& p) const
+          {
+            const Eigen::Vector3f v = (p - origin) * inv_cell_size;
+            if (!(v[0] >= 0.0f && v[1] >= 0.0f && v[2] >= 0.0f))
+              return patterns.data();
+            const size_t x = v[0], y = v[1], z = v[2];
+            if (x >= dim[0] || y >= dim[1] || z >= dim[2])
+              return patterns.data();
+            return patterns.data() + 2 * num_words * cells[x + dim[0] * (y + dim[1] * z)];
+          }
+
+          //! index of the least significant set bit within a (non-zero) bitmask word
+          /*! Uses a de Bruijn sequence lookup, avoiding compiler-specific intrinsics */
+          static size_t lowest_bit (const uint64_t bits)
+          {
+            static const uint8_t table[64] = {
+               0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+              62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+              63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+              46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6 };
+            assert (bits);
+            return table[((bits & (~bits + 1)) * uint64_t(0x03f79d71b4cb0a89)) >> 58];
+          }
+
+        private:
+          size_t num_words;
+          Eigen::Vector3f origin;
+          float inv_cell_size;
+          std::array<size_t, 3> dim;
+          vector<uint32_t> cells;
+          vector<uint64_t> patterns;
+      };
+
+
+
       class ROISet { MEMALIGN(ROISet)
         public:
           ROISet () { }
 
-          void clear () { R.clear(); }
+          void clear () { R.clear(); lookup.reset(); }
           size_t size () const { return (R.size()); }
           const ROI& operator[] (size_t i) const { return (R[i]); }
-          void add (const ROI& roi) { R.push_back (roi); }
+          void add (const ROI& roi) { R.push_back (roi); lookup.reset(); }
+
+          //! rasterise all ROIs in preparation for many repeated containment tests
+          /*! The grid resolution is the finest resolution of the constituent
+           * ROIs, multiplied by \a upsample_ratio; this has no effect (and any
+           * existing precomputation is discarded) if there are fewer than two
+           * ROIs in the set, or if \a upsample_ratio is zero. */
+          void precompute (const float upsample_ratio = 1.0f);
 
           bool contains (const Eigen::Vector3f& p) const {
+            if (lookup) {
+              const uint64_t* pattern = (*lookup) (p);
+              for (size_t w = 0; w != lookup->words(); ++w)
+                if (pattern[w]) return true;
+              for (size_t w = 0; w != lookup->words(); ++w) {
+                for (uint64_t bits = pattern[lookup->words() + w]; bits; bits &= bits - 1)
+                  if (R[64*w + ROILookup::lowest_bit (bits)].contains (p)) return true;
+              }
+              return false;
+            }
             for (size_t n = 0; n < R.size(); ++n)
               if (R[n].contains (p)) return (true);
             return false;
           }
 
           void contains (const Eigen::Vector3f& p, vector<bool>& retval) const {
+            if (lookup) {
+              const uint64_t* pattern = (*lookup) (p);
+              for (size_t w = 0; w != lookup->words(); ++w) {
+                for (uint64_t bits = pattern[w]; bits; bits &= bits - 1)
+                  retval[64*w + ROILookup::lowest_bit (bits)] = true;
+                for (uint64_t bits = pattern[lookup->words() + w]; bits; bits &= bits - 1) {
+                  const size_t n = 64*w + ROILookup::lowest_bit (bits);
+                  if (!retval[n] && R[n].contains (p)) retval[n] = true;
+                }
+              }
+              return;
+            }
             for (size_t n = 0; n < R.size(); ++n)
               if (R[n].contains (p)) retval[n] = true;
           }
@@ -152,6 +243,7 @@ namespace MR
 
         private:
           vector<ROI> R;
+          std::shared_ptr<const ROILookup> lookup;
       };
 
 
@@ -46,7 +46,7 @@ namespace MR
         auto interp = interp_template;
 
         interp.scanner (p.cast<double>());
-        const ACT::Tissues tissues (interp);
+        const ACT::Tissues tissues (interp.tissues());
 
         if (tissues.get_csf() > tissues.get_wm() + tissues.get_gm())
           return false;
@@ -69,6 +69,7 @@ namespace MR
           SIFT::ModelBase<Fixel_TD_seed> (fod_data, dirs),
           target_trackcount (num),
           track_count (0),
+          next_update (0),
           attempts (0),
           seeds (0),
 #ifdef DYNAMIC_SEED_DEBUGGING
@@ -94,6 +95,8 @@ namespace MR
         // For small / unreliable fixels, don't modify the seeding probability during execution
         perform_fixel_masking();
 
+        update_sampler();
+
 #ifdef DYNAMIC_SEED_DEBUGGING
         // Pick a good fixel to use for testing / debugging
         do {
@@ -127,7 +130,7 @@ namespace MR
             seed_prob = std::min (1.0f, seed_prob);
             seed_prob = std::max (0.0f, seed_prob);
           }
-          fixel.update_prob (seed_prob, false);
+          fixel.update_prob (seed_prob);
         }
 
         // Output seeding probabilites at end of execution
@@ -171,79 +174,43 @@ namespace MR
       {
 
         uint64_t this_attempts = 0;
-        std::uniform_int_distribution<size_t> uniform_int (0, fixels.size()-2);
+        std::uniform_real_distribution<double> uniform_double (0.0, 1.0);
         std::uniform_real_distribution<float> uniform_float (0.0f, 1.0f);
 
         while (1) {
 
           ++this_attempts;
-          const size_t fixel_index = 1 + uniform_int (*rng);
-          Fixel& fixel = fixels[fixel_index];
-          float seed_prob;
-          if (fixel.can_update()) {
-
-            // Derive the new seed probability
-            // TODO Functionalise this?
-            const float ratio = fixel.get_ratio (mu());
-            const bool force_seed = !fixel.get_TD();
-            const size_t current_trackcount = track_count.load (std::memory_order_relaxed);
-            const float cumulative_prob = fixel.get_cumulative_prob (current_trackcount);
-            seed_prob = cumulative_prob;
-            if (!force_seed) {
-
-              // Target track count is double the current track count, until this exceeds the actual target number
-              // - try to modify the probabilities faster at earlier stages
-              const size_t Szero = std::min (target_trackcount, 2 * current_trackcount);
-              seed_prob = (ratio < 1.0) ?
-                  (cumulative_prob * (Szero - (current_trackcount * ratio)) / (ratio * (Szero - current_trackcount))) :
-                  0.0;
-
-#ifdef DYNAMIC_SEED_DEBUGGING
-              //if (fixel_index == test_fixel)
-              //  std::cerr << "Ratio " << ratio << ", tracks " << current_trackcount << "/" << target_trackcount << ", seeds " << fixel_seeds << "/" << total_seeds << ", prob " << cumulative_prob << " -> " << seed_prob << "\n";
-#endif
-
-              // These can occur fairly regularly, depending on the exact derivation
-              seed_prob = std::min (1.0f, seed_prob);
-              seed_prob = std::max (0.0f, seed_prob);
 
-            }
+          // Fixels are drawn directly in proportion to their seeding probabilities,
+          //   rather than drawing fixels uniformly and rejecting according to probability
+          const auto current_sampler = std::atomic_load (&sampler);
+          Fixel& fixel = fixels[(*current_sampler) (uniform_double (*rng))];
 
-          } else {
-            seed_prob = fixel.get_old_prob();
-          }
+          const Eigen::Vector3i& v (fixel.get_voxel());
+          const Eigen::Vector3f vp (v[0]+uniform_float(*rng)-0.5, v[1]+uniform_float(*rng)-0.5, v[2]+uniform_float(*rng)-0.5);
+          p = transform.voxel2scanner.cast<float>() * vp;
 
-          if (seed_prob > uniform_float (*rng)) {
+          bool good_seed = !act;
+          if (!good_seed) {
 
-            const Eigen::Vector3i& v (fixel.get_voxel());
-            const Eigen::Vector3f vp (v[0]+uniform_float(*rng)-0.5, v[1]+uniform_float(*rng)-0.5, v[2]+uniform_float(*rng)-0.5);
-            p = transform.voxel2scanner.cast<float>() * vp;
-
-            bool good_seed = !act;
-            if (!good_seed) {
-
-              if (act->check_seed (p)) {
-                // Make sure that the seed point has not left the intended voxel
-                const Eigen::Vector3f new_v_float (transform.scanner2voxel.cast<float>() * p);
-                const Eigen::Vector3i new_v (std::round (new_v_float[0]), std::round (new_v_float[1]), std::round (new_v_float[2]));
-                good_seed = (new_v == v);
-              }
+            if (act->check_seed (p)) {
+              // Make sure that the seed point has not left the intended voxel
+              const Eigen::Vector3f new_v_float (transform.scanner2voxel.cast<float>() * p);
+              const Eigen::Vector3i new_v (std::round (new_v_float[0]), std::round (new_v_float[1]), std::round (new_v_float[2]));
+              good_seed = (new_v == v);
             }
-            if (good_seed) {
-              d = fixel.get_dir().cast<float>();
+          }
+          if (good_seed) {
+            d = fixel.get_dir().cast<float>();
 #ifdef DYNAMIC_SEED_DEBUGGING
-              write_seed (p);
+            write_seed (p);
 #endif
-              attempts.fetch_add (this_attempts, std::memory_order_relaxed);
-              seeds.fetch_add (1, std::memory_order_relaxed);
-              fixel.update_prob (seed_prob, true);
-              return true;
-            }
-
+            attempts.fetch_add (this_attempts, std::memory_order_relaxed);
+            seeds.fetch_add (1, std::memory_order_relaxed);
+            fixel.add_seed();
+            return true;
           }
 
-          fixel.update_prob (seed_prob, false);
-
         }
         return false;
 
@@ -323,6 +290,47 @@ namespace MR
 
 
 
+      float Dynamic::calc_seed_prob (Fixel& fixel, const size_t current_trackcount)
+      {
+        if (!fixel.can_update())
+          return fixel.get_old_prob();
+
+        const float ratio = fixel.get_ratio (mu());
+        const bool force_seed = !fixel.get_TD();
+        const float cumulative_prob = fixel.get_cumulative_prob (current_trackcount);
+        if (force_seed)
+          return cumulative_prob;
+
+        // Target track count is double the current track count, until this exceeds the actual target number
+        // - try to modify the probabilities faster at earlier stages
+        const size_t Szero = std::min (target_trackcount, 2 * current_trackcount);
+        float seed_prob = (ratio < 1.0) ?
+            (cumulative_prob * (Szero - (current_trackcount * ratio)) / (ratio * (Szero - current_trackcount))) :
+            0.0;
+
+        // These can occur fairly regularly, depending on the exact derivation
+        seed_prob = std::min (1.0f, seed_prob);
+        seed_prob = std::max (0.0f, seed_prob);
+        return seed_prob;
+      }
+
+
+
+      void Dynamic::update_sampler()
+      {
+        const size_t current_trackcount = track_count.load (std::memory_order_relaxed);
+        for (size_t fixel_index = 1; fixel_index != fixels.size(); ++fixel_index) {
+          Fixel& fixel = fixels[fixel_index];
+          fixel.update_prob (calc_seed_prob (fixel, current_trackcount));
+        }
+        std::atomic_store (&sampler, std::shared_ptr<const Fixel_TD_seed_sampler> (new Fixel_TD_seed_sampler (fixels)));
+        next_update = current_trackcount + std::max (size_t(DYNAMIC_SEED_UPDATE_MIN_TRACKS), size_t(current_trackcount * DYNAMIC_SEED_UPDATE_FRACTION));
+      }
+
+
+
+
+
       void Dynamic::perform_fixel_masking()
       {
         // IDEA Rather than a hard masking, could this be instead used to 'damp' how much the seeding
@@ -26,6 +26,7 @@
 #include "dwi/directions/set.h"
 #include "dwi/tractography/ACT/tissues.h"
 #include "dwi/tractography/ACT/gmwmi.h"
+#include "dwi/tractography/ACT/tissue_interp.h"
 #include "dwi/tractography/mapping/voxel.h"
 #include "dwi/tractography/seeding/base.h"
 #include "dwi/tractography/SIFT/model_base.h"
@@ -50,6 +51,23 @@
 #define DYNAMIC_SEED_INITIAL_PROB 1e-3
 
 
+// Seeding probabilities of all fixels are re-calculated whenever the number of
+//   accepted streamlines has grown by this fraction since the last update,
+//   or by the minimum number of streamlines below, whichever is larger.
+// Each update costs O(number of fixels), and the probabilities are otherwise
+//   held fixed. Since the target of calc_seed_prob() is defined relative to
+//   the current streamline count (it aims to correct the TD by the time this
+//   count has doubled), the probabilities evolve on a scale proportional to
+//   the streamline count; updating after 1% growth therefore lags this by no
+//   more than ~1%, while bounding the total number of updates to ~100 per
+//   e-fold increase in streamline count (~700 for 10^4 - 10^7 streamlines).
+// The minimum prevents the early stages (where the TD of a handful of
+//   streamlines is too noisy to inform the probabilities anyway) from
+//   triggering a full update for every few streamlines.
+#define DYNAMIC_SEED_UPDATE_FRACTION 0.01
+#define DYNAMIC_SEED_UPDATE_MIN_TRACKS 100
+
+
 // Applicable for approach 2 with correlation term only:
 // How much of the projected change in seed probability is included in seeds outside the fixel
 #define DYNAMIC_SEEDING_DAMPING_FACTOR 0.5
@@ -82,9 +100,7 @@ namespace MR
             old_prob (DYNAMIC_SEED_INITIAL_PROB),
             applied_prob (old_prob),
             track_count_at_last_update (0),
-            seed_count (0) {
-              updating.clear();
-            }
+            seed_count (0) { }
 
           Fixel_TD_seed (const Fixel_TD_seed& that) :
             SIFT::FixelBase (that),
@@ -94,9 +110,7 @@ namespace MR
             old_prob (that.old_prob),
             applied_prob (that.applied_prob),
             track_count_at_last_update (that.track_count_at_last_update),
-            seed_count (that.seed_count) { 
-              updating.clear();
-            }
+            seed_count (that.seed_count.load (std::memory_order_relaxed)) { }
 
           Fixel_TD_seed() :
             SIFT::FixelBase (),
@@ -106,9 +120,7 @@ namespace MR
             old_prob (DYNAMIC_SEED_INITIAL_PROB),
             applied_prob (old_prob),
             track_count_at_last_update (0),
-            seed_count (0) { 
-              updating.clear();
-            }
+            seed_count (0) { }
 
 
           double         get_TD     ()                    const { return TD.load (std::memory_order_relaxed); }
@@ -139,9 +151,10 @@ namespace MR
           float get_ratio (const double mu) const { return ((mu * TD.load (std::memory_order_relaxed)) / FOD); }
 
 
+          // These two functions are only invoked from the single thread
+          //   responsible for updating the seeding probabilities
           float get_cumulative_prob (const uint64_t track_count)
           {
-            while (updating.test_and_set (std::memory_order_acquire));
             float cumulative_prob = old_prob;
             if (track_count > track_count_at_last_update) {
               cumulative_prob = ((track_count_at_last_update * old_prob) + ((track_count - track_count_at_last_update) * applied_prob)) / float(track_count);
@@ -151,18 +164,14 @@ namespace MR
             return cumulative_prob;
           }
 
-          void update_prob (const float new_prob, const bool seed_drawn)
-          {
-            applied_prob = new_prob;
-            if (seed_drawn)
-              ++seed_count;
-            updating.clear (std::memory_order_release);
-          }
+          void update_prob (const float new_prob) { applied_prob = new_prob; }
+
+          void add_seed() { seed_count.fetch_add (1, std::memory_order_relaxed); }
 
 
           float get_old_prob()   const { return old_prob; }
           float get_prob()       const { return applied_prob; }
-          size_t get_seed_count() const { return seed_count; }
+          size_t get_seed_count() const { return seed_count.load (std::memory_order_relaxed); }
 
 
 
@@ -171,12 +180,46 @@ namespace MR
           std::atomic<double> TD; // Protect against concurrent reads & writes, though perfect thread concurrency is not necessary
           bool update; // For small / noisy fixels, exclude the seeding probability from being updated
 
-          // Multiple values to update - use an atomic boolean in a similar manner to a mutex, but with less overhead
-          std::atomic_flag updating;
           float old_prob, applied_prob;
           size_t track_count_at_last_update;
-          size_t seed_count;
+          std::atomic<size_t> seed_count;
+
+      };
+
+
+
 
+      // Draw fixel indices with probability proportional to their seeding probabilities
+      // This is immutable once constructed, such that it can be used concurrently by
+      //   multiple threads while a replacement is being generated
+      class Fixel_TD_seed_sampler
+      { MEMALIGN(Fixel_TD_seed_sampler)
+
+        public:
+          // Index 0 is the null fixel, and is never drawn
+          Fixel_TD_seed_sampler (const vector<Fixel_TD_seed>& fixels) :
+              cumulative (fixels.size() - 1)
+          {
+            assert (fixels.size() > 1);
+            double sum = 0.0;
+            for (size_t i = 1; i != fixels.size(); ++i) {
+              sum += fixels[i].get_prob();
+              cumulative[i-1] = sum;
+            }
+          }
+
+          // Provide a random number in the range [0.0, 1.0)
+          size_t operator() (const double sample) const
+          {
+            // Can't draw proportionally to zero probability; draw uniformly instead
+            if (!(cumulative.back() > 0.0))
+              return 1 + std::min (size_t (sample * cumulative.size()), cumulative.size()-1);
+            const size_t index = std::upper_bound (cumulative.begin(), cumulative.end(), sample * cumulative.back()) - cumulative.begin();
+            return 1 + std::min (index, cumulative.size()-1);
+          }
+
+        private:
+          vector<double> cumulative;
       };
 
 
@@ -193,7 +236,7 @@ namespace MR
           bool check_seed (Eigen::Vector3f&);
 
         private:
-          Interp::Linear<Image<float>> interp_template;
+          ACT::TissueInterp interp_template;
           ACT::GMWMI_finder gmwmi_finder;
 
 
@@ -243,7 +286,11 @@ namespace MR
               return false;
 #endif
           }
-          return SIFT::ModelBase<Fixel_TD_seed>::operator() (i);
+          if (!SIFT::ModelBase<Fixel_TD_seed>::operator() (i))
+            return false;
+          if (track_count.load (std::memory_order_relaxed) >= next_update)
+            update_sampler();
+          return true;
         }
 
 
@@ -258,6 +305,12 @@ namespace MR
         const size_t target_trackcount;
         std::atomic<size_t> track_count;
 
+        // Seeding probabilities are updated for all fixels at once by the thread
+        //   receiving mapped streamlines, at which point a new sampler is generated;
+        //   threads drawing seeds access only the most recent sampler
+        std::shared_ptr<const Fixel_TD_seed_sampler> sampler;
+        size_t next_update;
+
         // Want to know statistics on dynamic seeding sampling
         std::atomic<uint64_t> attempts, seeds;
 
@@ -275,6 +328,9 @@ namespace MR
 
         void perform_fixel_masking();
 
+        float calc_seed_prob (Fixel&, const size_t);
+        void update_sampler();
+
       };
 
 
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "dwi/tractography/spatial_index.h"
+
+#include <unordered_map>
+
+#include "raw.h"
+#include "thread_queue.h"
+#include "algo/loop.h"
+#include "file/binary_data.h"
+#include "file/key_value.h"
+#include "file/ofstream.h"
+
+#include "dwi/tractography/mapping/loader.h"
+
+
+// Each cell coordinate is stored using 21 bits within the 64-bit cell key
+#define SPATIAL_INDEX_KEY_BITS 21
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+
+
+
+      using namespace App;
+
+      const Option SpatialIndexOption
+      = Option ("tck_index", "provide a spatial index of the input tractogram (as generated by the tckindex command); "
+                             "this is used to identify those streamlines that cannot possibly intersect each "
+                             "include / exclude region of interest, and which therefore do not need to be tested explicitly")
+        + Argument ("path").type_file_in();
+
+
+
+      namespace {
+        const char* index_firstline = "mrtrix track index";
+        constexpr int key_offset = 1 << (SPATIAL_INDEX_KEY_BITS - 1);
+        // Small margin to guard against precision loss in coordinate transformations
+        constexpr float query_margin = 1e-3f;
+      }
+
+
+
+      class SpatialIndex::CellList : public vector<SpatialIndex::key_type>
+      { MEMALIGN(SpatialIndex::CellList)
+        public:
+          size_t index;
+      };
+
+
+
+
+
+      SpatialIndex::SpatialIndex (const std::string& path) :
+          cell_size (NaN),
+          count (0)
+      {
+        File::KeyValue kv (path, index_firstline);
+        std::string data_file;
+        size_t num_cells = 0, num_entries = 0;
+        while (kv.next()) {
+          const std::string key = lowercase (kv.key());
+          if (key == "cell_size")
+            cell_size = to<float> (kv.value());
+          else if (key == "cells")
+            num_cells = to<size_t> (kv.value());
+          else if (key == "entries")
+            num_entries = to<size_t> (kv.value());
+          else if (key == "file")
+            data_file = kv.value();
+          else
+            properties[kv.key()] = kv.value();
+        }
+        if (!std::isfinite (cell_size) || properties["count"].empty() || data_file.empty())
+          throw Exception ("track index file \"" + path + "\" is missing essential header information");
+        count = to<size_t> (properties["count"]);
+
+        std::ifstream in;
+        File::open_data (in, path, data_file, "track index");
+        keys.resize (num_cells);
+        offsets.resize (num_cells + 1);
+        ids.resize (num_entries);
+        File::read_LE (in, keys);
+        File::read_LE (in, offsets);
+        File::read_LE (in, ids);
+        if (!in.good())
+          throw Exception ("error reading track index file \"" + path + "\" (file may be truncated)");
+        if (offsets.back() != num_entries)
+          throw Exception ("malformed track index file \"" + path + "\"");
+        DEBUG ("track index \"" + path + "\" loaded: " + str(num_cells) + " cells, " + str(num_entries) + " entries");
+      }
+
+
+
+      SpatialIndex::SpatialIndex (const std::string& tck_path, const float cell_size) :
+          cell_size (cell_size),
+          count (0)
+      {
+        if (!(cell_size > 0.0f))
+          throw Exception ("spatial index cell size must be positive");
+
+        Properties tck_properties;
+        Reader<float> reader (tck_path, tck_properties);
+        if (tck_properties.find ("timestamp") != tck_properties.end())
+          properties["timestamp"] = tck_properties["timestamp"];
+        const size_t expected_count = tck_properties["count"].empty() ? 0 : to<size_t> (tck_properties["count"]);
+        if (expected_count > size_t(std::numeric_limits<id_type>::max()))
+          throw Exception ("track file \"" + tck_path + "\" contains too many streamlines to be indexed");
+
+        std::unordered_map<key_type, vector<id_type>> map;
+        {
+          Mapping::TrackLoader loader (reader, expected_count, "generating spatial index of tractogram");
+          auto worker = [&] (const Streamline<float>& in, CellList& out)
+          {
+            out.clear();
+            out.index = in.index;
+            for (const auto& p : in) {
+              if (p.allFinite())
+                out.push_back (key (cell (p)));
+            }
+            std::sort (out.begin(), out.end());
+            out.erase (std::unique (out.begin(), out.end()), out.end());
+            return true;
+          };
+          auto sink = [&] (const CellList& in)
+          {
+            for (auto k : in)
+              map[k].push_back (id_type (in.index));
+            count = std::max (count, in.index + 1);
+            return true;
+          };
+          Thread::run_queue (loader, Thread::batch (Streamline<float>()), Thread::multi (worker), Thread::batch (CellList()), sink);
+        }
+        properties["count"] = str(count);
+
+        // Convert to compressed sparse row format, with both cells and streamline indices sorted
+        keys.reserve (map.size());
+        size_t num_entries = 0;
+        for (const auto& i : map) {
+          keys.push_back (i.first);
+          num_entries += i.second.size();
+        }
+        std::sort (keys.begin(), keys.end());
+        offsets.reserve (keys.size() + 1);
+        ids.reserve (num_entries);
+        offsets.push_back (0);
+        for (auto k : keys) {
+          vector<id_type>& cell_ids (map[k]);
+          std::sort (cell_ids.begin(), cell_ids.end());
+          ids.insert (ids.end(), cell_ids.begin(), cell_ids.end());
+          offsets.push_back (ids.size());
+          vector<id_type>().swap (cell_ids);
+        }
+        INFO ("spatial index of track file \"" + tck_path + "\" contains " + str(keys.size()) + " cells, "
+              + str(ids.size()) + " entries (mean " + str(ids.size() / std::max (float(count), 1.0f)) + " cells per streamline)");
+      }
+
+
+
+      void SpatialIndex::save (const std::string& path) const
+      {
+        File::OFStream out (path, std::ios::out | std::ios::binary);
+        out << index_firstline << "\n";
+        out << "cell_size: " << cell_size << "\n";
+        for (const auto& i : properties)
+          out << i.first << ": " << i.second << "\n";
+        out << "cells: " << keys.size() << "\n";
+        out << "entries: " << ids.size() << "\n";
+        File::write_data_offset (out, 8);
+        File::write_LE (out, keys);
+        File::write_LE (out, offsets);
+        File::write_LE (out, ids);
+        if (!out.good())
+          throw Exception ("error writing track index file \"" + path + "\": " + strerror (errno));
+      }
+
+
+
+      void SpatialIndex::verify (const Properties& tck_properties) const
+      {
+        if (properties.find ("timestamp") != properties.end() && tck_properties.find ("timestamp") != tck_properties.end())
+          check_timestamps (properties, tck_properties, "track / track index");
+        else
+          WARN ("unable to verify correspondence between track file and track index: missing timestamp");
+        check_counts (properties, tck_properties, "track / track index", true);
+      }
+
+
+
+      BitSet SpatialIndex::candidates (const ROI& roi) const
+      {
+        vector<key_type> cells;
+        if (roi.is_mask()) {
+          Mask mask (roi.get_mask());
+          for (auto l = Loop (mask) (mask); l; ++l) {
+            if (mask.value()) {
+              // Any point that rounds to this voxel lies within its bounding box;
+              //   find the bounding box of this region in scanner space
+              Eigen::Vector3f lower (Eigen::Vector3f::Constant (std::numeric_limits<float>::infinity()));
+              Eigen::Vector3f upper (Eigen::Vector3f::Constant (-std::numeric_limits<float>::infinity()));
+              for (size_t corner = 0; corner != 8; ++corner) {
+                const Eigen::Vector3f v (mask.index(0) + ((corner & 1) ? 0.5f : -0.5f),
+                                         mask.index(1) + ((corner & 2) ? 0.5f : -0.5f),
+                                         mask.index(2) + ((corner & 4) ? 0.5f : -0.5f));
+                const Eigen::Vector3f p = *(mask.voxel2scanner) * v;
+                lower = lower.cwiseMin (p);
+                upper = upper.cwiseMax (p);
+              }
+              add_box (lower, upper, cells);
+            }
+          }
+        } else {
+          const Eigen::Vector3f extent (Eigen::Vector3f::Constant (roi.get_radius()));
+          add_box (roi.centre() - extent, roi.centre() + extent, cells);
+        }
+        return from_cells (cells);
+      }
+
+
+
+      BitSet SpatialIndex::candidates (const ROISet& rois, const bool intersection) const
+      {
+        BitSet result (count, intersection);
+        for (size_t i = 0; i != rois.size(); ++i) {
+          if (intersection)
+            result &= candidates (rois[i]);
+          else
+            result |= candidates (rois[i]);
+        }
+        return result;
+      }
+
+
+
+      SpatialIndex::key_type SpatialIndex::key (const Eigen::Array3i& c) const
+      {
+        key_type result = 0;
+        for (size_t axis = 0; axis != 3; ++axis) {
+          const int64_t shifted = std::min (std::max (int64_t(c[axis]) + key_offset, int64_t(0)), int64_t((1 << SPATIAL_INDEX_KEY_BITS) - 1));
+          result = (result << SPATIAL_INDEX_KEY_BITS) | key_type(shifted);
+        }
+        return result;
+      }
+
+      Eigen::Array3i SpatialIndex::cell (const Eigen::Vector3f& p) const
+      {
+        return Eigen::Array3i (int (std::floor (p[0] / cell_size)),
+                               int (std::floor (p[1] / cell_size)),
+                               int (std::floor (p[2] / cell_size)));
+      }
+
+
+
+      void SpatialIndex::add_box (const Eigen::Vector3f& lower, const Eigen::Vector3f& upper, vector<key_type>& cells) const
+      {
+        const Eigen::Array3i from = cell (lower - Eigen::Vector3f::Constant (query_margin));
+        const Eigen::Array3i to   = cell (upper + Eigen::Vector3f::Constant (query_margin));
+        Eigen::Array3i c;
+        for (c[2] = from[2]; c[2] <= to[2]; ++c[2]) {
+          for (c[1] = from[1]; c[1] <= to[1]; ++c[1]) {
+            for (c[0] = from[0]; c[0] <= to[0]; ++c[0])
+              cells.push_back (key (c));
+          }
+        }
+      }
+
+
+
+      BitSet SpatialIndex::from_cells (vector<key_type>& cells) const
+      {
+        std::sort (cells.begin(), cells.end());
+        cells.erase (std::unique (cells.begin(), cells.end()), cells.end());
+        BitSet result (count);
+        auto k = keys.begin();
+        for (auto c : cells) {
+          k = std::lower_bound (k, keys.end(), c);
+          if (k == keys.end())
+            break;
+          if (*k != c)
+            continue;
+          const size_t cell_index = k - keys.begin();
+          for (uint64_t i = offsets[cell_index]; i != offsets[cell_index+1]; ++i)
+            result[ids[i]] = true;
+        }
+        return result;
+      }
+
+
+
+    }
+  }
+}
+
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __dwi_tractography_spatial_index_h__
+#define __dwi_tractography_spatial_index_h__
+
+
+#include "app.h"
+#include "bitset.h"
+#include "types.h"
+
+#include "dwi/tractography/file.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/roi.h"
+
+
+#define TRACTOGRAPHY_SPATIAL_INDEX_DEFAULT_CELL_SIZE 4.0
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+
+
+
+      extern const App::Option SpatialIndexOption;
+
+
+
+      /*! A spatial index over the vertices of a tractogram
+       *
+       * Scanner space is divided into a regular grid of cubic cells; for each
+       * cell traversed by at least one streamline vertex, the (sorted) list of
+       * indices of those streamlines having at least one vertex within the cell
+       * is stored. Only occupied cells are stored, so no bounding box needs to
+       * be known in advance.
+       *
+       * Querying the index with a region of interest yields a superset of
+       * those streamlines that possess at least one vertex within that ROI
+       * (according to ROI::contains()); streamlines not in this set are
+       * guaranteed not to intersect the ROI, and therefore do not need to be
+       * explicitly tested.
+       *
+       * The index can be written to / read from file; the timestamp and count
+       * of the corresponding track file are stored, such that an index can
+       * be verified as belonging to a particular track file. */
+      class SpatialIndex
+      { MEMALIGN(SpatialIndex)
+
+        public:
+          using key_type = uint64_t;
+          using id_type = uint32_t;
+
+          //! load a spatial index from file
+          SpatialIndex (const std::string& path);
+
+          //! generate the spatial index from a track file
+          SpatialIndex (const std::string& tck_path, const float cell_size);
+
+          void save (const std::string& path) const;
+
+          //! ensure that this index was generated from the track file with the provided properties
+          void verify (const Properties& tck_properties) const;
+
+          size_t num_streamlines() const { return count; }
+          size_t num_cells() const { return keys.size(); }
+          float get_cell_size() const { return cell_size; }
+
+          //! the set of streamlines that may possess a vertex within this ROI
+          BitSet candidates (const ROI&) const;
+          //! the set of streamlines that may possess a vertex within all (intersection = true) or any (intersection = false) of these ROIs
+          BitSet candidates (const ROISet&, const bool intersection) const;
+
+
+        private:
+          float cell_size;
+          size_t count;
+          Properties properties;
+
+          // Occupied cells, in compressed sparse row format
+          vector<key_type> keys;
+          vector<uint64_t> offsets;
+          vector<id_type> ids;
+
+          key_type key (const Eigen::Array3i&) const;
+          Eigen::Array3i cell (const Eigen::Vector3f&) const;
+
+          // Get the keys of all cells that overlap the axis-aligned
+          //   bounding box defined by these two points
+          void add_box (const Eigen::Vector3f&, const Eigen::Vector3f&, vector<key_type>&) const;
+          // Get the set of streamlines present in any of these cells
+          BitSet from_cells (vector<key_type>&) const;
+
+          class CellList;
+      };
+
+
+
+    }
+  }
+}
+
+#endif
+
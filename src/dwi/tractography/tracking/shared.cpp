@@ -15,6 +15,8 @@
 
 #include "dwi/tractography/tracking/shared.h"
 
+#include "file/config.h"
+
 
 namespace MR
 {
@@ -43,6 +45,15 @@ namespace MR
             rk4 (false),
             stop_on_all_include (false),
             implicit_max_num_seeds (properties.find ("max_num_seeds") == properties.end()),
+            //CONF option: TckgenFixedLmaxSH
+            //CONF default: 1 (true)
+            //CONF Specifies whether the SH-based tracking algorithms should
+            //CONF evaluate the FOD using the implementations specialised for
+            //CONF each even lmax up to 12 where the precomputed lookup table is
+            //CONF not in use (i.e. with the -noprecomputed option). Set to
+            //CONF false to use the generic implementation instead; the results
+            //CONF should be identical to within floating-point precision.
+            fixed_lmax_sh (File::Config::get_bool ("TckgenFixedLmaxSH", true)),
             downsampler ()
 #ifdef DEBUG_TERMINATIONS
           , debug_header (Header::open (properties.find ("act") == properties.end() ? diff_path : properties["act"])),
@@ -81,6 +92,20 @@ namespace MR
               throw Exception ("Cannot use -stop option if ACT backtracking is enabled");
           }
 
+          //CONF option: TckgenROIUpsampleRatio
+          //CONF default: 1.0
+          //CONF Where multiple inclusion, exclusion or mask regions of interest
+          //CONF are provided to tckgen, these are rasterised in advance onto a
+          //CONF common grid, such that most streamline vertices can be tested
+          //CONF against all regions with a single lookup. This sets the resolution
+          //CONF of that grid relative to that of the finest region of interest;
+          //CONF larger values use more memory but invoke fewer exact tests.
+          //CONF Set to 0 to disable this precomputation.
+          const float roi_upsample_ratio = File::Config::get_float ("TckgenROIUpsampleRatio", 1.0f);
+          properties.include.precompute (roi_upsample_ratio);
+          properties.exclude.precompute (roi_upsample_ratio);
+          properties.mask.precompute (roi_upsample_ratio);
+
           if (properties.find ("downsample_factor") != properties.end())
             downsampler.set_ratio (to<int> (properties["downsample_factor"]));
 
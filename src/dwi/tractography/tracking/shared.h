@@ -62,7 +62,7 @@ namespace MR
             float max_angle, max_angle_rk4, cos_max_angle, cos_max_angle_rk4;
             float step_size, threshold, init_threshold;
             size_t max_seed_attempts;
-            bool unidirectional, rk4, stop_on_all_include, implicit_max_num_seeds;
+            bool unidirectional, rk4, stop_on_all_include, implicit_max_num_seeds, fixed_lmax_sh;
             DWI::Tractography::Resampling::Downsampler downsampler;
 
             // Additional members for ACT
@@ -41,6 +41,28 @@ namespace MR
 
 
 
+      //! check whether a linear transform is a rotation
+      /*! This returns true if \a linear is orthogonal up to an isotropic
+       * scaling factor (returned in \a scale), in which case \a rotation is
+       * set to the corresponding proper rotation. Reflections are folded into
+       * the rotation, since these have no effect on antipodally symmetric
+       * functions such as FODs. */
+      template <class MatrixType>
+      inline bool is_rotation (const MatrixType& linear, Eigen::Matrix3d& rotation, default_type& scale, const default_type tolerance = 1.0e-6)
+      {
+        const Eigen::Matrix3d M = linear.transpose() * linear;
+        const default_type scale2 = M.trace() / 3.0;
+        if (!(scale2 > 0.0) || (M - scale2 * Eigen::Matrix3d::Identity()).norm() > tolerance * scale2)
+          return false;
+        scale = std::sqrt (scale2);
+        rotation = linear / scale;
+        if (rotation.determinant() < 0.0)
+          rotation = -rotation;
+        return true;
+      }
+
+
+
       template <class FODImageType>
       class LinearKernel { MEMALIGN(LinearKernel<FODImageType>)
 
@@ -48,8 +70,26 @@ namespace MR
           LinearKernel (const ssize_t n_SH,
                         const transform_type& linear_transform,
                         const Eigen::MatrixXd& directions,
-                        const bool modulate) : fod (n_SH)
+                        const bool modulate) :
+              rotation (Math::SH::LforN (n_SH)),
+              modulation (1.0),
+              fod (n_SH)
           {
+            // for rigid transforms (possibly with isotropic scaling), rotate
+            // the SH coefficients directly: this is exact, and much cheaper
+            // to apply than the full aPSF-based transform
+            Eigen::Matrix3d R;
+            default_type scale;
+            use_rotation = is_rotation (linear_transform.linear(), R, scale);
+            if (use_rotation) {
+              // directions are mapped by the inverse of the linear transform:
+              rotation.set (R.transpose());
+              if (modulate)
+                modulation = scale * scale;
+              DEBUG ("reorienting FODs using exact SH rotation");
+              return;
+            }
+
             Eigen::MatrixXd transformed_directions = linear_transform.linear().inverse() * directions;
 
             if (modulate) {
@@ -69,14 +109,24 @@ namespace MR
             in.index(3) = 0;
             if (in.value() > 0.0) { // only reorient voxels that contain a FOD
               fod = in.row(3);
-              fod = transform * fod;
-              out.row(3) = fod;
+              if (use_rotation) {
+                rotation (rotated, fod);
+                if (modulation != 1.0)
+                  rotated *= modulation;
+                out.row(3) = rotated;
+              } else {
+                fod = transform * fod;
+                out.row(3) = fod;
+              }
             }
           }
 
         protected:
+          Math::SH::Rotation<default_type> rotation;
+          bool use_rotation;
+          default_type modulation;
           Eigen::MatrixXd transform;
-          Eigen::VectorXd fod; 
+          Eigen::VectorXd fod, rotated;
       };
 
 
@@ -127,32 +177,35 @@ namespace MR
                            directions (directions),
                            modulate (modulate),
                            FOD_to_aPSF_transform (Math::pinv (aPSF_weights_to_FOD_transform (n_SH, directions))),
+                           RH (Math::SH::aPSF<default_type> (Math::SH::LforN (n_SH)).RH_coefs()),
+                           delta_func (Math::SH::delta_function<Eigen::VectorXd,Eigen::Vector3d> (Math::SH::LforN (n_SH))),
                            fod (n_SH) {}
 
 
+          // rather than forming the full (n_SH x n_SH) transform in each
+          // voxel, the FOD is projected onto the aPSF weights, and the
+          // reoriented FOD is synthesised directly from the transformed
+          // directions. Since the aPSF convolution is linear, it is applied
+          // once to the sum of the delta functions, rather than to each term.
           void operator() (FODImageType& image) {
             image.index(3) = 0;
             if (image.value() > 0) {  // only reorient voxels that contain a FOD
               for (size_t dim = 0; dim < 3; ++dim)
                 jacobian_adapter.index(dim) = image.index(dim);
               Eigen::MatrixXd jacobian = jacobian_adapter.value().inverse().template cast<default_type>();
-              Eigen::MatrixXd transformed_directions = jacobian * directions;
-
-              if (modulate) {
-                Eigen::MatrixXd modulation_factors = transformed_directions.colwise().norm() / jacobian.determinant();
-                transformed_directions.colwise().normalize();
-
-                Eigen::MatrixXd temp = aPSF_weights_to_FOD_transform (n_SH, transformed_directions);
-                for (ssize_t i = 0; i < temp.cols(); ++i)
-                  temp.col(i) = temp.col(i) * modulation_factors(0,i);
+              transformed_directions.noalias() = jacobian * directions;
 
-                transform.noalias() = temp * FOD_to_aPSF_transform;
-              } else {
-                transformed_directions.colwise().normalize();
-                transform.noalias() = aPSF_weights_to_FOD_transform (n_SH, transformed_directions) * FOD_to_aPSF_transform;
-              }
               fod = image.row(3);
-              fod = transform * fod;
+              weights.noalias() = FOD_to_aPSF_transform * fod;
+              if (modulate)
+                weights.array() *= transformed_directions.colwise().norm().transpose().array() / jacobian.determinant();
+
+              fod.setZero();
+              for (ssize_t i = 0; i < transformed_directions.cols(); ++i) {
+                delta_func (delta_vec, transformed_directions.col(i).normalized(), Math::SH::LforN (n_SH));
+                fod += weights[i] * delta_vec;
+              }
+              Math::SH::sconv (fod, RH);
               image.row(3) = fod;
             }
           }
@@ -162,8 +215,10 @@ namespace MR
             const Eigen::MatrixXd& directions;
             const bool modulate;
             const Eigen::MatrixXd FOD_to_aPSF_transform;
-            Eigen::MatrixXd transform;
-            Eigen::VectorXd fod;
+            const Eigen::VectorXd RH;
+            const Math::SH::delta_function_type<Eigen::VectorXd,Eigen::Vector3d> delta_func;
+            Eigen::MatrixXd transformed_directions;
+            Eigen::VectorXd fod, weights, delta_vec;
       };
 
 
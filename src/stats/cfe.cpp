@@ -15,6 +15,25 @@
 
 #include "stats/cfe.h"
 
+#include "progressbar.h"
+#include "raw.h"
+#include "thread_queue.h"
+#include "file/binary_data.h"
+#include "file/key_value.h"
+#include "file/ofstream.h"
+
+#include "dwi/tractography/file.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/mapping/loader.h"
+#include "dwi/tractography/mapping/mapping.h"
+
+
+// Number of buffered fixel pairs at which a thread merges its data into the shared matrix
+#define CFE_PAIR_BUFFER_SIZE (1 << 21)
+// Number of mutexes used to protect rows of the shared matrix during merging
+#define CFE_NUM_ROW_MUTEXES 1024
+
+
 namespace MR
 {
   namespace Stats
@@ -27,7 +46,7 @@ namespace MR
       TrackProcessor::TrackProcessor (Image<index_type>& fixel_indexer,
                                       const vector<direction_type>& fixel_directions,
                                       Image<bool>& fixel_mask,
-                                      vector<uint16_t>& fixel_TDI,
+                                      vector<uint32_t>& fixel_TDI,
                                       init_connectivity_matrix_type& connectivity_matrix,
                                       const value_type angular_threshold) :
                                         fixel_indexer        (fixel_indexer) ,
@@ -35,7 +54,27 @@ namespace MR
                                         fixel_mask           (fixel_mask),
                                         fixel_TDI            (fixel_TDI),
                                         connectivity_matrix  (connectivity_matrix),
-                                        angular_threshold_dp (std::cos (angular_threshold * (Math::pi/180.0))) { }
+                                        angular_threshold_dp (std::cos (angular_threshold * (Math::pi/180.0))),
+                                        mutexes              (new vector<std::mutex> (CFE_NUM_ROW_MUTEXES)) { }
+
+
+
+      TrackProcessor::TrackProcessor (const TrackProcessor& that) :
+          fixel_indexer        (that.fixel_indexer),
+          fixel_directions     (that.fixel_directions),
+          fixel_mask           (that.fixel_mask),
+          fixel_TDI            (that.fixel_TDI),
+          connectivity_matrix  (that.connectivity_matrix),
+          angular_threshold_dp (that.angular_threshold_dp),
+          mutexes              (that.mutexes) { }
+
+
+
+      TrackProcessor::~TrackProcessor()
+      {
+        if (visits.size())
+          flush();
+      }
 
 
 
@@ -65,20 +104,21 @@ namespace MR
                   closest_fixel_index = j;
               }
             }
-            if (closest_fixel_index != num_fixels && largest_dp > angular_threshold_dp) {
+            if (closest_fixel_index != num_fixels && largest_dp > angular_threshold_dp)
               tract_fixel_indices.push_back (closest_fixel_index);
-              fixel_TDI[closest_fixel_index]++;
-            }
           }
         }
 
         try {
+          visits.insert (visits.end(), tract_fixel_indices.begin(), tract_fixel_indices.end());
           for (size_t i = 0; i < tract_fixel_indices.size(); i++) {
             for (size_t j = i + 1; j < tract_fixel_indices.size(); j++) {
-              connectivity_matrix[tract_fixel_indices[i]][tract_fixel_indices[j]].value++;
-              connectivity_matrix[tract_fixel_indices[j]][tract_fixel_indices[i]].value++;
+              pairs.push_back ((uint64_t(tract_fixel_indices[i]) << 32) | uint64_t(tract_fixel_indices[j]));
+              pairs.push_back ((uint64_t(tract_fixel_indices[j]) << 32) | uint64_t(tract_fixel_indices[i]));
             }
           }
+          if (pairs.size() >= CFE_PAIR_BUFFER_SIZE)
+            flush();
           return true;
         } catch (...) {
           throw Exception ("Error assigning memory for CFE connectivity matrix");
@@ -88,6 +128,258 @@ namespace MR
 
 
 
+      void TrackProcessor::flush()
+      {
+        // Sorting the buffered data groups all contributions to each row,
+        //   and all contributions to each element within that row
+        std::sort (pairs.begin(), pairs.end());
+        std::sort (visits.begin(), visits.end());
+
+        vector<InitMatrixElement> additions, insertions;
+        auto p = pairs.begin();
+        for (auto v = visits.begin(); v != visits.end();) {
+          // Every row present in the buffered pairs is also present in the buffered visits
+          const index_type row = *v;
+          uint32_t visit_count = 0;
+          for (; v != visits.end() && *v == row; ++v)
+            ++visit_count;
+          additions.clear();
+          while (p != pairs.end() && index_type(*p >> 32) == row) {
+            const uint64_t key = *p;
+            uint32_t count = 0;
+            for (; p != pairs.end() && *p == key; ++p)
+              ++count;
+            additions.push_back (InitMatrixElement (index_type(key & 0xFFFFFFFF), count));
+          }
+
+          std::lock_guard<std::mutex> lock ((*mutexes)[row % mutexes->size()]);
+          fixel_TDI[row] += visit_count;
+          // Increment existing elements in place; new elements are
+          //   appended and merged in a single pass
+          auto& data (connectivity_matrix[row]);
+          insertions.clear();
+          auto d = data.begin();
+          for (const auto& a : additions) {
+            d = std::lower_bound (d, data.end(), a);
+            if (d != data.end() && d->index() == a.index())
+              d->add (a.value());
+            else
+              insertions.push_back (a);
+          }
+          if (insertions.size()) {
+            const size_t old_size = data.size();
+            data.insert (data.end(), insertions.begin(), insertions.end());
+            std::inplace_merge (data.begin(), data.begin() + old_size, data.end());
+          }
+        }
+        assert (p == pairs.end());
+        pairs.clear();
+        visits.clear();
+      }
+
+
+
+
+
+
+
+
+      namespace {
+        const char* connectivity_firstline = "mrtrix fixel connectivity";
+      }
+
+
+
+      ConnectivityMatrix::ConnectivityMatrix (const std::string& path) :
+          angular_threshold (NaN),
+          connectivity_threshold (NaN),
+          mask_fixels (0)
+      {
+        File::KeyValue kv (path, connectivity_firstline);
+        std::string data_file, datatype ("Float32LE");
+        size_t num_fixels = 0, num_entries = 0;
+        connectivity_value_type scale = NaN;
+        while (kv.next()) {
+          const std::string key = lowercase (kv.key());
+          if (key == "angular_threshold")
+            angular_threshold = to<value_type> (kv.value());
+          else if (key == "connectivity_threshold")
+            connectivity_threshold = to<value_type> (kv.value());
+          else if (key == "fixels")
+            num_fixels = to<size_t> (kv.value());
+          else if (key == "mask_fixels")
+            mask_fixels = to<index_type> (kv.value());
+          else if (key == "entries")
+            num_entries = to<size_t> (kv.value());
+          else if (key == "datatype")
+            datatype = kv.value();
+          else if (key == "scale")
+            scale = to<connectivity_value_type> (kv.value());
+          else if (key == "file")
+            data_file = kv.value();
+          else
+            properties[kv.key()] = kv.value();
+        }
+        if (!num_fixels || !std::isfinite (angular_threshold) || !std::isfinite (connectivity_threshold) || data_file.empty())
+          throw Exception ("fixel connectivity file \"" + path + "\" is missing essential header information");
+        if (num_fixels > size_t(std::numeric_limits<index_type>::max()))
+          throw Exception ("fixel connectivity file \"" + path + "\" contains too many fixels");
+        const bool quantised = (datatype == "UInt16LE");
+        if (!quantised && datatype != "Float32LE")
+          throw Exception ("unsupported data type \"" + datatype + "\" in fixel connectivity file \"" + path + "\"");
+        if (quantised && !std::isfinite (scale))
+          throw Exception ("fixel connectivity file \"" + path + "\" is missing scale factor for quantised data");
+
+        std::ifstream in;
+        File::open_data (in, path, data_file, "fixel connectivity");
+        offsets.resize (num_fixels + 1);
+        indices.resize (num_entries);
+        File::read_LE (in, offsets);
+        File::read_LE (in, indices);
+        if (quantised) {
+          vector<uint16_t> quantised_values (num_entries);
+          File::read_LE (in, quantised_values);
+          values.reserve (num_entries);
+          for (auto q : quantised_values)
+            values.push_back (q * scale);
+        } else {
+          values.resize (num_entries);
+          File::read_LE (in, values);
+        }
+        if (!in.good())
+          throw Exception ("error reading fixel connectivity file \"" + path + "\" (file may be truncated)");
+        if (offsets.front() || offsets.back() != num_entries || !std::is_sorted (offsets.begin(), offsets.end()))
+          throw Exception ("malformed fixel connectivity file \"" + path + "\"");
+        for (auto i : indices) {
+          if (i >= num_fixels)
+            throw Exception ("malformed fixel connectivity file \"" + path + "\"");
+        }
+        DEBUG ("fixel connectivity file \"" + path + "\" loaded: " + str(num_fixels) + " fixels, " + str(num_entries) + " entries");
+      }
+
+
+
+      ConnectivityMatrix::ConnectivityMatrix (const std::string& tck_path,
+                                              Image<index_type>& fixel_indexer,
+                                              const vector<direction_type>& fixel_directions,
+                                              Image<bool>& fixel_mask,
+                                              const value_type angular_threshold,
+                                              const value_type connectivity_threshold) :
+          angular_threshold (angular_threshold),
+          connectivity_threshold (connectivity_threshold),
+          mask_fixels (0)
+      {
+        const index_type num_fixels = fixel_directions.size();
+        for (fixel_mask.index(0) = 0; fixel_mask.index(0) != num_fixels; ++fixel_mask.index(0)) {
+          if (fixel_mask.value())
+            ++mask_fixels;
+        }
+
+        // Compute fixel-fixel connectivity
+        init_connectivity_matrix_type connectivity_matrix (num_fixels);
+        vector<uint32_t> fixel_TDI (num_fixels, 0);
+        DWI::Tractography::Properties tck_properties;
+        DWI::Tractography::Reader<float> track_file (tck_path, tck_properties);
+        // Read in tracts, and compute whole-brain fixel-fixel connectivity
+        const size_t num_tracks = tck_properties["count"].empty() ? 0 : to<size_t> (tck_properties["count"]);
+        if (!num_tracks)
+          throw Exception ("no tracks found in input file");
+        if (num_tracks < 1000000)
+          WARN ("more than 1 million tracks should be used to ensure robust fixel-fixel connectivity");
+        if (tck_properties.find ("timestamp") != tck_properties.end())
+          properties["timestamp"] = tck_properties["timestamp"];
+        properties["count"] = str(num_tracks);
+        {
+          DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity");
+          DWI::Tractography::Mapping::TrackMapperBase mapper (fixel_indexer);
+          mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (Header (fixel_indexer), tck_properties, 0.333f));
+          mapper.set_use_precise_mapping (true);
+          TrackProcessor tract_processor (fixel_indexer, fixel_directions, fixel_mask, fixel_TDI, connectivity_matrix, angular_threshold);
+          Thread::run_queue (
+              loader,
+              Thread::batch (DWI::Tractography::Streamline<float>()),
+              Thread::multi (mapper),
+              Thread::batch (SetVoxelDir()),
+              Thread::multi (tract_processor));
+        }
+        track_file.close();
+
+        // Normalise connectivity matrix, threshold, and convert to compressed sparse row format
+        offsets.reserve (num_fixels + 1);
+        offsets.push_back (0);
+        {
+          ProgressBar progress ("normalising and thresholding fixel-fixel connectivity matrix", num_fixels);
+          for (index_type fixel = 0; fixel != num_fixels; ++fixel) {
+            for (const auto& it : connectivity_matrix[fixel]) {
+              const connectivity_value_type value = connectivity_value_type (it.value()) / connectivity_value_type (fixel_TDI[fixel]);
+              if (value >= connectivity_threshold) {
+                indices.push_back (it.index());
+                values.push_back (value);
+              }
+            }
+            offsets.push_back (indices.size());
+            // Force deallocation of memory used for this fixel in the original matrix
+            vector<InitMatrixElement>().swap (connectivity_matrix[fixel]);
+            ++progress;
+          }
+        }
+        INFO ("fixel-fixel connectivity matrix contains " + str(indices.size()) + " entries (mean " + str(indices.size() / std::max (float(mask_fixels), 1.0f)) + " connections per fixel)");
+      }
+
+
+
+      bool ConnectivityMatrix::is_file (const std::string& path)
+      {
+        std::ifstream in (path.c_str(), std::ios::in | std::ios::binary);
+        std::string line;
+        if (!in || !std::getline (in, line))
+          return false;
+        return !line.compare (0, strlen (connectivity_firstline), connectivity_firstline);
+      }
+
+
+
+      void ConnectivityMatrix::save (const std::string& path, const bool quantise) const
+      {
+        File::OFStream out (path, std::ios::out | std::ios::binary);
+        out << connectivity_firstline << "\n";
+        out << "angular_threshold: " << str(angular_threshold) << "\n";
+        out << "connectivity_threshold: " << str(connectivity_threshold) << "\n";
+        for (const auto& i : properties)
+          out << i.first << ": " << i.second << "\n";
+        out << "fixels: " << num_fixels() << "\n";
+        out << "mask_fixels: " << mask_fixels << "\n";
+        out << "entries: " << num_entries() << "\n";
+        // Connectivity values lie within [0, 1] (or very close to it), so can be
+        //   stored in a fixed-point representation without appreciable loss of precision
+        connectivity_value_type scale = 1.0f;
+        if (quantise) {
+          const connectivity_value_type max_value = values.size() ? *std::max_element (values.begin(), values.end()) : 0.0f;
+          if (max_value > 0.0f)
+            scale = max_value / connectivity_value_type (std::numeric_limits<uint16_t>::max());
+          out << "datatype: UInt16LE\n";
+          out << "scale: " << str(scale) << "\n";
+        } else {
+          out << "datatype: Float32LE\n";
+        }
+        File::write_data_offset (out, 8);
+        File::write_LE (out, offsets);
+        File::write_LE (out, indices);
+        if (quantise) {
+          vector<uint16_t> quantised_values;
+          quantised_values.reserve (values.size());
+          for (auto v : values)
+            quantised_values.push_back (uint16_t (std::min (std::round (v / scale), connectivity_value_type (std::numeric_limits<uint16_t>::max()))));
+          File::write_LE (out, quantised_values);
+        } else {
+          File::write_LE (out, values);
+        }
+        if (!out.good())
+          throw Exception ("error writing fixel connectivity file \"" + path + "\": " + strerror (errno));
+      }
+
+
+
 
 
 
@@ -96,32 +388,85 @@ namespace MR
       Enhancer::Enhancer (const norm_connectivity_matrix_type& connectivity_matrix,
                           const value_type dh,
                           const value_type E,
-                          const value_type H) :
+                          const value_type H,
+                          const bool threaded) :
           connectivity_matrix (connectivity_matrix),
           dh (dh),
           E (E),
-          H (H) { }
+          H (H),
+          threaded (threaded) { }
 
 
 
       value_type Enhancer::operator() (const vector_type& stats, vector_type& enhanced_stats) const
       {
         enhanced_stats = vector_type::Zero (stats.size());
-        value_type max_enhanced_stat = 0.0;
-        vector<NormMatrixElement>::const_iterator connected_fixel;
-        for (size_t fixel = 0; fixel < connectivity_matrix.size(); ++fixel) {
-          for (value_type h = this->dh; h < stats[fixel]; h +=  this->dh) {
-            value_type extent = 0.0;
-            for (connected_fixel = connectivity_matrix[fixel].begin(); connected_fixel != connectivity_matrix[fixel].end(); ++connected_fixel)
-              if (stats[connected_fixel->index()] > h)
-                extent += connected_fixel->value();
-            enhanced_stats[fixel] += std::pow (extent, E) * std::pow (h, H);
-          }
-          if (enhanced_stats[fixel] > max_enhanced_stat)
-            max_enhanced_stat = enhanced_stats[fixel];
+        if (!connectivity_matrix.size())
+          return 0.0;
+
+        // All heights at which any fixel is enhanced, and the cumulative sum of height terms
+        const value_type max_stat = stats.head (connectivity_matrix.size()).maxCoeff();
+        vector<value_type> heights, cumulative (1, 0.0);
+        for (value_type h = dh; h < max_stat; h += dh) {
+          heights.push_back (h);
+          cumulative.push_back (cumulative.back() + std::pow (h, H));
+        }
+
+        if (!threaded || Thread::number_of_threads() <= 1) {
+          vector<Band> bands;
+          for (size_t fixel = 0; fixel != connectivity_matrix.size(); ++fixel)
+            enhanced_stats[fixel] = enhance (stats, fixel, heights, cumulative, bands);
+        } else {
+          size_t counter = 0;
+          auto source = [&] (size_t& fixel) { return ((fixel = counter++) < connectivity_matrix.size()); };
+          auto worker = [&] (const size_t& fixel)
+          {
+            static thread_local vector<Band> bands;
+            enhanced_stats[fixel] = enhance (stats, fixel, heights, cumulative, bands);
+            return true;
+          };
+          Thread::run_queue (source, Thread::batch (size_t(), 1024), Thread::multi (worker));
         }
 
-        return max_enhanced_stat;
+        return std::max (value_type(0), enhanced_stats.head (connectivity_matrix.size()).maxCoeff());
+      }
+
+
+
+      value_type Enhancer::enhance (const vector_type& stats,
+                                    const size_t fixel,
+                                    const vector<value_type>& heights,
+                                    const vector<value_type>& cumulative,
+                                    vector<Band>& bands) const
+      {
+        // Number of heights at which a statistic exceeds threshold
+        auto num_levels = [&] (const value_type stat) -> size_t {
+          return std::lower_bound (heights.begin(), heights.end(), stat) - heights.begin();
+        };
+
+        const size_t fixel_levels = num_levels (stats[fixel]);
+        if (!fixel_levels)
+          return 0.0;
+
+        bands.clear();
+        for (const auto& connected_fixel : connectivity_matrix[fixel]) {
+          const size_t levels = std::min (fixel_levels, num_levels (stats[connected_fixel.index()]));
+          if (levels)
+            bands.push_back (Band (levels, connected_fixel.value()));
+        }
+        std::sort (bands.begin(), bands.end());
+
+        value_type enhanced = 0.0, extent = 0.0;
+        size_t level = fixel_levels;
+        auto band = bands.begin();
+        while (level) {
+          while (band != bands.end() && band->levels == level)
+            extent += (band++)->value;
+          const size_t next_level = band == bands.end() ? 0 : band->levels;
+          enhanced += std::pow (extent, E) * (cumulative[level] - cumulative[next_level]);
+          level = next_level;
+        }
+        return enhanced;
       }
 
 
@@ -16,6 +16,8 @@
 #ifndef __stats_cfe_h__
 #define __stats_cfe_h__
 
+#include <mutex>
+
 #include "image.h"
 #include "image_helpers.h"
 #include "types.h"
@@ -45,11 +47,21 @@ namespace MR
       @{ */
 
 
-      class connectivity { NOMEMALIGN
+      // A class to store fixel index / streamline count pairs
+      //   while the connectivity matrix is being built
+      class InitMatrixElement
+      { NOMEMALIGN
         public:
-          connectivity () : value (0.0) { }
-          connectivity (const connectivity_value_type v) : value (v) { }
-          connectivity_value_type value;
+          InitMatrixElement (const index_type fixel_index, const uint32_t count) :
+              fixel_index (fixel_index),
+              track_count (count) { }
+          FORCE_INLINE index_type index() const { return fixel_index; }
+          FORCE_INLINE uint32_t value() const { return track_count; }
+          FORCE_INLINE void add (const uint32_t count) { track_count += count; }
+          FORCE_INLINE bool operator< (const InitMatrixElement& that) const { return fixel_index < that.fixel_index; }
+        private:
+          index_type fixel_index;
+          uint32_t track_count;
       };
 
 
@@ -74,13 +86,19 @@ namespace MR
 
       // Different types are used depending on whether the connectivity matrix
       //   is in the process of being built, or whether it has been normalised
-      using init_connectivity_matrix_type = vector<std::map<index_type, connectivity>>;
+      //   (during construction, each row is kept sorted by fixel index)
+      using init_connectivity_matrix_type = vector<vector<InitMatrixElement>>;
       using norm_connectivity_matrix_type = vector<vector<NormMatrixElement>>;
 
 
 
       /**
        * Process each track by converting each streamline to a set of dixels, and map these to fixels.
+       *
+       * Can be run in multiple threads: each copy buffers the fixel pairs traversed by its
+       * streamlines, and periodically sorts these and merges the resulting counts into the
+       * shared connectivity matrix (row-wise locking permits concurrent merges from different
+       * threads). Any remaining buffered data are merged upon destruction.
        */
       class TrackProcessor { MEMALIGN(TrackProcessor)
 
@@ -88,9 +106,11 @@ namespace MR
           TrackProcessor (Image<index_type>& fixel_indexer,
                           const vector<direction_type>& fixel_directions,
                           Image<bool>& fixel_mask,
-                          vector<uint16_t>& fixel_TDI,
+                          vector<uint32_t>& fixel_TDI,
                           init_connectivity_matrix_type& connectivity_matrix,
                           const value_type angular_threshold);
+          TrackProcessor (const TrackProcessor&);
+          ~TrackProcessor();
 
           bool operator () (const SetVoxelDir& in);
 
@@ -98,18 +118,96 @@ namespace MR
           Image<index_type> fixel_indexer;
           const vector<direction_type>& fixel_directions;
           Image<bool> fixel_mask;
-          vector<uint16_t>& fixel_TDI;
+          vector<uint32_t>& fixel_TDI;
           init_connectivity_matrix_type& connectivity_matrix;
           const value_type angular_threshold_dp;
+          std::shared_ptr<vector<std::mutex>> mutexes;
+
+          // Buffered data not yet merged into the shared matrix:
+          //   fixel pairs encoded as (row << 32 | column), and the fixels traversed
+          vector<uint64_t> pairs;
+          vector<index_type> visits;
+
+          void flush();
+      };
+
+
+
+
+      /*! Fixel-fixel connectivity, normalised by fixel TDI and thresholded
+       *
+       * For each template fixel, the fraction of streamlines traversing that fixel
+       * that also traverse each other fixel, retaining only those connections that
+       * exceed the connectivity threshold. Data are stored in compressed sparse row
+       * format, indexed by template fixel (not by row of the statistical analysis),
+       * such that the same matrix can be re-used for multiple analyses, regardless of
+       * the connectivity exponent or smoothing kernel.
+       *
+       * The matrix can be written to / read from file, so that fixel-fixel
+       * connectivity need only be computed from the tractogram once. */
+      class ConnectivityMatrix
+      { MEMALIGN(ConnectivityMatrix)
+        public:
+          //! load a connectivity matrix from file
+          ConnectivityMatrix (const std::string& path);
+
+          //! compute fixel-fixel connectivity from a track file
+          ConnectivityMatrix (const std::string& tck_path,
+                              Image<index_type>& fixel_indexer,
+                              const vector<direction_type>& fixel_directions,
+                              Image<bool>& fixel_mask,
+                              const value_type angular_threshold,
+                              const value_type connectivity_threshold);
+
+          //! determine whether \a path is a fixel connectivity file from its contents, rather than its suffix
+          static bool is_file (const std::string& path);
+
+          //! write to file; if \a quantise is true, connectivity values are stored as 16-bit integers
+          void save (const std::string& path, const bool quantise) const;
+
+          index_type num_fixels() const { return offsets.size() - 1; }
+          size_t num_entries() const { return indices.size(); }
+          index_type num_mask_fixels() const { return mask_fixels; }
+          value_type get_angular_threshold() const { return angular_threshold; }
+          value_type get_connectivity_threshold() const { return connectivity_threshold; }
+
+          uint64_t row_begin (const index_type fixel) const { return offsets[fixel]; }
+          uint64_t row_end   (const index_type fixel) const { return offsets[fixel+1]; }
+          index_type index (const uint64_t entry) const { return indices[entry]; }
+          connectivity_value_type value (const uint64_t entry) const { return values[entry]; }
+
+          std::map<std::string, std::string> properties;
+
+        private:
+          value_type angular_threshold, connectivity_threshold;
+          index_type mask_fixels;
+          vector<uint64_t> offsets;
+          vector<index_type> indices;
+          vector<connectivity_value_type> values;
       };
 
 
 
 
+      /*! Connectivity-based fixel enhancement
+       *
+       * For each fixel, the extent at each height is constant between those heights
+       * at which connected fixels fall below threshold. The connected fixels are therefore
+       * sorted by the number of heights at which they exceed threshold, and the enhanced
+       * statistic is integrated band-wise using the pre-computed sum of height terms across
+       * each band, rather than re-computing the extent from all connected fixels at every
+       * height.
+       *
+       * If \a threaded is set on construction, fixels are processed in parallel. This
+       * should only be requested where the enhancer is invoked from a single thread
+       * (e.g. for the default permutation); during permutation testing, the enhancer
+       * is instead invoked concurrently from multiple threads, and each call should
+       * then run in the calling thread only. */
       class Enhancer : public Stats::EnhancerBase { MEMALIGN (Enhancer)
         public:
           Enhancer (const norm_connectivity_matrix_type& connectivity_matrix,
-                    const value_type dh, const value_type E, const value_type H);
+                    const value_type dh, const value_type E, const value_type H,
+                    const bool threaded = false);
           virtual ~Enhancer() { }
 
 
@@ -119,6 +217,19 @@ namespace MR
         protected:
           const norm_connectivity_matrix_type& connectivity_matrix;
           const value_type dh, E, H;
+          const bool threaded;
+
+          // A connected fixel, alongside the number of heights at which it exceeds threshold
+          class Band
+          { NOMEMALIGN
+            public:
+              Band (const size_t levels, const connectivity_value_type value) : levels (levels), value (value) { }
+              bool operator< (const Band& that) const { return levels > that.levels; }
+              size_t levels;
+              connectivity_value_type value;
+          };
+
+          value_type enhance (const vector_type&, const size_t, const vector<value_type>&, const vector<value_type>&, vector<Band>&) const;
       };
 
 
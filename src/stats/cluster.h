@@ -51,6 +51,11 @@ namespace MR
 
           value_type operator() (const vector_type&, const value_type, vector_type&) const override;
 
+          const Filter::Connector* get_connector() const override { return &connector; }
+
+          // Filter::Connector compares against a single-precision threshold
+          bool is_suprathreshold (const value_type stat, const value_type T) const override { return stat > float(T); }
+
 
         protected:
           const Filter::Connector& connector;
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "stats/permshard.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "raw.h"
+#include "file/binary_data.h"
+#include "file/key_value.h"
+#include "file/ofstream.h"
+
+
+namespace MR
+{
+  namespace Stats
+  {
+    namespace PermTest
+    {
+
+
+
+      namespace {
+        const char* shard_firstline = "mrtrix permutation shard";
+
+        void write_counter (File::OFStream& out, const vector<size_t>& data)
+        {
+          vector<uint64_t> temp (data.begin(), data.end());
+          File::write_LE (out, temp);
+        }
+
+        void read_counter (std::ifstream& in, vector<size_t>& data)
+        {
+          vector<uint64_t> temp (data.size());
+          File::read_LE (in, temp);
+          data.assign (temp.begin(), temp.end());
+        }
+      }
+
+
+
+      Shard::Shard (const std::string& path) :
+          num_permutations (0),
+          first (0),
+          num_elements (0),
+          checksum (NaN)
+      {
+        File::KeyValue kv (path, shard_firstline);
+        std::string data_file;
+        size_t num = 0;
+        bool neg = false;
+        while (kv.next()) {
+          const std::string key = lowercase (kv.key());
+          if (key == "permutations")
+            num_permutations = to<size_t> (kv.value());
+          else if (key == "first")
+            first = to<size_t> (kv.value());
+          else if (key == "count")
+            num = to<size_t> (kv.value());
+          else if (key == "elements")
+            num_elements = to<size_t> (kv.value());
+          else if (key == "negative")
+            neg = to<bool> (kv.value());
+          else if (key == "seed")
+            seed = kv.value();
+          else if (key == "checksum")
+            checksum = to<default_type> (kv.value());
+          else if (key == "file")
+            data_file = kv.value();
+          else
+            WARN ("unknown key \"" + kv.key() + "\" in permutation shard file \"" + path + "\" ignored");
+        }
+        if (!num_permutations || !num || !num_elements || !std::isfinite (checksum) || data_file.empty())
+          throw Exception ("permutation shard file \"" + path + "\" is missing essential header information");
+
+        std::ifstream in;
+        File::open_data (in, path, data_file, "permutation shard");
+        perm_dist_pos.resize (num);
+        uncorrected_pvalue_counter.resize (num_elements);
+        File::read_LE (in, perm_dist_pos.data(), num);
+        read_counter (in, uncorrected_pvalue_counter);
+        if (neg) {
+          perm_dist_neg.resize (num);
+          uncorrected_pvalue_counter_neg.resize (num_elements);
+          File::read_LE (in, perm_dist_neg.data(), num);
+          read_counter (in, uncorrected_pvalue_counter_neg);
+        }
+        if (!in.good())
+          throw Exception ("error reading permutation shard file \"" + path + "\" (file may be truncated)");
+      }
+
+
+
+      Shard::Shard (const size_t num_permutations,
+                    const size_t first,
+                    const size_t count,
+                    const size_t num_elements,
+                    const bool negative,
+                    const std::string& seed,
+                    const default_type checksum) :
+          num_permutations (num_permutations),
+          first (first),
+          num_elements (num_elements),
+          seed (seed),
+          checksum (checksum),
+          perm_dist_pos (vector_type::Zero (count)),
+          uncorrected_pvalue_counter (num_elements, 0)
+      {
+        if (negative) {
+          perm_dist_neg = vector_type::Zero (count);
+          uncorrected_pvalue_counter_neg.assign (num_elements, 0);
+        }
+      }
+
+
+
+      void Shard::save (const std::string& path) const
+      {
+        File::OFStream out (path, std::ios::out | std::ios::binary);
+        out << shard_firstline << "\n";
+        out << "permutations: " << num_permutations << "\n";
+        out << "first: " << first << "\n";
+        out << "count: " << count() << "\n";
+        out << "elements: " << num_elements << "\n";
+        out << "negative: " << str(negative()) << "\n";
+        if (seed.size())
+          out << "seed: " << seed << "\n";
+        out << "checksum: " << str(checksum, 17) << "\n";
+        File::write_data_offset (out, 8);
+        File::write_LE (out, perm_dist_pos.data(), count());
+        write_counter (out, uncorrected_pvalue_counter);
+        if (negative()) {
+          File::write_LE (out, perm_dist_neg.data(), count());
+          write_counter (out, uncorrected_pvalue_counter_neg);
+        }
+        if (!out.good())
+          throw Exception ("error writing permutation shard file \"" + path + "\": " + strerror (errno));
+      }
+
+
+
+      default_type shard_checksum (const Math::Stats::vector_type& data)
+      {
+        return data.sum();
+      }
+
+
+
+      void merge_shards (const vector<std::string>& paths,
+                         const size_t num_permutations,
+                         const bool generated,
+                         const default_type checksum,
+                         Math::Stats::vector_type& perm_dist_pos,
+                         std::shared_ptr<Math::Stats::vector_type> perm_dist_neg,
+                         vector<size_t>& uncorrected_pvalue_counter,
+                         std::shared_ptr<vector<size_t>> uncorrected_pvalue_counter_neg)
+      {
+        vector<bool> processed (num_permutations, false);
+        std::string seed;
+        for (size_t n = 0; n != paths.size(); ++n) {
+          const std::string& path (paths[n]);
+          Shard shard (path);
+          if (shard.num_permutations != num_permutations)
+            throw Exception ("permutation shard file \"" + path + "\" was generated for " + str(shard.num_permutations) + " permutations; "
+                             "expected " + str(num_permutations));
+          if (shard.num_elements != size_t(uncorrected_pvalue_counter.size()))
+            throw Exception ("number of elements in permutation shard file \"" + path + "\" (" + str(shard.num_elements) + ") "
+                             "does not match input data (" + str(uncorrected_pvalue_counter.size()) + ")");
+          if (shard.negative() != bool(perm_dist_neg))
+            throw Exception ("permutation shard file \"" + path + "\" " + (shard.negative() ? "contains" : "does not contain") + " results for the negative contrast");
+          if (shard.seed.empty() == generated)
+            throw Exception ("permutation shard file \"" + path + "\" was generated using " + (generated ? "user-defined" : "randomly generated") + " permutations");
+          if (!n)
+            seed = shard.seed;
+          else if (shard.seed != seed)
+            throw Exception ("permutation shard files were generated using different random seeds");
+          // the default enhanced statistics are bit-identical between runs of the same
+          //   build on the same data, irrespective of multi-threading (including the
+          //   empirical statistic used for non-stationarity correction, which is
+          //   accumulated in a fixed order), and the checksum is stored at full
+          //   precision; an exact comparison is therefore appropriate
+          if (shard.checksum != checksum)
+            throw Exception ("permutation shard file \"" + path + "\" does not originate from the same data and processing options");
+
+          for (size_t i = 0; i != shard.count(); ++i) {
+            const size_t index = shard.first + i;
+            if (index >= num_permutations)
+              throw Exception ("permutation shard file \"" + path + "\" contains permutations beyond the expected number");
+            if (processed[index])
+              throw Exception ("permutation " + str(index) + " is present in more than one shard file");
+            processed[index] = true;
+            perm_dist_pos[index] = shard.perm_dist_pos[i];
+            if (perm_dist_neg)
+              (*perm_dist_neg)[index] = shard.perm_dist_neg[i];
+          }
+          for (size_t i = 0; i != shard.num_elements; ++i) {
+            uncorrected_pvalue_counter[i] += shard.uncorrected_pvalue_counter[i];
+            if (uncorrected_pvalue_counter_neg)
+              (*uncorrected_pvalue_counter_neg)[i] += shard.uncorrected_pvalue_counter_neg[i];
+          }
+        }
+        const size_t missing = std::count (processed.begin(), processed.end(), false);
+        if (missing)
+          throw Exception (str(missing) + " permutation" + (missing > 1 ? "s are" : " is") + " not present in any of the shard files provided");
+        INFO ("results of " + str(num_permutations) + " permutations merged from " + str(paths.size()) + " shard files");
+      }
+
+
+
+    }
+  }
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __stats_permshard_h__
+#define __stats_permshard_h__
+
+#include <memory>
+
+#include "types.h"
+#include "math/stats/typedefs.h"
+
+
+namespace MR
+{
+  namespace Stats
+  {
+    namespace PermTest
+    {
+
+
+
+      //! The partial results of permutation testing for a contiguous range of permutations
+      /*! These are generated when the -shard option is used, such that
+       * permutation testing can be distributed across multiple processes or
+       * machines; the shards can subsequently be combined using
+       * merge_shards() to yield results identical to those that would have
+       * been obtained by processing all permutations in a single process. */
+      class Shard
+      { MEMALIGN (Shard)
+        public:
+          using vector_type = Math::Stats::vector_type;
+
+          //! load a shard from file
+          Shard (const std::string& path);
+          //! initialise an empty shard, to be filled by permutation testing
+          Shard (const size_t num_permutations,
+                 const size_t first,
+                 const size_t count,
+                 const size_t num_elements,
+                 const bool negative,
+                 const std::string& seed,
+                 const default_type checksum);
+
+          void save (const std::string& path) const;
+
+          //! total number of permutations across all shards
+          size_t num_permutations;
+          //! index of the first permutation processed in this shard
+          size_t first;
+          size_t num_elements;
+          //! random seed from which permutations were generated; empty if permutations were provided by the user
+          std::string seed;
+          //! checksum of the default enhanced statistics, to detect shards originating from different analyses
+          default_type checksum;
+
+          //! maximal enhanced statistic of each permutation in this shard
+          vector_type perm_dist_pos, perm_dist_neg;
+          //! for each element, the number of permutations for which the default enhanced statistic is larger
+          vector<size_t> uncorrected_pvalue_counter, uncorrected_pvalue_counter_neg;
+
+          size_t count () const { return perm_dist_pos.size(); }
+          bool negative () const { return perm_dist_neg.size(); }
+      };
+
+
+
+      //! compute a checksum of the default enhanced statistics for inclusion in a Shard
+      default_type shard_checksum (const Math::Stats::vector_type& data);
+
+
+
+      //! combine the contents of shard files, verifying that all permutations are included exactly once
+      void merge_shards (const vector<std::string>& paths,
+                         const size_t num_permutations,
+                         const bool generated,
+                         const default_type checksum,
+                         Math::Stats::vector_type& perm_dist_pos,
+                         std::shared_ptr<Math::Stats::vector_type> perm_dist_neg,
+                         vector<size_t>& uncorrected_pvalue_counter,
+                         std::shared_ptr<vector<size_t>> uncorrected_pvalue_counter_neg);
+
+
+
+    }
+  }
+}
+
+#endif
@@ -15,6 +15,9 @@
 
 #include "stats/permstack.h"
 
+#include "math/math.h"
+#include "math/rng.h"
+
 namespace MR
 {
   namespace Stats
@@ -24,31 +27,60 @@ namespace MR
 
 
 
-      PermutationStack::PermutationStack (const size_t num_permutations, const size_t num_samples, const std::string msg, const bool include_default) :
+      PermutationStack::PermutationStack (const size_t num_permutations, const size_t num_samples, const vector<size_t>& blocks, const std::string msg, const bool include_default) :
           num_permutations (num_permutations),
           counter (0),
+          end (num_permutations),
+          limit (num_permutations),
           progress (msg, num_permutations)
       {
-        Math::Stats::Permutation::generate (num_permutations, num_samples, permutations, include_default);
+        generator.reset (new Math::Stats::Permutation::Generator (num_permutations, num_samples, Math::RNG::get_seed(), blocks, include_default));
+        INFO ("generating permutations using random seed " + str(generator->get_seed()));
       }
 
       PermutationStack::PermutationStack (vector <vector<size_t> >& permutations, const std::string msg) :
           num_permutations (permutations.size()),
           permutations (permutations),
           counter (0),
+          end (num_permutations),
+          limit (num_permutations),
           progress (msg, permutations.size()) { }
 
 
 
+      void PermutationStack::set_range (const size_t first, const size_t count)
+      {
+        if (counter)
+          throw Exception ("cannot restrict range of permutations once permutation testing has commenced");
+        if (first + count > num_permutations)
+          throw Exception ("requested range of permutations (" + str(first) + " to " + str(first+count-1)
+                           + ") exceeds the number of permutations (" + str(num_permutations) + ")");
+        // Generated permutations depend on all of those preceding them,
+        //   due to the rejection of duplicates
+        if (generator) {
+          vector<size_t> temp;
+          for (size_t i = 0; i != first; ++i)
+            (*generator) (temp);
+        }
+        counter = first;
+        end = limit = first + count;
+        progress.set_max (count);
+      }
+
+
+
       bool PermutationStack::operator() (Permutation& out)
       {
-        if (counter < num_permutations) {
-          out.index = counter;
-          out.data = permutations[counter++];
+        if (counter < limit) {
+          out.index = counter++;
+          if (generator)
+            (*generator) (out.data);
+          else
+            out.data = permutations[out.index];
           ++progress;
           return true;
         } else {
-          out.index = num_permutations;
+          out.index = limit;
           out.data.clear();
           return false;
         }
@@ -56,6 +88,23 @@ namespace MR
 
 
 
+      bool PermutationBatcher::operator() (vector<Permutation>& out)
+      {
+        out.resize (batch_size);
+        size_t count = 0;
+        // Batches are aligned to multiples of the batch size, such that the
+        //   composition of each batch does not depend on which range of
+        //   permutations is being processed
+        while (count != batch_size && stack (out[count])) {
+          if (!((out[count++].index + 1) % batch_size))
+            break;
+        }
+        out.resize (count);
+        return count;
+      }
+
+
+
     }
   }
 }
@@ -42,26 +42,63 @@ namespace MR
       class PermutationStack 
       { MEMALIGN (PermutationStack)
         public:
-          PermutationStack (const size_t num_permutations, const size_t num_samples, const std::string msg, const bool include_default = true);
+          //! generate permutations on demand
+          /*! If \a blocks is non-empty (one entry per sample), samples are
+           * exchanged only within the same exchangeability block. */
+          PermutationStack (const size_t num_permutations, const size_t num_samples, const vector<size_t>& blocks, const std::string msg, const bool include_default = true);
 
+          //! use a pre-defined set of permutations
           PermutationStack (vector <vector<size_t> >& permutations, const std::string msg);
 
           bool operator() (Permutation&);
 
-          const vector<size_t>& operator[] (size_t index) const {
-            return permutations[index];
-          }
+          //! only provide those permutations with indices from \a first to (\a first + \a count - 1)
+          /*! Permutation indices, and the permutations themselves, are identical
+           * to those that would be provided if the full set of permutations
+           * were processed. */
+          void set_range (const size_t first, const size_t count);
+
+          //! withhold permutations with index \a limit or greater, until the limit is raised
+          /*! This allows permutation testing to be paused at a well-defined
+           * point, e.g. in order to test whether further permutations are
+           * necessary. */
+          void set_limit (const size_t value) { limit = std::min (value, end); }
+
+          //! the index of the next permutation to be provided
+          size_t next () const { return counter; }
+
+          //! whether permutations are being generated, rather than provided by the user
+          bool is_generated () const { return bool(generator); }
+          size_t get_seed () const { assert (generator); return generator->get_seed(); }
 
           const size_t num_permutations;
 
         protected:
+          std::unique_ptr<Math::Stats::Permutation::Generator> generator;
           vector< vector<size_t> > permutations;
-          size_t counter;
+          size_t counter, end, limit;
           ProgressBar progress;
       };
 
 
 
+      //! Draws permutations from a PermutationStack in batches, for simultaneous processing
+      class PermutationBatcher
+      { MEMALIGN (PermutationBatcher)
+        public:
+          PermutationBatcher (PermutationStack& stack, const size_t batch_size) :
+              stack (stack),
+              batch_size (batch_size) { }
+
+          bool operator() (vector<Permutation>&);
+
+        protected:
+          PermutationStack& stack;
+          const size_t batch_size;
+      };
+
+
+
 
     }
   }
@@ -36,6 +36,31 @@ namespace MR
                                     "where each relabelling is defined as a column vector of size    m, and the number of columns, n, defines "
                                     "the number of permutations. Can be generated with the palm_quickperms function in PALM (http://fsl.fmrib.ox.ac.uk/fsl/fslwiki/PALM). "
                                     "Overrides the nperms option.")
+            + Argument ("file").type_file_in()
+          + Option ("exchange_within", "only exchange subjects within the same exchangeability block; the input should be a text file "
+                                       "containing one integer per subject, defining the block to which each subject belongs. "
+                                       "Applies only to permutations generated internally, not those provided using the -permutations option.")
+            + Argument ("file").type_file_in()
+          + Option ("adaptive", "terminate permutation testing early, once it can be determined with confidence for every element "
+                                "whether or not its family-wise error corrected p-value is less than the specified alpha; in this case the "
+                                "number of permutations specified via the -nperms or -permutations option is the maximal number "
+                                "processed. The Monte Carlo standard error of the resulting p-values is reported; for image outputs, the number of "
+                                "permutations processed is recorded only in the headers of the p-value images.")
+            + Argument ("alpha").type_float (0.0, 1.0)
+          + Option ("shard", "process only a subset of the permutations, writing the partial results to file rather than computing "
+                             "the final outputs: those permutations with indices from first to (first+count-1) (indexed from zero) "
+                             "are processed. This allows permutation testing to be distributed across multiple processes or machines; "
+                             "the resulting shard files are subsequently combined using the -merge_shard option. Unless permutations are "
+                             "provided using the -permutations option, the MRTRIX_RNG_SEED environment variable must be set to the same "
+                             "value for all shards.")
+            + Argument ("first").type_integer (0)
+            + Argument ("count").type_integer (1)
+            + Argument ("output").type_file_out()
+          + Option ("merge_shard", "rather than performing permutation testing, combine the results of shard files generated using the -shard option; "
+                                   "this option should be specified once for each shard file, and all permutations must be present "
+                                   "in exactly one shard file. All other inputs and options must be identical to those used when generating "
+                                   "the shard files, and all shards must have been generated by the same build of the software on the "
+                                   "same architecture; the merged results are then identical to those of a single process.").allow_multiple()
             + Argument ("file").type_file_in();
 
         if (include_nonstationarity) {
@@ -57,6 +82,33 @@ namespace MR
 
 
 
+      size_t num_unresolved (const vector_type& perm_dist, const vector_type& stats, const default_type alpha)
+      {
+        const size_t num_perms = perm_dist.size();
+        if (!num_perms)
+          return stats.size();
+        vector<value_type> sorted (perm_dist.data(), perm_dist.data() + num_perms);
+        std::sort (sorted.begin(), sorted.end());
+        const default_type n = num_perms;
+        const default_type z2 = Math::pow2 (PERMUTATION_ADAPTIVE_Z);
+        size_t result = 0;
+        for (ssize_t i = 0; i != stats.size(); ++i) {
+          // Elements with no enhanced statistic are never significant
+          if (!(stats[i] > 0.0))
+            continue;
+          // As for Math::Stats::Permutation::statistic2pvalue()
+          const size_t exceeding = sorted.end() - std::upper_bound (sorted.begin(), sorted.end(), value_type(stats[i]));
+          const default_type p = exceeding / n;
+          const default_type centre = (p + 0.5 * z2 / n) / (1.0 + z2 / n);
+          const default_type half_width = PERMUTATION_ADAPTIVE_Z * std::sqrt (p * (1.0 - p) / n + 0.25 * z2 / Math::pow2 (n)) / (1.0 + z2 / n);
+          if (alpha > centre - half_width && alpha < centre + half_width)
+            ++result;
+        }
+        return result;
+      }
+
+
+
     }
   }
 }
@@ -16,6 +16,7 @@
 #ifndef __stats_permtest_h__
 #define __stats_permtest_h__
 
+#include <map>
 #include <memory>
 #include <mutex>
 
@@ -28,11 +29,17 @@
 #include "math/stats/typedefs.h"
 
 #include "stats/enhance.h"
+#include "stats/permshard.h"
 #include "stats/permstack.h"
 
 
 #define DEFAULT_NUMBER_PERMUTATIONS 5000
 #define DEFAULT_NUMBER_PERMUTATIONS_NONSTATIONARITY 5000
+#define PERMUTATION_BATCH_SIZE 16
+// Interval (in permutations) at which termination criteria are tested for adaptive permutation testing
+#define PERMUTATION_ADAPTIVE_INTERVAL 100
+// Confidence level of the intervals on FWE-corrected p-values for adaptive permutation testing (z=2.576: 99%)
+#define PERMUTATION_ADAPTIVE_Z 2.576
 
 
 namespace MR
@@ -50,52 +57,132 @@ namespace MR
       const App::OptionGroup Options (const bool include_nonstationarity);
 
 
-      /*! A class to pre-compute the empirical enhanced statistic image for non-stationarity correction */
+      // Number of permutations for which statistics are computed simultaneously;
+      //   limited such that the statistics for a batch occupy no more than 64MB
+      inline size_t batch_size (const size_t num_elements)
+      {
+        const size_t max_batch = (size_t(64) << 20) / (std::max (num_elements, size_t(1)) * sizeof (value_type));
+        return std::max (size_t(1), std::min (size_t(PERMUTATION_BATCH_SIZE), max_batch));
+      }
+
+
+      //! the number of elements for which it cannot yet be determined whether or not the FWE-corrected p-value is less than \a alpha
+      /*! Monte Carlo uncertainty in the p-values estimated from the (partial)
+       * null distribution \a perm_dist is quantified using the Wilson score
+       * interval; an element is considered resolved if this interval does
+       * not include \a alpha. */
+      size_t num_unresolved (const vector_type& perm_dist, const vector_type& stats, const default_type alpha);
+
+
+
+      /*! A class to pre-compute the empirical enhanced statistic image for non-stationarity correction
+       *
+       * The enhanced statistics are summed within each batch of permutations in
+       * order of permutation index, and the batch sums are then accumulated in
+       * order of the index of their first permutation; the result is therefore
+       * independent of the number of threads and of the order in which batches
+       * are processed. */
       template <class StatsType>
         class PreProcessor { MEMALIGN (PreProcessor<StatsType>)
           public:
             PreProcessor (const StatsType& stats_calculator,
                           const std::shared_ptr<EnhancerBase> enhancer,
+                          const size_t first_index,
                           vector_type& global_enhanced_sum,
                           vector<size_t>& global_enhanced_count) :
                             stats_calculator (stats_calculator),
-                            enhancer (enhancer), global_enhanced_sum (global_enhanced_sum),
-                            global_enhanced_count (global_enhanced_count), enhanced_sum (vector_type::Zero (global_enhanced_sum.size())),
-                            enhanced_count (global_enhanced_sum.size(), 0.0), stats (global_enhanced_sum.size()),
-                            enhanced_stats (global_enhanced_sum.size()), mutex (new std::mutex()) {}
+                            enhancer (enhancer),
+                            shared (new Shared (first_index, global_enhanced_sum, global_enhanced_count)),
+                            enhanced_sum (global_enhanced_sum.size()),
+                            enhanced_count (global_enhanced_sum.size(), 0), stats (global_enhanced_sum.size()),
+                            enhanced_stats (global_enhanced_sum.size()) {}
 
             ~PreProcessor ()
             {
-              std::lock_guard<std::mutex> lock (*mutex);
-              for (ssize_t i = 0; i < global_enhanced_sum.size(); ++i) {
-                global_enhanced_sum[i] += enhanced_sum[i];
-                global_enhanced_count[i] += enhanced_count[i];
-              }
+              shared->add_counts (enhanced_count);
             }
 
             bool operator() (const Permutation& permutation)
             {
+              enhanced_sum.setZero();
               stats_calculator (permutation.data, stats);
-              (*enhancer) (stats, enhanced_stats);
-              for (ssize_t i = 0; i < enhanced_stats.size(); ++i) {
-                if (enhanced_stats[i] > 0.0) {
-                  enhanced_sum[i] += enhanced_stats[i];
-                  enhanced_count[i]++;
-                }
+              process();
+              shared->add_sum (permutation.index, 1, enhanced_sum);
+              return true;
+            }
+
+            bool operator() (const vector<Permutation>& permutations)
+            {
+              if (permutations.empty())
+                return true;
+              vector<vector<size_t>> labellings;
+              for (const auto& p : permutations)
+                labellings.push_back (p.data);
+              stats_calculator (labellings, batch_stats);
+              enhanced_sum.setZero();
+              for (size_t p = 0; p != permutations.size(); ++p) {
+                stats = batch_stats.col (p).array();
+                process();
               }
+              shared->add_sum (permutations.front().index, permutations.size(), enhanced_sum);
               return true;
             }
 
           protected:
+            class Shared { MEMALIGN (Shared)
+              public:
+                Shared (const size_t first_index, vector_type& global_enhanced_sum, vector<size_t>& global_enhanced_count) :
+                    next_index (first_index),
+                    global_enhanced_sum (global_enhanced_sum),
+                    global_enhanced_count (global_enhanced_count) { }
+
+                void add_sum (const size_t index, const size_t count, const vector_type& sum)
+                {
+                  std::lock_guard<std::mutex> lock (mutex);
+                  pending.insert (std::make_pair (index, std::make_pair (count, sum)));
+                  while (pending.size() && pending.begin()->first == next_index) {
+                    global_enhanced_sum += pending.begin()->second.second;
+                    next_index += pending.begin()->second.first;
+                    pending.erase (pending.begin());
+                  }
+                }
+
+                void add_counts (const vector<size_t>& counts)
+                {
+                  std::lock_guard<std::mutex> lock (mutex);
+                  for (size_t i = 0; i != counts.size(); ++i)
+                    global_enhanced_count[i] += counts[i];
+                }
+
+              private:
+                size_t next_index;
+                vector_type& global_enhanced_sum;
+                vector<size_t>& global_enhanced_count;
+                // Batch sums that cannot yet be accumulated, since a batch
+                //   with a lower permutation index is still being processed
+                std::map<size_t, std::pair<size_t, vector_type>> pending;
+                std::mutex mutex;
+            };
+
             StatsType stats_calculator;
             std::shared_ptr<EnhancerBase> enhancer;
-            vector_type& global_enhanced_sum;
-            vector<size_t>& global_enhanced_count;
+            std::shared_ptr<Shared> shared;
             vector_type enhanced_sum;
             vector<size_t> enhanced_count;
             vector_type stats;
             vector_type enhanced_stats;
-            std::shared_ptr<std::mutex> mutex;
+            Math::Stats::matrix_type batch_stats;
+
+            void process ()
+            {
+              (*enhancer) (stats, enhanced_stats);
+              for (ssize_t i = 0; i < enhanced_stats.size(); ++i) {
+                if (enhanced_stats[i] > 0.0) {
+                  enhanced_sum[i] += enhanced_stats[i];
+                  enhanced_count[i]++;
+                }
+              }
+            }
         };
 
 
@@ -125,7 +212,7 @@ namespace MR
                            mutex (new std::mutex())
               {
                 if (global_uncorrected_pvalue_counter_neg)
-                  uncorrected_pvalue_counter_neg.reset (new vector<size_t>(stats_calculator.num_elements(), 0));
+                  uncorrected_pvalue_counter_neg.assign (stats_calculator.num_elements(), 0);
               }
 
 
@@ -134,7 +221,7 @@ namespace MR
                 for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
                   global_uncorrected_pvalue_counter[i] += uncorrected_pvalue_counter[i];
                   if (global_uncorrected_pvalue_counter_neg)
-                    (*global_uncorrected_pvalue_counter_neg)[i] = (*uncorrected_pvalue_counter_neg)[i];
+                    (*global_uncorrected_pvalue_counter_neg)[i] += uncorrected_pvalue_counter_neg[i];
                 }
               }
 
@@ -142,18 +229,57 @@ namespace MR
               bool operator() (const Permutation& permutation)
               {
                 stats_calculator (permutation.data, statistics);
+                process (permutation.index);
+                return true;
+              }
+
+
+              bool operator() (const vector<Permutation>& permutations)
+              {
+                vector<vector<size_t>> labellings;
+                for (const auto& p : permutations)
+                  labellings.push_back (p.data);
+                stats_calculator (labellings, batch_statistics);
+                for (size_t p = 0; p != permutations.size(); ++p) {
+                  statistics = batch_statistics.col (p).array();
+                  process (permutations[p].index);
+                }
+                return true;
+              }
+
+            protected:
+              StatsType stats_calculator;
+              std::shared_ptr<EnhancerBase> enhancer;
+              const vector_type& empirical_enhanced_statistics;
+              const vector_type& default_enhanced_statistics;
+              const std::shared_ptr<vector_type> default_enhanced_statistics_neg;
+              vector_type statistics;
+              vector_type enhanced_statistics;
+              Math::Stats::matrix_type batch_statistics;
+              vector<size_t> uncorrected_pvalue_counter;
+              vector<size_t> uncorrected_pvalue_counter_neg;
+              vector_type& perm_dist_pos;
+              std::shared_ptr<vector_type> perm_dist_neg;
+
+              vector<size_t>& global_uncorrected_pvalue_counter;
+              std::shared_ptr<vector<size_t> > global_uncorrected_pvalue_counter_neg;
+              std::shared_ptr<std::mutex> mutex;
+
+
+              void process (const size_t index)
+              {
                 if (enhancer) {
-                  perm_dist_pos[permutation.index] = (*enhancer) (statistics, enhanced_statistics);
+                  perm_dist_pos[index] = (*enhancer) (statistics, enhanced_statistics);
                 } else {
                   enhanced_statistics = statistics;
-                  perm_dist_pos[permutation.index] = enhanced_statistics.maxCoeff();
+                  perm_dist_pos[index] = enhanced_statistics.maxCoeff();
                 }
 
                 if (empirical_enhanced_statistics.size()) {
-                  perm_dist_pos[permutation.index] = 0.0;
+                  perm_dist_pos[index] = 0.0;
                   for (ssize_t i = 0; i < enhanced_statistics.size(); ++i) {
                     enhanced_statistics[i] /= empirical_enhanced_statistics[i];
-                    perm_dist_pos[permutation.index] = std::max(perm_dist_pos[permutation.index], enhanced_statistics[i]);
+                    perm_dist_pos[index] = std::max(perm_dist_pos[index], enhanced_statistics[i]);
                   }
                 }
 
@@ -166,40 +292,22 @@ namespace MR
                 if (perm_dist_neg) {
                   statistics = -statistics;
 
-                  (*perm_dist_neg)[permutation.index] = (*enhancer) (statistics, enhanced_statistics);
+                  (*perm_dist_neg)[index] = (*enhancer) (statistics, enhanced_statistics);
 
                   if (empirical_enhanced_statistics.size()) {
-                    (*perm_dist_neg)[permutation.index] = 0.0;
+                    (*perm_dist_neg)[index] = 0.0;
                     for (ssize_t i = 0; i < enhanced_statistics.size(); ++i) {
                       enhanced_statistics[i] /= empirical_enhanced_statistics[i];
-                      (*perm_dist_neg)[permutation.index] = std::max ((*perm_dist_neg)[permutation.index], enhanced_statistics[i]);
+                      (*perm_dist_neg)[index] = std::max ((*perm_dist_neg)[index], enhanced_statistics[i]);
                     }
                   }
 
                   for (ssize_t i = 0; i < enhanced_statistics.size(); ++i) {
                     if ((*default_enhanced_statistics_neg)[i] > enhanced_statistics[i])
-                      (*uncorrected_pvalue_counter_neg)[i]++;
+                      uncorrected_pvalue_counter_neg[i]++;
                   }
                 }
-                return true;
               }
-
-            protected:
-              StatsType stats_calculator;
-              std::shared_ptr<EnhancerBase> enhancer;
-              const vector_type& empirical_enhanced_statistics;
-              const vector_type& default_enhanced_statistics;
-              const std::shared_ptr<vector_type> default_enhanced_statistics_neg;
-              vector_type statistics;
-              vector_type enhanced_statistics;
-              vector<size_t> uncorrected_pvalue_counter;
-              std::shared_ptr<vector<size_t> > uncorrected_pvalue_counter_neg;
-              vector_type& perm_dist_pos;
-              std::shared_ptr<vector_type> perm_dist_neg;
-
-              vector<size_t>& global_uncorrected_pvalue_counter;
-              std::shared_ptr<vector<size_t> > global_uncorrected_pvalue_counter_neg;
-              std::shared_ptr<std::mutex> mutex;
         };
 
 
@@ -210,8 +318,9 @@ namespace MR
           {
             vector<size_t> global_enhanced_count (empirical_statistic.size(), 0);
             {
-              PreProcessor<StatsType> preprocessor (stats_calculator, enhancer, empirical_statistic, global_enhanced_count);
-              Thread::run_queue (perm_stack, Permutation(), Thread::multi (preprocessor));
+              PreProcessor<StatsType> preprocessor (stats_calculator, enhancer, perm_stack.next(), empirical_statistic, global_enhanced_count);
+              PermutationBatcher batcher (perm_stack, batch_size (stats_calculator.num_elements()));
+              Thread::run_queue (batcher, vector<Permutation>(), Thread::multi (preprocessor));
             }
             for (ssize_t i = 0; i < empirical_statistic.size(); ++i) {
               if (global_enhanced_count[i] > 0)
@@ -253,8 +362,20 @@ namespace MR
               }
             }
 
+          //! perform permutation testing
+          /*! If the -shard option has been used, only the requested subset of
+           * permutations is processed, and the partial results are written to
+           * file; in this case the function returns false, and the final
+           * outputs (null distributions & uncorrected p-values) are not
+           * computed. If the -merge_shard option has been used, the results
+           * are instead loaded from the shard files provided.
+           *
+           * If the -adaptive option has been used, permutation testing may
+           * terminate before all permutations have been processed; in this
+           * case \a perm_dist_pos & \a perm_dist_neg are truncated to the
+           * number of permutations actually processed. */
           template <class StatsType>
-            inline void run_permutations (PermutationStack& perm_stack,
+            inline bool run_permutations (PermutationStack& perm_stack,
                                           const StatsType& stats_calculator,
                                           const std::shared_ptr<EnhancerBase> enhancer,
                                           const vector_type& empirical_enhanced_statistic,
@@ -270,26 +391,108 @@ namespace MR
               if (perm_dist_neg)
                 global_uncorrected_pvalue_count_neg.reset (new vector<size_t> (stats_calculator.num_elements(), 0));
 
-              {
-                Processor<StatsType> processor (stats_calculator, enhancer,
-                                                empirical_enhanced_statistic,
-                                                default_enhanced_statistics, default_enhanced_statistics_neg,
-                                                perm_dist_pos, perm_dist_neg,
-                                                global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg);
-                Thread::run_queue (perm_stack, Permutation(), Thread::multi (processor));
+              const default_type checksum = shard_checksum (default_enhanced_statistics);
+              auto opt = App::get_options ("merge_shard");
+              if (opt.size()) {
+
+                if (App::get_options ("adaptive").size())
+                  throw Exception ("options -adaptive and -merge_shard are mutually exclusive");
+                vector<std::string> paths;
+                for (const auto& i : opt)
+                  paths.push_back (i[0]);
+                merge_shards (paths, perm_stack.num_permutations, perm_stack.is_generated(), checksum,
+                              perm_dist_pos, perm_dist_neg, global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg);
+
+              } else {
+
+                auto adaptive_opt = App::get_options ("adaptive");
+                opt = App::get_options ("shard");
+                if (adaptive_opt.size() && opt.size())
+                  throw Exception ("options -adaptive and -shard are mutually exclusive");
+                const size_t first = opt.size() ? size_t(opt[0][0]) : 0;
+                const size_t count = opt.size() ? size_t(opt[0][1]) : perm_stack.num_permutations;
+                if (opt.size()) {
+                  if (perm_stack.is_generated() && !getenv ("MRTRIX_RNG_SEED"))
+                    throw Exception ("the MRTRIX_RNG_SEED environment variable must be set when using the -shard option, "
+                                     "such that all shards process the same set of permutations");
+                  perm_stack.set_range (first, count);
+                }
+
+                auto run = [&] ()
+                {
+                  Processor<StatsType> processor (stats_calculator, enhancer,
+                                                  empirical_enhanced_statistic,
+                                                  default_enhanced_statistics, default_enhanced_statistics_neg,
+                                                  perm_dist_pos, perm_dist_neg,
+                                                  global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg);
+                  PermutationBatcher batcher (perm_stack, batch_size (stats_calculator.num_elements()));
+                  Thread::run_queue (batcher, vector<Permutation>(), Thread::multi (processor));
+                };
+
+                if (adaptive_opt.size()) {
+
+                  // Process permutations in blocks, testing after each whether the
+                  //   significance of every element at the requested FWE rate has
+                  //   been resolved; since processing pauses at fixed indices, the
+                  //   outcome does not depend on the number of threads
+                  const default_type alpha = adaptive_opt[0][0];
+                  size_t unresolved = 0;
+                  do {
+                    perm_stack.set_limit (perm_stack.next() + PERMUTATION_ADAPTIVE_INTERVAL);
+                    run();
+                    const size_t processed = perm_stack.next();
+                    unresolved = num_unresolved (perm_dist_pos.head (processed), default_enhanced_statistics, alpha);
+                    if (perm_dist_neg)
+                      unresolved += num_unresolved (perm_dist_neg->head (processed), *default_enhanced_statistics_neg, alpha);
+                  } while (unresolved && perm_stack.next() < perm_stack.num_permutations);
+
+                  const size_t processed = perm_stack.next();
+                  const default_type std_error = std::sqrt (alpha * (1.0 - alpha) / default_type(processed));
+                  if (unresolved) {
+                    CONSOLE ("adaptive permutation testing: " + str(unresolved) + " element" + (unresolved > 1 ? "s" : "")
+                             + " not resolved at alpha = " + str(alpha, 6) + " after maximal number of permutations (" + str(processed) + ")");
+                  } else {
+                    CONSOLE ("adaptive permutation testing: all elements resolved at alpha = " + str(alpha, 6)
+                             + " after " + str(processed) + " of " + str(perm_stack.num_permutations) + " permutations");
+                  }
+                  CONSOLE ("Monte Carlo standard error of FWE-corrected p-values at alpha = " + str(alpha, 6) + ": " + str(std_error, 3)
+                           + " (maximum: " + str(0.5 / std::sqrt (default_type(processed)), 3) + ")");
+
+                  perm_dist_pos.conservativeResize (processed);
+                  if (perm_dist_neg)
+                    perm_dist_neg->conservativeResize (processed);
+
+                } else {
+                  run();
+                }
+
+                if (opt.size()) {
+                  Shard shard (perm_stack.num_permutations, first, count, stats_calculator.num_elements(), bool(perm_dist_neg),
+                               perm_stack.is_generated() ? str(perm_stack.get_seed()) : std::string(), checksum);
+                  shard.perm_dist_pos = perm_dist_pos.segment (first, count);
+                  shard.uncorrected_pvalue_counter = global_uncorrected_pvalue_count;
+                  if (perm_dist_neg) {
+                    shard.perm_dist_neg = perm_dist_neg->segment (first, count);
+                    shard.uncorrected_pvalue_counter_neg = *global_uncorrected_pvalue_count_neg;
+                  }
+                  shard.save (opt[0][2]);
+                  return false;
+                }
+
               }
 
+              const size_t num_permutations = perm_dist_pos.size();
               for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
-                uncorrected_pvalues[i] = global_uncorrected_pvalue_count[i] / default_type(perm_stack.num_permutations);
+                uncorrected_pvalues[i] = global_uncorrected_pvalue_count[i] / default_type(num_permutations);
                 if (perm_dist_neg)
-                  (*uncorrected_pvalues_neg)[i] = (*global_uncorrected_pvalue_count_neg)[i] / default_type(perm_stack.num_permutations);
+                  (*uncorrected_pvalues_neg)[i] = (*global_uncorrected_pvalue_count_neg)[i] / default_type(num_permutations);
               }
-
+              return true;
             }
 
 
             template <class StatsType>
-              inline void run_permutations (vector<vector<size_t>>& permutations,
+              inline bool run_permutations (vector<vector<size_t>>& permutations,
                                             const StatsType& stats_calculator,
                                             const std::shared_ptr<EnhancerBase> enhancer,
                                             const vector_type& empirical_enhanced_statistic,
@@ -302,13 +505,14 @@ namespace MR
               {
                 PermutationStack perm_stack (permutations, "running " + str(permutations.size()) + " permutations");
 
-                run_permutations (perm_stack, stats_calculator, enhancer, empirical_enhanced_statistic, default_enhanced_statistics, default_enhanced_statistics_neg,
-                                  perm_dist_pos, perm_dist_neg, uncorrected_pvalues, uncorrected_pvalues_neg);
+                return run_permutations (perm_stack, stats_calculator, enhancer, empirical_enhanced_statistic, default_enhanced_statistics, default_enhanced_statistics_neg,
+                                         perm_dist_pos, perm_dist_neg, uncorrected_pvalues, uncorrected_pvalues_neg);
               }
 
 
             template <class StatsType>
-              inline void run_permutations (const size_t num_permutations,
+              inline bool run_permutations (const size_t num_permutations,
+                                            const vector<size_t>& blocks,
                                             const StatsType& stats_calculator,
                                             const std::shared_ptr<EnhancerBase> enhancer,
                                             const vector_type& empirical_enhanced_statistic,
@@ -319,10 +523,10 @@ namespace MR
                                             vector_type& uncorrected_pvalues,
                                             std::shared_ptr<vector_type> uncorrected_pvalues_neg)
               {
-                PermutationStack perm_stack (num_permutations, stats_calculator.num_subjects(), "running " + str(num_permutations) + " permutations");
+                PermutationStack perm_stack (num_permutations, stats_calculator.num_subjects(), blocks, "running " + str(num_permutations) + " permutations");
 
-                run_permutations (perm_stack, stats_calculator, enhancer, empirical_enhanced_statistic, default_enhanced_statistics, default_enhanced_statistics_neg,
-                                  perm_dist_pos, perm_dist_neg, uncorrected_pvalues, uncorrected_pvalues_neg);
+                return run_permutations (perm_stack, stats_calculator, enhancer, empirical_enhanced_statistic, default_enhanced_statistics, default_enhanced_statistics_neg,
+                                         perm_dist_pos, perm_dist_neg, uncorrected_pvalues, uncorrected_pvalues_neg);
               }
 
 
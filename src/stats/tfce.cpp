@@ -15,6 +15,8 @@
 
 #include "stats/tfce.h"
 
+#include <numeric>
+
 namespace MR
 {
   namespace Stats
@@ -23,6 +25,24 @@ namespace MR
     {
 
 
+
+      namespace
+      {
+        template <class Functor>
+          inline void for_each_neighbour (const adjacency_type& adjacency, const uint32_t index, Functor&& functor)
+          {
+            for (auto n : adjacency[index])
+              functor (n);
+          }
+
+        template <class Functor>
+          inline void for_each_neighbour (const Filter::Connector& connector, const uint32_t index, Functor&& functor)
+          {
+            connector.for_each_neighbour (index, std::forward<Functor> (functor));
+          }
+      }
+
+
       using namespace App;
       const OptionGroup Options (const default_type default_dh, const default_type default_e, const default_type default_h)
       {
@@ -44,8 +64,21 @@ namespace MR
 
       value_type Wrapper::operator() (const vector_type& in, vector_type& out) const
       {
-        out = vector_type::Zero (in.size());
         const value_type max_input_value = in.maxCoeff();
+        const adjacency_type* adjacency = enhancer->get_adjacency();
+        const Filter::Connector* connector = enhancer->get_connector();
+        if (adjacency || connector) {
+          vector<value_type> heights;
+          for (value_type h = dH; (h-dH) < max_input_value; h += dH)
+            heights.push_back (h);
+          if (adjacency)
+            single_pass (in, heights, *adjacency, out);
+          else
+            single_pass (in, heights, *connector, out);
+          return out.maxCoeff();
+        }
+
+        out = vector_type::Zero (in.size());
         for (value_type h = dH; (h-dH) < max_input_value; h += dH) {
           vector_type temp;
           const value_type max = (*enhancer) (in, h, temp);
@@ -60,6 +93,114 @@ namespace MR
 
 
 
+      // Rather than forming clusters from scratch at every threshold, elements are
+      //   added to clusters in order of decreasing statistic, with clusters merged
+      //   using a union-find structure. The contribution of each cluster is only
+      //   evaluated whenever that cluster changes, by multiplying its size term by
+      //   the sum of height terms over the range of thresholds at which that cluster
+      //   persisted unchanged. Each cluster root stores the value to be added to all
+      //   of its members; every other element stores its value relative to that of
+      //   its parent, such that clusters can be merged without visiting their members.
+      template <class AdjacencyType>
+      void Wrapper::single_pass (const vector_type& in, const vector<value_type>& heights, const AdjacencyType& adjacency, vector_type& out) const
+      {
+        const size_t num_elements = in.size();
+        assert (adjacency.size() == num_elements);
+        out = vector_type::Zero (num_elements);
+        if (heights.empty())
+          return;
+
+        // For each element, the number of thresholds at which it is suprathreshold
+        vector<uint32_t> levels (num_elements);
+        for (size_t i = 0; i != num_elements; ++i) {
+          const value_type stat = in[i];
+          levels[i] = std::partition_point (heights.begin(), heights.end(),
+                                            [&] (const value_type h) { return enhancer->is_suprathreshold (stat, h); }) - heights.begin();
+        }
+
+        // Sum of height terms over the first N thresholds
+        vector<value_type> cumulative (heights.size() + 1, value_type(0));
+        for (size_t k = 0; k != heights.size(); ++k)
+          cumulative[k+1] = cumulative[k] + std::pow (heights[k], H);
+
+        vector<uint32_t> order (num_elements);
+        std::iota (order.begin(), order.end(), 0);
+        std::sort (order.begin(), order.end(), [&] (const uint32_t a, const uint32_t b) { return levels[a] > levels[b]; });
+        const uint32_t max_level = levels[order.front()];
+
+        constexpr uint32_t inactive = std::numeric_limits<uint32_t>::max();
+        vector<uint32_t> parent (num_elements, inactive), size (num_elements, 0), last_level (num_elements, 0);
+        vector<value_type> offset (num_elements, value_type(0));
+
+        vector<uint32_t> path;
+        auto find = [&] (uint32_t x)
+        {
+          path.clear();
+          while (parent[x] != x) {
+            path.push_back (x);
+            x = parent[x];
+          }
+          value_type sum = value_type(0);
+          for (auto i = path.rbegin(); i != path.rend(); ++i) {
+            sum += offset[*i];
+            offset[*i] = sum;
+            parent[*i] = x;
+          }
+          return x;
+        };
+
+        // Add the contribution of a cluster for all thresholds
+        //   above this level at which it has not yet been accounted
+        auto flush = [&] (const uint32_t root, const uint32_t level)
+        {
+          offset[root] += std::pow (value_type(size[root]), E) * (cumulative[last_level[root]] - cumulative[level]);
+          last_level[root] = level;
+        };
+
+        for (auto i : order) {
+          const uint32_t level = levels[i];
+          if (!level)
+            break;
+          parent[i] = i;
+          size[i] = 1;
+          last_level[i] = level;
+          uint32_t root = i;
+          for_each_neighbour (adjacency, i, [&] (const uint32_t n) {
+            if (parent[n] == inactive)
+              return;
+            uint32_t other = find (n);
+            if (other == root)
+              return;
+            flush (root, level);
+            flush (other, level);
+            if (size[root] < size[other])
+              std::swap (root, other);
+            parent[other] = root;
+            offset[other] -= offset[root];
+            size[root] += size[other];
+          });
+        }
+
+        for (size_t i = 0; i != num_elements; ++i) {
+          if (parent[i] == i)
+            flush (i, 0);
+        }
+
+        // Elements not within any cluster at a particular threshold still receive the
+        //   height term if the extent exponent is zero, as long as some cluster exists
+        const value_type zero_extent = std::pow (value_type(0), E);
+        for (size_t i = 0; i != num_elements; ++i) {
+          if (parent[i] != inactive) {
+            const uint32_t root = find (i);
+            out[i] = offset[i] + (root == i ? value_type(0) : offset[root]);
+          }
+          if (zero_extent && levels[i] < max_level)
+            out[i] += zero_extent * (cumulative[max_level] - cumulative[levels[i]]);
+        }
+      }
+
+
+
     }
   }
 }
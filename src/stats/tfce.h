@@ -41,6 +41,10 @@ namespace MR
 
 
 
+      using adjacency_type = vector<vector<uint32_t>>;
+
+
+
       class EnhancerBase : public Stats::EnhancerBase
       { MEMALIGN (EnhancerBase)
         public:
@@ -48,6 +52,20 @@ namespace MR
           //   makes TFCE integration cleaner
           virtual value_type operator() (const vector_type& /*input_statistics*/, const value_type /*threshold*/, vector_type& /*enhanced_statistics*/) const = 0;
 
+          // If the enhanced statistic is the size of the cluster to which each element belongs,
+          //   where clusters are the connected components of suprathreshold elements within a
+          //   fixed adjacency structure, derived classes should provide that structure here;
+          //   TFCE can then be computed in a single pass over all thresholds
+          virtual const adjacency_type* get_adjacency() const { return nullptr; }
+
+          // As above, for elements that are voxels within a mask and are adjacent
+          //   if they are neighbours on the image grid
+          virtual const Filter::Connector* get_connector() const { return nullptr; }
+
+          // Whether or not an element with this statistic contributes to
+          //   clusters formed at this threshold
+          virtual bool is_suprathreshold (const value_type stat, const value_type threshold) const { return stat > threshold; }
+
       };
 
 
@@ -73,6 +91,9 @@ namespace MR
         private:
           std::shared_ptr<Stats::TFCE::EnhancerBase> enhancer;
           value_type dH, E, H;
+
+          template <class AdjacencyType>
+            void single_pass (const vector_type&, const vector<value_type>&, const AdjacencyType&, vector_type&) const;
       };
 
 
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include <unsupported/Eigen/FFT>
+
+#include "command.h"
+#include "timer.h"
+#include "math/fft.h"
+#include "math/rng.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "MRtrix3 contributors";
+
+  SYNOPSIS = "Benchmark and verify the batched FFT against Eigen::FFT";
+
+  DESCRIPTION
+  + "For each transform length, this reports the time taken per line to perform the "
+    "forward and inverse transforms of a batch of lines using Math::FFT, and one line "
+    "at a time using Eigen::FFT (which uses FFTW if MRtrix3 was configured with it, "
+    "and KissFFT otherwise), in double and single precision. It also checks that the "
+    "results of Math::FFT match those of Eigen::FFT."
+
+  + "The default lengths include prime numbers, for which Math::FFT evaluates the DFT "
+    "directly if they do not exceed FFT_MAX_GENERIC_RADIX (as defined in core/math/fft.h), "
+    "and uses Bluestein's algorithm otherwise.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Option ("size", "the transform lengths to test (default: 64,96,100,128,31,37,61,127,211,256,257,509,1021)")
+    + Argument ("values").type_sequence_int()
+
+  + Option ("lines", "the number of lines transformed in each batch (default: 64)")
+    + Argument ("num").type_integer (1)
+
+  + Option ("tolerance", "the maximum difference allowed between implementations, relative to the maximal amplitude "
+                         "of the transformed data (default: 1e-5, as appropriate for single-precision)")
+    + Argument ("value").type_float (0.0);
+}
+
+
+
+// Time taken per line (in microseconds) to perform the forward and inverse
+//   transforms of all lines, repeated for at least 0.2s
+template <class Functor>
+double time_per_line (const size_t lines, Functor&& functor)
+{
+  Timer timer;
+  size_t repeats = 0;
+  do {
+    functor();
+    ++repeats;
+  } while (timer.elapsed() < 0.2);
+  return 1.0e6 * timer.elapsed() / (repeats * lines);
+}
+
+
+
+template <typename ValueType>
+void bench (const size_t N, const size_t lines, double& t_batched, double& t_eigen, double& max_diff)
+{
+  using complex_type = std::complex<ValueType>;
+  using matrix_type = Eigen::Matrix<complex_type, Eigen::Dynamic, Eigen::Dynamic>;
+  using vector_type = Eigen::Matrix<complex_type, Eigen::Dynamic, 1>;
+
+  Math::RNG::Normal<ValueType> rng;
+  matrix_type input (lines, N);
+  for (size_t l = 0; l != lines; ++l)
+    for (size_t n = 0; n != N; ++n)
+      input (l, n) = complex_type (rng(), rng());
+
+  Math::FFT<ValueType> fft (N);
+  matrix_type batched (input);
+  t_batched = time_per_line (lines, [&] () {
+      fft.forward (batched);
+      fft.inverse (batched);
+      });
+
+  Eigen::FFT<ValueType> eigen_fft;
+  vector_type in (N), out (N);
+  t_eigen = time_per_line (lines, [&] () {
+      for (size_t l = 0; l != lines; ++l) {
+        in = input.row (l).transpose();
+        eigen_fft.fwd (out, in);
+        eigen_fft.inv (in, out);
+      }
+      });
+
+  // compare forward transforms, and the round trip against the input
+  batched = input;
+  fft.forward (batched);
+  ValueType scale = 0.0, diff = 0.0;
+  for (size_t l = 0; l != lines; ++l) {
+    in = input.row (l).transpose();
+    eigen_fft.fwd (out, in);
+    scale = std::max (scale, out.cwiseAbs().maxCoeff());
+    diff = std::max (diff, (batched.row (l).transpose() - out).cwiseAbs().maxCoeff());
+  }
+  max_diff = diff / scale;
+  fft.inverse (batched);
+  max_diff = std::max (max_diff, double ((batched - input).cwiseAbs().maxCoeff() / input.cwiseAbs().maxCoeff()));
+}
+
+
+
+void run ()
+{
+  vector<int> sizes = { 64, 96, 100, 128, 31, 37, 61, 127, 211, 256, 257, 509, 1021 };
+  auto opt = get_options ("size");
+  if (opt.size())
+    sizes = parse_ints (opt[0][0]);
+  const size_t lines = get_option_value ("lines", 64);
+  const double tolerance = get_option_value ("tolerance", 1.0e-5);
+
+  bool failed = false;
+  std::cout << "size   double: batched   Eigen (us/line)   max rel. diff.   float: batched   Eigen (us/line)   max rel. diff.\n";
+  for (const auto N : sizes) {
+    if (N < 2)
+      throw Exception ("transform lengths must be greater than one");
+    double t_batched_d, t_eigen_d, diff_d, t_batched_f, t_eigen_f, diff_f;
+    bench<double> (N, lines, t_batched_d, t_eigen_d, diff_d);
+    bench<float>  (N, lines, t_batched_f, t_eigen_f, diff_f);
+    std::cout << str(N) << "\t" << str(t_batched_d, 4) << "\t" << str(t_eigen_d, 4) << "\t" << str(diff_d, 3)
+      << "\t" << str(t_batched_f, 4) << "\t" << str(t_eigen_f, 4) << "\t" << str(diff_f, 3) << "\n";
+    if (!(diff_d <= tolerance && diff_f <= tolerance))
+      failed = true;
+  }
+
+  if (failed)
+    throw Exception ("batched FFT does not match Eigen::FFT");
+}
+
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "image.h"
+#include "timer.h"
+#include "math/rng.h"
+#include "math/SH.h"
+#include "registration/transform/reorient.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "J-Donald Tournier (jdtournier@gmail.com)";
+
+  SYNOPSIS = "Benchmark and verify the SH evaluation kernels specialised on lmax, and the SH rotation";
+
+  DESCRIPTION
+  + "For each supported lmax, this reports the time taken per direction to evaluate "
+    "an SH series & its derivatives using the generic, precomputed and fixed-lmax "
+    "implementations, and checks that the fixed-lmax results match those of the "
+    "generic implementation."
+
+  + "It also checks that Math::SH::Rotation, applied to a random SH series, matches "
+    "the original series evaluated at the rotated directions (in double precision), "
+    "and that Registration::Transform::is_rotation() accepts rotations combined with "
+    "reflections and/or isotropic scaling, and rejects other linear transforms.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Option ("number", "the number of random directions to evaluate (default: 100000)")
+    + Argument ("num").type_integer (1)
+
+  + Option ("tolerance", "the maximum relative difference allowed between implementations (default: 1e-3, as appropriate for single-precision)")
+    + Argument ("value").type_float (0.0)
+
+  + Option ("notiming", "only verify the results, without timing the implementations");
+}
+
+
+using value_type = float;
+using vector_type = Eigen::Matrix<value_type,Eigen::Dynamic,1>;
+using dir_type = Eigen::Matrix<value_type,3,1>;
+
+// tolerance on the relative difference for the SH rotation, in double precision:
+#define ROTATION_TOLERANCE 1e-12
+
+
+template <class Functor>
+double time_per_dir (const vector<dir_type>& dirs, Functor&& functor)
+{
+  Timer timer;
+  for (const auto& d : dirs)
+    functor (d);
+  return 1.0e9 * timer.elapsed() / dirs.size();
+}
+
+
+Eigen::Matrix3d random_rotation (Math::RNG::Normal<double>& rng)
+{
+  return Eigen::Quaterniond (rng(), rng(), rng(), rng()).normalized().toRotationMatrix();
+}
+
+
+// maximum difference (relative to the norm of the series) between a random SH
+// series evaluated at R^T u, and the series rotated using \a rotation
+// evaluated at u:
+double rotation_error (const int lmax, const Eigen::Matrix3d& R, const Eigen::Matrix3d& rotation,
+    const vector<Eigen::Vector3d>& dirs, Math::RNG::Normal<double>& rng)
+{
+  Eigen::VectorXd sh (Math::SH::NforL (lmax)), rotated;
+  for (ssize_t n = 0; n < sh.size(); ++n)
+    sh[n] = rng();
+  Math::SH::Rotation<double> (lmax, rotation) (rotated, sh);
+  const double scale = sh.norm();
+  double max_diff = 0.0;
+  for (const auto& u : dirs)
+    max_diff = std::max (max_diff, std::abs (Math::SH::value (rotated, u, lmax) -
+                                             Math::SH::value (sh, Eigen::Vector3d (R.transpose() * u), lmax)) / scale);
+  return max_diff;
+}
+
+
+// check the result of is_rotation() for \a linear against that expected;
+// where \a linear is accepted, the rotation it returns must be proper, the
+// scale factor must match, and the SH rotation must be equivalent to \a linear
+bool check_is_rotation (const std::string& name, const Eigen::Matrix3d& linear,
+    const bool expected, const double expected_scale,
+    const vector<Eigen::Vector3d>& dirs, Math::RNG::Normal<double>& rng)
+{
+  Eigen::Matrix3d rotation;
+  default_type scale = NaN;
+  const bool result = Registration::Transform::is_rotation (linear, rotation, scale);
+  bool passed = (result == expected);
+  double max_diff = 0.0;
+  if (passed && result) {
+    passed = std::abs (scale - expected_scale) < 1.0e-12 * expected_scale &&
+             (rotation.transpose() * rotation - Eigen::Matrix3d::Identity()).norm() < 1.0e-12 &&
+             std::abs (rotation.determinant() - 1.0) < 1.0e-12;
+    // FODs are antipodally symmetric, so the effect of the (unscaled)
+    // transform should be that of the returned proper rotation:
+    max_diff = rotation_error (8, linear / expected_scale, rotation, dirs, rng);
+    passed = passed && max_diff <= ROTATION_TOLERANCE;
+  }
+  std::cout << "is_rotation, " << name << ": " << (result ? "true" : "false")
+    << (result ? ", scale " + str(scale, 6) + ", max rel. diff. " + str(max_diff, 3) : std::string())
+    << (passed ? "" : " [FAILED]") << "\n";
+  return passed;
+}
+
+
+void run ()
+{
+  const size_t num = get_option_value ("number", 100000);
+  const value_type tolerance = get_option_value ("tolerance", 1.0e-3);
+  const bool timing = !get_options ("notiming").size();
+
+  Math::RNG::Normal<value_type> rng;
+  vector<dir_type> dirs (num);
+  for (auto& d : dirs) {
+    do {
+      d = dir_type (rng(), rng(), rng());
+    } while (d.squaredNorm() < 1.0e-6);
+    d.normalize();
+  }
+
+  bool failed = false;
+  if (timing)
+    std::cout << "lmax   value: generic  precomputed   fixed (ns)   derivatives: generic  precomputed   fixed (ns)   max rel. diff.\n";
+  else
+    std::cout << "lmax   max rel. diff.\n";
+  for (int lmax = 2; lmax <= 12; lmax += 2) {
+    vector_type sh (Math::SH::NforL (lmax));
+    for (ssize_t n = 0; n < sh.size(); ++n)
+      sh[n] = rng();
+    Math::SH::PrecomputedAL<value_type> precomputer (lmax);
+    const auto fixed_value = Math::SH::value_function<vector_type,dir_type> (lmax);
+    const auto fixed_derivatives = Math::SH::derivatives_function<vector_type> (lmax);
+
+    value_type sum = 0.0, max_diff = 0.0;
+    const value_type scale = sh.norm();
+    double t_generic = 0.0, t_precomputed = 0.0, t_fixed = 0.0, t_deriv_generic = 0.0, t_deriv_precomputed = 0.0, t_deriv_fixed = 0.0;
+    if (timing) {
+      t_generic = time_per_dir (dirs, [&] (const dir_type& d) { sum += Math::SH::value (sh, d, lmax); });
+      t_precomputed = time_per_dir (dirs, [&] (const dir_type& d) { sum += precomputer.value (sh, d); });
+      t_fixed = time_per_dir (dirs, [&] (const dir_type& d) { sum += fixed_value (sh, d, lmax); });
+
+      value_type amp, del, daz, del2, deldaz, daz2;
+      t_deriv_generic = time_per_dir (dirs, [&] (const dir_type& d) {
+          Math::SH::derivatives (sh, lmax, std::acos (d[2]), std::atan2 (d[1], d[0]), amp, del, daz, del2, deldaz, daz2, nullptr);
+          sum += amp + del + daz + del2 + deldaz + daz2;
+          });
+      t_deriv_precomputed = time_per_dir (dirs, [&] (const dir_type& d) {
+          Math::SH::derivatives (sh, lmax, std::acos (d[2]), std::atan2 (d[1], d[0]), amp, del, daz, del2, deldaz, daz2, &precomputer);
+          sum += amp + del + daz + del2 + deldaz + daz2;
+          });
+      t_deriv_fixed = time_per_dir (dirs, [&] (const dir_type& d) {
+          fixed_derivatives (sh, lmax, std::acos (d[2]), std::atan2 (d[1], d[0]), amp, del, daz, del2, deldaz, daz2, nullptr);
+          sum += amp + del + daz + del2 + deldaz + daz2;
+          });
+    }
+
+    for (const auto& d : dirs) {
+      max_diff = std::max (max_diff, std::abs (fixed_value (sh, d, lmax) - Math::SH::value (sh, d, lmax)) / scale);
+      const value_type el = std::acos (d[2]), az = std::atan2 (d[1], d[0]);
+      value_type ref[6], test[6];
+      Math::SH::derivatives (sh, lmax, el, az, ref[0], ref[1], ref[2], ref[3], ref[4], ref[5], nullptr);
+      fixed_derivatives (sh, lmax, el, az, test[0], test[1], test[2], test[3], test[4], test[5], nullptr);
+      // derivatives w.r.t. azimuth are scaled by 1/sin(el) or 1/sin^2(el),
+      // which amplifies round-off near the poles:
+      for (size_t i = 0; i < 6; ++i)
+        max_diff = std::max (max_diff, std::abs (test[i] - ref[i]) / (scale * (1 + lmax*lmax) + std::abs (ref[i])));
+    }
+
+    std::cout << str(lmax) << "\t";
+    if (timing)
+      std::cout << str(t_generic, 4) << "\t" << str(t_precomputed, 4) << "\t" << str(t_fixed, 4)
+        << "\t" << str(t_deriv_generic, 4) << "\t" << str(t_deriv_precomputed, 4) << "\t" << str(t_deriv_fixed, 4) << "\t";
+    std::cout << str(max_diff, 3) << "\n";
+    if (!std::isfinite (sum))
+      WARN ("non-finite SH amplitudes encountered for lmax " + str(lmax));
+    if (!(max_diff <= tolerance))
+      failed = true;
+  }
+
+  if (failed)
+    throw Exception ("fixed-lmax SH kernels do not match generic implementation");
+
+  Math::RNG::Normal<double> rng_double;
+  vector<Eigen::Vector3d> dirs_double (std::min (num, size_t(1000)));
+  for (size_t n = 0; n != dirs_double.size(); ++n)
+    dirs_double[n] = dirs[n].cast<double>().normalized();
+
+  std::cout << "lmax   rotation: max rel. diff.\n";
+  for (int lmax = 2; lmax <= 12; lmax += 2) {
+    double max_diff = 0.0;
+    for (size_t n = 0; n != 10; ++n) {
+      const Eigen::Matrix3d R = random_rotation (rng_double);
+      max_diff = std::max (max_diff, rotation_error (lmax, R, R, dirs_double, rng_double));
+    }
+    std::cout << str(lmax) << "\t" << str(max_diff, 3) << "\n";
+    if (!(max_diff <= ROTATION_TOLERANCE))
+      failed = true;
+  }
+  if (failed)
+    throw Exception ("SH rotation does not match SH evaluation at rotated directions");
+
+  const Eigen::Matrix3d R = random_rotation (rng_double);
+  const Eigen::Matrix3d reflection = Eigen::Vector3d (-1.0, 1.0, 1.0).asDiagonal();
+  Eigen::Matrix3d shear (Eigen::Matrix3d::Identity());
+  shear(0,1) = 0.1;
+  bool passed = true;
+  passed &= check_is_rotation ("rotation", R, true, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("identity", Eigen::Matrix3d::Identity(), true, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("reflection", reflection, true, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("reflected rotation", reflection * R, true, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("point reflection", -R, true, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("isotropic scaling", 2.5 * Eigen::Matrix3d::Identity(), true, 2.5, dirs_double, rng_double);
+  passed &= check_is_rotation ("scaled rotation", 2.5 * R, true, 2.5, dirs_double, rng_double);
+  passed &= check_is_rotation ("scaled reflected rotation", 0.4 * reflection * R, true, 0.4, dirs_double, rng_double);
+  passed &= check_is_rotation ("anisotropic scaling", Eigen::Vector3d (1.0, 1.0, 1.1).asDiagonal() * R, false, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("shear", R * shear, false, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("singular", Eigen::Vector3d (1.0, 1.0, 0.0).asDiagonal() * R, false, 1.0, dirs_double, rng_double);
+  passed &= check_is_rotation ("zero", Eigen::Matrix3d::Zero(), false, 1.0, dirs_double, rng_double);
+  if (!passed)
+    throw Exception ("is_rotation() does not correctly identify rotations");
+}
+
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "header.h"
+#include "image.h"
+#include "math/rng.h"
+#include "filter/connected_components.h"
+#include "stats/cluster.h"
+#include "stats/tfce.h"
+#include "connectome/enhance.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "MRtrix3 contributors";
+
+  SYNOPSIS = "Verify the single-pass computation of TFCE against its computation at each threshold in turn";
+
+  DESCRIPTION
+  + "Where the enhanced statistic is the size of the cluster to which each element belongs, "
+    "Stats::TFCE::Wrapper computes TFCE in a single pass over all thresholds. This checks "
+    "that the result matches that obtained by forming the clusters at each threshold "
+    "independently, for clusters of voxels within a random mask (using 6-, 18- and "
+    "26-connectivity, as in mrclusterstats), and for clusters of edges within a "
+    "connectome (as in connectomestats)."
+
+  + "Statistic values are drawn at random; many are set exactly equal to one of the TFCE "
+    "thresholds, in order to verify the treatment of ties at cluster-forming thresholds. "
+    "Use the MRTRIX_RNG_SEED environment variable for reproducible results.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Option ("trials", "the number of random statistic vectors tested for each configuration (default: 10)")
+    + Argument ("num").type_integer (1)
+
+  + Option ("tolerance", "the maximum difference allowed between implementations, relative to "
+                         "the maximal enhanced statistic (default: 1e-9)")
+    + Argument ("value").type_float (0.0);
+}
+
+
+
+using value_type = Math::Stats::value_type;
+using vector_type = Math::Stats::vector_type;
+
+
+
+// Hides the adjacency structure of the underlying enhancer, such that
+//   Stats::TFCE::Wrapper forms clusters at each threshold in turn
+class PerThreshold : public Stats::TFCE::EnhancerBase
+{ MEMALIGN (PerThreshold)
+  public:
+    PerThreshold (const std::shared_ptr<Stats::TFCE::EnhancerBase>& base) : base (base) { }
+
+    value_type operator() (const vector_type& in, vector_type& out) const override { return static_cast<const Stats::EnhancerBase&> (*base) (in, out); }
+    value_type operator() (const vector_type& in, const value_type T, vector_type& out) const override { return (*base) (in, T, out); }
+    bool is_suprathreshold (const value_type stat, const value_type T) const override { return base->is_suprathreshold (stat, T); }
+
+  private:
+    std::shared_ptr<Stats::TFCE::EnhancerBase> base;
+};
+
+
+
+// Statistic values are either exactly equal to one of the thresholds at which
+//   Stats::TFCE::Wrapper forms clusters (computed in the same way), in between
+//   these thresholds, or negative
+vector_type random_statistics (const size_t num, const value_type dh, Math::RNG::Uniform<value_type>& rng)
+{
+  vector<value_type> heights;
+  for (value_type h = dh; h < 2.0; h += dh)
+    heights.push_back (h);
+  vector_type result (num);
+  for (size_t i = 0; i != num; ++i) {
+    const value_type u = rng();
+    if (u < 0.1)
+      result[i] = -rng();
+    else if (u < 0.6)
+      result[i] = heights[std::min (heights.size()-1, size_t (rng() * heights.size()))];
+    else
+      result[i] = 2.0 * rng();
+  }
+  return result;
+}
+
+
+
+bool check (const std::string& name, const std::shared_ptr<Stats::TFCE::EnhancerBase>& enhancer,
+            const size_t num_elements, const size_t num_trials, const value_type tolerance,
+            Math::RNG::Uniform<value_type>& rng)
+{
+  const std::shared_ptr<Stats::TFCE::EnhancerBase> per_threshold (new PerThreshold (enhancer));
+  // (dh, E, H): the defaults of mrclusterstats & fixelcfestats, those of connectomestats,
+  //   and a zero extent exponent (for which elements outside of any cluster also contribute)
+  const value_type parameters[][3] = { { 0.1, 0.5, 2.0 }, { 0.1, 0.4, 3.0 }, { 0.25, 0.0, 1.0 } };
+  bool passed = true;
+  for (const auto& p : parameters) {
+    const Stats::TFCE::Wrapper single_pass (enhancer, p[0], p[1], p[2]);
+    const Stats::TFCE::Wrapper multi_pass (per_threshold, p[0], p[1], p[2]);
+    value_type max_diff = 0.0;
+    for (size_t trial = 0; trial != num_trials; ++trial) {
+      const vector_type stats = random_statistics (num_elements, p[0], rng);
+      vector_type test, ref;
+      const value_type test_max = single_pass (stats, test);
+      const value_type ref_max = multi_pass (stats, ref);
+      if (!(ref_max > 0.0))
+        throw Exception ("no suprathreshold clusters for " + name);
+      max_diff = std::max (max_diff, std::abs (test_max - ref_max) / ref_max);
+      max_diff = std::max (max_diff, (test - ref).cwiseAbs().maxCoeff() / ref_max);
+    }
+    const bool ok = max_diff <= tolerance;
+    std::cout << name << ", dh = " << str(p[0], 3) << ", E = " << str(p[1], 3) << ", H = " << str(p[2], 3)
+              << ": max rel. diff. " << str(max_diff, 3) << (ok ? "" : " [FAILED]") << "\n";
+    passed = passed && ok;
+  }
+  return passed;
+}
+
+
+
+void run ()
+{
+  const size_t num_trials = get_option_value ("trials", 10);
+  const value_type tolerance = get_option_value ("tolerance", 1.0e-9);
+
+  Math::RNG::Uniform<value_type> rng;
+  bool passed = true;
+
+  Header header;
+  header.ndim() = 3;
+  for (size_t axis = 0; axis != 3; ++axis) {
+    header.size (axis) = 12;
+    header.spacing (axis) = 1.0;
+  }
+  header.transform().setIdentity();
+  auto mask = Image<bool>::scratch (header, "random mask");
+  for (auto l = Loop (mask) (mask); l; ++l)
+    mask.value() = rng() < 0.8;
+
+  for (const size_t connectivity : { 6, 18, 26 }) {
+    Filter::Connector connector (connectivity);
+    const size_t num_voxels = connector.set_mask (mask);
+    const std::shared_ptr<Stats::TFCE::EnhancerBase> enhancer (new Stats::Cluster::ClusterSize (connector, 0.0));
+    passed &= check ("voxel clusters (" + str(connectivity) + "-connectivity)", enhancer, num_voxels, num_trials, tolerance, rng);
+  }
+
+  const Connectome::node_t num_nodes = 20;
+  const std::shared_ptr<Stats::TFCE::EnhancerBase> nbs (new Connectome::Enhance::NBS (num_nodes));
+  passed &= check ("connectome edge clusters", nbs, num_nodes * (num_nodes+1) / 2, num_trials, tolerance, rng);
+
+  if (!passed)
+    throw Exception ("single-pass TFCE does not match TFCE computed at each threshold");
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "image.h"
+#include "transform.h"
+#include "interp/linear.h"
+#include "math/rng.h"
+#include "dwi/tractography/ACT/tissue_interp.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "MRtrix3 contributors";
+
+  SYNOPSIS = "Verify the interpolation of ACT 5TT images against that of Interp::Linear";
+
+  DESCRIPTION
+  + "This checks that DWI::Tractography::ACT::TissueInterp, which interpolates all five "
+    "tissue partial volumes at once, yields the same values as Interp::Linear applied to "
+    "each volume of the 5TT image in turn, at random positions in voxel and scanner space; "
+    "these include positions outside the image, on voxel boundaries and on the image "
+    "boundary, for which both must also agree on whether the position is out of bounds.";
+
+  ARGUMENTS
+  + Argument ("5tt", "the 5TT image").type_image_in();
+
+  OPTIONS
+  + Option ("number", "the number of random positions at which to interpolate (default: 100000)")
+    + Argument ("num").type_integer (1)
+
+  + Option ("tolerance", "the maximum absolute difference allowed between implementations (default: 1e-6)")
+    + Argument ("value").type_float (0.0);
+}
+
+
+
+void run ()
+{
+  auto image = Image<float>::open (argument[0]);
+  const size_t num = get_option_value ("number", 100000);
+  const float tolerance = get_option_value ("tolerance", 1.0e-6);
+
+  DWI::Tractography::ACT::TissueInterp tissues (image);
+  Interp::Linear<Image<float>> interp (image);
+  const Transform transform (image);
+
+  Math::RNG::Uniform<default_type> rng;
+  size_t num_in_bounds = 0, num_mismatched_bounds = 0;
+  float max_diff = 0.0;
+  for (size_t n = 0; n != num; ++n) {
+    // positions extend one voxel beyond the image, and are in a third of cases
+    //   rounded to a voxel centre or half-way between voxel centres
+    Eigen::Vector3d pos;
+    for (size_t axis = 0; axis != 3; ++axis) {
+      pos[axis] = -1.0 + (image.size (axis) + 1.0) * rng();
+      if (n % 3 == 1)
+        pos[axis] = std::round (pos[axis]);
+      else if (n % 3 == 2)
+        pos[axis] = 0.5 * std::round (2.0 * pos[axis]);
+    }
+
+    for (size_t space = 0; space != 2; ++space) {
+      bool in_bounds;
+      if (space) {
+        const Eigen::Vector3d scanner_pos = transform.voxel2scanner * pos;
+        in_bounds = tissues.scanner (scanner_pos);
+        if (in_bounds != interp.scanner (scanner_pos))
+          ++num_mismatched_bounds;
+      } else {
+        in_bounds = tissues.voxel (pos);
+        if (in_bounds != interp.voxel (pos))
+          ++num_mismatched_bounds;
+      }
+      if (in_bounds != !(!tissues))
+        ++num_mismatched_bounds;
+      if (!in_bounds || !interp)
+        continue;
+
+      ++num_in_bounds;
+      const auto values = tissues.value();
+      for (interp.index(3) = 0; interp.index(3) != 5; ++interp.index(3))
+        max_diff = std::max (max_diff, std::abs (values[interp.index(3)] - interp.value()));
+    }
+  }
+
+  std::cout << "positions within bounds: " << num_in_bounds << " of " << 2*num
+            << "; mismatched bounds: " << num_mismatched_bounds
+            << "; max abs. diff.: " << str(max_diff, 3) << "\n";
+
+  if (num_mismatched_bounds)
+    throw Exception ("TissueInterp and Interp::Linear do not agree on image bounds");
+  if (!num_in_bounds)
+    throw Exception ("no random positions within image bounds");
+  if (!(max_diff <= tolerance))
+    throw Exception ("TissueInterp does not match Interp::Linear");
+}
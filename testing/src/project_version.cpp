@@ -0,0 +1,11 @@
+
+namespace MR {
+  namespace App {
+    extern const char* project_version;
+    extern const char* project_build_date;
+    void set_project_version () {
+      project_version = "94d264ca";
+      project_build_date = __DATE__;
+    }
+  }
+}